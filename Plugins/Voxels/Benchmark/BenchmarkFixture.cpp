@@ -0,0 +1,199 @@
+#include "BenchmarkFixture.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <zlib.h>
+
+static std::atomic<uint64_t> Allocations(0);
+
+void* operator new(size_t Size)
+{
+	Allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* Ptr = malloc(Size ? Size : 1))
+	{
+		return Ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* Ptr) noexcept
+{
+	free(Ptr);
+}
+
+void operator delete(void* Ptr, size_t) noexcept
+{
+	free(Ptr);
+}
+
+uint64_t GetNumAllocations()
+{
+	return Allocations.load(std::memory_order_relaxed);
+}
+
+double ElapsedMs(FClock::time_point Start, FClock::time_point End)
+{
+	return std::chrono::duration<double, std::milli>(End - Start).count();
+}
+
+double FStat::Percentile(double P)
+{
+	if (Samples.empty())
+	{
+		return 0.0;
+	}
+	std::sort(Samples.begin(), Samples.end());
+	size_t Index = std::min(Samples.size() - 1, (size_t)(P * Samples.size()));
+	return Samples[Index];
+}
+
+void PrintStat(const char* Name, FStat& Stat)
+{
+	printf("  %-8s p50 %8.3f ms  p99 %8.3f ms\n", Name, Stat.Percentile(0.5), Stat.Percentile(0.99));
+}
+
+double IntervalDeviationMs(const std::vector<double>& Times)
+{
+	double Sum = 0.0, SumSquares = 0.0;
+	for (size_t i = 1; i < Times.size(); i++)
+	{
+		const double Interval = (Times[i] - Times[i - 1]) * 1000.0;
+		Sum += Interval;
+		SumSquares += Interval * Interval;
+	}
+	const double N = (double)(Times.size() - 1);
+	return std::sqrt(std::max(0.0, SumSquares / N - (Sum / N) * (Sum / N)));
+}
+
+void MakeCapture(uint32_t Count, uint32_t Frame, std::vector<uint8_t>& Wire)
+{
+	Wire.resize(Count * WireVoxelBytes);
+	const uint32_t Moving = Count / 10;
+	const int16_t Swing = (int16_t)(std::sin(Frame * 0.7f) * 30.0f);
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		int16_t Pos[3];
+		if (i < Count - Moving)
+		{
+			Pos[0] = (int16_t)(i % 128 - 64);
+			Pos[1] = (int16_t)((i / 128) % 128 - 64);
+			Pos[2] = (int16_t)(i / (128 * 128));
+		}
+		else
+		{
+			uint32_t j = i - (Count - Moving);
+			Pos[0] = (int16_t)(100 + Swing + j % 16);
+			Pos[1] = (int16_t)((j / 16) % 16);
+			Pos[2] = (int16_t)(j / 256);
+		}
+		uint8_t* w = &Wire[i * WireVoxelBytes];
+		memcpy(w, Pos, 6);
+		w[6] = (uint8_t)(i * 3);
+		w[7] = (uint8_t)(i * 5);
+		w[8] = (uint8_t)(i * 7);
+	}
+}
+
+std::vector<std::vector<uint8_t>> MakeCaptures(uint32_t Count, int Num)
+{
+	std::vector<std::vector<uint8_t>> Captures(Num);
+	for (int i = 0; i < Num; i++)
+	{
+		MakeCapture(Count, i, Captures[i]);
+	}
+	return Captures;
+}
+
+void Parse(const std::vector<uint8_t>& Wire, FSyntheticGrid& Grid)
+{
+	const size_t Count = Wire.size() / WireVoxelBytes;
+	Grid.Voxels.resize(Count);
+	for (size_t i = 0; i < Count; i++)
+	{
+		const uint8_t* w = &Wire[i * WireVoxelBytes];
+		FSyntheticVoxel& v = Grid.Voxels[i];
+		memcpy(&v.pos, w, 6);
+		memcpy(v.Rgb, w + 6, 3);
+	}
+	Grid.Rewind();
+}
+
+uint32_t GatherWire(const std::vector<uint8_t>& Wire, std::vector<int16_t>& Gathered, std::vector<uint32_t>* Colours)
+{
+	const uint32_t Count = (uint32_t)(Wire.size() / WireVoxelBytes);
+	Gathered.resize(Count * VoxelPacking::GatherStride);
+	if (Colours)
+	{
+		Colours->assign(Count, 0);
+	}
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		int16_t Pos[3];
+		memcpy(Pos, &Wire[i * WireVoxelBytes], 6);
+		int16_t* g = &Gathered[i * VoxelPacking::GatherStride];
+		g[0] = Pos[2];
+		g[1] = Pos[1];
+		g[2] = Pos[0];
+		g[3] = 0;
+		if (Colours)
+		{
+			memcpy(&(*Colours)[i], &Wire[i * WireVoxelBytes + 6], 3);
+		}
+	}
+	return Count;
+}
+
+void PackBlocks(const int16_t* Gathered, const uint32_t* Colours, uint32_t Count, int32_t NumWorkers, uint8_t* Coarse, uint8_t* Fine,
+	uint8_t* Colour, uint64_t* BlockHashes, int16_t* Bounds)
+{
+	const int32_t NumBlocks = (int32_t)((Count + BlockTexels - 1) / BlockTexels);
+	VoxelPacking::ParallelFor(NumBlocks, NumWorkers, [=](int32_t Block)
+	{
+		const uint32_t First = Block * BlockTexels;
+		const uint32_t Num = std::min(Count - First, BlockTexels);
+		const size_t Offset = (size_t)First * BytesPerTexel;
+		const int16_t* BlockGathered = Gathered + First * VoxelPacking::GatherStride;
+		if (Colours)
+		{
+			memcpy(Colour + Offset, Colours + First, Num * BytesPerTexel);
+		}
+		BlockHashes[Block] = VoxelPacking::PackBlock(BlockGathered, Num, BlockTexels, Coarse + Offset, Fine + Offset, Colour + Offset);
+		if (Bounds)
+		{
+			int16_t* BlockBounds = Bounds + Block * 6;
+			std::fill(BlockBounds, BlockBounds + 3, INT16_MAX);
+			std::fill(BlockBounds + 3, BlockBounds + 6, INT16_MIN);
+			VoxelPacking::GatheredBounds(BlockGathered, Num, BlockBounds, BlockBounds + 3);
+		}
+	});
+}
+
+VoxelFrameCache::FCodec MakeZlibCodec()
+{
+	VoxelFrameCache::FCodec Zlib;
+	Zlib.Id = VoxelFrameCache::ECodec::Zlib;
+	Zlib.Bound = [](size_t Bytes) { return (size_t)compressBound((uLong)Bytes); };
+	Zlib.Compress = [](const void* In, size_t InBytes, void* Out, size_t OutCapacity) -> size_t
+	{
+		uLongf OutBytes = (uLongf)OutCapacity;
+		return compress2((Bytef*)Out, &OutBytes, (const Bytef*)In, (uLong)InBytes, 1) == Z_OK ? (size_t)OutBytes : 0;
+	};
+	Zlib.Decompress = [](const void* In, size_t InBytes, void* Out, size_t OutBytes)
+	{
+		uLongf Bytes = (uLongf)OutBytes;
+		return uncompress((Bytef*)Out, &Bytes, (const Bytef*)In, (uLong)InBytes) == Z_OK && Bytes == OutBytes;
+	};
+	return Zlib;
+}
+
+FVoxelFrameCacheWriter::FWriteFn WriteToMemory(std::vector<uint8_t>& File)
+{
+	return [&File](const void* Data, size_t Bytes)
+	{
+		File.insert(File.end(), (const uint8_t*)Data, (const uint8_t*)Data + Bytes);
+		return true;
+	};
+}
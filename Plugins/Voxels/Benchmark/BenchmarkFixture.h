@@ -0,0 +1,119 @@
+// Fixture and timing shared by the stages of VoxelPipelineBenchmark: synthetic captures in place of VIMR voxel grids,
+// the gather and block packing CopyVoxelData does over them, and percentiles over timed samples.
+
+#pragma once
+
+#include "VoxelPacking.h"
+#include "VoxelFrameCache.h"
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+typedef std::chrono::steady_clock FClock;
+
+double ElapsedMs(FClock::time_point Start, FClock::time_point End);
+
+// Heap allocations on any thread since the benchmark started
+uint64_t GetNumAllocations();
+
+// Captures arrive at a typical camera frame rate, so the consumer sees frames the way the game thread would
+static const std::chrono::microseconds FrameInterval(33333);
+
+// Same sizes as the plugin's defaults
+static const uint32_t BlockTexels = 4096;
+static const uint32_t SliceVoxels = 128 * 128;
+static const uint32_t BytesPerTexel = 4;
+
+inline uint32_t AlignToBlocks(uint32_t Count)
+{
+	return (Count + BlockTexels - 1) / BlockTexels * BlockTexels;
+}
+
+struct FStat
+{
+	std::vector<double> Samples;
+
+	double Percentile(double P);
+
+	// Runs Fn and adds how long it took
+	template <typename FnType>
+	void Time(FnType&& Fn)
+	{
+		const FClock::time_point Start = FClock::now();
+		Fn();
+		Samples.push_back(ElapsedMs(Start, FClock::now()));
+	}
+};
+
+void PrintStat(const char* Name, FStat& Stat);
+
+// Standard deviation of the time between successive Times, in ms
+double IntervalDeviationMs(const std::vector<double>& Times);
+
+// Layout of a voxel as far as CopyVoxelData is concerned: a position and 3 bytes read by read_data
+struct FSyntheticVoxel
+{
+	struct
+	{
+		int16_t X, Y, Z;
+	} pos;
+	uint8_t Rgb[3];
+
+	void read_data(char* Out) const
+	{
+		memcpy(Out, Rgb, 3);
+	}
+};
+
+// Iterates like VIMR::VoxelGrid, handing out one voxel at a time
+class FSyntheticGrid
+{
+public:
+	std::vector<FSyntheticVoxel> Voxels;
+
+	void Rewind()
+	{
+		Next = 0;
+	}
+
+	bool GetNextVoxel(const FSyntheticVoxel** Node)
+	{
+		if (Next >= Voxels.size())
+		{
+			return false;
+		}
+		*Node = &Voxels[Next++];
+		return true;
+	}
+
+private:
+	size_t Next = 0;
+};
+
+static const size_t WireVoxelBytes = 9;
+
+// A static body with a moving arm, so consecutive frames mostly match like a real capture. Every voxel of a
+// frame has its own position, as in a voxel grid.
+void MakeCapture(uint32_t Count, uint32_t Frame, std::vector<uint8_t>& Wire);
+
+// Frames 0 to Num - 1, generated up front so their cost isn't measured
+std::vector<std::vector<uint8_t>> MakeCaptures(uint32_t Count, int Num);
+
+// Reads a wire payload into a grid, a stand-in for VIMR::Deserializer
+void Parse(const std::vector<uint8_t>& Wire, FSyntheticGrid& Grid);
+
+// Gathers positions straight from a wire payload, and colours unless Colours is null, without going through a grid.
+// Returns the number of voxels.
+uint32_t GatherWire(const std::vector<uint8_t>& Wire, std::vector<int16_t>& Gathered, std::vector<uint32_t>* Colours);
+
+// Packs Count gathered voxels block by block on NumWorkers workers, as CopyVoxelData does. Colours are copied into
+// Colour first unless null, and each block's min X/Y/Z then max X/Y/Z go to Bounds unless null.
+void PackBlocks(const int16_t* Gathered, const uint32_t* Colours, uint32_t Count, int32_t NumWorkers, uint8_t* Coarse, uint8_t* Fine,
+	uint8_t* Colour, uint64_t* BlockHashes, int16_t* Bounds);
+
+// Stands in for the engine's LZ4 in frame caches
+VoxelFrameCache::FCodec MakeZlibCodec();
+
+// Appends what a FVoxelFrameCacheWriter writes to File
+FVoxelFrameCacheWriter::FWriteFn WriteToMemory(std::vector<uint8_t>& File);
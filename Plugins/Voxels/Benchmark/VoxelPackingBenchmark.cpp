@@ -0,0 +1,106 @@
+// Micro-benchmark for the position packing kernels used by UVoxelSourceBaseComponent::CopyVoxelData.
+// Checks every supported kernel against the scalar one, then times them on a full frame of synthetic voxels,
+// followed by the slice-parallel packing with different worker counts (0 = one per hardware thread), and with as many
+// as CopyVoxelData would use for the frame (auto).
+
+#include "VoxelPacking.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using VoxelPacking::EKernel;
+
+static const uint32_t FrameVoxels = 196608;
+static const int Iterations = 200;
+
+int main(int argc, char** argv)
+{
+	uint32_t Count = argc > 1 ? (uint32_t)atoi(argv[1]) : FrameVoxels;
+
+	std::mt19937 Rng(1234);
+	std::uniform_int_distribution<int> Coord(-32768, 32767);
+	std::vector<int16_t> Positions(Count * VoxelPacking::GatherStride);
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		int16_t* p = &Positions[i * VoxelPacking::GatherStride];
+		p[0] = (int16_t)Coord(Rng);
+		p[1] = (int16_t)Coord(Rng);
+		p[2] = (int16_t)Coord(Rng);
+		p[3] = 0;
+	}
+
+	std::vector<uint8_t> RefCoarse(Count * 4), RefFine(Count * 4);
+	VoxelPacking::PackPositions(Positions.data(), Count, RefCoarse.data(), RefFine.data(), EKernel::Scalar);
+
+	printf("%u voxels, best kernel: %s\n", Count, VoxelPacking::GetKernelName(VoxelPacking::GetBestKernel()));
+
+	int Failures = 0;
+	for (EKernel Kernel : { EKernel::Scalar, EKernel::SSE2, EKernel::AVX2 })
+	{
+		if (!VoxelPacking::IsKernelSupported(Kernel))
+		{
+			printf("%-8s not supported\n", VoxelPacking::GetKernelName(Kernel));
+			continue;
+		}
+
+		std::vector<uint8_t> Coarse(Count * 4, 0xCD), Fine(Count * 4, 0xCD);
+		VoxelPacking::PackPositions(Positions.data(), Count, Coarse.data(), Fine.data(), Kernel);
+		bool bMatch = Coarse == RefCoarse && Fine == RefFine;
+		Failures += bMatch ? 0 : 1;
+
+		std::vector<double> Times;
+		for (int i = 0; i < Iterations; i++)
+		{
+			auto Start = std::chrono::high_resolution_clock::now();
+			VoxelPacking::PackPositions(Positions.data(), Count, Coarse.data(), Fine.data(), Kernel);
+			auto End = std::chrono::high_resolution_clock::now();
+			Times.push_back(std::chrono::duration<double, std::nano>(End - Start).count());
+		}
+		std::sort(Times.begin(), Times.end());
+		double Median = Times[Times.size() / 2];
+		printf("%-8s %s  median %8.3f us  %6.3f ns/voxel\n", VoxelPacking::GetKernelName(Kernel), bMatch ? "ok      " : "MISMATCH", Median / 1000.0, Median / Count);
+	}
+
+	// Same split as CopyVoxelData: one task per 16,384 voxel sub-renderer slice
+	const uint32_t SliceVoxels = 16384;
+	const int32_t NumSlices = (int32_t)((Count + SliceVoxels - 1) / SliceVoxels);
+	const int32_t AutoWorkers = -1;
+	for (int32_t Workers : { 1, 2, 4, 0, AutoWorkers })
+	{
+		const int32_t Split = Workers == AutoWorkers ? VoxelPacking::GetNumWorkers(Count, 0) : Workers;
+		std::vector<uint8_t> Coarse(Count * 4), Fine(Count * 4);
+		auto PackSlice = [&](int32_t Slice)
+		{
+			uint32_t First = Slice * SliceVoxels;
+			uint32_t Packed = std::min(Count - First, SliceVoxels);
+			VoxelPacking::PackPositions(Positions.data() + First * VoxelPacking::GatherStride, Packed, Coarse.data() + First * 4, Fine.data() + First * 4);
+		};
+
+		std::vector<double> Times;
+		for (int i = 0; i < Iterations; i++)
+		{
+			auto Start = std::chrono::high_resolution_clock::now();
+			VoxelPacking::ParallelFor(NumSlices, Split, PackSlice);
+			auto End = std::chrono::high_resolution_clock::now();
+			Times.push_back(std::chrono::duration<double, std::nano>(End - Start).count());
+		}
+		bool bMatch = Coarse == RefCoarse && Fine == RefFine;
+		Failures += bMatch ? 0 : 1;
+		std::sort(Times.begin(), Times.end());
+		double Median = Times[Times.size() / 2];
+		if (Workers == AutoWorkers)
+		{
+			printf("auto (%d) %s  median %8.3f us  %6.3f ns/voxel\n", Split, bMatch ? "ok      " : "MISMATCH", Median / 1000.0, Median / Count);
+		}
+		else
+		{
+			printf("%2d workers %s  median %8.3f us  %6.3f ns/voxel\n", Workers, bMatch ? "ok      " : "MISMATCH", Median / 1000.0, Median / Count);
+		}
+	}
+
+	return Failures == 0 ? 0 : 1;
+}
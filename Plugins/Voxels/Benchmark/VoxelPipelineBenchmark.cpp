@@ -0,0 +1,883 @@
+// End to end benchmark of the engine independent half of the voxel pipeline, on synthetic captures:
+//   parse     - reads a wire payload into a voxel grid (a stand-in for VIMR::Deserializer, which needs the VIMR libs)
+//   gather    - the CopyVoxelData loop over the grid, gathering colours and positions
+//   pack      - copying colours in, VoxelPacking::PackBlock and GatheredBounds over every block in parallel, as
+//               CopyVoxelData does
+//   handoff   - FVoxelTripleBuffer publish on the producer thread until acquire on a consumer thread
+//   slice     - the partitioning and slice hashing UVoxelRenderComponent::TickComponent does per frame
+//   delta     - FVoxelDeltaEncoder applying each gathered frame's changes, as CopyVoxelData does with DeltaFrames on,
+//               next to packing the same frame in full on one thread, checked against the capture it was given, then
+//               with half the voxels gone until compaction settles
+//   morton    - VoxelPacking::MortonSort and the reorder after it, as CopyVoxelData does with MortonOrder on, on
+//               three people standing apart, counting the slices that overlap one of them before and after
+//   lod       - FVoxelDecimator bringing a frame 4x over budget down to it, checked for overlapping cells
+//   instances - the same, packed and then decoded to cube instances as UVoxelInstancedSubComponent does for the
+//               blocks that changed since the last frame, checked against the kept voxels, with how many of the
+//               captured voxels the merged instances show compared with sub-renderers drawing the same budget
+//   decode    - FVoxelDecodePool under each backpressure policy, frames arriving faster than the workers keep up,
+//               checked for frames published out of order or lost, with latency from arrival to publish
+//   jitter    - FVoxelFramePacer on a simulated 30 fps stream with network jitter, frames picked up on a 90 Hz render
+//               tick, comparing how evenly frames arrive with how evenly they're shown
+//   cache     - FVoxelFrameCacheWriter writing a recording to memory, uncompressed and then compressed with zlib (the
+//               engine uses LZ4, which isn't available headless), FVoxelFrameCacheReader checking every frame against
+//               what was written and timing how long each takes to decode, and FVoxelCachePlayer seeking to random
+//               frames, timed until each is shown
+//   readahead - FVoxelCachePlayer playing 3 seconds of a cache from simulated slow storage, where every eighth read
+//               stalls for 60 ms, with and without frames read ahead, comparing how evenly frames are shown
+// Reports p50/p99 per stage, ns/voxel for the producer side and heap allocations per frame.
+// The captures, gather, block packing and timing shared by the stages are in BenchmarkFixture.h.
+//
+// Usage: VoxelPipelineBenchmark [frames] [max producer ns/voxel]
+// Frames are produced at 30 fps, so the default 100 frames takes a little over 3 seconds per size.
+// With a limit, exits with 1 if the p50 at any size is over it, so it can gate deploys.
+
+#include "BenchmarkFixture.h"
+#include "VoxelTripleBuffer.h"
+#include "VoxelDeltaEncoder.h"
+#include "VoxelDecimator.h"
+#include "VoxelDecodePool.h"
+#include "VoxelFramePacer.h"
+#include "VoxelCachePlayer.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+
+// Where the decimator measures distance from, in front of the captures
+static const float Viewer[3] = { 0.0f, 0.0f, -100.0f };
+
+struct FFrameBuffer
+{
+	std::vector<uint8_t> Coarse, Position, Colour;
+	std::vector<uint64_t> BlockHashes;
+	// Min X/Y/Z then max X/Y/Z per block
+	std::vector<int16_t> BlockBounds;
+	uint32_t VoxelCount = 0;
+	uint32_t Sequence = 0;
+	FClock::time_point Published;
+};
+
+// Returns the producer's p50 ns/voxel
+static double RunSize(uint32_t Count, int Frames)
+{
+	const int NumCaptures = 8;
+	const std::vector<std::vector<uint8_t>> Captures = MakeCaptures(Count, NumCaptures);
+	const uint32_t Capacity = AlignToBlocks(Count);
+	FFrameBuffer Buffers[3];
+	for (FFrameBuffer& Buffer : Buffers)
+	{
+		Buffer.Coarse.assign(Capacity * BytesPerTexel, 0);
+		Buffer.Position.assign(Capacity * BytesPerTexel, 0);
+		Buffer.Colour.assign(Capacity * BytesPerTexel, 0);
+		Buffer.BlockHashes.reserve(Capacity / BlockTexels);
+		Buffer.BlockBounds.reserve(Capacity / BlockTexels * 6);
+	}
+	std::vector<int16_t> Gathered(Capacity * VoxelPacking::GatherStride);
+	std::vector<uint32_t> GatheredColours(Capacity);
+	FSyntheticGrid Grid;
+	Grid.Voxels.reserve(Count);
+
+	// Warm up frames aren't counted, the first ones take page faults on the buffers
+	const uint32_t WarmUp = 3;
+
+	FVoxelTripleBuffer Handoff;
+	std::atomic<bool> bProducerDone(false);
+	FStat ParseStat, GatherStat, PackStat, ProducerStat, HandoffStat, SliceStat;
+	uint64_t Overwritten = 0;
+	uint64_t ChangedSlices = 0;
+	uint64_t ConsumedFrames = 0;
+
+	// Game thread stand-in: picks up frames as they're published and works out which slices changed
+	std::thread Consumer([&]()
+	{
+		std::vector<uint64_t> LastSliceHashes;
+		uint32_t LastSequence = 0;
+		while (true)
+		{
+			bool bDone = bProducerDone.load(std::memory_order_acquire);
+			if (Handoff.Acquire())
+			{
+				FClock::time_point Now = FClock::now();
+				FFrameBuffer& Frame = Buffers[Handoff.GetReadIndex()];
+				if (Frame.Sequence != LastSequence && Frame.Sequence > WarmUp)
+				{
+					LastSequence = Frame.Sequence;
+					HandoffStat.Samples.push_back(ElapsedMs(Frame.Published, Now));
+
+					const uint32_t NumSlices = (Frame.VoxelCount + SliceVoxels - 1) / SliceVoxels;
+					LastSliceHashes.resize(NumSlices, 0);
+					for (uint32_t Slice = 0; Slice < NumSlices; Slice++)
+					{
+						uint32_t First = Slice * SliceVoxels;
+						uint32_t SliceCount = std::min(Frame.VoxelCount - First, SliceVoxels);
+						uint64_t Hash = VoxelPacking::HashSlice(Frame.BlockHashes.data(), (int32_t)Frame.BlockHashes.size(), BlockTexels, First, SliceCount);
+						ChangedSlices += Hash != LastSliceHashes[Slice] ? 1 : 0;
+						LastSliceHashes[Slice] = Hash;
+					}
+					SliceStat.Samples.push_back(ElapsedMs(Now, FClock::now()));
+					ConsumedFrames++;
+				}
+			}
+			else if (bDone)
+			{
+				break;
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+	});
+
+	uint64_t SteadyAllocations = 0;
+	FClock::time_point NextFrame = FClock::now();
+	for (uint32_t FrameIdx = 0; FrameIdx < WarmUp + (uint32_t)Frames; FrameIdx++)
+	{
+		std::this_thread::sleep_until(NextFrame);
+		NextFrame += FrameInterval;
+		const bool bMeasure = FrameIdx >= WarmUp;
+		uint64_t AllocationsBefore = GetNumAllocations();
+
+		FClock::time_point Start = FClock::now();
+		Parse(Captures[FrameIdx % NumCaptures], Grid);
+		FClock::time_point Parsed = FClock::now();
+
+		FFrameBuffer& Frame = Buffers[Handoff.GetWriteIndex()];
+		uint32_t Gathers = 0;
+		const FSyntheticVoxel* Node;
+		while (Grid.GetNextVoxel(&Node))
+		{
+			Node->read_data((char*)&GatheredColours[Gathers]);
+			int16_t* g = &Gathered[Gathers * VoxelPacking::GatherStride];
+			g[0] = Node->pos.Z;
+			g[1] = Node->pos.Y;
+			g[2] = Node->pos.X;
+			g[3] = 0;
+			Gathers++;
+		}
+		FClock::time_point GatheredTime = FClock::now();
+
+		Frame.VoxelCount = Gathers;
+		Frame.BlockHashes.resize((Gathers + BlockTexels - 1) / BlockTexels);
+		Frame.BlockBounds.resize(Frame.BlockHashes.size() * 6);
+		PackBlocks(Gathered.data(), GatheredColours.data(), Gathers, VoxelPacking::GetNumWorkers(Gathers, 0), Frame.Coarse.data(), Frame.Position.data(),
+			Frame.Colour.data(), Frame.BlockHashes.data(), Frame.BlockBounds.data());
+		FClock::time_point Packed = FClock::now();
+
+		Frame.Sequence = FrameIdx + 1;
+		Frame.Published = Packed;
+		Overwritten += Handoff.Publish() && bMeasure ? 1 : 0;
+
+		if (bMeasure)
+		{
+			SteadyAllocations += GetNumAllocations() - AllocationsBefore;
+			ParseStat.Samples.push_back(ElapsedMs(Start, Parsed));
+			GatherStat.Samples.push_back(ElapsedMs(Parsed, GatheredTime));
+			PackStat.Samples.push_back(ElapsedMs(GatheredTime, Packed));
+			ProducerStat.Samples.push_back(ElapsedMs(Parsed, Packed));
+		}
+	}
+	bProducerDone.store(true, std::memory_order_release);
+	Consumer.join();
+
+	// The consumer's own allocations are counted too, they happen on the game thread in the plugin
+	double ProducerNsPerVoxel = ProducerStat.Percentile(0.5) * 1.0e6 / Count;
+	printf("%u voxels, %d frames\n", Count, Frames);
+	PrintStat("parse", ParseStat);
+	PrintStat("gather", GatherStat);
+	PrintStat("pack", PackStat);
+	PrintStat("handoff", HandoffStat);
+	PrintStat("slice", SliceStat);
+	printf("  producer (gather + pack) %.3f ns/voxel, %.1f allocations/frame\n", ProducerNsPerVoxel, (double)SteadyAllocations / Frames);
+	printf("  %llu frames consumed, %llu overwritten, %.1f changed slices/frame\n", (unsigned long long)ConsumedFrames, (unsigned long long)Overwritten,
+		ConsumedFrames ? (double)ChangedSlices / ConsumedFrames : 0.0);
+	return ProducerNsPerVoxel;
+}
+
+// Reads back every voxel in a delta image, sorted, for comparing against the capture
+static std::vector<uint64_t> DecodeImage(const std::vector<uint8_t>& Coarse, const std::vector<uint8_t>& Fine, const std::vector<uint8_t>& Colour, uint32_t NumSlots)
+{
+	std::vector<uint64_t> Voxels;
+	for (uint32_t s = 0; s < NumSlots; s++)
+	{
+		const uint8_t* c = &Coarse[s * 4];
+		if (c[0] == 0 && c[1] == 0 && c[2] == 0)
+		{
+			continue; // Free slot
+		}
+		const uint8_t* f = &Fine[s * 4];
+		uint64_t X = (uint16_t)(((c[2] - 128) << 8) | f[2]);
+		uint64_t Y = (uint16_t)(((c[1] - 128) << 8) | f[1]);
+		uint64_t Z = (uint16_t)(((c[0] - 128) << 8) | f[0]);
+		uint64_t Rgb = Colour[s * 4] | (Colour[s * 4 + 1] << 8) | (Colour[s * 4 + 2] << 16);
+		Voxels.push_back((((X << 16) | Y) << 16 | Z) ^ (Rgb << 40));
+	}
+	std::sort(Voxels.begin(), Voxels.end());
+	return Voxels;
+}
+
+static std::vector<uint64_t> DecodeCapture(const std::vector<uint8_t>& Wire)
+{
+	std::vector<uint64_t> Voxels;
+	for (size_t i = 0; i < Wire.size() / WireVoxelBytes; i++)
+	{
+		const uint8_t* w = &Wire[i * WireVoxelBytes];
+		int16_t Pos[3];
+		memcpy(Pos, w, 6);
+		uint64_t Rgb = w[6] | (w[7] << 8) | (w[8] << 16);
+		Voxels.push_back(((((uint64_t)(uint16_t)Pos[0] << 16) | (uint16_t)Pos[1]) << 16 | (uint16_t)Pos[2]) ^ (Rgb << 40));
+	}
+	std::sort(Voxels.begin(), Voxels.end());
+	return Voxels;
+}
+
+// Returns false if a frame's image didn't match its capture
+static bool RunDelta(uint32_t Count, int Frames)
+{
+	const int NumCaptures = 8;
+	const std::vector<std::vector<uint8_t>> Captures = MakeCaptures(Count, NumCaptures);
+
+	const uint32_t Capacity = AlignToBlocks(Count);
+	std::vector<uint8_t> Coarse(Capacity * BytesPerTexel, 0), Fine(Capacity * BytesPerTexel, 0), Colour(Capacity * BytesPerTexel, 0);
+	std::vector<uint8_t> DirtyBlocks;
+	FVoxelDeltaEncoder Encoder;
+	Encoder.Reset(Capacity, BlockTexels);
+	std::vector<int16_t> Gathered;
+	std::vector<uint32_t> Colours;
+
+	// The same frames packed in full on one thread, the work delta frames replace
+	std::vector<uint8_t> PackCoarse(Capacity * BytesPerTexel), PackFine(Capacity * BytesPerTexel), PackColour(Capacity * BytesPerTexel);
+	std::vector<uint64_t> BlockHashes(Capacity / BlockTexels);
+	std::vector<int16_t> BlockBounds(Capacity / BlockTexels * 6);
+
+	FStat DeltaStat, PackStat;
+	uint64_t Changed = 0, Dirty = 0, Blocks = 0;
+	bool bMatch = true;
+	for (int FrameIdx = 0; FrameIdx < Frames + 1; FrameIdx++)
+	{
+		const std::vector<uint8_t>& Capture = Captures[FrameIdx % NumCaptures];
+		const uint32_t Gathers = GatherWire(Capture, Gathered, &Colours);
+
+		FClock::time_point Start = FClock::now();
+		PackBlocks(Gathered.data(), Colours.data(), Gathers, 1, PackCoarse.data(), PackFine.data(), PackColour.data(), BlockHashes.data(), BlockBounds.data());
+		FClock::time_point Packed = FClock::now();
+		Encoder.BeginFrame();
+		Encoder.AddVoxels(Gathered.data(), Colours.data(), Gathers);
+		Encoder.EndFrame(Coarse.data(), Fine.data(), Colour.data(), DirtyBlocks);
+		FClock::time_point End = FClock::now();
+
+		// The first frame places everything, it's the steady state that matters
+		if (FrameIdx > 0)
+		{
+			const FVoxelDeltaEncoder::FStats& Stats = Encoder.GetStats();
+			PackStat.Samples.push_back(ElapsedMs(Start, Packed));
+			DeltaStat.Samples.push_back(ElapsedMs(Packed, End));
+			Changed += Stats.Added + Stats.Removed + Stats.Recoloured;
+			Dirty += std::count(DirtyBlocks.begin(), DirtyBlocks.end(), 1);
+			Blocks += DirtyBlocks.size();
+		}
+		if (FrameIdx < 2 || FrameIdx == Frames)
+		{
+			bMatch &= DecodeImage(Coarse, Fine, Colour, Encoder.GetNumSlots()) == DecodeCapture(Capture);
+		}
+	}
+
+	printf("%u voxels, %d delta frames %s\n", Count, Frames, bMatch ? "ok" : "MISMATCH");
+	PrintStat("delta", DeltaStat);
+	PrintStat("pack", PackStat);
+	printf("  %.1f voxels changed/frame, %.1f%% of blocks dirty, %u slots, delta %.2fx the cost of a full pack\n", (double)Changed / Frames,
+		Blocks ? 100.0 * Dirty / Blocks : 0.0, Encoder.GetNumSlots(), DeltaStat.Percentile(0.5) / PackStat.Percentile(0.5));
+
+	// Every other voxel leaves, which leaves holes all the way up that only compaction can close
+	std::vector<uint8_t> Half;
+	const std::vector<uint8_t>& Last = Captures[Frames % NumCaptures];
+	for (size_t i = 0; i < Last.size() / WireVoxelBytes; i += 2)
+	{
+		Half.insert(Half.end(), Last.begin() + i * WireVoxelBytes, Last.begin() + (i + 1) * WireVoxelBytes);
+	}
+	const uint32_t HalfGathers = GatherWire(Half, Gathered, &Colours);
+	const uint32_t SlotsBefore = Encoder.GetNumSlots();
+	int CompactFrames = 0;
+	uint32_t Moved = 0;
+	do
+	{
+		Encoder.BeginFrame();
+		Encoder.AddVoxels(Gathered.data(), Colours.data(), HalfGathers);
+		Encoder.EndFrame(Coarse.data(), Fine.data(), Colour.data(), DirtyBlocks);
+		Moved += Encoder.GetStats().Moved;
+		CompactFrames++;
+	} while (Encoder.GetStats().Moved > 0 && CompactFrames < 1000);
+	const bool bCompacted = DecodeImage(Coarse, Fine, Colour, Encoder.GetNumSlots()) == DecodeCapture(Half);
+	printf("  half gone: %u -> %u slots, %u moved over %d frames %s\n", SlotsBefore, Encoder.GetNumSlots(), Moved, CompactFrames, bCompacted ? "ok" : "MISMATCH");
+	return bMatch && bCompacted;
+}
+
+// Decimates a capture with Factor times more voxels than the budget. Returns false if the result didn't fit or
+// merged voxels overlapped.
+static bool RunLod(uint32_t Budget, uint32_t Factor, int Frames)
+{
+	std::vector<uint8_t> Wire;
+	MakeCapture(Budget * Factor, 0, Wire);
+	std::vector<int16_t> Gathered;
+	std::vector<uint32_t> Kept;
+	uint32_t Count = 0;
+	FVoxelDecimator Decimator;
+
+	FStat LodStat;
+	bool bValid = true;
+	for (int FrameIdx = 0; FrameIdx < Frames; FrameIdx++)
+	{
+		// Decimating writes the merged levels over the gathered positions
+		Count = GatherWire(Wire, Gathered, nullptr);
+		LodStat.Time([&] { Decimator.Decimate(Gathered.data(), Count, Viewer, Budget, FVoxelDecimator::MaxLevel, Kept); });
+	}
+
+	// Every kept voxel is aligned to its cell, and no two cover the same voxel
+	std::vector<uint64_t> Covered;
+	for (uint32_t i : Kept)
+	{
+		const int16_t* g = &Gathered[i * VoxelPacking::GatherStride];
+		const int32_t Size = 1 << g[3];
+		bValid &= (g[0] & (Size - 1)) == 0 && (g[1] & (Size - 1)) == 0 && (g[2] & (Size - 1)) == 0;
+		for (int32_t z = 0; z < Size; z++)
+		{
+			for (int32_t y = 0; y < Size; y++)
+			{
+				for (int32_t x = 0; x < Size; x++)
+				{
+					Covered.push_back(((uint64_t)(uint16_t)(g[0] + z) << 32) | ((uint64_t)(uint16_t)(g[1] + y) << 16) | (uint16_t)(g[2] + x));
+				}
+			}
+		}
+	}
+	std::sort(Covered.begin(), Covered.end());
+	bValid &= std::adjacent_find(Covered.begin(), Covered.end()) == Covered.end();
+	bValid &= Kept.size() <= Budget;
+
+	printf("%u voxels into %u, %d lod frames %s\n", Count, Budget, Frames, bValid ? "ok" : "INVALID");
+	PrintStat("lod", LodStat);
+	printf("  kept %u/%u/%u at levels 0/1/2, %u dropped\n", Decimator.GetNumAtLevel(0), Decimator.GetNumAtLevel(1), Decimator.GetNumAtLevel(2), Decimator.GetNumDropped());
+	return bValid;
+}
+
+// Decimates captures Factor times over budget and packs them, then decodes the range of blocks that changed since the
+// last frame to instances, as UVoxelInstancedSubComponent::SetData does. Returns false if the instances don't match
+// the kept voxels.
+static bool RunInstances(uint32_t Budget, uint32_t Factor, int Frames)
+{
+	const uint32_t Capacity = AlignToBlocks(Budget);
+	std::vector<uint8_t> Wire;
+	std::vector<int16_t> Gathered, Packed(Capacity * VoxelPacking::GatherStride);
+	std::vector<uint32_t> Colours, Kept;
+	std::vector<uint8_t> Coarse(Capacity * BytesPerTexel), Fine(Capacity * BytesPerTexel), Colour(Capacity * BytesPerTexel);
+	std::vector<uint64_t> Hashes, LastHashes;
+	std::vector<float> Instances(Capacity * 4), InstanceColours(Capacity * 3);
+	FVoxelDecimator Decimator;
+
+	FStat FullStat, ChangedStat;
+	uint64_t Rewritten = 0, Shown = 0, Captured = 0;
+	bool bValid = true;
+	for (int FrameIdx = 0; FrameIdx < Frames; FrameIdx++)
+	{
+		MakeCapture(Budget * Factor, FrameIdx, Wire);
+		const uint32_t Count = GatherWire(Wire, Gathered, &Colours);
+		Decimator.Decimate(Gathered.data(), Count, Viewer, Budget, FVoxelDecimator::MaxLevel, Kept);
+		const uint32_t NumKept = (uint32_t)Kept.size();
+		for (uint32_t i = 0; i < NumKept; i++)
+		{
+			memcpy(&Packed[i * VoxelPacking::GatherStride], &Gathered[Kept[i] * VoxelPacking::GatherStride], VoxelPacking::GatherStride * sizeof(int16_t));
+			memcpy(&Colour[i * BytesPerTexel], &Colours[Kept[i]], BytesPerTexel);
+		}
+		const uint32_t NumBlocks = (NumKept + BlockTexels - 1) / BlockTexels;
+		Hashes.resize(NumBlocks);
+		PackBlocks(Packed.data(), nullptr, NumKept, 1, Coarse.data(), Fine.data(), Colour.data(), Hashes.data(), nullptr);
+
+		// Only the range from the first block that changed to the last is decoded
+		uint32_t FirstDirty = NumBlocks, EndDirty = 0;
+		for (uint32_t Block = 0; Block < NumBlocks; Block++)
+		{
+			if (Block >= LastHashes.size() || Hashes[Block] != LastHashes[Block])
+			{
+				FirstDirty = std::min(FirstDirty, Block);
+				EndDirty = Block + 1;
+			}
+		}
+		LastHashes = Hashes;
+		if (EndDirty > FirstDirty)
+		{
+			const uint32_t First = FirstDirty * BlockTexels;
+			const uint32_t End = std::min(EndDirty * BlockTexels, NumKept);
+			ChangedStat.Time([&]
+			{
+				VoxelPacking::UnpackInstances(&Coarse[First * BytesPerTexel], &Fine[First * BytesPerTexel], &Colour[First * BytesPerTexel], End - First,
+					&Instances[First * 4], &InstanceColours[First * 3]);
+			});
+			Rewritten += End - First;
+		}
+		else
+		{
+			ChangedStat.Samples.push_back(0.0);
+		}
+		FullStat.Time([&] { VoxelPacking::UnpackInstances(Coarse.data(), Fine.data(), Colour.data(), NumKept, Instances.data(), InstanceColours.data()); });
+
+		// Each instance sits on the cell its voxel was merged to, at the cell's size
+		for (uint32_t i = 0; bValid && i < NumKept; i++)
+		{
+			const int16_t* g = &Packed[i * VoxelPacking::GatherStride];
+			const float* Instance = &Instances[i * 4];
+			const float Size = (float)(1 << g[3]);
+			bValid &= Instance[3] == Size && Instance[0] == g[2] + (Size - 1.0f) * 0.5f && Instance[1] == g[1] + (Size - 1.0f) * 0.5f && Instance[2] == g[0] + (Size - 1.0f) * 0.5f;
+		}
+		Shown += Count - Decimator.GetNumDropped();
+		Captured += Count;
+	}
+
+	printf("%u voxels into %u instances, %d frames %s\n", Budget * Factor, Budget, Frames, bValid ? "ok" : "INVALID");
+	PrintStat("full", FullStat);
+	PrintStat("changed", ChangedStat);
+	printf("  %.0f%% of instances rewritten per frame, showing %.0f%% of captured voxels where sub-renderers show %.0f%%\n",
+		100.0 * Rewritten / ((double)Budget * Frames), 100.0 * Shown / Captured, 100.0 * std::min<uint64_t>(Captured, (uint64_t)Budget * Frames) / Captured);
+	return bValid;
+}
+
+// Slices whose box around their voxels overlaps the box from Min to Max, both X, Y, Z. With culling, these are the
+// slices still uploaded while only that box is in view.
+static uint32_t SlicesTouching(const int16_t* Positions, uint32_t Count, const int32_t* Min, const int32_t* Max)
+{
+	uint32_t Touching = 0;
+	for (uint32_t First = 0; First < Count; First += SliceVoxels)
+	{
+		int16_t SliceMin[3] = { INT16_MAX, INT16_MAX, INT16_MAX };
+		int16_t SliceMax[3] = { INT16_MIN, INT16_MIN, INT16_MIN };
+		VoxelPacking::GatheredBounds(Positions + First * VoxelPacking::GatherStride, std::min(SliceVoxels, Count - First), SliceMin, SliceMax);
+		bool bOverlaps = true;
+		for (int Axis = 0; Axis < 3; Axis++)
+		{
+			bOverlaps &= SliceMin[Axis] <= Max[Axis] && SliceMax[Axis] >= Min[Axis];
+		}
+		Touching += bOverlaps ? 1 : 0;
+	}
+	return Touching;
+}
+
+// Morton sorts a capture and reorders its positions and colours. Returns false if the order wasn't a permutation.
+static bool RunMorton(uint32_t Count, int Frames)
+{
+	// Captures are surfaces, so this is three hollow ellipsoids standing apart, like people in a room, handed out in
+	// grid order. Grid order slices are slabs through all three.
+	const int32_t People = 3;
+	const float Radius = std::sqrt(Count / (4.0f * 3.14159f * 2.0f * People));
+	const int32_t Spacing = (int32_t)(Radius * 4.0f);
+	std::vector<int16_t> Gathered, Sorted;
+	std::vector<uint32_t> Colours, SortedColours;
+	for (int32_t z = (int32_t)(-2 * Radius) - 1; z <= (int32_t)(2 * Radius) + 1; z++)
+	{
+		for (int32_t y = (int32_t)-Radius - 1; y <= (int32_t)Radius + 1; y++)
+		{
+			for (int32_t x = -Spacing - (int32_t)Radius - 1; x <= Spacing + (int32_t)Radius + 1; x++)
+			{
+				const int32_t Person = std::min(std::max((int32_t)std::lround((float)x / Spacing), -1), 1);
+				const int32_t dx = x - Person * Spacing;
+				const float d = std::sqrt(dx * dx + y * y + z * z / 4.0f);
+				if (std::fabs(d - Radius) < 0.5f)
+				{
+					Gathered.insert(Gathered.end(), { (int16_t)z, (int16_t)y, (int16_t)x, 0 });
+					Colours.push_back((uint32_t)(x * 3 + y * 5 + z * 7));
+				}
+			}
+		}
+	}
+	Count = (uint32_t)Colours.size();
+	Sorted.resize(Gathered.size());
+	SortedColours.resize(Count);
+
+	std::vector<uint32_t> Order;
+	std::vector<uint64_t> Items;
+	std::vector<uint32_t> Histograms;
+	FStat SortStat;
+	for (int FrameIdx = 0; FrameIdx < Frames + 1; FrameIdx++)
+	{
+		FClock::time_point Start = FClock::now();
+		VoxelPacking::MortonSort(Gathered.data(), Count, 0, Order, Items, Histograms);
+		const uint64_t* From = (const uint64_t*)Gathered.data();
+		uint64_t* To = (uint64_t*)Sorted.data();
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			To[i] = From[Order[i]];
+			SortedColours[i] = Colours[Order[i]];
+		}
+		if (FrameIdx > 0)
+		{
+			SortStat.Samples.push_back(ElapsedMs(Start, FClock::now()));
+		}
+	}
+
+	std::vector<uint32_t> Check(Order);
+	std::sort(Check.begin(), Check.end());
+	bool bPermutation = Check.size() == Count;
+	for (uint32_t i = 0; i < Check.size() && bPermutation; i++)
+	{
+		bPermutation = Check[i] == i;
+	}
+
+	printf("%u voxels, %d morton frames %s\n", Count, Frames, bPermutation ? "ok" : "NOT A PERMUTATION");
+	PrintStat("morton", SortStat);
+	const int32_t PersonMin[3] = { -(int32_t)Radius - 1, -(int32_t)Radius - 1, (int32_t)(-2 * Radius) - 1 };
+	const int32_t PersonMax[3] = { (int32_t)Radius + 1, (int32_t)Radius + 1, (int32_t)(2 * Radius) + 1 };
+	const uint32_t NumSlices = (Count + SliceVoxels - 1) / SliceVoxels;
+	printf("  %u slices, %u touch the middle person in grid order, %u sorted\n", NumSlices, SlicesTouching(Gathered.data(), Count, PersonMin, PersonMax), SlicesTouching(Sorted.data(), Count, PersonMin, PersonMax));
+	return bPermutation;
+}
+
+// Hands Frames frames to a decode pool every ArrivalUs, each taking DecodeUs to decode on one of Workers workers.
+// Returns false if frames were published out of order, or any that weren't dropped by the policy went missing.
+static bool RunDecode(FVoxelDecodePool::EBackpressure Backpressure, const char* Name, int32_t Workers, int Frames, int ArrivalUs, int DecodeUs)
+{
+	std::vector<int> SlotFrames;
+	std::vector<FClock::time_point> SlotArrivals;
+	std::vector<int> PublishedFrames;
+	FStat LatencyStat;
+	PublishedFrames.reserve(Frames);
+	LatencyStat.Samples.reserve(Frames);
+
+	FVoxelDecodePool Pool(Workers, 2, Backpressure,
+		[&](int32_t Slot)
+		{
+			// Decode times vary, so workers finish out of order
+			FClock::time_point End = FClock::now() + std::chrono::microseconds(DecodeUs / 2 + (SlotFrames[Slot] * 7919) % DecodeUs);
+			while (FClock::now() < End)
+			{
+			}
+		},
+		[&](int32_t Slot)
+		{
+			PublishedFrames.push_back(SlotFrames[Slot]);
+			LatencyStat.Samples.push_back(ElapsedMs(SlotArrivals[Slot], FClock::now()));
+		});
+	SlotFrames.resize(Pool.GetNumSlots());
+	SlotArrivals.resize(Pool.GetNumSlots());
+
+	FClock::time_point Next = FClock::now();
+	for (int FrameIdx = 0; FrameIdx < Frames; FrameIdx++)
+	{
+		std::this_thread::sleep_until(Next);
+		Next += std::chrono::microseconds(ArrivalUs);
+		const int32_t Slot = Pool.BeginFrame();
+		if (Slot >= 0)
+		{
+			SlotFrames[Slot] = FrameIdx;
+			SlotArrivals[Slot] = FClock::now();
+			Pool.SubmitFrame(Slot);
+		}
+	}
+	FVoxelDecodePool::FStats Stats = Pool.GetStats();
+	while (Stats.Published < Stats.Submitted - Stats.DroppedOldest)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		Stats = Pool.GetStats();
+	}
+	Pool.Stop();
+
+	bool bValid = std::is_sorted(PublishedFrames.begin(), PublishedFrames.end()) && std::adjacent_find(PublishedFrames.begin(), PublishedFrames.end()) == PublishedFrames.end();
+	bValid &= PublishedFrames.size() + Stats.DroppedOldest + Stats.DroppedNewest == (size_t)Frames;
+	if (Backpressure == FVoxelDecodePool::EBackpressure::Block)
+	{
+		bValid &= PublishedFrames.size() == (size_t)Frames;
+	}
+	printf("%d frames every %d us, %d us decodes on %d workers, %s %s\n", Frames, ArrivalUs, DecodeUs, Workers, Name, bValid ? "ok" : "INVALID");
+	PrintStat("decode", LatencyStat);
+	printf("  %zu published, %llu dropped oldest, %llu dropped newest, %llu waits, %llu slot waits\n", PublishedFrames.size(),
+		(unsigned long long)Stats.DroppedOldest, (unsigned long long)Stats.DroppedNewest, (unsigned long long)Stats.Blocked,
+		(unsigned long long)Stats.SlotWaits);
+	return bValid;
+}
+
+// Frames captured at 30 fps arrive after a 20 ms base delay plus up to JitterMs more, and are shown on the first
+// render tick at or after their release time. Returns false if frames were shown out of order.
+static bool RunJitter(double JitterMs, int Frames)
+{
+	const double CapturePeriod = 1.0 / 30.0;
+	const double TickPeriod = 1.0 / 90.0;
+	std::mt19937 Random(1234);
+	std::uniform_real_distribution<double> Extra(0.0, JitterMs / 1000.0);
+
+	std::vector<std::pair<double, int>> Arrivals;
+	for (int FrameIdx = 0; FrameIdx < Frames; FrameIdx++)
+	{
+		Arrivals.emplace_back(FrameIdx * CapturePeriod + 0.02 + Extra(Random), FrameIdx);
+	}
+	// UDP doesn't reorder much, but a frame that took longer holds up the ones behind it in the ring
+	for (size_t i = 1; i < Arrivals.size(); i++)
+	{
+		Arrivals[i].first = std::max(Arrivals[i].first, Arrivals[i - 1].first);
+	}
+
+	FVoxelFramePacer Pacer;
+	FVoxelFramePacer::FSettings Settings;
+	std::vector<double> ArrivalTimes, ShownTimes;
+	std::vector<std::pair<double, int>> Released;
+	double LatencySum = 0.0;
+	for (const std::pair<double, int>& Arrival : Arrivals)
+	{
+		ArrivalTimes.push_back(Arrival.first);
+		Released.emplace_back(Pacer.Schedule(Arrival.first, Settings), Arrival.second);
+	}
+
+	// Each tick shows the newest frame that's due, the same as UVoxelSourceBaseComponent::GetFrame
+	bool bValid = true;
+	int LastShown = -1;
+	uint32_t Skipped = 0;
+	size_t Next = 0;
+	for (double Tick = 0.0; Next < Released.size(); Tick += TickPeriod)
+	{
+		size_t Due = Next;
+		while (Due < Released.size() && Released[Due].first <= Tick + TickPeriod * 0.5)
+		{
+			Due++;
+		}
+		if (Due > Next)
+		{
+			const int Frame = Released[Due - 1].second;
+			bValid &= Frame > LastShown;
+			LastShown = Frame;
+			Skipped += (uint32_t)(Due - Next - 1);
+			ShownTimes.push_back(Tick);
+			LatencySum += Tick - Frame * CapturePeriod;
+			Next = Due;
+		}
+	}
+
+	printf("%d frames with %.0f ms of jitter, paced %s\n", Frames, JitterMs, bValid ? "ok" : "INVALID");
+	printf("  arrivals %.2f ms apart +- %.2f, shown +- %.2f, %.1f ms capture to shown, %llu late, %u skipped, %.1f ms playout delay\n",
+		Pacer.GetPeriod() * 1000.0, IntervalDeviationMs(ArrivalTimes), IntervalDeviationMs(ShownTimes), LatencySum / ShownTimes.size() * 1000.0,
+		(unsigned long long)Pacer.GetNumLate(), Skipped, Pacer.GetDelay() * 1000.0);
+	return bValid;
+}
+
+static bool RunCache(uint32_t Count, int Frames, const VoxelFrameCache::FCodec* Codec)
+{
+	std::mt19937 Random(4321);
+	// Neighbouring voxels in a grid are close together, like the surfaces VIMR captures
+	std::uniform_int_distribution<int> Step(0, 3);
+	std::vector<int16_t> Gathered((size_t)Count * VoxelPacking::GatherStride);
+	std::vector<uint32_t> Colours(Count);
+	std::vector<uint8_t> Flags(Count);
+	std::vector<uint16_t> Aux(Count);
+
+	// Frame i has Count - i voxels, the first coordinate and colour of each set from i so every frame can be checked
+	std::vector<uint8_t> File;
+	FVoxelFrameCacheWriter Writer;
+	VoxelFrameCache::FAudioStream Audio = {};
+	strcpy(Audio.FileName, "voice.wav");
+	bool bValid = Writer.Begin(1234, 5678, WriteToMemory(File), Codec, { Audio });
+	double RawBytes = 0.0;
+	const FClock::time_point WriteStart = FClock::now();
+	for (int FrameIdx = 0; FrameIdx < Frames; FrameIdx++)
+	{
+		const uint32_t Num = Count - FrameIdx;
+		int16_t Y = -500;
+		int16_t X = -500;
+		for (uint32_t i = 0; i < Num; i++)
+		{
+			X = (int16_t)(X + Step(Random));
+			if (X > 500)
+			{
+				X = -500;
+				Y++;
+			}
+			int16_t* Position = &Gathered[(size_t)i * VoxelPacking::GatherStride];
+			Position[0] = (int16_t)(FrameIdx + i % 7);
+			Position[1] = Y;
+			Position[2] = X;
+			Position[3] = 1;
+			Colours[i] = 0xff000000 | ((uint32_t)FrameIdx * 31 + i) % 0x10000;
+			Flags[i] = (uint8_t)(i & 1);
+			Aux[i] = (uint16_t)(FrameIdx + i);
+		}
+		const bool bLabels = FrameIdx % 2 == 0;
+		RawBytes += Num * (bLabels ? 13.0 : 10.0);
+		bValid &= Writer.AddFrame(FrameIdx / 30.0, 8, Num, Gathered.data(), Colours.data(), bLabels ? Flags.data() : nullptr, bLabels ? Aux.data() : nullptr);
+	}
+	bValid &= Writer.End();
+	const double WriteMs = ElapsedMs(WriteStart, FClock::now());
+
+	FVoxelFrameCacheReader Reader;
+	VoxelFrameCache::FFrameScratch Scratch;
+	FStat DecodeStat;
+	bValid &= !Reader.Open(File.data(), File.size() - 1, Codec);
+	bValid &= Codec == nullptr || !Reader.Open(File.data(), File.size(), nullptr);
+	// A listing only needs the metadata, which has to match without the frames being read
+	bValid &= Reader.OpenMetadata(File.data(), File.size()) && Reader.GetNumFrames() == (uint32_t)Frames && Reader.GetMaxVoxels() == Count;
+	{
+		VoxelFrameCache::FFrame Frame;
+		bValid &= !Reader.GetFrame(0, Frame, Scratch);
+	}
+	bValid &= Reader.Open(File.data(), File.size(), Codec) && Reader.GetNumFrames() == (uint32_t)Frames;
+	bValid &= Reader.GetMaxVoxels() == Count && Reader.GetVoxelSizemm() == 8;
+	bValid &= Reader.IsFrom(1234, 5678) && !Reader.IsFrom(1234, 5679) && Reader.GetNumAudioStreams() == 1 && strcmp(Reader.GetAudioStream(0).FileName, "voice.wav") == 0;
+	for (uint32_t FrameIdx = 0; bValid && FrameIdx < Reader.GetNumFrames(); FrameIdx++)
+	{
+		VoxelFrameCache::FFrame Frame;
+		DecodeStat.Time([&] { bValid &= Reader.GetFrame(FrameIdx, Frame, Scratch); });
+		bValid &= Frame.NumVoxels == Count - FrameIdx && Frame.VoxelSizemm == 8 && (Frame.Flags != nullptr) == (FrameIdx % 2 == 0);
+		for (uint32_t i = 0; bValid && i < Frame.NumVoxels; i++)
+		{
+			const int16_t* Written = &Gathered[(size_t)i * VoxelPacking::GatherStride];
+			bValid &= Frame.Positions[i * 3] == (int16_t)(FrameIdx + i % 7) && Frame.Colours[i] == (0xff000000 | ((uint32_t)FrameIdx * 31 + i) % 0x10000);
+			// Only the last frame's positions are still around to check in full
+			bValid &= FrameIdx + 1 < Reader.GetNumFrames() || (Frame.Positions[i * 3 + 1] == Written[1] && Frame.Positions[i * 3 + 2] == Written[2]);
+			bValid &= Frame.Flags == nullptr || (Frame.Flags[i] == (i & 1) && Frame.AuxLabels[i] == (uint16_t)(FrameIdx + i));
+		}
+		bValid &= Reader.FindFrame(FrameIdx / 30.0 + 0.01) == FrameIdx;
+	}
+
+	// Seek while paused and time until the frame is handed over
+	std::mutex Mutex;
+	std::condition_variable Shown;
+	int64_t LastShown = -1;
+	FStat SeekStat;
+	{
+		FVoxelCachePlayer Player(Reader, [&](uint32_t Frame, int32_t)
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			LastShown = Frame;
+			Shown.notify_all();
+		});
+		std::uniform_int_distribution<uint32_t> Pick(0, Reader.GetNumFrames() - 1);
+		for (int i = 0; i < Frames; i++)
+		{
+			const uint32_t Target = Pick(Random);
+			SeekStat.Time([&]
+			{
+				Player.SeekToFrame(Target);
+				std::unique_lock<std::mutex> Lock(Mutex);
+				bValid &= Shown.wait_for(Lock, std::chrono::seconds(1), [&] { return LastShown == Target; });
+			});
+		}
+	}
+
+	printf("%u voxels, %d frames cached %s in %.1f MB, %.0f%% of uncompressed, %s\n", Count, Frames, Codec != nullptr ? "with zlib" : "uncompressed",
+		File.size() / (1024.0 * 1024.0), File.size() * 100.0 / RawBytes, bValid ? "ok" : "INVALID");
+	printf("  written in %.2f ms/frame\n", WriteMs / Frames);
+	PrintStat("decode", DecodeStat);
+	PrintStat("seek", SeekStat);
+	return bValid;
+}
+
+static bool RunReadAhead(int32_t ReadAhead, int32_t ReadThreads)
+{
+	const int Frames = 90;
+	const uint32_t Count = 20000;
+	std::vector<int16_t> Gathered((size_t)Count * VoxelPacking::GatherStride, 1);
+	std::vector<uint32_t> Colours(Count, 0xffffffff);
+	std::vector<uint8_t> File;
+	FVoxelFrameCacheWriter Writer;
+	Writer.Begin(0, 0, WriteToMemory(File));
+	for (int FrameIdx = 0; FrameIdx < Frames; FrameIdx++)
+	{
+		Writer.AddFrame(FrameIdx / 30.0, 8, Count, Gathered.data(), Colours.data(), nullptr, nullptr);
+	}
+	Writer.End();
+	FVoxelFrameCacheReader Reader;
+	bool bValid = Reader.Open(File.data(), File.size());
+
+	// Reading a frame copies it out and takes 5 ms, or 60 ms when the share stalls
+	std::vector<std::vector<uint32_t>> Slots(ReadAhead + 1, std::vector<uint32_t>(Count));
+	std::vector<uint32_t> Shown(Count);
+	auto ReadFrame = [&Reader, Count](uint32_t Frame, uint32_t* Out)
+	{
+		VoxelFrameCache::FFrameScratch Unused;
+		VoxelFrameCache::FFrame Cached;
+		Reader.GetFrame(Frame, Cached, Unused);
+		memcpy(Out, Cached.Colours, Count * sizeof(uint32_t));
+		std::this_thread::sleep_for(std::chrono::milliseconds(Frame % 8 == 7 ? 60 : 5));
+	};
+
+	std::vector<double> ShownTimes;
+	int64_t LastShown = -1;
+	const FClock::time_point Start = FClock::now();
+	FVoxelCachePlayer Player(Reader, [&](uint32_t Frame, int32_t Slot)
+	{
+		if (Slot < 0)
+		{
+			ReadFrame(Frame, Shown.data());
+		}
+		else
+		{
+			Shown.swap(Slots[Slot]);
+		}
+		bValid &= (int64_t)Frame > LastShown;
+		LastShown = Frame;
+		ShownTimes.push_back(ElapsedMs(Start, FClock::now()) / 1000.0);
+	}, ReadAhead, [&](uint32_t Frame, int32_t Slot) { ReadFrame(Frame, Slots[Slot].data()); }, ReadThreads);
+	// Give it the time to fill up, as it does while a recording is loaded and waits to be played
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	Player.Play();
+	while (!Player.IsFinished())
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	printf("read ahead %d on %d threads, %s\n", ReadAhead, ReadThreads, bValid ? "ok" : "INVALID");
+	printf("  %zu of %d frames shown +- %.2f ms, %llu skipped, %llu underruns\n", ShownTimes.size(), Frames, IntervalDeviationMs(ShownTimes),
+		(unsigned long long)Player.GetNumSkipped(), (unsigned long long)Player.GetNumUnderruns());
+	return bValid;
+}
+
+int main(int argc, char** argv)
+{
+	int Frames = argc > 1 ? std::max(1, atoi(argv[1])) : 100;
+	double MaxNsPerVoxel = argc > 2 ? atof(argv[2]) : 0.0;
+
+	printf("Packing kernel: %s, %u hardware threads\n", VoxelPacking::GetKernelName(VoxelPacking::GetBestKernel()), std::thread::hardware_concurrency());
+
+	bool bFailed = false;
+	for (uint32_t Count : { 10000u, 50000u, 196608u, 1000000u })
+	{
+		double NsPerVoxel = RunSize(Count, Frames);
+		if (MaxNsPerVoxel > 0.0 && NsPerVoxel > MaxNsPerVoxel)
+		{
+			printf("  REGRESSION: %.3f ns/voxel is over the %.3f limit\n", NsPerVoxel, MaxNsPerVoxel);
+			bFailed = true;
+		}
+	}
+	for (uint32_t Count : { 10000u, 50000u, 196608u, 1000000u })
+	{
+		bFailed |= !RunDelta(Count, Frames);
+	}
+	for (uint32_t Count : { 50000u, 196608u, 1000000u })
+	{
+		bFailed |= !RunMorton(Count, Frames);
+	}
+	for (uint32_t Budget : { 50000u, 196608u })
+	{
+		bFailed |= !RunLod(Budget, 4, Frames);
+	}
+	for (uint32_t Budget : { 50000u, 196608u })
+	{
+		bFailed |= !RunInstances(Budget, 4, Frames);
+	}
+	// Frames arrive at three times the rate two workers can decode them
+	bFailed |= !RunDecode(FVoxelDecodePool::EBackpressure::DropOldest, "drop oldest", 2, Frames * 3, 1000, 6000);
+	bFailed |= !RunDecode(FVoxelDecodePool::EBackpressure::DropNewest, "drop newest", 2, Frames * 3, 1000, 6000);
+	bFailed |= !RunDecode(FVoxelDecodePool::EBackpressure::Block, "block", 2, Frames * 3, 1000, 6000);
+	for (double JitterMs : { 5.0, 20.0, 60.0 })
+	{
+		bFailed |= !RunJitter(JitterMs, std::max(Frames * 10, 300));
+	}
+	const VoxelFrameCache::FCodec Zlib = MakeZlibCodec();
+	for (uint32_t Count : { 50000u, 196608u })
+	{
+		bFailed |= !RunCache(Count, Frames, nullptr);
+		bFailed |= !RunCache(Count, Frames, &Zlib);
+	}
+	bFailed |= !RunReadAhead(0, 1);
+	bFailed |= !RunReadAhead(8, 1);
+	bFailed |= !RunReadAhead(8, 3);
+	return bFailed ? 1 : 0;
+}
@@ -5,6 +5,7 @@
 #include "Engine/Engine.h"
 #include "Sound/SoundWaveProcedural.h"
 #include "Runtime/Core/Public/Misc/FileHelper.h"
+#include "Async/Async.h"
 
 // Sets default values for this component's properties
 URuntimeAudioSource::URuntimeAudioSource()
@@ -14,6 +15,13 @@ URuntimeAudioSource::URuntimeAudioSource()
 
 
 void URuntimeAudioSource::LoadWav(FString wavPath)
+{
+	TArray<uint8> wavData;
+	FFileHelper::LoadFileToArray(wavData, wavPath.GetCharArray().GetData());
+	LoadWavData(MoveTemp(wavData));
+}
+
+void URuntimeAudioSource::LoadWavData(TArray<uint8>&& wavData)
 {
 	// Sound Attenuation Settings
 	SoundAttenuation = NewObject<USoundAttenuation>();
@@ -54,9 +62,9 @@ void URuntimeAudioSource::LoadWav(FString wavPath)
 	else
 	{
 	}
-	FFileHelper::LoadFileToArray(audioData, wavPath.GetCharArray().GetData());
-	SoundWave->ResetAudio();
-	SoundWave->QueueAudio(audioData.GetData(), audioData.Num());
+	WaitForQueue();
+	audioData = MoveTemp(wavData);
+	QueueAudio(0);
 
 	SetIsReplicated(true);
 }
@@ -73,8 +81,7 @@ void URuntimeAudioSource::Stop()
 {
 	if (AudioComponent) {
 		Pause();
-		SoundWave->ResetAudio();
-		SoundWave->QueueAudio(audioData.GetData(), audioData.Num());
+		QueueAudio(0);
 	}
 }
 
@@ -92,6 +99,36 @@ void URuntimeAudioSource::Resume()
 	}
 }
 
+void URuntimeAudioSource::Seek(float Seconds)
+{
+	if (AudioComponent) {
+		Pause();
+		// Past the RIFF header and every sample before Seconds. From the start, queue everything like Stop does.
+		const int32 Offset = Seconds > 0.0f ? FMath::Min(WavHeaderBytes + FMath::FloorToInt(Seconds * 44100.0f) * 2, audioData.Num()) : 0;
+		QueueAudio(Offset);
+	}
+}
+
+void URuntimeAudioSource::QueueAudio(int32 Offset)
+{
+	WaitForQueue();
+	SoundWave->ResetAudio();
+	// audioData only changes once this has been waited for. The procedural wave plays silence until the samples are in.
+	QueueTask = Async(EAsyncExecution::ThreadPool, [Wave = SoundWave, Data = audioData.GetData() + Offset, Bytes = audioData.Num() - Offset]()
+	{
+		Wave->QueueAudio(Data, Bytes);
+	});
+}
+
+void URuntimeAudioSource::WaitForQueue()
+{
+	if (QueueTask.IsValid())
+	{
+		QueueTask.Wait();
+		QueueTask = TFuture<void>();
+	}
+}
+
 bool URuntimeAudioSource::IsReady()
 {
 	return false;
@@ -103,7 +140,14 @@ void URuntimeAudioSource::BeginPlay()
 	Super::BeginPlay();
 }
 
+void URuntimeAudioSource::OnComponentDestroyed(bool bDestroyingHierarchy)
+{
+	WaitForQueue();
+	Super::OnComponentDestroyed(bDestroyingHierarchy);
+}
+
 void URuntimeAudioSource::clear()
 {
+	WaitForQueue();
 	SoundWave->ResetAudio();
 }
\ No newline at end of file
@@ -0,0 +1,422 @@
+#include "VoxelAtlasSubComponent.h"
+#include "Voxels.h"
+#include "VoxelDecimator.h"
+#include "Engine.h"
+#include "RenderingThread.h"
+#include "RHI.h"
+#if WITH_EDITOR
+#include "MeshDescription.h"
+#include "StaticMeshAttributes.h"
+#include "Materials/Material.h"
+#include "Materials/MaterialExpressionCustom.h"
+#include "Materials/MaterialExpressionPerInstanceCustomData.h"
+#include "Materials/MaterialExpressionScalarParameter.h"
+#include "Materials/MaterialExpressionTextureCoordinate.h"
+#include "Materials/MaterialExpressionTextureObjectParameter.h"
+#include "Materials/MaterialExpressionTextureSampleParameter2D.h"
+#include "Materials/MaterialExpressionTransform.h"
+#include "Materials/MaterialExpressionVertexColor.h"
+#include "Materials/MaterialExpressionVertexInterpolator.h"
+#endif
+
+// Fix conflict between Windows.h macros and Unreal function name
+#undef UpdateResource
+
+
+UVoxelAtlasSubComponent::UVoxelAtlasSubComponent()
+{
+	PrimaryComponentTick.bCanEverTick = false;
+
+	// First voxel index of each instance's tile
+	NumCustomDataFloats = 1;
+
+	// Every cube is moved by the material, there's nothing to gain from collision or shadows
+	SetCollisionEnabled(ECollisionEnabled::NoCollision);
+	SetCastShadow(false);
+}
+
+void UVoxelAtlasSubComponent::Init(int32 AtlasWidth, int32 Capacity, UMaterialInterface* AtlasMaterial)
+{
+	this->AtlasWidth = AtlasWidth;
+	this->AtlasHeight = FMath::DivideAndRoundUp(Capacity, AtlasWidth);
+	// Transient textures start out undefined, so the first SetData clears every row it doesn't fill
+	UploadedRows = AtlasHeight;
+	if (AtlasMaterial != nullptr)
+	{
+		StaticMaterial = AtlasMaterial;
+	}
+}
+
+void UVoxelAtlasSubComponent::OnComponentDestroyed(bool bDestroyingHierarchy)
+{
+	EmptyData.SafeRelease();
+
+	Super::OnComponentDestroyed(bDestroyingHierarchy);
+}
+
+void UVoxelAtlasSubComponent::BeginPlay()
+{
+	Super::BeginPlay();
+
+	// Loaded here rather than with constructor finders, so projects only using sub-renderers don't need the assets
+	UStaticMesh* Mesh = LoadObject<UStaticMesh>(nullptr, TEXT("StaticMesh'/Voxels/AtlasUnitCubes.AtlasUnitCubes'"));
+	if (StaticMaterial == nullptr)
+	{
+		StaticMaterial = LoadObject<UMaterialInterface>(nullptr, TEXT("Material'/Voxels/VertexMoveAtlasMaterial.VertexMoveAtlasMaterial'"));
+	}
+#if WITH_EDITOR
+	// Not saved yet, see UVoxelMaterialCommandlet. Built once per session so the editor draws the mode regardless.
+	if (Mesh == nullptr)
+	{
+		static TWeakObjectPtr<UStaticMesh> SessionMesh;
+		if (!SessionMesh.IsValid())
+		{
+			SessionMesh = CreateAtlasMesh(GetTransientPackage(), NAME_None, RF_Transient);
+		}
+		Mesh = SessionMesh.Get();
+	}
+	if (StaticMaterial == nullptr)
+	{
+		static TWeakObjectPtr<UMaterial> SessionMaterial;
+		if (!SessionMaterial.IsValid())
+		{
+			SessionMaterial = CreateAtlasMaterial(GetTransientPackage(), NAME_None, RF_Transient);
+		}
+		StaticMaterial = SessionMaterial.Get();
+	}
+#endif
+
+	if(Mesh && StaticMaterial && AtlasHeight > 0)
+	{
+		SetStaticMesh(Mesh);
+
+		// Positions are read back byte for byte, so they're neither filtered nor converted from sRGB
+		CoarsePositionTexture = UTexture2D::CreateTransient(AtlasWidth, AtlasHeight);
+		CoarsePositionTexture->SRGB = false;
+		CoarsePositionTexture->Filter = TF_Nearest;
+		CoarsePositionTexture->UpdateResource();
+
+		PositionTexture = UTexture2D::CreateTransient(AtlasWidth, AtlasHeight);
+		PositionTexture->SRGB = false;
+		PositionTexture->Filter = TF_Nearest;
+		PositionTexture->UpdateResource();
+
+		ColourTexture = UTexture2D::CreateTransient(AtlasWidth, AtlasHeight);
+		ColourTexture->Filter = TF_Nearest;
+		ColourTexture->UpdateResource();
+
+		// Staging buffers are zeroed when they're allocated
+		EmptyData = FVoxelStagingPool::Create(AtlasWidth * AtlasHeight * VOXEL_TEXTURE_BPP)->Acquire();
+
+		Material = CreateDynamicMaterialInstance(0, StaticMaterial);
+		Material->SetTextureParameterValue(FName("CoarsePositionTexture"), CoarsePositionTexture);
+		Material->SetTextureParameterValue(FName("PositionTexture"), PositionTexture);
+		Material->SetTextureParameterValue(FName("ColourTexture"), ColourTexture);
+		Material->SetScalarParameterValue(FName("AtlasWidth"), AtlasWidth);
+		Material->SetScalarParameterValue(FName("AtlasHeight"), AtlasHeight);
+		Material->SetScalarParameterValue(FName("Scale"), Scale);
+		SetMaterial(0, Material);
+	}
+	else
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Couldn't load /Voxels/AtlasUnitCubes and /Voxels/VertexMoveAtlasMaterial, or there's no atlas size. Save them with -run=VoxelMaterial."));
+	}
+}
+
+#if WITH_EDITOR
+UStaticMesh* UVoxelAtlasSubComponent::CreateAtlasMesh(UObject* Outer, FName Name, EObjectFlags Flags)
+{
+	FMeshDescription MeshDescription;
+	FStaticMeshAttributes Attributes(MeshDescription);
+	Attributes.Register();
+	TVertexAttributesRef<FVector> Positions = Attributes.GetVertexPositions();
+	TVertexInstanceAttributesRef<FVector2D> UVs = Attributes.GetVertexInstanceUVs();
+	TVertexInstanceAttributesRef<FVector4> Colours = Attributes.GetVertexInstanceColors();
+	const FPolygonGroupID PolygonGroup = MeshDescription.CreatePolygonGroup();
+
+	// Corner c of a cube is at (c & 1, c >> 1 & 1, c >> 2 & 1), each face goes round four of them
+	static const int32 Faces[6][4] = { { 0, 2, 3, 1 }, { 4, 5, 7, 6 }, { 0, 1, 5, 4 }, { 2, 6, 7, 3 }, { 0, 4, 6, 2 }, { 1, 3, 7, 5 } };
+	const int32 NumCubes = VOXEL_ATLAS_TILE_SIZE * VOXEL_ATLAS_TILE_SIZE;
+	MeshDescription.ReserveNewVertices(NumCubes * 8);
+	MeshDescription.ReserveNewVertexInstances(NumCubes * 24);
+	MeshDescription.ReserveNewPolygons(NumCubes * 6);
+	for (int32 Cube = 0; Cube < NumCubes; Cube++)
+	{
+		const int32 X = Cube % VOXEL_ATLAS_TILE_SIZE;
+		const int32 Y = Cube / VOXEL_ATLAS_TILE_SIZE;
+		// Every vertex of the cube has the same UV, which is all the material needs to find its texel. It also keeps
+		// the vertices of neighbouring cubes from being welded together when the mesh is built.
+		const FVector2D UV((X + 0.5f) / VOXEL_ATLAS_TILE_SIZE, (Y + 0.5f) / VOXEL_ATLAS_TILE_SIZE);
+		FVertexID Corners[8];
+		for (int32 Corner = 0; Corner < 8; Corner++)
+		{
+			Corners[Corner] = MeshDescription.CreateVertex();
+			Positions[Corners[Corner]] = FVector(X + (Corner & 1), Y + (Corner >> 1 & 1), Corner >> 2 & 1);
+		}
+		for (const int32* Face : Faces)
+		{
+			TArray<FVertexInstanceID, TInlineAllocator<4>> Instances;
+			for (int32 i = 0; i < 4; i++)
+			{
+				const int32 Corner = Face[i];
+				const FVertexInstanceID Instance = MeshDescription.CreateVertexInstance(Corners[Corner]);
+				UVs.Set(Instance, 0, UV);
+				Colours[Instance] = FVector4(Corner & 1, Corner >> 1 & 1, Corner >> 2 & 1, 1.0f);
+				Instances.Add(Instance);
+			}
+			MeshDescription.CreatePolygon(PolygonGroup, Instances);
+		}
+	}
+
+	UStaticMesh* Mesh = NewObject<UStaticMesh>(Outer, Name, Flags);
+	FStaticMeshSourceModel& SourceModel = Mesh->AddSourceModel();
+	SourceModel.BuildSettings.bRecomputeNormals = true;
+	SourceModel.BuildSettings.bRecomputeTangents = true;
+	SourceModel.BuildSettings.bUseFullPrecisionUVs = true;
+	SourceModel.BuildSettings.bGenerateLightmapUVs = false;
+	Mesh->CreateMeshDescription(0, MoveTemp(MeshDescription));
+	Mesh->CommitMeshDescription(0);
+	Mesh->StaticMaterials.Add(FStaticMaterial());
+	// Cubes are moved onto their voxels in the vertex shader, the component's bounds cover where they end up
+	Mesh->Build(true);
+	Mesh->PostEditChange();
+	return Mesh;
+}
+
+UMaterial* UVoxelAtlasSubComponent::CreateAtlasMaterial(UObject* Outer, FName Name, EObjectFlags Flags)
+{
+	UMaterial* Material = NewObject<UMaterial>(Outer, Name, Flags);
+	Material->SetShadingModel(MSM_Unlit);
+	Material->bUsedWithInstancedStaticMeshes = true;
+	// Collapsed cubes and moved ones don't keep a consistent winding, so both sides are drawn
+	Material->TwoSided = true;
+
+	auto AddScalar = [Material](FName ParameterName, float DefaultValue)
+	{
+		UMaterialExpressionScalarParameter* Parameter = NewObject<UMaterialExpressionScalarParameter>(Material);
+		Parameter->ParameterName = ParameterName;
+		Parameter->DefaultValue = DefaultValue;
+		Material->Expressions.Add(Parameter);
+		return Parameter;
+	};
+	auto AddCustom = [Material](const FString& Code, ECustomMaterialOutputType OutputType, TArray<TPair<FName, UMaterialExpression*>> Inputs)
+	{
+		UMaterialExpressionCustom* Custom = NewObject<UMaterialExpressionCustom>(Material);
+		Custom->Code = Code;
+		Custom->OutputType = OutputType;
+		Custom->Inputs.Reset();
+		for (const TPair<FName, UMaterialExpression*>& Input : Inputs)
+		{
+			FCustomInput& CustomInput = Custom->Inputs.AddDefaulted_GetRef();
+			CustomInput.InputName = Input.Key;
+			CustomInput.Input.Expression = Input.Value;
+		}
+		Material->Expressions.Add(Custom);
+		return Custom;
+	};
+
+	// Position texels are raw bytes, so their parameters default to a linear texture of their own
+	UTexture2D* LinearDefault = NewObject<UTexture2D>(Material, TEXT("LinearDefault"));
+	const uint8 Black[4] = { 0, 0, 0, 0 };
+	LinearDefault->Source.Init(1, 1, 1, 1, TSF_BGRA8, Black);
+	LinearDefault->SRGB = false;
+	LinearDefault->CompressionSettings = TC_VectorDisplacementmap;
+	LinearDefault->PostEditChange();
+	UMaterialExpressionTextureObjectParameter* PositionTextures[2];
+	const FName PositionTextureNames[2] = { FName("CoarsePositionTexture"), FName("PositionTexture") };
+	for (int32 i = 0; i < 2; i++)
+	{
+		PositionTextures[i] = NewObject<UMaterialExpressionTextureObjectParameter>(Material);
+		PositionTextures[i]->ParameterName = PositionTextureNames[i];
+		PositionTextures[i]->Texture = LinearDefault;
+		PositionTextures[i]->SamplerType = SAMPLERTYPE_LinearColor;
+		Material->Expressions.Add(PositionTextures[i]);
+	}
+
+	UMaterialExpressionTextureCoordinate* CubeUV = NewObject<UMaterialExpressionTextureCoordinate>(Material);
+	Material->Expressions.Add(CubeUV);
+	UMaterialExpressionPerInstanceCustomData* TileFirst = NewObject<UMaterialExpressionPerInstanceCustomData>(Material);
+	TileFirst->DataIndex = 0;
+	Material->Expressions.Add(TileFirst);
+	UMaterialExpressionVertexColor* Corner = NewObject<UMaterialExpressionVertexColor>(Material);
+	Material->Expressions.Add(Corner);
+
+	// Centre of the cube's texel in the atlas: its index in the tile plus the tile's first voxel, a row per AtlasWidth
+	const FString TileSize = FString::FromInt(VOXEL_ATLAS_TILE_SIZE);
+	UMaterialExpressionCustom* AtlasUV = AddCustom(
+		TEXT("float2 Cell = floor(CubeUV * ") + TileSize + TEXT(");\n")
+		TEXT("float Index = TileFirst + Cell.y * ") + TileSize + TEXT(" + Cell.x;\n")
+		TEXT("float Row = floor(Index / AtlasWidth);\n")
+		TEXT("return (float2(Index - Row * AtlasWidth, Row) + 0.5) / float2(AtlasWidth, AtlasHeight);"),
+		CMOT_Float2,
+		{ { FName("CubeUV"), CubeUV }, { FName("TileFirst"), TileFirst }, { FName("AtlasWidth"), AddScalar(FName("AtlasWidth"), DEFAULT_VOXEL_ATLAS_WIDTH) },
+			{ FName("AtlasHeight"), AddScalar(FName("AtlasHeight"), 1.0f) } });
+
+	// Coarse texels hold the high byte + 128 of X, Y and Z in R, G and B, fine texels the low byte and the level of
+	// detail in A, see VoxelPacking::PackPositions. The voxel covers 2^level voxels from its position, a cube either
+	// side of it centred on the voxel, the same as UnpackInstances. Empty texels collapse the cube to the origin.
+	UMaterialExpressionCustom* Offset = AddCustom(
+		TEXT("float3 Rest = float3(floor(CubeUV * ") + TileSize + TEXT("), 0) + Corner;\n")
+		TEXT("float3 Coarse = round(Texture2DSampleLevel(CoarseTexture, CoarseTextureSampler, AtlasUV, 0).rgb * 255);\n")
+		TEXT("float4 Fine = round(Texture2DSampleLevel(FineTexture, FineTextureSampler, AtlasUV, 0) * 255);\n")
+		TEXT("if (all(Coarse == 0)) return -Rest;\n")
+		TEXT("float Size = exp2(fmod(Fine.a, 16));\n")
+		TEXT("float3 Voxel = (Coarse - 128) * 256 + Fine.rgb;\n")
+		TEXT("return (Voxel - 0.5 + Corner * Size) * Scale - Rest;"),
+		CMOT_Float3,
+		{ { FName("CubeUV"), CubeUV }, { FName("Corner"), Corner }, { FName("AtlasUV"), AtlasUV }, { FName("CoarseTexture"), PositionTextures[0] },
+			{ FName("FineTexture"), PositionTextures[1] }, { FName("Scale"), AddScalar(FName("Scale"), 1.0f) } });
+
+	// The offset is in the mesh's space, the component's transform places the voxels like the Instanced mode's
+	UMaterialExpressionTransform* WorldOffset = NewObject<UMaterialExpressionTransform>(Material);
+	WorldOffset->Input.Expression = Offset;
+	WorldOffset->TransformSourceType = TRANSFORMSOURCE_Local;
+	WorldOffset->TransformType = TRANSFORM_World;
+	Material->Expressions.Add(WorldOffset);
+	Material->WorldPositionOffset.Expression = WorldOffset;
+
+	// The texel is found once per vertex and handed to the pixel shader for the colour
+	UMaterialExpressionVertexInterpolator* ColourUV = NewObject<UMaterialExpressionVertexInterpolator>(Material);
+	ColourUV->Input.Expression = AtlasUV;
+	Material->Expressions.Add(ColourUV);
+	UMaterialExpressionTextureSampleParameter2D* Colour = NewObject<UMaterialExpressionTextureSampleParameter2D>(Material);
+	Colour->ParameterName = FName("ColourTexture");
+	Colour->Texture = LoadObject<UTexture2D>(nullptr, TEXT("/Engine/EngineResources/DefaultTexture.DefaultTexture"));
+	Colour->Coordinates.Expression = ColourUV;
+	Material->Expressions.Add(Colour);
+	Material->EmissiveColor.Expression = Colour;
+
+	// Compiles its shaders
+	Material->PostEditChange();
+	return Material;
+}
+#endif
+
+void UVoxelAtlasSubComponent::SetNumTiles(int32 NumTiles)
+{
+	const int32 TileVoxels = VOXEL_ATLAS_TILE_SIZE * VOXEL_ATLAS_TILE_SIZE;
+	while (GetInstanceCount() < NumTiles)
+	{
+		int32 Instance = AddInstance(FTransform::Identity);
+		SetCustomDataValue(Instance, 0, (float)(Instance * TileVoxels), true);
+	}
+	while (GetInstanceCount() > NumTiles)
+	{
+		RemoveInstance(GetInstanceCount() - 1);
+	}
+}
+
+void UVoxelAtlasSubComponent::SetData(const FVoxelStagingBufferRef& Staging, uint32 NumVoxels)
+{
+	if (!CoarsePositionTexture || !PositionTexture || !ColourTexture)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Tried UVoxelAtlasSubComponent::SetData without Textures initalised"));
+		return;
+	}
+	FTextureResource* CoarsePositionResource = CoarsePositionTexture->Resource;
+	FTextureResource* PositionResource = PositionTexture->Resource;
+	FTextureResource* ColourResource = ColourTexture->Resource;
+	if (CoarsePositionResource == nullptr || PositionResource == nullptr || ColourResource == nullptr)
+	{
+		return;
+	}
+
+	NumVoxels = FMath::Min<uint32>(NumVoxels, AtlasWidth * AtlasHeight);
+	SetNumTiles(FMath::DivideAndRoundUp<uint32>(NumVoxels, VOXEL_ATLAS_TILE_SIZE * VOXEL_ATLAS_TILE_SIZE));
+
+	// The single draw is culled against the frame's voxels, like a sub-renderer against its slice's
+	const FVoxelBounds FrameBounds = Staging->GetBounds(0, NumVoxels);
+	if (FMemory::Memcmp(&FrameBounds, &VoxelBounds, sizeof(FVoxelBounds)) != 0)
+	{
+		VoxelBounds = FrameBounds;
+		UpdateBounds();
+		MarkRenderTransformDirty();
+	}
+
+	// Blocks are zero padded and AtlasWidth divides the block size, so the rows cover whole blocks. Each run of
+	// changed blocks is uploaded as its own region, so a frame where little changed only sends those rows.
+	const uint32 Pitch = AtlasWidth * VOXEL_TEXTURE_BPP;
+	const int32 BlockRows = FMath::DivideAndRoundUp<int32>(FVoxelStagingBuffer::HashBlockTexels, AtlasWidth);
+	const int32 NumBlocks = FMath::Min(FMath::DivideAndRoundUp<int32>(NumVoxels, FVoxelStagingBuffer::HashBlockTexels), Staging->BlockHashes.Num());
+	const int32 UsedRows = FMath::Min(NumBlocks * BlockRows, AtlasHeight);
+	TArray<FUpdateTextureRegion2D, TInlineAllocator<8>> DataRegions;
+	int32 RunStart = -1;
+	for (int32 Block = 0; Block <= NumBlocks; Block++)
+	{
+		bool bDirty = Block < NumBlocks && (!UploadedBlockHashes.IsValidIndex(Block) || UploadedBlockHashes[Block] != Staging->BlockHashes[Block]);
+		if (bDirty && RunStart < 0)
+		{
+			RunStart = Block;
+		}
+		else if (!bDirty && RunStart >= 0)
+		{
+			const int32 FirstRow = RunStart * BlockRows;
+			DataRegions.Add(FUpdateTextureRegion2D(0, FirstRow, 0, 0, AtlasWidth, FMath::Min(Block * BlockRows, UsedRows) - FirstRow));
+			RunStart = -1;
+		}
+	}
+	UploadedBlockHashes.SetNumUninitialized(NumBlocks, false);
+	FMemory::Memcpy(UploadedBlockHashes.GetData(), Staging->BlockHashes.GetData(), NumBlocks * sizeof(uint64));
+
+	// Rows that held voxels last frame but don't now are cleared, so the material sees them as empty
+	FUpdateTextureRegion2D EmptyRegion(0, UsedRows, 0, 0, AtlasWidth, FMath::Max(UploadedRows - UsedRows, 0));
+	UploadedRows = UsedRows;
+
+	if (DataRegions.Num() == 0 && EmptyRegion.Height == 0)
+	{
+		return;
+	}
+
+	FVoxelStagingBufferRef Empty = EmptyData;
+	ENQUEUE_RENDER_COMMAND(UploadVoxelAtlas)(
+		[CoarsePositionResource, PositionResource, ColourResource, DataRegions, EmptyRegion, Pitch, Staging, Empty](FRHICommandListImmediate& RHICmdList)
+	{
+		for (const FUpdateTextureRegion2D& DataRegion : DataRegions)
+		{
+			const uint32 ByteOffset = DataRegion.DestY * Pitch;
+			RHIUpdateTexture2D(CoarsePositionResource->TextureRHI->GetTexture2D(), 0, DataRegion, Pitch, Staging->GetCoarsePositionData() + ByteOffset);
+			RHIUpdateTexture2D(PositionResource->TextureRHI->GetTexture2D(), 0, DataRegion, Pitch, Staging->GetPositionData() + ByteOffset);
+			RHIUpdateTexture2D(ColourResource->TextureRHI->GetTexture2D(), 0, DataRegion, Pitch, Staging->GetColourData() + ByteOffset);
+		}
+		if (EmptyRegion.Height > 0)
+		{
+			RHIUpdateTexture2D(CoarsePositionResource->TextureRHI->GetTexture2D(), 0, EmptyRegion, Pitch, Empty->GetCoarsePositionData());
+			RHIUpdateTexture2D(PositionResource->TextureRHI->GetTexture2D(), 0, EmptyRegion, Pitch, Empty->GetPositionData());
+		}
+	});
+}
+
+FBoxSphereBounds UVoxelAtlasSubComponent::CalcBounds(const FTransform& LocalToWorld) const
+{
+	// A voxel below and the largest merged cell above cover the cubes drawn around the voxels. Sources that don't
+	// know where their voxels are could put them anywhere a position texel reaches.
+	const float MergedSize = (float)(1 << FVoxelDecimator::MaxLevel);
+	const FBox VoxelBox = VoxelBounds.IsEmpty() ? FBox(FVector(MIN_int16), FVector(MAX_int16 + MergedSize)) : FBox(
+		FVector(VoxelBounds.Min[0], VoxelBounds.Min[1], VoxelBounds.Min[2]) - FVector(1.0f),
+		FVector(VoxelBounds.Max[0], VoxelBounds.Max[1], VoxelBounds.Max[2]) + FVector(MergedSize));
+	return FBoxSphereBounds(VoxelBox.TransformBy(FTransform(FQuat::Identity, FVector::ZeroVector, FVector(Scale)) * LocalToWorld));
+}
+
+void UVoxelAtlasSubComponent::SetScale(float Scale)
+{
+	if (Scale != this->Scale) {
+		this->Scale = Scale;
+		// Set in BeginPlay when the material isn't there yet
+		if (Material != nullptr)
+		{
+			Material->SetScalarParameterValue(FName("Scale"), Scale);
+		}
+		UpdateBounds();
+		MarkRenderTransformDirty();
+	}
+}
+
+void UVoxelAtlasSubComponent::SetLocation(FVector Location)
+{
+	SetRelativeLocation(Location);
+}
+
+void UVoxelAtlasSubComponent::SetRotation(FVector Rotation)
+{
+	SetRelativeRotation(FRotator(Rotation.Y, Rotation.Z, Rotation.X));
+}
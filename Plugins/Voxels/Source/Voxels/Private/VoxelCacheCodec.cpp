@@ -0,0 +1,27 @@
+#include "VoxelCacheCodec.h"
+#include "Misc/Compression.h"
+
+const VoxelFrameCache::FCodec& GetVoxelCacheCodec()
+{
+	static const VoxelFrameCache::FCodec Codec = []()
+	{
+		// LZ4 decompresses several times faster than zlib, which matters more here than the last few percent of size
+		VoxelFrameCache::FCodec LZ4;
+		LZ4.Id = VoxelFrameCache::ECodec::LZ4;
+		LZ4.Bound = [](size_t Bytes)
+		{
+			return (size_t)FCompression::CompressMemoryBound(NAME_LZ4, (int32)Bytes);
+		};
+		LZ4.Compress = [](const void* In, size_t InBytes, void* Out, size_t OutCapacity) -> size_t
+		{
+			int32 OutBytes = (int32)OutCapacity;
+			return FCompression::CompressMemory(NAME_LZ4, Out, OutBytes, In, (int32)InBytes) ? (size_t)OutBytes : 0;
+		};
+		LZ4.Decompress = [](const void* In, size_t InBytes, void* Out, size_t OutBytes)
+		{
+			return FCompression::UncompressMemory(NAME_LZ4, Out, (int32)OutBytes, In, (int32)InBytes);
+		};
+		return LZ4;
+	}();
+	return Codec;
+}
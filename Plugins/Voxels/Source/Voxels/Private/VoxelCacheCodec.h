@@ -0,0 +1,6 @@
+#pragma once
+
+#include "VoxelFrameCache.h"
+
+// LZ4 through the engine's FCompression, what frame caches and .vxz containers are compressed with
+const VoxelFrameCache::FCodec& GetVoxelCacheCodec();
@@ -0,0 +1,296 @@
+#include "VoxelCachePlayer.h"
+#include <algorithm>
+
+FVoxelCachePlayer::FVoxelCachePlayer(const FVoxelFrameCacheReader& Cache, FFrameFn OnFrame, int32_t ReadAhead, FReadFn Read, int32_t NumReadThreads)
+	: Cache(Cache)
+	, OnFrame(std::move(OnFrame))
+	, ReadAhead(Read ? std::max(ReadAhead, 0) : 0)
+	, Read(std::move(Read))
+{
+	RestartClock();
+	Thread = std::thread(&FVoxelCachePlayer::Run, this);
+	if (this->ReadAhead > 0)
+	{
+		for (int32_t Slot = this->ReadAhead; Slot >= 0; Slot--)
+		{
+			FreeSlots.push_back(Slot);
+		}
+		for (int32_t i = 0; i < std::max(NumReadThreads, 1); i++)
+		{
+			ReadThreads.emplace_back(&FVoxelCachePlayer::ReadLoop, this);
+		}
+	}
+}
+
+FVoxelCachePlayer::~FVoxelCachePlayer()
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		bStopping = true;
+	}
+	Changed.notify_all();
+	ReadChanged.notify_all();
+	ReadDone.notify_all();
+	Thread.join();
+	for (std::thread& ReadThread : ReadThreads)
+	{
+		ReadThread.join();
+	}
+}
+
+void FVoxelCachePlayer::Play()
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (bFinished || PlayHead >= Cache.GetNumFrames())
+		{
+			PlayHead = 0;
+			DropReadAhead();
+		}
+		bFinished = false;
+		bPlaying = true;
+		RestartClock();
+	}
+	Changed.notify_all();
+}
+
+void FVoxelCachePlayer::Pause()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	bPlaying = false;
+}
+
+void FVoxelCachePlayer::SeekToFrame(uint32_t Frame)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		PlayHead = std::min(Frame, Cache.GetNumFrames() - 1);
+		DropReadAhead();
+		bFinished = false;
+		bShowPlayHead = true;
+		RestartClock();
+	}
+	Changed.notify_all();
+}
+
+void FVoxelCachePlayer::SeekToTime(double Seconds)
+{
+	SeekToFrame(Cache.FindFrame(Seconds));
+}
+
+void FVoxelCachePlayer::SetLoop(bool bInLoop)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	bLoop = bInLoop;
+}
+
+bool FVoxelCachePlayer::IsPlaying()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return bPlaying;
+}
+
+bool FVoxelCachePlayer::IsFinished()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return bFinished;
+}
+
+double FVoxelCachePlayer::GetTime()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return Cache.GetFrameTime(LastShown);
+}
+
+uint64_t FVoxelCachePlayer::GetNumSkipped()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return NumSkipped;
+}
+
+int32_t FVoxelCachePlayer::GetReadAheadDepth()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return (int32_t)Ahead.size();
+}
+
+uint64_t FVoxelCachePlayer::GetNumUnderruns()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return NumUnderruns;
+}
+
+void FVoxelCachePlayer::RestartClock()
+{
+	const double Time = Cache.GetFrameTime(std::min(PlayHead, Cache.GetNumFrames() - 1));
+	Origin = FClock::now() - std::chrono::duration_cast<FClock::duration>(std::chrono::duration<double>(Time));
+}
+
+void FVoxelCachePlayer::Run()
+{
+	std::unique_lock<std::mutex> Lock(Mutex);
+	const uint32_t NumFrames = Cache.GetNumFrames();
+	while (!bStopping)
+	{
+		uint32_t Frame;
+		const bool bSeek = bShowPlayHead;
+		if (bShowPlayHead)
+		{
+			bShowPlayHead = false;
+			Frame = PlayHead;
+		}
+		else if (!bPlaying)
+		{
+			Changed.wait(Lock);
+			continue;
+		}
+		else if (PlayHead >= NumFrames)
+		{
+			if (!bLoop)
+			{
+				bPlaying = false;
+				bFinished = true;
+				continue;
+			}
+			PlayHead = 0;
+			RestartClock();
+			ReadChanged.notify_all();
+			continue;
+		}
+		else
+		{
+			const FClock::time_point Due = Origin + std::chrono::duration_cast<FClock::duration>(std::chrono::duration<double>(Cache.GetFrameTime(PlayHead)));
+			if (FClock::now() < Due)
+			{
+				Changed.wait_until(Lock, Due);
+				continue;
+			}
+			// Fell behind, skip to the newest frame that's due
+			const double Now = std::chrono::duration<double>(FClock::now() - Origin).count();
+			while (PlayHead + 1 < NumFrames && Cache.GetFrameTime(PlayHead + 1) <= Now)
+			{
+				PlayHead++;
+				NumSkipped++;
+			}
+			Frame = PlayHead;
+		}
+		PlayHead = Frame + 1;
+		LastShown = Frame;
+		const int32_t Slot = TakeReadAhead(Lock, Frame, bSeek);
+		if (bStopping)
+		{
+			break;
+		}
+
+		Lock.unlock();
+		OnFrame(Frame, Slot);
+		Lock.lock();
+		if (Slot >= 0)
+		{
+			FreeSlots.push_back(Slot);
+			ReadChanged.notify_all();
+		}
+	}
+}
+
+int32_t FVoxelCachePlayer::TakeReadAhead(std::unique_lock<std::mutex>& Lock, uint32_t Frame, bool bSeek)
+{
+	if (ReadAhead <= 0)
+	{
+		return -1;
+	}
+	// Anything in front of it was skipped
+	while (!Ahead.empty() && Ahead.front().Frame != Frame)
+	{
+		DropAhead(Ahead.front());
+		Ahead.pop_front();
+	}
+	const bool bUnderrun = Ahead.empty() || !Ahead.front().bRead;
+	if (!Ahead.empty() && !Ahead.front().bRead)
+	{
+		// Nearly there, sooner than reading it again here
+		ReadDone.wait(Lock, [this, Frame] { return bStopping || Ahead.empty() || Ahead.front().Frame != Frame || Ahead.front().bRead; });
+	}
+	// Seeks can't be read ahead for, so they don't count
+	NumUnderruns += bUnderrun && !bSeek ? 1 : 0;
+	if (Ahead.empty() || Ahead.front().Frame != Frame || !Ahead.front().bRead)
+	{
+		DropReadAhead();
+		return -1;
+	}
+	const int32_t Slot = Ahead.front().Slot;
+	Ahead.pop_front();
+	ReadChanged.notify_all();
+	return Slot;
+}
+
+void FVoxelCachePlayer::DropAhead(const FAhead& Entry)
+{
+	// The thread reading it gives it back when it doesn't find it here
+	if (Entry.bRead)
+	{
+		FreeSlots.push_back(Entry.Slot);
+	}
+}
+
+void FVoxelCachePlayer::DropReadAhead()
+{
+	for (const FAhead& Entry : Ahead)
+	{
+		DropAhead(Entry);
+	}
+	Ahead.clear();
+	ReadChanged.notify_all();
+}
+
+int64_t FVoxelCachePlayer::NextToRead() const
+{
+	if ((int32_t)Ahead.size() >= ReadAhead || FreeSlots.empty())
+	{
+		return -1;
+	}
+	int64_t Next = Ahead.empty() ? PlayHead : Ahead.back().Frame + 1;
+	if (Next >= Cache.GetNumFrames())
+	{
+		if (!bLoop)
+		{
+			return -1;
+		}
+		Next = 0;
+	}
+	return Next;
+}
+
+void FVoxelCachePlayer::ReadLoop()
+{
+	std::unique_lock<std::mutex> Lock(Mutex);
+	while (true)
+	{
+		ReadChanged.wait(Lock, [this] { return bStopping || NextToRead() >= 0; });
+		if (bStopping)
+		{
+			return;
+		}
+		const uint32_t Frame = (uint32_t)NextToRead();
+		const int32_t Slot = FreeSlots.back();
+		FreeSlots.pop_back();
+		Ahead.push_back({ Frame, Slot, false });
+		Lock.unlock();
+
+		Read(Frame, Slot);
+
+		Lock.lock();
+		auto Entry = std::find_if(Ahead.begin(), Ahead.end(), [Slot](const FAhead& Other) { return Other.Slot == Slot; });
+		if (Entry != Ahead.end())
+		{
+			Entry->bRead = true;
+		}
+		else
+		{
+			// Dropped while it was being read
+			FreeSlots.push_back(Slot);
+			ReadChanged.notify_all();
+		}
+		ReadDone.notify_all();
+	}
+}
@@ -0,0 +1,251 @@
+#include "VoxelCompositorSourceComponent.h"
+#include "VoxelRenderSubComponent.h"
+#include "VoxelPacking.h"
+
+UVoxelCompositorSourceComponent::UVoxelCompositorSourceComponent()
+{
+	// Merging happens in GetFrame, when a renderer asks for a frame
+	PrimaryComponentTick.bCanEverTick = false;
+}
+
+void UVoxelCompositorSourceComponent::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (MaxVoxels <= 0)
+	{
+		MaxVoxels = DEFAULT_MAX_VOXELS;
+	}
+	MaxVoxels = Align(MaxVoxels, FVoxelStagingBuffer::HashBlockTexels);
+	StagingPool = FVoxelStagingPool::GetShared(MaxVoxels * VOXEL_TEXTURE_BPP);
+	LastFrameSequence = 0;
+}
+
+void UVoxelCompositorSourceComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	Super::EndPlay(EndPlayReason);
+	MergedInputs.Empty();
+	BlockCopies.Empty();
+	Composite.SafeRelease();
+	StagingPool.Reset();
+}
+
+FVoxelStagingBufferRef UVoxelCompositorSourceComponent::GetFrame()
+{
+	if (!StagingPool.IsValid())
+	{
+		return nullptr;
+	}
+
+	// Only merge again if an input has published a frame or had its settings changed since the last merge. Asking
+	// each input for its frame also makes it swap in the newest one, as it would for a render component.
+	bool bChanged = MergedInputs.Num() != Inputs.Num();
+	MergedInputs.SetNum(Inputs.Num());
+	for (int32 i = 0; i < Inputs.Num(); i++)
+	{
+		const FVoxelCompositorInput& Input = Inputs[i];
+		FMergedInput& Merged = MergedInputs[i];
+		FVoxelStagingBufferRef Frame = Input.Source != nullptr ? Input.Source->GetFrame() : nullptr;
+		const uint32 FrameSequence = Frame.IsValid() ? Frame->FrameSequence : 0;
+		if (Frame != Merged.Frame || FrameSequence != Merged.FrameSequence || Input.Offset != Merged.Offset || Input.Priority != Merged.Priority || Input.MaxVoxels != Merged.MaxVoxels)
+		{
+			Merged.Frame = Frame;
+			Merged.FrameSequence = FrameSequence;
+			Merged.Offset = Input.Offset;
+			Merged.Priority = Input.Priority;
+			Merged.MaxVoxels = Input.MaxVoxels;
+			bChanged = true;
+		}
+	}
+	if (bChanged)
+	{
+		Merge();
+	}
+	return Composite;
+}
+
+void UVoxelCompositorSourceComponent::SetViewerPosition(const FVector& VoxelPosition)
+{
+	for (const FVoxelCompositorInput& Input : Inputs)
+	{
+		if (Input.Source != nullptr)
+		{
+			Input.Source->SetViewerPosition(VoxelPosition - FVector(Input.Offset));
+		}
+	}
+}
+
+void UVoxelCompositorSourceComponent::SetDrawsMergedVoxels(bool bDraws)
+{
+	for (const FVoxelCompositorInput& Input : Inputs)
+	{
+		if (Input.Source != nullptr)
+		{
+			Input.Source->SetDrawsMergedVoxels(bDraws);
+		}
+	}
+}
+
+void UVoxelCompositorSourceComponent::Merge()
+{
+	const double MergeStartTime = FPlatformTime::Seconds();
+	const uint32 BlockTexels = FVoxelStagingBuffer::HashBlockTexels;
+	const int32 MaxBlocks = MaxVoxels / BlockTexels;
+
+	// Highest priority first, inputs with the same priority in the order they're listed
+	TArray<int32, TInlineAllocator<8>> Order;
+	for (int32 i = 0; i < MergedInputs.Num(); i++)
+	{
+		Order.Add(i);
+	}
+	Order.StableSort([this](int32 A, int32 B) { return MergedInputs[A].Priority > MergedInputs[B].Priority; });
+
+	// Pick the blocks that fit in the budgets, and where each of them goes
+	BlockCopies.Reset();
+	uint32 Budget = (uint32)MaxVoxels;
+	uint32 OverBudget = 0;
+	uint8 VoxelSizemm = 0;
+	bool bLabels = false;
+	const FVoxelStagingBuffer* Newest = nullptr;
+	for (int32 i : Order)
+	{
+		const FMergedInput& Merged = MergedInputs[i];
+		const FVoxelStagingBuffer* Input = Merged.Frame.GetReference();
+		if (Input == nullptr || Input->NumVoxels == 0)
+		{
+			continue;
+		}
+		if (VoxelSizemm == 0)
+		{
+			VoxelSizemm = Input->VoxelSizemm;
+		}
+		else if (Input->VoxelSizemm != VoxelSizemm && !bWarnedVoxelSize)
+		{
+			UE_LOG(VoxLog, Warning, TEXT("Compositor inputs have different voxel sizes (%u and %u mm), all are drawn at %u mm"), VoxelSizemm, Input->VoxelSizemm, VoxelSizemm);
+			bWarnedVoxelSize = true;
+		}
+		if (Newest == nullptr || Input->CopyEndTime > Newest->CopyEndTime)
+		{
+			Newest = Input;
+		}
+
+		uint32 InputBudget = Merged.MaxVoxels > 0 ? FMath::Min<uint32>(Budget, Merged.MaxVoxels) : Budget;
+		const int16 Offset[3] = {
+			(int16)FMath::Clamp(Merged.Offset.X, (int32)MIN_int16, (int32)MAX_int16),
+			(int16)FMath::Clamp(Merged.Offset.Y, (int32)MIN_int16, (int32)MAX_int16),
+			(int16)FMath::Clamp(Merged.Offset.Z, (int32)MIN_int16, (int32)MAX_int16),
+		};
+		const int32 NumBlocks = FMath::Min(Input->BlockHashes.Num(), Input->BlockVoxelCounts.Num());
+		for (int32 Block = 0; Block < NumBlocks; Block++)
+		{
+			const uint32 Count = Input->BlockVoxelCounts[Block];
+			if (Count == 0)
+			{
+				continue;
+			}
+			if (Count > InputBudget || BlockCopies.Num() >= MaxBlocks)
+			{
+				for (; Block < NumBlocks; Block++)
+				{
+					OverBudget += Input->BlockVoxelCounts[Block];
+				}
+				break;
+			}
+			InputBudget -= Count;
+			Budget -= Count;
+			bLabels |= Input->Flags.Num() > 0;
+			BlockCopies.Add({ Input, Block, BlockCopies.Num(), { Offset[0], Offset[1], Offset[2] } });
+		}
+	}
+
+	FVoxelStagingBufferRef Frame = StagingPool->Acquire();
+	const int32 NumBlocks = BlockCopies.Num();
+	Frame->BlockHashes.SetNumUninitialized(NumBlocks, false);
+	Frame->BlockVoxelCounts.SetNumUninitialized(NumBlocks, false);
+	Frame->BlockBounds.SetNumUninitialized(NumBlocks, false);
+	uint8* CoarsePositionData = Frame->GetCoarsePositionData();
+	uint8* PositionData = Frame->GetPositionData();
+	uint8* ColourData = Frame->GetColourData();
+	uint64* BlockHashes = Frame->BlockHashes.GetData();
+	uint16* BlockVoxelCounts = Frame->BlockVoxelCounts.GetData();
+	FVoxelBounds* BlockBounds = Frame->BlockBounds.GetData();
+	const FBlockCopy* Copies = BlockCopies.GetData();
+	// Labels go wherever their voxels do, zeroed for inputs that don't keep them
+	if (bLabels)
+	{
+		Frame->Flags.SetNumZeroed(NumBlocks * BlockTexels, false);
+		Frame->AuxLabels.SetNumZeroed(NumBlocks * BlockTexels, false);
+	}
+	uint8* Flags = bLabels ? Frame->Flags.GetData() : nullptr;
+	uint16* AuxLabels = bLabels ? Frame->AuxLabels.GetData() : nullptr;
+	std::atomic<uint32> OutOfRange(0);
+	std::atomic<uint32>* OutOfRangeCount = &OutOfRange;
+
+	// Blocks are copied whole. Positions in their unused tails are already zero in the input, so those texels stay
+	// empty. Colours there are stale, but nothing draws an empty texel.
+	VoxelPacking::ParallelFor(NumBlocks, VoxelPacking::GetNumWorkers(NumBlocks * BlockTexels, 0), [=](int32 Index) {
+		const FBlockCopy& Copy = Copies[Index];
+		const size_t BlockBytes = BlockTexels * VOXEL_TEXTURE_BPP;
+		const size_t InOffset = (size_t)Copy.InputBlock * BlockBytes;
+		const size_t OutOffset = (size_t)Copy.OutputBlock * BlockBytes;
+		const FVoxelStagingBuffer* Input = Copy.Input;
+		FVoxelBounds Bounds = Input->BlockBounds.IsValidIndex(Copy.InputBlock) ? Input->BlockBounds[Copy.InputBlock] : FVoxelBounds();
+		uint32 Count = Input->BlockVoxelCounts[Copy.InputBlock];
+		FMemory::Memcpy(ColourData + OutOffset, Input->GetColourData() + InOffset, BlockBytes);
+		if (Copy.Offset[0] == 0 && Copy.Offset[1] == 0 && Copy.Offset[2] == 0)
+		{
+			FMemory::Memcpy(CoarsePositionData + OutOffset, Input->GetCoarsePositionData() + InOffset, BlockBytes);
+			FMemory::Memcpy(PositionData + OutOffset, Input->GetPositionData() + InOffset, BlockBytes);
+			BlockHashes[Copy.OutputBlock] = Input->BlockHashes[Copy.InputBlock];
+		}
+		else
+		{
+			const uint32 Kept = VoxelPacking::OffsetTexels(Input->GetCoarsePositionData() + InOffset, Input->GetPositionData() + InOffset, BlockTexels, Copy.Offset,
+				CoarsePositionData + OutOffset, PositionData + OutOffset);
+			if (Kept < Count)
+			{
+				OutOfRangeCount->fetch_add(Count - Kept, std::memory_order_relaxed);
+				Count = Kept;
+			}
+			BlockHashes[Copy.OutputBlock] = VoxelPacking::HashBlock(CoarsePositionData + OutOffset, PositionData + OutOffset, ColourData + OutOffset, BlockTexels);
+			if (!Bounds.IsEmpty())
+			{
+				// Bounds of voxels that were left out are clamped to the edge, which only makes them looser
+				for (int32 Axis = 0; Axis < 3; Axis++)
+				{
+					Bounds.Min[Axis] = (int16)FMath::Clamp((int32)Bounds.Min[Axis] + Copy.Offset[Axis], (int32)MIN_int16, (int32)MAX_int16);
+					Bounds.Max[Axis] = (int16)FMath::Clamp((int32)Bounds.Max[Axis] + Copy.Offset[Axis], (int32)MIN_int16, (int32)MAX_int16);
+				}
+			}
+		}
+		if (Flags != nullptr)
+		{
+			const int32 InFirst = Copy.InputBlock * BlockTexels;
+			const int32 Labelled = FMath::Clamp(FMath::Min(Input->Flags.Num(), Input->AuxLabels.Num()) - InFirst, 0, (int32)BlockTexels);
+			FMemory::Memcpy(Flags + Copy.OutputBlock * BlockTexels, Input->Flags.GetData() + InFirst, Labelled * sizeof(uint8));
+			FMemory::Memcpy(AuxLabels + Copy.OutputBlock * BlockTexels, Input->AuxLabels.GetData() + InFirst, Labelled * sizeof(uint16));
+		}
+		BlockVoxelCounts[Copy.OutputBlock] = (uint16)Count;
+		BlockBounds[Copy.OutputBlock] = Bounds;
+	});
+
+	Frame->NumVoxels = NumBlocks * BlockTexels;
+	Frame->VoxelSizemm = VoxelSizemm;
+	for (const FVoxelBounds& Block : Frame->BlockBounds)
+	{
+		Frame->Bounds.Add(Block);
+	}
+	Frame->FrameSequence = ++LastFrameSequence;
+	// Timed from the newest input, that's the one whose arrival caused this frame
+	Frame->ReceivedTime = Newest != nullptr ? Newest->ReceivedTime : MergeStartTime;
+	Frame->CopyStartTime = MergeStartTime;
+	Frame->CopyEndTime = FPlatformTime::Seconds();
+	Composite = Frame;
+	VoxelsOverBudget = (int32)OverBudget;
+	VoxelsOutOfRange = (int32)OutOfRange.load();
+	if (VoxelsOutOfRange > 0 && !bWarnedOutOfRange)
+	{
+		UE_LOG(VoxLog, Warning, TEXT("Compositor input offsets moved %d voxels past the edge of the grid, they're left out"), VoxelsOutOfRange);
+		bWarnedOutOfRange = true;
+	}
+}
@@ -0,0 +1,203 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "VoxelConvertCommandlet.h"
+#include "Voxels.h"
+#include "VoxelFrameCache.h"
+#include "VoxelCacheCodec.h"
+#include "VoxelPacking.h"
+#include "VoxelStagingBuffer.h"
+#include "HAL/PlatformFilemanager.h"
+#include "HAL/FileManager.h"
+#include "Async/MappedFileHandle.h"
+#include "Misc/Paths.h"
+#include "VIMR/voxgrid.hpp"
+#include "VIMR/vidplayer.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+
+UVoxelConvertCommandlet::UVoxelConvertCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+}
+
+int32 UVoxelConvertCommandlet::Main(const FString& Params)
+{
+	TArray<FString> Tokens;
+	TArray<FString> Switches;
+	TMap<FString, FString> ParamVals;
+	ParseCommandLine(*Params, Tokens, Switches, ParamVals);
+
+	const FString RecordingPath = FPaths::ProjectContentDir() + TEXT("VoxelVideos/");
+	const FString In = ParamVals.FindRef(TEXT("in"));
+	const FString Out = ParamVals.FindRef(TEXT("out"));
+	const bool bLabels = Switches.Contains(TEXT("labels"));
+	const bool bCompress = !Switches.Contains(TEXT("raw"));
+	if (In.IsEmpty())
+	{
+		UE_LOG(VoxLog, Error, TEXT("Usage: -run=VoxelConvert -in=<recording.vx3 or folder> [-out=<container.vxz>] [-labels] [-raw]"));
+		return 1;
+	}
+
+	const FString InPath = FPaths::IsRelative(In) ? RecordingPath + In : In;
+	TArray<FString> Recordings;
+	if (IFileManager::Get().DirectoryExists(*InPath))
+	{
+		IFileManager::Get().FindFiles(Recordings, *(InPath / TEXT("*.vx3")), true, false);
+		for (FString& Recording : Recordings)
+		{
+			Recording = InPath / Recording;
+		}
+	}
+	else
+	{
+		Recordings.Add(InPath);
+	}
+
+	int32 Failed = 0;
+	for (const FString& Recording : Recordings)
+	{
+		FString OutPath = FPaths::ChangeExtension(Recording, TEXT("vxz"));
+		if (!Out.IsEmpty() && Recordings.Num() == 1)
+		{
+			OutPath = FPaths::IsRelative(Out) ? RecordingPath + Out : Out;
+		}
+		Failed += Convert(Recording, OutPath, bLabels, bCompress) ? 0 : 1;
+	}
+	return Failed > 0 ? 1 : 0;
+}
+
+bool UVoxelConvertCommandlet::Convert(const FString& InPath, const FString& OutPath, bool bLabels, bool bCompress)
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	if (!PlatformFile.FileExists(*InPath))
+	{
+		UE_LOG(VoxLog, Error, TEXT("%s doesn't exist"), *InPath);
+		return false;
+	}
+	const FString TempPath = OutPath + TEXT(".tmp");
+	TUniquePtr<IFileHandle> File(PlatformFile.OpenWrite(*TempPath));
+	if (!File.IsValid())
+	{
+		UE_LOG(VoxLog, Error, TEXT("Can't write %s"), *TempPath);
+		return false;
+	}
+
+	// Frames come in on VIMR's playback thread while this one waits for it to finish
+	FCriticalSection WriteLock;
+	FVoxelFrameCacheWriter Writer;
+	bool bFailed = false;
+	double FirstFrameTime = 0.0;
+	std::vector<int16_t> Positions;
+	std::vector<uint32_t> Colours;
+	std::vector<uint8_t> Flags;
+	std::vector<uint16_t> AuxLabels;
+
+	// Same as UVoxelSourceBaseComponent::GatherFrame, without a voxel budget
+	VIMR::VoxVidPlayer Player([&](VIMR::VoxelGrid* Voxels)
+	{
+		FScopeLock Lock(&WriteLock);
+		const double Now = FPlatformTime::Seconds();
+		if (Writer.GetNumFrames() == 0)
+		{
+			FirstFrameTime = Now;
+		}
+		Positions.clear();
+		Colours.clear();
+		Flags.clear();
+		AuxLabels.clear();
+		VIMR::Voxel* Node;
+		while (Voxels->GetNextVoxel(&Node))
+		{
+			Positions.insert(Positions.end(), { Node->pos.Z, Node->pos.Y, Node->pos.X, 0 });
+			uint32_t Colour = 0;
+			Node->read_data((char*)&Colour);
+			Colours.push_back(Colour);
+			if (bLabels)
+			{
+				Flags.push_back((uint8_t)((Node->GetFlag(VIMR::Voxel::Flags::Hidden) != 0 ? VoxelFlag_Hidden : 0) | (Node->GetFlag(VIMR::Voxel::Flags::Special) != 0 ? VoxelFlag_Special : 0)));
+				AuxLabels.push_back((uint16_t)Node->GetAux());
+			}
+		}
+		bFailed |= !Writer.AddFrame(Now - FirstFrameTime, (uint8_t)Voxels->VoxSize_mm(), (uint32_t)Colours.size(), Positions.data(), Colours.data(),
+			bLabels ? Flags.data() : nullptr, bLabels ? AuxLabels.data() : nullptr);
+	});
+	Player.Load(TCHAR_TO_ANSI(*InPath));
+	Player.Loop = false;
+
+	std::vector<VoxelFrameCache::FAudioStream> AudioStreams;
+	VIMR::AudioStream AudioStream;
+	while (Player.GetNextAudioStream(AudioStream))
+	{
+		VoxelFrameCache::FAudioStream Entry;
+		FMemory::Memzero(Entry);
+		strncpy(Entry.FileName, std::string(AudioStream.file_name).c_str(), sizeof(Entry.FileName) - 1);
+		strncpy(Entry.VoxelLabel, std::string(AudioStream.voxel_label).c_str(), sizeof(Entry.VoxelLabel) - 1);
+		AudioStreams.push_back(Entry);
+	}
+
+	IFileHandle* FilePtr = File.Get();
+	Writer.Begin(0, 0, [FilePtr](const void* Data, size_t Bytes) { return FilePtr->Write((const uint8*)Data, (int64)Bytes); },
+		bCompress ? &GetVoxelCacheCodec() : nullptr, AudioStreams);
+
+	// A cache from playing the recording has every frame already, and takes seconds rather than the whole recording
+	const FString CachePath = InPath + TEXT(".vxcache");
+	const uint64 InSize = (uint64)FMath::Max<int64>(IFileManager::Get().FileSize(*InPath), 0);
+	const int64 InTime = IFileManager::Get().GetTimeStamp(*InPath).ToUnixTimestamp();
+	TUniquePtr<IMappedFileHandle> CacheMapping(PlatformFile.FileExists(*CachePath) ? PlatformFile.OpenMapped(*CachePath) : nullptr);
+	TUniquePtr<IMappedFileRegion> CacheRegion(CacheMapping.IsValid() ? CacheMapping->MapRegion(0, CacheMapping->GetFileSize()) : nullptr);
+	FVoxelFrameCacheReader Cache;
+	VoxelFrameCache::FFrameScratch Scratch;
+	VoxelFrameCache::FFrame Frame;
+	const bool bFromCache = CacheRegion.IsValid() && Cache.Open(CacheRegion->GetMappedPtr(), (size_t)CacheRegion->GetMappedSize(), &GetVoxelCacheCodec()) &&
+		Cache.IsFrom(InSize, InTime) && Cache.GetFrame(0, Frame, Scratch) && (!bLabels || Frame.Flags != nullptr);
+
+	if (bFromCache)
+	{
+		UE_LOG(VoxLog, Log, TEXT("Converting %s from %s"), *InPath, *CachePath);
+		for (uint32 FrameIdx = 0; FrameIdx < Cache.GetNumFrames() && !bFailed; FrameIdx++)
+		{
+			if (!Cache.GetFrame(FrameIdx, Frame, Scratch))
+			{
+				bFailed = true;
+				break;
+			}
+			Positions.resize((size_t)Frame.NumVoxels * VoxelPacking::GatherStride);
+			for (uint32 i = 0; i < Frame.NumVoxels; i++)
+			{
+				FMemory::Memcpy(&Positions[(size_t)i * VoxelPacking::GatherStride], Frame.Positions + (size_t)i * 3, 3 * sizeof(int16));
+				Positions[(size_t)i * VoxelPacking::GatherStride + 3] = 0;
+			}
+			bFailed |= !Writer.AddFrame(Frame.Time, Frame.VoxelSizemm, Frame.NumVoxels, Positions.data(), Frame.Colours,
+				bLabels ? Frame.Flags : nullptr, bLabels ? Frame.AuxLabels : nullptr);
+		}
+	}
+	else
+	{
+		UE_LOG(VoxLog, Log, TEXT("Converting %s by playing it through"), *InPath);
+		Player.Play();
+		while (Player.State() != VIMR::VoxVidPlayer::PlayState::Finished)
+		{
+			FPlatformProcess::Sleep(0.1f);
+		}
+	}
+	Player.Close();
+
+	FScopeLock Lock(&WriteLock);
+	bFailed |= !Writer.End() || !File->Flush();
+	const uint32 NumFrames = Writer.GetNumFrames();
+	File.Reset();
+	PlatformFile.DeleteFile(*OutPath);
+	if (bFailed || !PlatformFile.MoveFile(*OutPath, *TempPath))
+	{
+		UE_LOG(VoxLog, Error, TEXT("Failed converting %s"), *InPath);
+		PlatformFile.DeleteFile(*TempPath);
+		return false;
+	}
+	const int64 OutSize = IFileManager::Get().FileSize(*OutPath);
+	UE_LOG(VoxLog, Log, TEXT("Wrote %s: %u frames, %.1f MB from %.1f MB"), *OutPath, NumFrames, OutSize / (1024.0 * 1024.0), InSize / (1024.0 * 1024.0));
+	return true;
+}
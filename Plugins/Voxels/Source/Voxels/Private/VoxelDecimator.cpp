@@ -0,0 +1,225 @@
+#include "VoxelDecimator.h"
+#include <algorithm>
+#include <cstring>
+
+const int32_t FVoxelDecimator::RegionBits;
+const int32_t FVoxelDecimator::MaxLevel;
+
+// Only 36 bits of a key are used, so this can't collide with a region
+static const uint64_t EmptyRegionKey = ~0ull;
+
+static uint32_t PopCount16(uint32_t v)
+{
+	v = v - ((v >> 1) & 0x5555);
+	v = (v & 0x3333) + ((v >> 2) & 0x3333);
+	v = (v + (v >> 4)) & 0x0F0F;
+	return (v + (v >> 8)) & 0x1F;
+}
+
+static uint32_t HashRegion(uint64_t Key, uint32_t Mask)
+{
+	return (uint32_t)((Key * 0x9E3779B97F4A7C15ull) >> 32) & Mask;
+}
+
+void FVoxelDecimator::GrowTable()
+{
+	const uint32_t NewSize = TableKeys.empty() ? 4096 : (uint32_t)TableKeys.size() * 2;
+	TableKeys.assign(NewSize, EmptyRegionKey);
+	TableRegions.assign(NewSize, 0);
+	TableMask = NewSize - 1;
+	for (uint32_t r = 0; r < Regions.size(); r++)
+	{
+		uint32_t i = HashRegion(Regions[r].Key, TableMask);
+		while (TableKeys[i] != EmptyRegionKey)
+		{
+			i = (i + 1) & TableMask;
+		}
+		TableKeys[i] = Regions[r].Key;
+		TableRegions[i] = r;
+	}
+}
+
+uint32_t FVoxelDecimator::FindOrAddRegion(uint64_t Key)
+{
+	uint32_t i = HashRegion(Key, TableMask);
+	while (TableKeys[i] != EmptyRegionKey)
+	{
+		if (TableKeys[i] == Key)
+		{
+			return TableRegions[i];
+		}
+		i = (i + 1) & TableMask;
+	}
+
+	const uint32_t r = (uint32_t)Regions.size();
+	Regions.emplace_back();
+	FRegion& Region = Regions.back();
+	memset(&Region, 0, sizeof(Region));
+	Region.Key = Key;
+	TableKeys[i] = Key;
+	TableRegions[i] = r;
+
+	// At most half full, so probes stay short
+	if (Regions.size() * 2 > TableKeys.size())
+	{
+		GrowTable();
+	}
+	return r;
+}
+
+bool FVoxelDecimator::Decimate(int16_t* Positions, uint32_t Count, const float* Viewer, uint32_t Budget, int32_t Levels, std::vector<uint32_t>& Kept)
+{
+	std::fill(NumAtLevel, NumAtLevel + MaxLevel + 1, 0);
+	NumDropped = 0;
+	if (Count <= Budget)
+	{
+		NumAtLevel[0] = Count;
+		return false;
+	}
+	Levels = std::max(0, std::min(Levels, MaxLevel));
+
+	// Sort voxels into regions and mark them in each region's bitmap. Gathered positions are Z, Y, X.
+	const int32_t RegionMask = (1 << RegionBits) - 1;
+	Regions.clear();
+	if (TableKeys.empty())
+	{
+		GrowTable();
+	}
+	else
+	{
+		std::fill(TableKeys.begin(), TableKeys.end(), EmptyRegionKey);
+	}
+	RegionOf.resize(Count);
+	// Grids hand voxels out in runs along X, so most share a region with the one before
+	uint64_t LastKey = EmptyRegionKey;
+	uint32_t r = 0;
+	FRegion* Current = nullptr;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		const int16_t* p = Positions + i * 4;
+		const int32_t z = p[0], y = p[1], x = p[2];
+		const uint64_t Key = ((uint64_t)(uint16_t)(x >> RegionBits) & 0xFFF) | (((uint64_t)(uint16_t)(y >> RegionBits) & 0xFFF) << 12) | (((uint64_t)(uint16_t)(z >> RegionBits) & 0xFFF) << 24);
+		if (Key != LastKey)
+		{
+			r = FindOrAddRegion(Key);
+			Current = &Regions[r];
+			LastKey = Key;
+		}
+		Current->Occupancy[(z & RegionMask) * 16 + (y & RegionMask)] |= (uint16_t)(1 << (x & RegionMask));
+		Current->Counts[0]++;
+		RegionOf[i] = r;
+	}
+
+	// Count cells at each level, and how far each region is from the viewer
+	for (FRegion& Region : Regions)
+	{
+		for (int32_t z = 0; z < 16; z += 2)
+		{
+			for (int32_t y = 0; y < 16; y += 2)
+			{
+				const uint16_t* Row = Region.Occupancy + z * 16 + y;
+				const uint32_t Rows = Row[0] | Row[1] | Row[16] | Row[17];
+				Region.Counts[1] += PopCount16((Rows | (Rows >> 1)) & 0x5555);
+			}
+		}
+		for (int32_t z = 0; z < 16; z += 4)
+		{
+			for (int32_t y = 0; y < 16; y += 4)
+			{
+				uint32_t Rows = 0;
+				for (int32_t dz = 0; dz < 4; dz++)
+				{
+					const uint16_t* Row = Region.Occupancy + (z + dz) * 16 + y;
+					Rows |= Row[0] | Row[1] | Row[2] | Row[3];
+				}
+				Region.Counts[2] += PopCount16((Rows | (Rows >> 1) | (Rows >> 2) | (Rows >> 3)) & 0x1111);
+			}
+		}
+
+		// Keys hold the region's coordinates as 12 bit two's complement numbers
+		float Centre[3];
+		for (int32_t Axis = 0; Axis < 3; Axis++)
+		{
+			int32_t k = (int32_t)((Region.Key >> (12 * Axis)) & 0xFFF);
+			k = k >= 0x800 ? k - 0x1000 : k;
+			Centre[Axis] = (float)(k * 16 + 8) - Viewer[Axis];
+		}
+		Region.DistanceSquared = Centre[0] * Centre[0] + Centre[1] * Centre[1] + Centre[2] * Centre[2];
+		Region.Level = 0;
+	}
+
+	// Coarsen from the farthest region in, one level at a time, until the frame fits
+	ByDistance.resize(Regions.size());
+	for (uint32_t r = 0; r < Regions.size(); r++)
+	{
+		ByDistance[r] = r;
+	}
+	std::sort(ByDistance.begin(), ByDistance.end(), [this](uint32_t A, uint32_t B) { return Regions[A].DistanceSquared > Regions[B].DistanceSquared; });
+	uint64_t Total = Count;
+	for (int32_t Level = 1; Level <= Levels && Total > Budget; Level++)
+	{
+		for (uint32_t r : ByDistance)
+		{
+			if (Total <= Budget)
+			{
+				break;
+			}
+			FRegion& Region = Regions[r];
+			Total -= Region.Counts[Level - 1] - Region.Counts[Level];
+			Region.Level = Level;
+		}
+	}
+	for (uint32_t r : ByDistance)
+	{
+		if (Total <= Budget)
+		{
+			break;
+		}
+		FRegion& Region = Regions[r];
+		Total -= Region.Counts[Region.Level];
+		NumDropped += Region.Counts[0];
+		Region.Level = -1;
+	}
+
+	// Keep the first voxel in every cell, in the order they came
+	Kept.resize(std::min(Count, Budget));
+	uint32_t* KeptOut = Kept.data();
+	uint32_t NumKept = 0;
+	uint32_t Run = ~0u;
+	Current = nullptr;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		if (RegionOf[i] != Run)
+		{
+			Run = RegionOf[i];
+			Current = &Regions[Run];
+		}
+		const int32_t Level = Current->Level;
+		if (Level < 0)
+		{
+			continue;
+		}
+		int16_t* p = Positions + i * 4;
+		if (Level > 0)
+		{
+			const int32_t CellBits = RegionBits - Level;
+			const uint32_t Cell = ((((p[0] & RegionMask) >> Level) << CellBits | ((p[1] & RegionMask) >> Level)) << CellBits) | ((p[2] & RegionMask) >> Level);
+			uint64_t& Word = Current->Emitted[Cell / 64];
+			const uint64_t Bit = 1ull << (Cell % 64);
+			if (Word & Bit)
+			{
+				continue;
+			}
+			Word |= Bit;
+			const int16_t Snap = (int16_t)~((1 << Level) - 1);
+			p[0] &= Snap;
+			p[1] &= Snap;
+			p[2] &= Snap;
+			p[3] = (int16_t)Level;
+		}
+		NumAtLevel[Level]++;
+		KeptOut[NumKept++] = i;
+	}
+	Kept.resize(NumKept);
+	return true;
+}
@@ -0,0 +1,150 @@
+#include "VoxelDecodePool.h"
+#include <algorithm>
+
+FVoxelDecodePool::FVoxelDecodePool(int32_t NumWorkers, int32_t QueueDepth, EBackpressure Backpressure, FSlotFn Decode, FSlotFn Publish)
+	: QueueDepth(std::max(QueueDepth, 1))
+	, Backpressure(Backpressure)
+	, Decode(std::move(Decode))
+	, Publish(std::move(Publish))
+{
+	NumWorkers = std::max(NumWorkers, 1);
+	NumSlots = this->QueueDepth + NumWorkers * 2;
+	for (int32_t Slot = NumSlots - 1; Slot >= 0; Slot--)
+	{
+		FreeSlots.push_back(Slot);
+	}
+	for (int32_t i = 0; i < NumWorkers; i++)
+	{
+		Workers.emplace_back(&FVoxelDecodePool::WorkerLoop, this);
+	}
+}
+
+FVoxelDecodePool::~FVoxelDecodePool()
+{
+	Stop();
+}
+
+int32_t FVoxelDecodePool::BeginFrame()
+{
+	std::unique_lock<std::mutex> Lock(Mutex);
+	if (!bStopping && (int32_t)Queue.size() >= QueueDepth)
+	{
+		switch (Backpressure)
+		{
+		case EBackpressure::DropOldest:
+		{
+			const int32_t Slot = Queue.front();
+			Queue.pop_front();
+			Stats.DroppedOldest++;
+			return Slot;
+		}
+		case EBackpressure::DropNewest:
+			Stats.DroppedNewest++;
+			return -1;
+		case EBackpressure::Block:
+			Stats.Blocked++;
+			RoomMade.wait(Lock, [this] { return bStopping || (int32_t)Queue.size() < QueueDepth; });
+			break;
+		}
+	}
+
+	// Every slot can only be out while workers are sitting on frames finished ahead of a slow one, which doesn't
+	// last longer than that one frame takes
+	if (!bStopping && FreeSlots.empty())
+	{
+		Stats.SlotWaits++;
+		RoomMade.wait(Lock, [this] { return bStopping || !FreeSlots.empty(); });
+	}
+	if (bStopping)
+	{
+		return -1;
+	}
+	const int32_t Slot = FreeSlots.back();
+	FreeSlots.pop_back();
+	return Slot;
+}
+
+void FVoxelDecodePool::SubmitFrame(int32_t Slot)
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (bStopping)
+		{
+			FreeSlots.push_back(Slot);
+			return;
+		}
+		Queue.push_back(Slot);
+		Stats.Submitted++;
+	}
+	WorkQueued.notify_one();
+}
+
+FVoxelDecodePool::FStats FVoxelDecodePool::GetStats()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	FStats Result = Stats;
+	Result.Queued = (uint32_t)Queue.size();
+	return Result;
+}
+
+void FVoxelDecodePool::Stop()
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		bStopping = true;
+		FreeSlots.insert(FreeSlots.end(), Queue.begin(), Queue.end());
+		Queue.clear();
+	}
+	WorkQueued.notify_all();
+	RoomMade.notify_all();
+	for (std::thread& Worker : Workers)
+	{
+		if (Worker.joinable())
+		{
+			Worker.join();
+		}
+	}
+	Workers.clear();
+}
+
+void FVoxelDecodePool::WorkerLoop()
+{
+	std::unique_lock<std::mutex> Lock(Mutex);
+	while (true)
+	{
+		WorkQueued.wait(Lock, [this] { return bStopping || !Queue.empty(); });
+		if (Queue.empty())
+		{
+			return;
+		}
+		const int32_t Slot = Queue.front();
+		Queue.pop_front();
+		const uint64_t Sequence = NextSequence++;
+		Lock.unlock();
+		RoomMade.notify_all();
+
+		Decode(Slot);
+
+		Lock.lock();
+		Decoded[Sequence] = Slot;
+		if (bPublishing)
+		{
+			// Whoever is publishing picks this one up once it gets to it
+			continue;
+		}
+		bPublishing = true;
+		while (!Decoded.empty() && Decoded.begin()->first == NextPublish)
+		{
+			const int32_t Ready = Decoded.begin()->second;
+			Decoded.erase(Decoded.begin());
+			Lock.unlock();
+			Publish(Ready);
+			Lock.lock();
+			NextPublish++;
+			Stats.Published++;
+			FreeSlots.push_back(Ready);
+			RoomMade.notify_all();
+		}
+		bPublishing = false;
+	}
+}
@@ -0,0 +1,356 @@
+#include "VoxelDeltaEncoder.h"
+#include "VoxelPacking.h"
+#include <algorithm>
+#include <cstring>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+const uint64_t FVoxelDeltaEncoder::EmptyKey;
+const uint64_t FVoxelDeltaEncoder::KeyMask;
+const int32_t FVoxelDeltaEncoder::NewSlot;
+const uint32_t FVoxelDeltaEncoder::NoEntry;
+
+// Table entries of changed voxels are scattered, so loops over them ask for the ones a few voxels ahead
+static inline void Prefetch(const void* Address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(Address, 1);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_prefetch((const char*)Address, _MM_HINT_T0);
+#endif
+}
+
+static const uint32_t PrefetchDistance = 16;
+
+void FVoxelDeltaEncoder::Reset(uint32_t MaxSlots, uint32_t BlockSlots)
+{
+	this->MaxSlots = MaxSlots;
+	this->BlockSlots = BlockSlots;
+
+	// At most half full with a frame's voxels, so probes stay short. New voxels go in on top of last frame's until
+	// it's three quarters full, see AddVoxel.
+	uint32_t TableSize = 1024;
+	while (TableSize < MaxSlots * 2)
+	{
+		TableSize *= 2;
+	}
+	Table.assign(TableSize, { EmptyKey, NewSlot });
+	TableMask = TableSize - 1;
+	NumEntries = 0;
+	MaxEntries = TableSize / 4 * 3;
+
+	SlotKeys.assign(MaxSlots, EmptyKey);
+	SlotColours.assign(MaxSlots, 0);
+	SlotNext.assign(MaxSlots, -1);
+	SeenBits.assign((MaxSlots + 63) / 64, 0);
+	SeenCounts.assign((MaxSlots + BlockSlots - 1) / BlockSlots, 0);
+	FirstSlot = -1;
+	PreviousSlot = -1;
+	Slots.Reset(MaxSlots, BlockSlots);
+	Moves.clear();
+	RecolouredSlots.clear();
+	RecolouredSlots.reserve(MaxSlots);
+	NewVoxels.clear();
+	NewVoxels.reserve(MaxSlots);
+	RemovedKeys.clear();
+	RemovedKeys.reserve(MaxSlots);
+
+	NumInFrame = 0;
+	Stats = FStats();
+}
+
+void FVoxelDeltaEncoder::SetCompaction(float MinHoleFraction, uint32_t MaxMovesPerFrame)
+{
+	this->MinHoleFraction = MinHoleFraction;
+	this->MaxMovesPerFrame = MaxMovesPerFrame;
+}
+
+uint32_t FVoxelDeltaEncoder::Probe(uint64_t Key) const
+{
+	uint32_t i = HashIndex(Key);
+	while (Table[i].Key != Key && Table[i].Key != EmptyKey)
+	{
+		i = (i + 1) & TableMask;
+	}
+	return i;
+}
+
+void FVoxelDeltaEncoder::Erase(uint64_t Key)
+{
+	uint32_t i = Probe(Key);
+	if (Table[i].Key == EmptyKey)
+	{
+		return;
+	}
+	NumEntries--;
+
+	// Shift later entries of the probe run back into the gap, so lookups never need tombstones
+	for (uint32_t j = (i + 1) & TableMask; Table[j].Key != EmptyKey; j = (j + 1) & TableMask)
+	{
+		uint32_t Home = HashIndex(Table[j].Key);
+		if (((j - Home) & TableMask) >= ((j - i) & TableMask))
+		{
+			Table[i] = Table[j];
+			i = j;
+		}
+	}
+	Table[i] = { EmptyKey, NewSlot };
+}
+
+void FVoxelDeltaEncoder::BeginFrame()
+{
+	const uint32_t NumSlots = Slots.GetNumSlots();
+	std::fill(SeenBits.begin(), SeenBits.begin() + (NumSlots + 63) / 64, 0);
+	std::fill(SeenCounts.begin(), SeenCounts.begin() + (NumSlots + BlockSlots - 1) / BlockSlots, 0);
+	RecolouredSlots.clear();
+	NewVoxels.clear();
+	RemovedKeys.clear();
+	NumInFrame = 0;
+	PreviousSlot = -1;
+	Stats = FStats();
+}
+
+uint32_t FVoxelDeltaEncoder::AddVoxels(const int16_t* Gathered, const uint32_t* Colours, uint32_t Count)
+{
+	// Most voxels are where they were, with the same colour, and come right after the voxel they came after last
+	// frame. Slots are handed out in the order voxels first arrive, so that's usually the next slot up, and those
+	// voxels only get a compare and a seen bit.
+	const uint64_t* Keys = SlotKeys.data();
+	const uint32_t* SlotColour = SlotColours.data();
+	uint64_t* Seen = SeenBits.data();
+	uint16_t* SeenInBlock = SeenCounts.data();
+	const uint32_t NumSlots = Slots.GetNumSlots();
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		uint64_t Key;
+		memcpy(&Key, Gathered + i * VoxelPacking::GatherStride, sizeof(Key));
+		Key &= KeyMask;
+		const uint32_t Slot = (uint32_t)(PreviousSlot + 1);
+		const uint64_t Bit = 1ull << (Slot % 64);
+		if (Slot < NumSlots && Keys[Slot] == Key && SlotColour[Slot] == Colours[i] && (Seen[Slot / 64] & Bit) == 0 && NumInFrame < MaxSlots)
+		{
+			Seen[Slot / 64] |= Bit;
+			SeenInBlock[Slot / BlockSlots]++;
+			PreviousSlot = (int32_t)Slot;
+			NumInFrame++;
+			Stats.Unchanged++;
+		}
+		else
+		{
+			// Changes come in runs, the voxels after this one are likely to need the table as well
+			if (i + PrefetchDistance < Count)
+			{
+				uint64_t AheadKey;
+				memcpy(&AheadKey, Gathered + (i + PrefetchDistance) * VoxelPacking::GatherStride, sizeof(AheadKey));
+				Prefetch(&Table[HashIndex(AheadKey & KeyMask)]);
+			}
+			if (!AddVoxel(Key, Colours[i]))
+			{
+				return i;
+			}
+		}
+	}
+	return Count;
+}
+
+bool FVoxelDeltaEncoder::AddVoxel(uint64_t Key, uint32_t Colour)
+{
+	// Slots of voxels missing from this frame are freed before new ones are placed, so a frame fits as long
+	// as it has no more voxels than there are slots
+	if (NumInFrame >= MaxSlots)
+	{
+		return false;
+	}
+
+	// Grids are usually walked in the same order every frame, so try the slot that followed the last voxel's slot
+	// last frame before going to the hash table
+	int32_t Slot = PreviousSlot >= 0 ? SlotNext[PreviousSlot] : FirstSlot;
+	if (Slot < 0 || SlotKeys[Slot] != Key)
+	{
+		const uint32_t Entry = Probe(Key);
+		if (Table[Entry].Key == EmptyKey)
+		{
+			// Entered now so a second voxel at the same position finds it, and EndFrame doesn't have to look for it
+			// again to fill in the slot. Once the table's too full for that, it waits for removed voxels to go.
+			if (NumEntries < MaxEntries)
+			{
+				Table[Entry] = { Key, NewSlot };
+				NumEntries++;
+				NewVoxels.push_back({ Key, Colour, Entry });
+			}
+			else
+			{
+				NewVoxels.push_back({ Key, Colour, NoEntry });
+			}
+			NumInFrame++;
+			return true;
+		}
+		Slot = Table[Entry].Slot;
+		if (Slot == NewSlot)
+		{
+			return true; // Same new position twice in one frame, keep the first
+		}
+	}
+	// New voxels don't break the chain, the next voxel is still predicted from the last one that had a slot
+	if (PreviousSlot >= 0)
+	{
+		SlotNext[PreviousSlot] = Slot;
+	}
+	else
+	{
+		FirstSlot = Slot;
+	}
+	PreviousSlot = Slot;
+
+	if (IsSeen(Slot))
+	{
+		return true; // Same position twice in one frame, keep the first
+	}
+	SeenBits[Slot / 64] |= 1ull << (Slot % 64);
+	SeenCounts[Slot / BlockSlots]++;
+	NumInFrame++;
+	if (SlotColours[Slot] != Colour)
+	{
+		SlotColours[Slot] = Colour;
+		RecolouredSlots.push_back((uint32_t)Slot);
+	}
+	else
+	{
+		Stats.Unchanged++;
+	}
+	return true;
+}
+
+static void WritePosition(uint64_t Key, uint8_t* Coarse, uint8_t* Fine)
+{
+	// Texel channels are Z, Y, X like the key, see VoxelPacking::PackPositions
+	const int16_t Channels[3] = { (int16_t)Key, (int16_t)(Key >> 16), (int16_t)(Key >> 32) };
+	for (int c = 0; c < 3; c++)
+	{
+		Coarse[c] = (uint8_t)((Channels[c] >> 8) + 128);
+		Fine[c] = (uint8_t)(Channels[c] & 0xFF);
+	}
+	Coarse[3] = 0;
+	Fine[3] = 0;
+}
+
+void FVoxelDeltaEncoder::PlaceVoxel(const FNewVoxel& Voxel, uint32_t Entry, uint8_t* CoarseOut, uint8_t* FineOut, uint8_t* ColourOut, std::vector<uint8_t>& DirtyBlocks)
+{
+	// Can't fail, AddVoxel stops taking voxels once the frame has as many as there are slots
+	const uint32_t s = (uint32_t)Slots.Allocate();
+	Table[Entry].Slot = (int32_t)s;
+	SlotNext[s] = -1;
+	SlotKeys[s] = Voxel.Key;
+	SlotColours[s] = Voxel.Colour;
+	WritePosition(Voxel.Key, CoarseOut + s * 4, FineOut + s * 4);
+	memcpy(ColourOut + s * 4, &Voxel.Colour, 4);
+	DirtyBlocks[s / BlockSlots] = 1;
+	Stats.Added++;
+}
+
+static void MoveTexel(uint8_t* Plane, uint32_t From, uint32_t To)
+{
+	memcpy(Plane + To * 4, Plane + From * 4, 4);
+	memset(Plane + From * 4, 0, 4);
+}
+
+void FVoxelDeltaEncoder::EndFrame(uint8_t* CoarseOut, uint8_t* FineOut, uint8_t* ColourOut, std::vector<uint8_t>& DirtyBlocks)
+{
+	DirtyBlocks.assign((MaxSlots + BlockSlots - 1) / BlockSlots, 0);
+
+	// Only blocks that hold more voxels than were seen in them can have lost any
+	const uint32_t NumSlots = Slots.GetNumSlots();
+	const uint32_t NumBlocks = (NumSlots + BlockSlots - 1) / BlockSlots;
+	for (uint32_t Block = 0; Block < NumBlocks; Block++)
+	{
+		if (SeenCounts[Block] == Slots.GetBlockCounts()[Block])
+		{
+			continue;
+		}
+		for (uint32_t s = Block * BlockSlots, End = std::min(s + BlockSlots, NumSlots); s < End; s++)
+		{
+			if (Slots.IsAllocated(s) && !IsSeen(s))
+			{
+				RemovedKeys.push_back(SlotKeys[s]);
+				SlotKeys[s] = EmptyKey;
+				Slots.Free(s);
+				memset(CoarseOut + s * 4, 0, 4);
+				memset(FineOut + s * 4, 0, 4);
+				memset(ColourOut + s * 4, 0, 4);
+				DirtyBlocks[Block] = 1;
+				Stats.Removed++;
+			}
+		}
+	}
+
+	for (uint32_t s : RecolouredSlots)
+	{
+		memcpy(ColourOut + s * 4, &SlotColours[s], 4);
+		DirtyBlocks[s / BlockSlots] = 1;
+		Stats.Recoloured++;
+	}
+
+	for (size_t i = 0; i < NewVoxels.size(); i++)
+	{
+		if (i + PrefetchDistance < NewVoxels.size() && NewVoxels[i + PrefetchDistance].Entry != NoEntry)
+		{
+			Prefetch(&Table[NewVoxels[i + PrefetchDistance].Entry]);
+		}
+		if (NewVoxels[i].Entry != NoEntry)
+		{
+			PlaceVoxel(NewVoxels[i], NewVoxels[i].Entry, CoarseOut, FineOut, ColourOut, DirtyBlocks);
+		}
+	}
+
+	// Every new voxel in the table has its slot, so entries can move now
+	for (size_t i = 0; i < RemovedKeys.size(); i++)
+	{
+		if (i + PrefetchDistance < RemovedKeys.size())
+		{
+			Prefetch(&Table[HashIndex(RemovedKeys[i + PrefetchDistance])]);
+		}
+		Erase(RemovedKeys[i]);
+	}
+
+	for (const FNewVoxel& Voxel : NewVoxels)
+	{
+		if (Voxel.Entry == NoEntry)
+		{
+			const uint32_t Entry = Probe(Voxel.Key);
+			if (Table[Entry].Key == EmptyKey) // Otherwise the same new position twice
+			{
+				Table[Entry] = { Voxel.Key, NewSlot };
+				NumEntries++;
+				PlaceVoxel(Voxel, Entry, CoarseOut, FineOut, ColourOut, DirtyBlocks);
+			}
+		}
+	}
+
+	// New voxels went into the lowest holes, move the highest voxels down into any that are left
+	const uint32_t NumHoles = Slots.GetNumHoles();
+	if (NumHoles > 0 && (float)NumHoles > MinHoleFraction * (float)Slots.GetNumSlots())
+	{
+		Moves.clear();
+		Slots.Compact(MaxMovesPerFrame, Moves);
+		for (const FVoxelSlotAllocator::FMove& Move : Moves)
+		{
+			const uint32_t From = Move.From;
+			const uint32_t To = Move.To;
+			Table[Probe(SlotKeys[From])].Slot = (int32_t)To;
+			SlotKeys[To] = SlotKeys[From];
+			SlotColours[To] = SlotColours[From];
+			// Voxels whose next slot was From now mispredict once and go through the hash table
+			SlotNext[To] = SlotNext[From];
+			SlotKeys[From] = EmptyKey;
+			MoveTexel(CoarseOut, From, To);
+			MoveTexel(FineOut, From, To);
+			MoveTexel(ColourOut, From, To);
+			DirtyBlocks[To / BlockSlots] = 1;
+			DirtyBlocks[From / BlockSlots] = 1;
+		}
+		Stats.Moved = (uint32_t)Moves.size();
+	}
+
+	DirtyBlocks.resize((Slots.GetNumSlots() + BlockSlots - 1) / BlockSlots);
+}
@@ -0,0 +1,414 @@
+#include "VoxelFrameCache.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace VoxelFrameCache;
+
+static size_t PaddedBytes(size_t Bytes)
+{
+	return (Bytes + 7) & ~(size_t)7;
+}
+
+// Bytes a stream of NumVoxels takes before compression
+static size_t RawStreamBytes(int32_t Stream, uint64_t NumVoxels, bool bLabels)
+{
+	static const size_t VoxelBytes[NumStreams] = { 3 * sizeof(int16_t), sizeof(uint32_t), sizeof(uint8_t), sizeof(uint16_t) };
+	const bool bLabelStream = Stream == Stream_Flags || Stream == Stream_AuxLabels;
+	return bLabelStream && !bLabels ? 0 : (size_t)NumVoxels * VoxelBytes[Stream];
+}
+
+// Splits Count values of Bytes each into planes of their first bytes, their second bytes and so on
+static void SplitPlanes(const uint8_t* In, uint32_t Count, size_t Bytes, uint8_t* Out)
+{
+	for (size_t Plane = 0; Plane < Bytes; Plane++)
+	{
+		uint8_t* PlaneOut = Out + Plane * Count;
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			PlaneOut[i] = In[i * Bytes + Plane];
+		}
+	}
+}
+
+static void JoinPlanes(const uint8_t* In, uint32_t Count, size_t Bytes, uint8_t* Out)
+{
+	for (size_t Plane = 0; Plane < Bytes; Plane++)
+	{
+		const uint8_t* PlaneIn = In + Plane * Count;
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			Out[i * Bytes + Plane] = PlaneIn[i];
+		}
+	}
+}
+
+bool FVoxelFrameCacheWriter::Begin(uint64_t SourceSize, int64_t SourceTime, FWriteFn Write, const FCodec* InCodec, const std::vector<FAudioStream>& AudioStreams)
+{
+	WriteFn = std::move(Write);
+	Codec = InCodec != nullptr && InCodec->Id != ECodec::None ? InCodec : nullptr;
+	Offset = 0;
+	bFailed = false;
+	Index.clear();
+
+	FHeader Header;
+	memset(&Header, 0, sizeof(Header));
+	Header.Magic = Magic;
+	Header.Version = Version;
+	Header.SourceSize = SourceSize;
+	Header.SourceTime = SourceTime;
+	Header.Codec = (uint32_t)(Codec != nullptr ? Codec->Id : ECodec::None);
+	Header.NumAudioStreams = (uint32_t)AudioStreams.size();
+	this->Write(&Header, sizeof(Header));
+	return this->Write(AudioStreams.data(), AudioStreams.size() * sizeof(FAudioStream));
+}
+
+bool FVoxelFrameCacheWriter::AddFrame(double Time, uint8_t VoxelSizemm, uint32_t NumVoxels, const int16_t* Gathered, const uint32_t* Colours, const uint8_t* Flags, const uint16_t* AuxLabels)
+{
+	if (bFailed || (!Index.empty() && Time < Index.back().Time))
+	{
+		return false;
+	}
+	FIndexEntry Entry;
+	memset(&Entry, 0, sizeof(Entry));
+	Entry.Offset = Offset;
+	Entry.Time = Time;
+	Entry.NumVoxels = NumVoxels;
+	Entry.VoxelSizemm = VoxelSizemm;
+	Index.push_back(Entry);
+
+	FFrameHeader Frame;
+	memset(&Frame, 0, sizeof(Frame));
+	Frame.Time = Time;
+	Frame.NumVoxels = NumVoxels;
+	Frame.VoxelSizemm = VoxelSizemm;
+	Frame.bLabels = Flags != nullptr && AuxLabels != nullptr;
+
+	// The level lane is dropped, cached frames are always decimated again when they're played
+	const uint8_t* Raw[NumStreams] = {};
+	Streams[Stream_Positions].resize(RawStreamBytes(Stream_Positions, NumVoxels, true));
+	int16_t* Positions = (int16_t*)Streams[Stream_Positions].data();
+	if (Codec == nullptr)
+	{
+		for (uint32_t i = 0; i < NumVoxels; i++)
+		{
+			memcpy(&Positions[(size_t)i * 3], Gathered + (size_t)i * 4, 3 * sizeof(int16_t));
+		}
+		Raw[Stream_Colours] = (const uint8_t*)Colours;
+		Raw[Stream_Flags] = Flags;
+		Raw[Stream_AuxLabels] = (const uint8_t*)AuxLabels;
+	}
+	else
+	{
+		for (int32_t Axis = 0; Axis < 3; Axis++)
+		{
+			int16_t* Plane = Positions + (size_t)Axis * NumVoxels;
+			int16_t Last = 0;
+			for (uint32_t i = 0; i < NumVoxels; i++)
+			{
+				const int16_t Position = Gathered[(size_t)i * 4 + Axis];
+				Plane[i] = (int16_t)(uint16_t)((uint16_t)Position - (uint16_t)Last);
+				Last = Position;
+			}
+		}
+		Streams[Stream_Colours].resize(RawStreamBytes(Stream_Colours, NumVoxels, true));
+		SplitPlanes((const uint8_t*)Colours, NumVoxels, sizeof(uint32_t), Streams[Stream_Colours].data());
+		Raw[Stream_Colours] = Streams[Stream_Colours].data();
+		Raw[Stream_Flags] = Flags;
+		if (Frame.bLabels)
+		{
+			Streams[Stream_AuxLabels].resize(RawStreamBytes(Stream_AuxLabels, NumVoxels, true));
+			SplitPlanes((const uint8_t*)AuxLabels, NumVoxels, sizeof(uint16_t), Streams[Stream_AuxLabels].data());
+			Raw[Stream_AuxLabels] = Streams[Stream_AuxLabels].data();
+		}
+	}
+	Raw[Stream_Positions] = Streams[Stream_Positions].data();
+
+	const uint8_t* Stored[NumStreams] = {};
+	for (int32_t Stream = 0; Stream < NumStreams; Stream++)
+	{
+		const size_t RawBytes = RawStreamBytes(Stream, NumVoxels, Frame.bLabels != 0);
+		Stored[Stream] = Raw[Stream];
+		Frame.StreamBytes[Stream] = (uint32_t)RawBytes;
+		if (Codec != nullptr && RawBytes > 0)
+		{
+			Compressed[Stream].resize(Codec->Bound(RawBytes));
+			const size_t Bytes = Codec->Compress(Raw[Stream], RawBytes, Compressed[Stream].data(), Compressed[Stream].size());
+			if (Bytes > 0 && Bytes < RawBytes)
+			{
+				Stored[Stream] = Compressed[Stream].data();
+				Frame.StreamBytes[Stream] = (uint32_t)Bytes;
+			}
+		}
+	}
+
+	Write(&Frame, sizeof(Frame));
+	for (int32_t Stream = 0; Stream < NumStreams; Stream++)
+	{
+		Write(Stored[Stream], Frame.StreamBytes[Stream]);
+		Pad();
+	}
+	return !bFailed;
+}
+
+bool FVoxelFrameCacheWriter::End()
+{
+	FFooter Footer;
+	memset(&Footer, 0, sizeof(Footer));
+	Footer.IndexOffset = Offset;
+	Footer.NumFrames = (uint32_t)Index.size();
+	for (const FIndexEntry& Entry : Index)
+	{
+		Footer.MaxVoxels = std::max(Footer.MaxVoxels, Entry.NumVoxels);
+	}
+	Footer.Magic = Magic;
+	Write(Index.data(), Index.size() * sizeof(FIndexEntry));
+	Write(&Footer, sizeof(Footer));
+	return !bFailed && !Index.empty();
+}
+
+bool FVoxelFrameCacheWriter::Write(const void* Data, size_t Bytes)
+{
+	if (!bFailed && Bytes > 0)
+	{
+		bFailed = !WriteFn(Data, Bytes);
+		Offset += Bytes;
+	}
+	return !bFailed;
+}
+
+bool FVoxelFrameCacheWriter::Pad()
+{
+	static const uint8_t Zeroes[8] = {};
+	return Write(Zeroes, PaddedBytes(Offset) - Offset);
+}
+
+bool FVoxelFrameCacheReader::Open(const uint8_t* InData, size_t InSize, const FCodec* InCodec)
+{
+	if (!OpenIndex(InData, InSize))
+	{
+		return false;
+	}
+	const bool bCompressed = (ECodec)Header->Codec != ECodec::None;
+	if (bCompressed && (InCodec == nullptr || InCodec->Id != (ECodec)Header->Codec))
+	{
+		Close();
+		return false;
+	}
+
+	// Every frame has to fit before the index, so a truncated or corrupt cache is caught here rather than in playback
+	const uint64_t IndexOffset = (uint64_t)((const uint8_t*)Index - Data);
+	for (uint32_t i = 0; i < NumFrames; i++)
+	{
+		const FFrameHeader* Frame = (const FFrameHeader*)(Data + Index[i].Offset);
+		uint64_t Bytes = sizeof(FFrameHeader);
+		bool bValid = Frame->NumVoxels == Index[i].NumVoxels;
+		for (int32_t Stream = 0; Stream < NumStreams; Stream++)
+		{
+			// Compressed streams are only stored when they came out smaller
+			const size_t RawBytes = RawStreamBytes(Stream, Frame->NumVoxels, Frame->bLabels != 0);
+			bValid &= bCompressed ? Frame->StreamBytes[Stream] <= RawBytes : Frame->StreamBytes[Stream] == RawBytes;
+			Bytes += PaddedBytes(Frame->StreamBytes[Stream]);
+		}
+		if (!bValid || Index[i].Offset + Bytes > IndexOffset)
+		{
+			Close();
+			return false;
+		}
+	}
+	Codec = bCompressed ? InCodec : nullptr;
+	bMetadataOnly = false;
+	return true;
+}
+
+bool FVoxelFrameCacheReader::OpenMetadata(const uint8_t* InData, size_t InSize)
+{
+	if (!OpenIndex(InData, InSize))
+	{
+		return false;
+	}
+	bMetadataOnly = true;
+	return true;
+}
+
+bool FVoxelFrameCacheReader::OpenIndex(const uint8_t* InData, size_t InSize)
+{
+	Close();
+	if (InData == nullptr || InSize < sizeof(FHeader) + sizeof(FFooter))
+	{
+		return false;
+	}
+	const FHeader* InHeader = (const FHeader*)InData;
+	FFooter Footer;
+	memcpy(&Footer, InData + InSize - sizeof(Footer), sizeof(Footer));
+	if (InHeader->Magic != Magic || InHeader->Version != Version || Footer.Magic != Magic)
+	{
+		return false;
+	}
+	const uint64_t FramesStart = sizeof(FHeader) + (uint64_t)InHeader->NumAudioStreams * sizeof(FAudioStream);
+	if (Footer.NumFrames == 0 || Footer.IndexOffset % 8 != 0 || Footer.IndexOffset < FramesStart ||
+		Footer.IndexOffset + (uint64_t)Footer.NumFrames * sizeof(FIndexEntry) + sizeof(FFooter) != InSize)
+	{
+		return false;
+	}
+
+	// Frames are in order and each one's header fits before the next, which is as far as the index alone can tell
+	const FIndexEntry* Entries = (const FIndexEntry*)(InData + Footer.IndexOffset);
+	uint32_t InMaxVoxels = 0;
+	for (uint32_t i = 0; i < Footer.NumFrames; i++)
+	{
+		const uint64_t End = i + 1 < Footer.NumFrames ? Entries[i + 1].Offset : Footer.IndexOffset;
+		if (Entries[i].Offset % 8 != 0 || Entries[i].Offset < FramesStart || Entries[i].Offset + sizeof(FFrameHeader) > End ||
+			(i > 0 && Entries[i].Time < Entries[i - 1].Time))
+		{
+			return false;
+		}
+		InMaxVoxels = std::max(InMaxVoxels, Entries[i].NumVoxels);
+	}
+	if (InMaxVoxels != Footer.MaxVoxels)
+	{
+		return false;
+	}
+
+	Data = InData;
+	Size = InSize;
+	Header = InHeader;
+	Index = Entries;
+	NumFrames = Footer.NumFrames;
+	AudioStreams = (const FAudioStream*)(InData + sizeof(FHeader));
+	NumAudioStreams = InHeader->NumAudioStreams;
+	MaxVoxels = Footer.MaxVoxels;
+	VoxelSizemm = Entries[0].VoxelSizemm;
+	return true;
+}
+
+void FVoxelFrameCacheReader::Close()
+{
+	Data = nullptr;
+	Size = 0;
+	Header = nullptr;
+	Index = nullptr;
+	NumFrames = 0;
+	Codec = nullptr;
+	AudioStreams = nullptr;
+	NumAudioStreams = 0;
+	MaxVoxels = 0;
+	VoxelSizemm = 0;
+	bMetadataOnly = false;
+}
+
+bool FVoxelFrameCacheReader::IsFrom(uint64_t SourceSize, int64_t SourceTime) const
+{
+	return Header != nullptr && Header->SourceSize == SourceSize && Header->SourceTime == SourceTime;
+}
+
+bool FVoxelFrameCacheReader::GetFrame(uint32_t FrameIdx, FFrame& Out, FFrameScratch& Scratch) const
+{
+	if (bMetadataOnly)
+	{
+		return false;
+	}
+	const FFrameHeader* FrameHeader = (const FFrameHeader*)(Data + Index[FrameIdx].Offset);
+	const uint8_t* Stored[NumStreams];
+	const uint8_t* Ptr = (const uint8_t*)(FrameHeader + 1);
+	for (int32_t Stream = 0; Stream < NumStreams; Stream++)
+	{
+		Stored[Stream] = Ptr;
+		Ptr += PaddedBytes(FrameHeader->StreamBytes[Stream]);
+	}
+
+	const uint32_t Count = FrameHeader->NumVoxels;
+	Out = FFrame();
+	Out.Time = FrameHeader->Time;
+	Out.NumVoxels = Count;
+	Out.VoxelSizemm = FrameHeader->VoxelSizemm;
+	if (Codec == nullptr)
+	{
+		Out.Positions = (const int16_t*)Stored[Stream_Positions];
+		Out.Colours = (const uint32_t*)Stored[Stream_Colours];
+		if (FrameHeader->bLabels)
+		{
+			Out.Flags = Stored[Stream_Flags];
+			Out.AuxLabels = (const uint16_t*)Stored[Stream_AuxLabels];
+		}
+		return true;
+	}
+
+	// Each stream is decompressed to Scratch.Stream in turn, unless it was stored as it was
+	auto Decompress = [this, FrameHeader, &Stored, &Scratch](int32_t Stream) -> const uint8_t*
+	{
+		const size_t RawBytes = RawStreamBytes(Stream, FrameHeader->NumVoxels, FrameHeader->bLabels != 0);
+		if (FrameHeader->StreamBytes[Stream] == RawBytes)
+		{
+			return Stored[Stream];
+		}
+		Scratch.Stream.resize(RawBytes);
+		return Codec->Decompress(Stored[Stream], FrameHeader->StreamBytes[Stream], Scratch.Stream.data(), RawBytes) ? Scratch.Stream.data() : nullptr;
+	};
+
+	const int16_t* Deltas = (const int16_t*)Decompress(Stream_Positions);
+	if (Deltas == nullptr)
+	{
+		return false;
+	}
+	Scratch.Positions.resize((size_t)Count * 3);
+	for (int32_t Axis = 0; Axis < 3; Axis++)
+	{
+		const int16_t* Plane = Deltas + (size_t)Axis * Count;
+		uint16_t Position = 0;
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			Position = (uint16_t)(Position + (uint16_t)Plane[i]);
+			Scratch.Positions[(size_t)i * 3 + Axis] = (int16_t)Position;
+		}
+	}
+
+	const uint8_t* ColourPlanes = Decompress(Stream_Colours);
+	if (ColourPlanes == nullptr)
+	{
+		return false;
+	}
+	Scratch.Colours.resize(Count);
+	JoinPlanes(ColourPlanes, Count, sizeof(uint32_t), (uint8_t*)Scratch.Colours.data());
+	Out.Positions = Scratch.Positions.data();
+	Out.Colours = Scratch.Colours.data();
+
+	if (FrameHeader->bLabels)
+	{
+		const uint8_t* Flags = Decompress(Stream_Flags);
+		if (Flags == nullptr)
+		{
+			return false;
+		}
+		Scratch.Flags.assign(Flags, Flags + Count);
+		const uint8_t* AuxPlanes = Decompress(Stream_AuxLabels);
+		if (AuxPlanes == nullptr)
+		{
+			return false;
+		}
+		Scratch.AuxLabels.resize(Count);
+		JoinPlanes(AuxPlanes, Count, sizeof(uint16_t), (uint8_t*)Scratch.AuxLabels.data());
+		Out.Flags = Scratch.Flags.data();
+		Out.AuxLabels = Scratch.AuxLabels.data();
+	}
+	return true;
+}
+
+uint32_t FVoxelFrameCacheReader::FindFrame(double Time) const
+{
+	if (NumFrames == 0 || Time <= Index[0].Time)
+	{
+		return 0;
+	}
+	const double Span = Index[NumFrames - 1].Time - Index[0].Time;
+	int64_t Frame = Span > 0.0 ? (int64_t)((Time - Index[0].Time) / Span * (NumFrames - 1)) : 0;
+	Frame = std::max<int64_t>(0, std::min<int64_t>(Frame, NumFrames - 1));
+	while (Frame + 1 < NumFrames && Index[Frame + 1].Time <= Time)
+	{
+		Frame++;
+	}
+	while (Frame > 0 && Index[Frame].Time > Time)
+	{
+		Frame--;
+	}
+	return (uint32_t)Frame;
+}
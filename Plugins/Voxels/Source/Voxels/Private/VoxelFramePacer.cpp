@@ -0,0 +1,81 @@
+#include "VoxelFramePacer.h"
+#include <algorithm>
+#include <cmath>
+
+const int32_t FVoxelFramePacer::GapPeriods;
+constexpr double FVoxelFramePacer::BaseDelayWindow;
+
+void FVoxelFramePacer::Reset()
+{
+	bStarted = false;
+	Period = 0.0;
+	Jitter = 0.0;
+	Delay = 0.0;
+	NumLate = 0;
+	NumGaps = 0;
+	Offsets.clear();
+}
+
+double FVoxelFramePacer::Schedule(double ArrivalTime, const FSettings& Settings)
+{
+	double Capture = ArrivalTime;
+	if (bStarted)
+	{
+		const double Interval = ArrivalTime - LastArrival;
+		const bool bGap = Period > 0.0 && Interval >= Period * GapPeriods;
+		NumGaps = bGap ? NumGaps + 1 : 0;
+		if (Period <= 0.0 || NumGaps >= GapPeriods)
+		{
+			// First interval, or gaps keep coming because the period was taken from a burst
+			Period = Interval;
+			NumGaps = 0;
+		}
+		else if (!bGap)
+		{
+			// Same smoothing as RTP's interarrival jitter
+			Period += (Interval - Period) / 16.0;
+			Jitter += (std::fabs(Interval - Period) - Jitter) / 16.0;
+		}
+
+		if (!bGap)
+		{
+			Capture = LastCapture + Period;
+		}
+		else
+		{
+			// Start the capture clock over at the base delay we had, so the pause isn't counted as delay
+			Capture = ArrivalTime - (Offsets.empty() ? 0.0 : Offsets.front().second);
+		}
+	}
+	bStarted = true;
+	LastArrival = ArrivalTime;
+	LastCapture = Capture;
+
+	const double Offset = ArrivalTime - Capture;
+	while (!Offsets.empty() && Offsets.back().second >= Offset)
+	{
+		Offsets.pop_back();
+	}
+	Offsets.emplace_back(ArrivalTime, Offset);
+	while (Offsets.front().first < ArrivalTime - BaseDelayWindow)
+	{
+		Offsets.pop_front();
+	}
+	const double BaseDelay = Offsets.front().second;
+
+	Delay = Settings.TargetLatency;
+	if (Settings.bAdaptive)
+	{
+		Delay = std::max(Delay, Jitter * Settings.JitterMultiplier);
+	}
+	Delay = std::min(Delay, std::max(Settings.MaxLatency, Settings.TargetLatency));
+
+	double Release = std::max(Capture + BaseDelay + Delay, LastRelease);
+	if (Release < ArrivalTime)
+	{
+		NumLate++;
+		Release = ArrivalTime;
+	}
+	LastRelease = Release;
+	return Release;
+}
@@ -0,0 +1,240 @@
+#include "VoxelInstancedSubComponent.h"
+#include "Voxels.h"
+#include "VoxelRenderSubComponent.h"
+#include "VoxelPacking.h"
+#include "Engine.h"
+#include "Async/ParallelFor.h"
+#if WITH_EDITOR
+#include "Materials/Material.h"
+#include "Materials/MaterialExpressionAppendVector.h"
+#include "Materials/MaterialExpressionPerInstanceCustomData.h"
+#endif
+
+
+UVoxelInstancedSubComponent::UVoxelInstancedSubComponent()
+{
+	PrimaryComponentTick.bCanEverTick = false;
+
+	FString VoxelAsset = FString::Printf(TEXT("StaticMesh'/Engine/BasicShapes/Cube.Cube'"));
+
+	static ConstructorHelpers::FObjectFinder<UStaticMesh> MeshFinder(*VoxelAsset);
+	if(MeshFinder.Object != nullptr)
+	{
+		SetStaticMesh(MeshFinder.Object);
+	}
+	else
+	{
+		UE_LOG(LogTemp, Error, TEXT("Couldn't load asset: %s"), *VoxelAsset);
+	}
+
+	// Colour of each voxel
+	NumCustomDataFloats = 3;
+
+	// Instances are rewritten every frame, there's nothing to gain from collision or shadows
+	SetCollisionEnabled(ECollisionEnabled::NoCollision);
+	SetCastShadow(false);
+}
+
+void UVoxelInstancedSubComponent::Init(UStaticMesh* Mesh, UMaterialInterface* InstanceMaterial, float ShrinkDelaySeconds)
+{
+	if (Mesh != nullptr)
+	{
+		SetStaticMesh(Mesh);
+	}
+	if (InstanceMaterial != nullptr)
+	{
+		StaticMaterial = InstanceMaterial;
+	}
+	this->ShrinkDelaySeconds = ShrinkDelaySeconds;
+}
+
+void UVoxelInstancedSubComponent::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (GetStaticMesh() != nullptr)
+	{
+		MeshSize = FMath::Max(GetStaticMesh()->GetBounds().BoxExtent.GetMax() * 2.0f, KINDA_SMALL_NUMBER);
+	}
+
+	// Loaded here rather than with a constructor finder, so projects using the texture renderers don't need the asset
+	if (StaticMaterial == nullptr)
+	{
+		StaticMaterial = LoadObject<UMaterialInterface>(nullptr, TEXT("Material'/Voxels/InstancedVoxelMaterial.InstancedVoxelMaterial'"));
+	}
+#if WITH_EDITOR
+	if (StaticMaterial == nullptr)
+	{
+		// Not saved yet, see UVoxelMaterialCommandlet. Built once per session so the editor shows colours regardless.
+		static TWeakObjectPtr<UMaterial> SessionMaterial;
+		if (!SessionMaterial.IsValid())
+		{
+			SessionMaterial = CreateInstancedVoxelMaterial(GetTransientPackage(), NAME_None, RF_Transient);
+		}
+		StaticMaterial = SessionMaterial.Get();
+	}
+#endif
+	if (StaticMaterial != nullptr)
+	{
+		SetMaterial(0, StaticMaterial);
+	}
+	else
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Couldn't load /Voxels/InstancedVoxelMaterial, voxels will be drawn without their colours. Save it with -run=VoxelMaterial."));
+	}
+}
+
+#if WITH_EDITOR
+UMaterial* UVoxelInstancedSubComponent::CreateInstancedVoxelMaterial(UObject* Outer, FName Name, EObjectFlags Flags)
+{
+	UMaterial* Material = NewObject<UMaterial>(Outer, Name, Flags);
+	Material->SetShadingModel(MSM_Unlit);
+	Material->bUsedWithInstancedStaticMeshes = true;
+
+	// Emissive colour is custom data 0, 1 and 2 appended together
+	UMaterialExpression* Channels[3];
+	for (int32 Channel = 0; Channel < 3; Channel++)
+	{
+		UMaterialExpressionPerInstanceCustomData* Data = NewObject<UMaterialExpressionPerInstanceCustomData>(Material);
+		Data->DataIndex = Channel;
+		Material->Expressions.Add(Data);
+		Channels[Channel] = Data;
+	}
+	UMaterialExpressionAppendVector* RG = NewObject<UMaterialExpressionAppendVector>(Material);
+	RG->A.Expression = Channels[0];
+	RG->B.Expression = Channels[1];
+	Material->Expressions.Add(RG);
+	UMaterialExpressionAppendVector* RGB = NewObject<UMaterialExpressionAppendVector>(Material);
+	RGB->A.Expression = RG;
+	RGB->B.Expression = Channels[2];
+	Material->Expressions.Add(RGB);
+	Material->EmissiveColor.Expression = RGB;
+
+	// Compiles its shaders
+	Material->PostEditChange();
+	return Material;
+}
+#endif
+
+void UVoxelInstancedSubComponent::UpdateInstances(const FVoxelStagingBuffer* Staging, uint32 First, uint32 End, uint32 NumVoxels)
+{
+	const uint32 BlockTexels = FVoxelStagingBuffer::HashBlockTexels;
+	const uint8* CoarsePositionData = Staging->GetCoarsePositionData();
+	const uint8* PositionData = Staging->GetPositionData();
+	const uint8* ColourData = Staging->GetColourData();
+	const float InstanceScale = Scale / MeshSize;
+	const uint32 Num = End - First;
+
+	Transforms.SetNumUninitialized(Num, false);
+	InstanceData.SetNumUninitialized(Num * 4, false);
+	// Colours are decoded straight into the component's custom data, which is 3 floats per instance like theirs
+	check(PerInstanceSMCustomData.Num() >= (int32)End * NumCustomDataFloats);
+	float* CustomData = PerInstanceSMCustomData.GetData() + (size_t)First * NumCustomDataFloats;
+	const int32 NumBlocks = FMath::DivideAndRoundUp<uint32>(Num, BlockTexels);
+	ParallelFor(NumBlocks, [&](int32 Block)
+	{
+		const uint32 BlockStart = First + Block * BlockTexels;
+		const uint32 BlockEnd = FMath::Min(BlockStart + BlockTexels, End);
+		// Instances past the frame's voxels are collapsed, as are empty texels
+		const uint32 Live = BlockStart < NumVoxels ? FMath::Min(BlockEnd, NumVoxels) - BlockStart : 0;
+		float* Instances = InstanceData.GetData() + (BlockStart - First) * 4;
+		float* Colours = CustomData + (BlockStart - First) * 3;
+		const size_t Offset = BlockStart * VOXEL_TEXTURE_BPP;
+		VoxelPacking::UnpackInstances(CoarsePositionData + Offset, PositionData + Offset, ColourData + Offset, Live, Instances, Colours);
+		FMemory::Memzero(Instances + Live * 4, (BlockEnd - BlockStart - Live) * 4 * sizeof(float));
+		FMemory::Memzero(Colours + Live * 3, (BlockEnd - BlockStart - Live) * 3 * sizeof(float));
+		for (uint32 i = 0; i < BlockEnd - BlockStart; i++)
+		{
+			const float* Instance = Instances + i * 4;
+			Transforms[BlockStart - First + i] = FTransform(FQuat::Identity, FVector(Instance[0], Instance[1], Instance[2]) * Scale, FVector(InstanceScale * Instance[3]));
+		}
+	});
+
+	// One batch for the transforms, which marks the render state dirty once and so sends the custom data written
+	// above along with them, rather than a call per instance and channel
+	BatchUpdateInstancesTransforms(First, Transforms, false, true, true);
+}
+
+void UVoxelInstancedSubComponent::SetData(const FVoxelStagingBufferRef& Staging, uint32 NumVoxels)
+{
+	const uint32 BlockTexels = FVoxelStagingBuffer::HashBlockTexels;
+
+	// Surplus instances are only given up once they've gone unused for a while, so they don't churn
+	const int32 Wanted = FMath::DivideAndRoundUp(NumVoxels, BlockTexels) * BlockTexels;
+	if (GetInstanceCount() > Wanted * 2)
+	{
+		float Now = GetWorld()->GetTimeSeconds();
+		if (ShrinkPendingSince < 0.0f)
+		{
+			ShrinkPendingSince = Now;
+		}
+		else if (Now - ShrinkPendingSince > ShrinkDelaySeconds)
+		{
+			ClearInstances();
+			UploadedBlockHashes.Reset();
+			UploadedVoxels = 0;
+			ShrinkPendingSince = -1.0f;
+		}
+	}
+	else
+	{
+		ShrinkPendingSince = -1.0f;
+	}
+
+	// Grow a block at a time, the new instances are filled in below
+	if (GetInstanceCount() < Wanted)
+	{
+		Transforms.Init(FTransform(FQuat::Identity, FVector::ZeroVector, FVector::ZeroVector), Wanted - GetInstanceCount());
+		AddInstances(Transforms, false);
+	}
+
+	const int32 NumBlocks = FMath::Min(FMath::DivideAndRoundUp<int32>(NumVoxels, BlockTexels), Staging->BlockHashes.Num());
+	int32 FirstDirty = NumBlocks;
+	int32 LastDirty = -1;
+	for (int32 Block = 0; Block < NumBlocks; Block++)
+	{
+		if (!UploadedBlockHashes.IsValidIndex(Block) || UploadedBlockHashes[Block] != Staging->BlockHashes[Block])
+		{
+			FirstDirty = FMath::Min(FirstDirty, Block);
+			LastDirty = Block;
+		}
+	}
+	UploadedBlockHashes.SetNumUninitialized(NumBlocks, false);
+	FMemory::Memcpy(UploadedBlockHashes.GetData(), Staging->BlockHashes.GetData(), NumBlocks * sizeof(uint64));
+
+	// Changed blocks, and any instances that held voxels last frame but don't now
+	uint32 First = UploadedVoxels > NumVoxels ? NumVoxels : MAX_uint32;
+	uint32 End = UploadedVoxels;
+	if (LastDirty >= FirstDirty)
+	{
+		First = FMath::Min<uint32>(First, FirstDirty * BlockTexels);
+		End = FMath::Max(End, FMath::Min<uint32>((LastDirty + 1) * BlockTexels, NumVoxels));
+	}
+	UploadedVoxels = NumVoxels;
+	if (First >= End)
+	{
+		return;
+	}
+
+	UpdateInstances(Staging, First, End, NumVoxels);
+}
+
+void UVoxelInstancedSubComponent::SetScale(float Scale)
+{
+	if (Scale != this->Scale) {
+		this->Scale = Scale;
+		// Every instance's position depends on the scale, so the next frame rebuilds them all
+		UploadedBlockHashes.Reset();
+		UploadedVoxels = GetInstanceCount();
+	}
+}
+
+void UVoxelInstancedSubComponent::SetLocation(FVector Location)
+{
+	SetRelativeLocation(Location);
+}
+
+void UVoxelInstancedSubComponent::SetRotation(FVector Rotation)
+{
+	SetRelativeRotation(FRotator(Rotation.Y, Rotation.Z, Rotation.X));
+}
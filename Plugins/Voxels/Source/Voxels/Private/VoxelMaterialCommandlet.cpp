@@ -0,0 +1,51 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "VoxelMaterialCommandlet.h"
+#include "Voxels.h"
+#include "VoxelAtlasSubComponent.h"
+#include "VoxelInstancedSubComponent.h"
+#include "Engine/StaticMesh.h"
+#include "Materials/Material.h"
+#include "Misc/PackageName.h"
+#include "UObject/Package.h"
+
+UVoxelMaterialCommandlet::UVoxelMaterialCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = true;
+	LogToConsole = true;
+}
+
+#if WITH_EDITOR
+// Builds an asset with Create into its own package under /Voxels and saves it
+static bool SaveAsset(const TCHAR* AssetName, TFunctionRef<UObject*(UObject*, FName, EObjectFlags)> Create)
+{
+	const FString PackageName = FString(TEXT("/Voxels/")) + AssetName;
+	UPackage* Package = CreatePackage(*PackageName);
+	UObject* Asset = Create(Package, AssetName, RF_Public | RF_Standalone);
+	Package->MarkPackageDirty();
+
+	const FString FileName = FPackageName::LongPackageNameToFilename(PackageName, FPackageName::GetAssetPackageExtension());
+	if (!UPackage::SavePackage(Package, Asset, RF_Public | RF_Standalone, *FileName))
+	{
+		UE_LOG(VoxLog, Error, TEXT("Couldn't save %s"), *FileName);
+		return false;
+	}
+	UE_LOG(VoxLog, Display, TEXT("Saved %s"), *FileName);
+	return true;
+}
+#endif
+
+int32 UVoxelMaterialCommandlet::Main(const FString& Params)
+{
+#if WITH_EDITOR
+	bool bSaved = SaveAsset(TEXT("InstancedVoxelMaterial"), &UVoxelInstancedSubComponent::CreateInstancedVoxelMaterial);
+	bSaved &= SaveAsset(TEXT("AtlasUnitCubes"), &UVoxelAtlasSubComponent::CreateAtlasMesh);
+	bSaved &= SaveAsset(TEXT("VertexMoveAtlasMaterial"), &UVoxelAtlasSubComponent::CreateAtlasMaterial);
+	return bSaved ? 0 : 1;
+#else
+	UE_LOG(VoxLog, Error, TEXT("Materials can only be built in the editor"));
+	return 1;
+#endif
+}
@@ -0,0 +1,504 @@
+#include "VoxelPacking.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define VOXEL_PACKING_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define VOXEL_PACKING_X64 0
+#endif
+
+// MSVC lets us use AVX2 intrinsics in any function, gcc and clang need it enabled per function
+#if VOXEL_PACKING_X64 && !defined(_MSC_VER)
+#define VOXEL_PACKING_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define VOXEL_PACKING_TARGET_AVX2
+#endif
+
+namespace VoxelPacking
+{
+	static void PackPositionsScalar(const int16_t* Positions, uint32_t Count, uint8_t* CoarseOut, uint8_t* FineOut)
+	{
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			const int16_t* p = Positions + i * GatherStride;
+			uint8_t* c = CoarseOut + i * 4;
+			uint8_t* f = FineOut + i * 4;
+			c[0] = (uint8_t)((p[0] >> 8) + 128);
+			c[1] = (uint8_t)((p[1] >> 8) + 128);
+			c[2] = (uint8_t)((p[2] >> 8) + 128);
+			c[3] = 0;
+			f[0] = (uint8_t)(p[0] & 0xFF);
+			f[1] = (uint8_t)(p[1] & 0xFF);
+			f[2] = (uint8_t)(p[2] & 0xFF);
+			f[3] = (uint8_t)(p[3] & 0xFF);
+		}
+	}
+
+#if VOXEL_PACKING_X64
+	// 4 voxels per iteration. Every value fits in 0..255 after the shift/mask, so the saturating pack is exact.
+	static void PackPositionsSSE2(const int16_t* Positions, uint32_t Count, uint8_t* CoarseOut, uint8_t* FineOut)
+	{
+		const __m128i Bias = _mm_set1_epi16(128);
+		const __m128i LowByte = _mm_set1_epi16(0xFF);
+		const __m128i NoAlpha = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+
+		uint32_t i = 0;
+		for (; i + 4 <= Count; i += 4)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(Positions + i * GatherStride));
+			__m128i b = _mm_loadu_si128((const __m128i*)(Positions + i * GatherStride + 8));
+
+			__m128i CoarseA = _mm_and_si128(_mm_add_epi16(_mm_srai_epi16(a, 8), Bias), NoAlpha);
+			__m128i CoarseB = _mm_and_si128(_mm_add_epi16(_mm_srai_epi16(b, 8), Bias), NoAlpha);
+			_mm_storeu_si128((__m128i*)(CoarseOut + i * 4), _mm_packus_epi16(CoarseA, CoarseB));
+
+			__m128i FineA = _mm_and_si128(a, LowByte);
+			__m128i FineB = _mm_and_si128(b, LowByte);
+			_mm_storeu_si128((__m128i*)(FineOut + i * 4), _mm_packus_epi16(FineA, FineB));
+		}
+		PackPositionsScalar(Positions + i * GatherStride, Count - i, CoarseOut + i * 4, FineOut + i * 4);
+	}
+
+	// 8 voxels per iteration. packus works within 128 bit lanes, so the qwords need putting back in order after.
+	VOXEL_PACKING_TARGET_AVX2
+	static void PackPositionsAVX2(const int16_t* Positions, uint32_t Count, uint8_t* CoarseOut, uint8_t* FineOut)
+	{
+		const __m256i Bias = _mm256_set1_epi16(128);
+		const __m256i LowByte = _mm256_set1_epi16(0xFF);
+		const __m256i NoAlpha = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+
+		uint32_t i = 0;
+		for (; i + 8 <= Count; i += 8)
+		{
+			__m256i a = _mm256_loadu_si256((const __m256i*)(Positions + i * GatherStride));
+			__m256i b = _mm256_loadu_si256((const __m256i*)(Positions + i * GatherStride + 16));
+
+			__m256i CoarseA = _mm256_and_si256(_mm256_add_epi16(_mm256_srai_epi16(a, 8), Bias), NoAlpha);
+			__m256i CoarseB = _mm256_and_si256(_mm256_add_epi16(_mm256_srai_epi16(b, 8), Bias), NoAlpha);
+			__m256i Coarse = _mm256_permute4x64_epi64(_mm256_packus_epi16(CoarseA, CoarseB), 0xD8);
+			_mm256_storeu_si256((__m256i*)(CoarseOut + i * 4), Coarse);
+
+			__m256i FineA = _mm256_and_si256(a, LowByte);
+			__m256i FineB = _mm256_and_si256(b, LowByte);
+			__m256i Fine = _mm256_permute4x64_epi64(_mm256_packus_epi16(FineA, FineB), 0xD8);
+			_mm256_storeu_si256((__m256i*)(FineOut + i * 4), Fine);
+		}
+		PackPositionsSSE2(Positions + i * GatherStride, Count - i, CoarseOut + i * 4, FineOut + i * 4);
+	}
+
+	static bool CpuHasAVX2()
+	{
+#if defined(_MSC_VER)
+		int Info[4];
+		__cpuid(Info, 0);
+		if (Info[0] < 7)
+		{
+			return false;
+		}
+		__cpuid(Info, 1);
+		bool bOSXSave = (Info[2] & (1 << 27)) != 0;
+		bool bAVX = (Info[2] & (1 << 28)) != 0;
+		if (!bOSXSave || !bAVX || (_xgetbv(0) & 0x6) != 0x6)
+		{
+			return false;
+		}
+		__cpuidex(Info, 7, 0);
+		return (Info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif
+
+	bool IsKernelSupported(EKernel Kernel)
+	{
+		switch (Kernel)
+		{
+#if VOXEL_PACKING_X64
+		case EKernel::AVX2:
+			return CpuHasAVX2();
+		case EKernel::SSE2:
+			return true; // Part of x64
+#endif
+		case EKernel::Scalar:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	EKernel GetBestKernel()
+	{
+		static const EKernel Best = IsKernelSupported(EKernel::AVX2) ? EKernel::AVX2 : IsKernelSupported(EKernel::SSE2) ? EKernel::SSE2 : EKernel::Scalar;
+		return Best;
+	}
+
+	const char* GetKernelName(EKernel Kernel)
+	{
+		switch (Kernel)
+		{
+		case EKernel::AVX2:
+			return "AVX2";
+		case EKernel::SSE2:
+			return "SSE2";
+		default:
+			return "Scalar";
+		}
+	}
+
+	void PackPositions(const int16_t* Positions, uint32_t Count, uint8_t* CoarseOut, uint8_t* FineOut, EKernel Kernel)
+	{
+		switch (Kernel)
+		{
+#if VOXEL_PACKING_X64
+		case EKernel::AVX2:
+			PackPositionsAVX2(Positions, Count, CoarseOut, FineOut);
+			break;
+		case EKernel::SSE2:
+			PackPositionsSSE2(Positions, Count, CoarseOut, FineOut);
+			break;
+#endif
+		default:
+			PackPositionsScalar(Positions, Count, CoarseOut, FineOut);
+			break;
+		}
+	}
+
+	uint64_t HashTexels(const uint8_t* Data, size_t Bytes)
+	{
+		uint64_t Hash = 0xcbf29ce484222325ull;
+		for (size_t i = 0; i < Bytes / sizeof(uint64_t); i++)
+		{
+			uint64_t Word;
+			memcpy(&Word, Data + i * sizeof(uint64_t), sizeof(uint64_t));
+			Hash = (Hash ^ Word) * 0x100000001b3ull;
+		}
+		return Hash;
+	}
+
+	void GatheredBounds(const int16_t* Positions, uint32_t Count, int16_t* Min, int16_t* Max)
+	{
+		// Gathered positions are Z, Y, X, level. A voxel at level n covers 2^n voxels from its position along each axis.
+		int16_t Lo[3] = { Min[2], Min[1], Min[0] };
+		int16_t Hi[3] = { Max[2], Max[1], Max[0] };
+		for (uint32_t i = 0; i < Count; i++, Positions += GatherStride)
+		{
+			const int16_t Extent = (int16_t)((1 << (Positions[3] & 0xF)) - 1);
+			for (int c = 0; c < 3; c++)
+			{
+				Lo[c] = std::min(Lo[c], Positions[c]);
+				Hi[c] = std::max(Hi[c], (int16_t)(Positions[c] + Extent));
+			}
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			Min[2 - c] = Lo[c];
+			Max[2 - c] = Hi[c];
+		}
+	}
+
+	void TexelBounds(const uint8_t* Coarse, const uint8_t* Fine, uint32_t NumTexels, int16_t* Min, int16_t* Max)
+	{
+		for (uint32_t i = 0; i < NumTexels; i++, Coarse += 4, Fine += 4)
+		{
+			if ((Coarse[0] | Coarse[1] | Coarse[2]) == 0)
+			{
+				continue;
+			}
+			const int16_t Extent = (int16_t)((1 << (Fine[3] & 0xF)) - 1);
+			for (int c = 0; c < 3; c++)
+			{
+				const int16_t v = (int16_t)((Coarse[c] - 128) * 256 + Fine[c]);
+				Min[2 - c] = std::min(Min[2 - c], v);
+				Max[2 - c] = std::max(Max[2 - c], (int16_t)(v + Extent));
+			}
+		}
+	}
+
+	void UnpackInstances(const uint8_t* Coarse, const uint8_t* Fine, const uint8_t* Colour, uint32_t NumTexels, float* Instances, float* Colours)
+	{
+		for (uint32_t i = 0; i < NumTexels; i++, Coarse += 4, Fine += 4, Colour += 4, Instances += 4, Colours += 3)
+		{
+			if ((Coarse[0] | Coarse[1] | Coarse[2]) == 0)
+			{
+				memset(Instances, 0, 4 * sizeof(float));
+				memset(Colours, 0, 3 * sizeof(float));
+				continue;
+			}
+			// Channels are Z, Y, X. A merged voxel covers 2^level voxels from its position.
+			const float Size = (float)(1 << (Fine[3] & 0xF));
+			for (int c = 0; c < 3; c++)
+			{
+				Instances[2 - c] = (float)(int16_t)((Coarse[c] - 128) * 256 + Fine[c]) + (Size - 1.0f) * 0.5f;
+			}
+			Instances[3] = Size;
+			// Colours are stored BGR
+			Colours[0] = Colour[2] / 255.0f;
+			Colours[1] = Colour[1] / 255.0f;
+			Colours[2] = Colour[0] / 255.0f;
+		}
+	}
+
+	uint32_t OffsetTexels(const uint8_t* CoarseIn, const uint8_t* FineIn, uint32_t NumTexels, const int16_t* Offset, uint8_t* CoarseOut, uint8_t* FineOut)
+	{
+		// Texel channels are Z, Y, X
+		const int32_t ChannelOffset[3] = { Offset[2], Offset[1], Offset[0] };
+		uint32_t Kept = 0;
+		for (uint32_t i = 0; i < NumTexels; i++, CoarseIn += 4, FineIn += 4, CoarseOut += 4, FineOut += 4)
+		{
+			if ((CoarseIn[0] | CoarseIn[1] | CoarseIn[2]) == 0)
+			{
+				memset(CoarseOut, 0, 4);
+				memset(FineOut, 0, 4);
+				continue;
+			}
+			int32_t v[3];
+			bool bInRange = true;
+			for (int c = 0; c < 3; c++)
+			{
+				v[c] = (CoarseIn[c] - 128) * 256 + FineIn[c] + ChannelOffset[c];
+				bInRange &= v[c] >= INT16_MIN && v[c] <= INT16_MAX;
+			}
+			for (int c = 0; c < 3 && bInRange; c++)
+			{
+				CoarseOut[c] = (uint8_t)((v[c] >> 8) + 128);
+				FineOut[c] = (uint8_t)(v[c] & 0xFF);
+			}
+			// A coarse texel of all zeroes reads as empty, so a voxel moved into that corner is lost either way
+			if (!bInRange || (CoarseOut[0] | CoarseOut[1] | CoarseOut[2]) == 0)
+			{
+				memset(CoarseOut, 0, 4);
+				memset(FineOut, 0, 4);
+				continue;
+			}
+			CoarseOut[3] = 0;
+			FineOut[3] = FineIn[3];
+			Kept++;
+		}
+		return Kept;
+	}
+
+	bool IsSliceEmpty(const uint16_t* BlockVoxelCounts, int32_t NumBlockCounts, uint32_t BlockTexels, uint32_t First, uint32_t NumVoxels)
+	{
+		int32_t EndBlock = (int32_t)((First + NumVoxels + BlockTexels - 1) / BlockTexels);
+		if (EndBlock > NumBlockCounts)
+		{
+			return false;
+		}
+		for (int32_t Block = First / BlockTexels; Block < EndBlock; Block++)
+		{
+			if (BlockVoxelCounts[Block] != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint64_t PackBlock(const int16_t* Positions, uint32_t Count, uint32_t BlockTexels, uint8_t* CoarseOut, uint8_t* FineOut, const uint8_t* Colour)
+	{
+		PackPositions(Positions, Count, CoarseOut, FineOut);
+		memset(CoarseOut + Count * 4, 0, (BlockTexels - Count) * 4);
+		memset(FineOut + Count * 4, 0, (BlockTexels - Count) * 4);
+
+		return HashBlock(CoarseOut, FineOut, Colour, BlockTexels);
+	}
+
+	uint64_t HashBlock(const uint8_t* Coarse, const uint8_t* Fine, const uint8_t* Colour, uint32_t BlockTexels)
+	{
+		const size_t BlockBytes = BlockTexels * 4;
+		return HashTexels(Coarse, BlockBytes) ^ (HashTexels(Fine, BlockBytes) * 31) ^ (HashTexels(Colour, BlockBytes) * 961);
+	}
+
+	uint64_t HashSlice(const uint64_t* BlockHashes, int32_t NumBlockHashes, uint32_t BlockTexels, uint32_t First, uint32_t NumVoxels)
+	{
+		uint64_t Hash = NumVoxels;
+		int32_t EndBlock = std::min<int32_t>((First + NumVoxels + BlockTexels - 1) / BlockTexels, NumBlockHashes);
+		for (int32_t Block = First / BlockTexels; Block < EndBlock; Block++)
+		{
+			Hash = (Hash * 0x9E3779B97F4A7C15ull) ^ BlockHashes[Block];
+		}
+		return Hash;
+	}
+
+	// Spreads the low 10 bits of v out to every third bit
+	static inline uint32_t SpreadBits3(uint32_t v)
+	{
+		v &= 0x3FF;
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+
+	void MortonSort(const int16_t* Positions, uint32_t Count, int32_t NumWorkers, std::vector<uint32_t>& Order, std::vector<uint64_t>& Items, std::vector<uint32_t>& Histograms)
+	{
+		Order.resize(Count);
+		if (Count == 0)
+		{
+			return;
+		}
+
+		// Keys only need to span the frame. Anything over 1024 voxels across loses its lowest bits, which only
+		// coarsens the curve.
+		int16_t Min[3] = { INT16_MAX, INT16_MAX, INT16_MAX };
+		int16_t Max[3] = { INT16_MIN, INT16_MIN, INT16_MIN };
+		GatheredBounds(Positions, Count, Min, Max);
+		const int32_t Range = std::max({ Max[0] - Min[0], Max[1] - Min[1], Max[2] - Min[2] });
+		int32_t AxisBits = 0;
+		while (AxisBits < 16 && (1 << AxisBits) <= Range)
+		{
+			AxisBits++;
+		}
+		const int32_t Drop = std::max(AxisBits - 10, 0);
+		const int32_t KeyBits = 3 * (AxisBits - Drop);
+
+		// Items are the key above the voxel's index, so one 64 bit move carries both. Digits are at most 11 bits, as
+		// few passes as that allows, split evenly so the histograms stay small.
+		const int32_t NumPasses = std::max((KeyBits + 10) / 11, 1);
+		const int32_t DigitBits = (KeyBits + NumPasses - 1) / NumPasses;
+		const uint32_t NumDigits = 1u << DigitBits;
+		const uint32_t ChunkVoxels = 32768;
+		const int32_t NumChunks = (int32_t)std::min<uint32_t>((Count + ChunkVoxels - 1) / ChunkVoxels, 64);
+		const uint32_t ChunkSize = (Count + NumChunks - 1) / NumChunks;
+		NumWorkers = GetNumWorkers(Count, NumWorkers);
+		Items.resize((size_t)Count * 2);
+		Histograms.resize((size_t)NumChunks * NumDigits);
+		uint64_t* Unsorted = Items.data();
+		uint64_t* Sorted = Unsorted + Count;
+		uint32_t* Counts = Histograms.data();
+
+		// Gathered positions are Z, Y, X
+		ParallelFor(NumChunks, NumWorkers, [=](int32_t Chunk)
+		{
+			const uint32_t End = std::min(Count, (Chunk + 1) * ChunkSize);
+			for (uint32_t i = Chunk * ChunkSize; i < End; i++)
+			{
+				const int16_t* p = Positions + i * GatherStride;
+				const uint32_t Key = SpreadBits3((uint32_t)(p[2] - Min[0]) >> Drop) | SpreadBits3((uint32_t)(p[1] - Min[1]) >> Drop) << 1 | SpreadBits3((uint32_t)(p[0] - Min[2]) >> Drop) << 2;
+				Unsorted[i] = (uint64_t)Key << 32 | i;
+			}
+		});
+
+		// Least significant digit first. Each chunk counts its digits, then scatters to where its share of each digit starts.
+		for (int32_t Shift = 32; Shift < 32 + KeyBits; Shift += DigitBits)
+		{
+			ParallelFor(NumChunks, NumWorkers, [=](int32_t Chunk)
+			{
+				uint32_t* Histogram = Counts + Chunk * NumDigits;
+				memset(Histogram, 0, NumDigits * sizeof(uint32_t));
+				const uint32_t End = std::min(Count, (Chunk + 1) * ChunkSize);
+				for (uint32_t i = Chunk * ChunkSize; i < End; i++)
+				{
+					Histogram[(Unsorted[i] >> Shift) & (NumDigits - 1)]++;
+				}
+			});
+			uint32_t Total = 0;
+			for (uint32_t Digit = 0; Digit < NumDigits; Digit++)
+			{
+				for (int32_t Chunk = 0; Chunk < NumChunks; Chunk++)
+				{
+					uint32_t& Slot = Counts[Chunk * NumDigits + Digit];
+					const uint32_t Num = Slot;
+					Slot = Total;
+					Total += Num;
+				}
+			}
+			ParallelFor(NumChunks, NumWorkers, [=](int32_t Chunk)
+			{
+				uint32_t* Next = Counts + Chunk * NumDigits;
+				const uint32_t End = std::min(Count, (Chunk + 1) * ChunkSize);
+				for (uint32_t i = Chunk * ChunkSize; i < End; i++)
+				{
+					Sorted[Next[(Unsorted[i] >> Shift) & (NumDigits - 1)]++] = Unsorted[i];
+				}
+			});
+			std::swap(Unsorted, Sorted);
+		}
+
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			Order[i] = (uint32_t)Unsorted[i];
+		}
+	}
+
+	static void StdThreadParallelFor(int32_t Num, int32_t NumWorkers, const FIndexFn& Body)
+	{
+		// More threads than the hardware runs at once only take turns
+		const int32_t HardwareThreads = (int32_t)std::max(1u, std::thread::hardware_concurrency());
+		NumWorkers = NumWorkers <= 0 ? HardwareThreads : std::min(NumWorkers, HardwareThreads);
+		NumWorkers = std::min(NumWorkers, Num);
+		if (NumWorkers == 1)
+		{
+			for (int32_t i = 0; i < Num; i++)
+			{
+				Body(i);
+			}
+			return;
+		}
+
+		// Workers pull the next index as they go, so uneven items don't leave threads idle
+		std::atomic<int32_t> Next(0);
+		auto Worker = [&]()
+		{
+			for (int32_t i = Next++; i < Num; i = Next++)
+			{
+				Body(i);
+			}
+		};
+
+		std::vector<std::thread> Threads;
+		for (int32_t i = 1; i < NumWorkers; i++)
+		{
+			Threads.emplace_back(Worker);
+		}
+		Worker();
+		for (std::thread& Thread : Threads)
+		{
+			Thread.join();
+		}
+	}
+
+	static std::atomic<FParallelForFn> ParallelForImpl(&StdThreadParallelFor);
+
+	void ParallelFor(int32_t Num, int32_t NumWorkers, const FIndexFn& Body)
+	{
+		if (Num <= 0)
+		{
+			return;
+		}
+		if (Num == 1 || NumWorkers == 1)
+		{
+			for (int32_t i = 0; i < Num; i++)
+			{
+				Body(i);
+			}
+			return;
+		}
+		ParallelForImpl.load()(Num, NumWorkers, Body);
+	}
+
+	int32_t GetNumWorkers(uint32_t NumVoxels, int32_t NumWorkers)
+	{
+		if (NumWorkers <= 0)
+		{
+			NumWorkers = (int32_t)std::max(1u, std::thread::hardware_concurrency());
+		}
+		return std::max(1, std::min(NumWorkers, (int32_t)(NumVoxels / MinVoxelsPerWorker)));
+	}
+
+	void SetParallelFor(FParallelForFn Fn)
+	{
+		ParallelForImpl.store(Fn != nullptr ? Fn : &StdThreadParallelFor);
+	}
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace VoxelPacking
+{
+	// Gathered positions are 4 int16 per voxel, in texel channel order: Z, Y, X, then the level of detail (usually 0)
+	static const int GatherStride = 4;
+
+	enum class EKernel
+	{
+		Scalar,
+		SSE2,
+		AVX2,
+	};
+
+	// Fastest kernel the CPU we're running on supports, detected once
+	EKernel GetBestKernel();
+
+	const char* GetKernelName(EKernel Kernel);
+
+	bool IsKernelSupported(EKernel Kernel);
+
+	/**
+	*	Splits gathered voxel positions into the coarse (high byte + 128) and fine (low byte) position texels
+	*	sampled by VertexMoveMaterial. The coarse alpha is written as 0, the fine alpha takes the low byte of the
+	*	fourth gathered lane, which is 0 unless FVoxelDecimator put a level of detail there.
+	*
+	*	@param Positions	Count * GatherStride int16 values
+	*	@param Count		Number of voxels
+	*	@param CoarseOut	Count * 4 bytes
+	*	@param FineOut		Count * 4 bytes
+	*/
+	void PackPositions(const int16_t* Positions, uint32_t Count, uint8_t* CoarseOut, uint8_t* FineOut, EKernel Kernel);
+
+	inline void PackPositions(const int16_t* Positions, uint32_t Count, uint8_t* CoarseOut, uint8_t* FineOut)
+	{
+		PackPositions(Positions, Count, CoarseOut, FineOut, GetBestKernel());
+	}
+
+	// Cheap multiply-xor hash, only used to tell whether a block of texels changed between frames
+	uint64_t HashTexels(const uint8_t* Data, size_t Bytes);
+
+	// Hash of a block of BlockTexels texels of all three planes
+	uint64_t HashBlock(const uint8_t* Coarse, const uint8_t* Fine, const uint8_t* Colour, uint32_t BlockTexels);
+
+	/**
+	*	Everything CopyVoxelData does to a block of BlockTexels texels once its voxels are gathered: packs the
+	*	positions, zeroes the unused tail of both position planes so leftover cubes don't show stale voxels, and
+	*	hashes all three planes so unchanged blocks can be skipped when uploading.
+	*
+	*	@param Count		Voxels in the block, up to BlockTexels
+	*	@return				Hash of the block
+	*/
+	uint64_t PackBlock(const int16_t* Positions, uint32_t Count, uint32_t BlockTexels, uint8_t* CoarseOut, uint8_t* FineOut, const uint8_t* Colour);
+
+	// Combines the hashes of the blocks covering NumVoxels texels from First, with the number of voxels in them
+	uint64_t HashSlice(const uint64_t* BlockHashes, int32_t NumBlockHashes, uint32_t BlockTexels, uint32_t First, uint32_t NumVoxels);
+
+	// Widens Min and Max, in X, Y, Z order, to cover Count gathered positions
+	void GatheredBounds(const int16_t* Positions, uint32_t Count, int16_t* Min, int16_t* Max);
+
+	// Widens Min and Max, in X, Y, Z order, to cover the positions of the non-empty texels among NumTexels
+	void TexelBounds(const uint8_t* Coarse, const uint8_t* Fine, uint32_t NumTexels, int16_t* Min, int16_t* Max);
+
+	/**
+	*	Decodes NumTexels texels into what an instanced cube needs: its centre and size in voxels (X, Y, Z, size per
+	*	voxel, size 0 for an empty texel) and its colour as 0-1 RGB. Merged voxels are centred on the cell they cover.
+	*
+	*	@param Instances	NumTexels * 4 floats
+	*	@param Colours		NumTexels * 3 floats
+	*/
+	void UnpackInstances(const uint8_t* Coarse, const uint8_t* Fine, const uint8_t* Colour, uint32_t NumTexels, float* Instances, float* Colours);
+
+	// Copies the position texels of NumTexels voxels, moving each one by Offset (X, Y, Z voxels). Empty texels stay
+	// empty and levels of detail are kept. Voxels the offset takes outside the positions texels can hold are left
+	// empty rather than wrapped round to the other side. Returns how many voxels were kept.
+	uint32_t OffsetTexels(const uint8_t* CoarseIn, const uint8_t* FineIn, uint32_t NumTexels, const int16_t* Offset, uint8_t* CoarseOut, uint8_t* FineOut);
+
+	// True if every block covering NumVoxels texels from First has no voxels in it. False if any of them isn't counted.
+	bool IsSliceEmpty(const uint16_t* BlockVoxelCounts, int32_t NumBlockCounts, uint32_t BlockTexels, uint32_t First, uint32_t NumVoxels);
+
+	/**
+	*	Finds the order that puts Count gathered positions along a Morton (Z-order) curve, so any run of them covers a
+	*	compact region rather than a slab of the grid. Order[i] is the index of the voxel that goes i-th. Keys take up
+	*	to 10 bits an axis across the extent of the positions, voxels sharing a key keep the order they came in.
+	*	Sorted with a radix sort split across up to NumWorkers threads. Items and Histograms are scratch space, kept by
+	*	the caller so sorting doesn't allocate once it's warmed up.
+	*/
+	void MortonSort(const int16_t* Positions, uint32_t Count, int32_t NumWorkers, std::vector<uint32_t>& Order, std::vector<uint64_t>& Items, std::vector<uint32_t>& Histograms);
+
+	typedef std::function<void(int32_t Index)> FIndexFn;
+	typedef void (*FParallelForFn)(int32_t Num, int32_t NumWorkers, const FIndexFn& Body);
+
+	/**
+	*	Runs Body for every index in [0, Num) on up to NumWorkers threads (0 picks a sensible default) and returns
+	*	once they're all done. Uses std::thread unless an implementation has been installed with SetParallelFor,
+	*	which the Voxels module does at startup so the engine build runs on the task graph instead.
+	*/
+	void ParallelFor(int32_t Num, int32_t NumWorkers, const FIndexFn& Body);
+
+	// Least voxels worth handing to a worker of their own. Packing runs at memory speed, so below this starting the
+	// workers costs more than splitting the frame saves.
+	const uint32_t MinVoxelsPerWorker = 65536;
+
+	// Workers to split NumVoxels across: up to NumWorkers (0 for one per hardware thread), each with at least
+	// MinVoxelsPerWorker, so frames up to twice that are packed on the calling thread
+	int32_t GetNumWorkers(uint32_t NumVoxels, int32_t NumWorkers);
+
+	void SetParallelFor(FParallelForFn Fn);
+}
@@ -0,0 +1,297 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "VoxelRecordingCatalog.h"
+#include "Voxels.h"
+#include "VoxelFrameCache.h"
+#include "VoxelCacheCodec.h"
+#include "HAL/PlatformFilemanager.h"
+#include "HAL/FileManager.h"
+#include "Async/MappedFileHandle.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Dom/JsonObject.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include <chrono>
+#include <cstring>
+#include <string>
+
+// Bumped when what's saved for each recording changes, so an old index is ignored
+static const int32 IndexVersion = 3;
+static const std::chrono::seconds PollInterval(5);
+
+static TUniquePtr<FVoxelRecordingCatalog> ProjectCatalog;
+
+FVoxelRecordingCatalog& FVoxelRecordingCatalog::Get()
+{
+	check(IsInGameThread());
+	if (!ProjectCatalog.IsValid())
+	{
+		ProjectCatalog = MakeUnique<FVoxelRecordingCatalog>(FPaths::ProjectContentDir() + TEXT("VoxelVideos/"));
+	}
+	return *ProjectCatalog;
+}
+
+void FVoxelRecordingCatalog::Shutdown()
+{
+	ProjectCatalog.Reset();
+}
+
+FVoxelRecordingCatalog::FVoxelRecordingCatalog(const FString& InDirectory)
+	: Directory(InDirectory)
+	, IndexPath(InDirectory / TEXT("VoxelCatalog.json"))
+{
+	Thread = std::thread(&FVoxelRecordingCatalog::Run, this);
+}
+
+FVoxelRecordingCatalog::~FVoxelRecordingCatalog()
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		bStopping = true;
+	}
+	Changed.notify_all();
+	Thread.join();
+}
+
+TArray<FVoxelRecordingInfo> FVoxelRecordingCatalog::GetRecordings()
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	return Recordings;
+}
+
+bool FVoxelRecordingCatalog::FindRecording(const FString& FileName, FVoxelRecordingInfo& Out)
+{
+	std::lock_guard<std::mutex> Lock(Mutex);
+	const FVoxelRecordingInfo* Found = Recordings.FindByPredicate([&FileName](const FVoxelRecordingInfo& Recording) { return Recording.FileName == FileName; });
+	if (Found == nullptr)
+	{
+		return false;
+	}
+	Out = *Found;
+	return true;
+}
+
+void FVoxelRecordingCatalog::Rescan()
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		bRescan = true;
+	}
+	Changed.notify_all();
+}
+
+void FVoxelRecordingCatalog::Run()
+{
+	TArray<FVoxelRecordingInfo> Indexed;
+	if (LoadIndex(Indexed))
+	{
+		Publish(MoveTemp(Indexed));
+	}
+
+	std::unique_lock<std::mutex> Lock(Mutex);
+	while (!bStopping)
+	{
+		bRescan = false;
+		Lock.unlock();
+		Scan();
+		Lock.lock();
+		Changed.wait_for(Lock, PollInterval, [this] { return bStopping || bRescan; });
+	}
+}
+
+void FVoxelRecordingCatalog::Scan()
+{
+	// One listing of the folder gets the size and time of everything in it, caches included
+	TMap<FString, FFileStatData> Files;
+	FPlatformFileManager::Get().GetPlatformFile().IterateDirectoryStat(*Directory, [&Files](const TCHAR* Path, const FFileStatData& Stat)
+	{
+		if (!Stat.bIsDirectory)
+		{
+			Files.Add(FPaths::GetCleanFilename(Path), Stat);
+		}
+		return true;
+	});
+
+	TMap<FString, FVoxelRecordingInfo> Known;
+	for (FVoxelRecordingInfo& Recording : GetRecordings())
+	{
+		Known.Add(Recording.FileName, MoveTemp(Recording));
+	}
+
+	TArray<FVoxelRecordingInfo> Scanned;
+	for (const TPair<FString, FFileStatData>& File : Files)
+	{
+		const FString Extension = FPaths::GetExtension(File.Key);
+		const bool bStandalone = Extension.Equals(TEXT("vxz"), ESearchCase::IgnoreCase);
+		if (!bStandalone && !Extension.Equals(TEXT("vx3"), ESearchCase::IgnoreCase))
+		{
+			continue;
+		}
+
+		FVoxelRecordingInfo Info;
+		Info.FileName = File.Key;
+		Info.Size = File.Value.FileSize;
+		Info.Time = File.Value.ModificationTime.ToUnixTimestamp();
+		const FFileStatData* Cache = bStandalone ? nullptr : Files.Find(File.Key + TEXT(".vxcache"));
+		if (Cache != nullptr)
+		{
+			Info.CacheSize = Cache->FileSize;
+			Info.CacheTime = Cache->ModificationTime.ToUnixTimestamp();
+		}
+
+		const FVoxelRecordingInfo* Old = Known.Find(Info.FileName);
+		if (Old != nullptr && Old->Size == Info.Size && Old->Time == Info.Time && Old->CacheSize == Info.CacheSize && Old->CacheTime == Info.CacheTime)
+		{
+			Scanned.Add(*Old);
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			if (bStopping)
+			{
+				return;
+			}
+		}
+		Info.Modified = FDateTime::FromUnixTimestamp(Info.Time);
+		Info.SizeMB = Info.Size / (1024.0f * 1024.0f);
+		if (bStandalone || Cache != nullptr)
+		{
+			ReadMetadata(Directory / (bStandalone ? File.Key : File.Key + TEXT(".vxcache")), bStandalone, Info);
+		}
+		Scanned.Add(MoveTemp(Info));
+	}
+
+	Scanned.Sort([](const FVoxelRecordingInfo& A, const FVoxelRecordingInfo& B) { return A.FileName < B.FileName; });
+	if (Publish(MoveTemp(Scanned)))
+	{
+		SaveIndex(GetRecordings());
+	}
+}
+
+bool FVoxelRecordingCatalog::ReadMetadata(const FString& Path, bool bStandalone, FVoxelRecordingInfo& Info)
+{
+	// Only the header, index and footer are read, the pages holding frames are never touched
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	TUniquePtr<IMappedFileHandle> Mapping(PlatformFile.OpenMapped(*Path));
+	TUniquePtr<IMappedFileRegion> Region(Mapping.IsValid() ? Mapping->MapRegion(0, Mapping->GetFileSize()) : nullptr);
+	FVoxelFrameCacheReader Cache;
+	if (!Region.IsValid() || !Cache.OpenMetadata(Region->GetMappedPtr(), (size_t)Region->GetMappedSize()) ||
+		(!bStandalone && !Cache.IsFrom((uint64)Info.Size, Info.Time)))
+	{
+		return false;
+	}
+
+	Info.bHasMetadata = true;
+	Info.NumFrames = (int32)Cache.GetNumFrames();
+	Info.Duration = (float)Cache.GetDuration();
+	Info.MaxVoxels = (int32)Cache.GetMaxVoxels();
+	Info.VoxelSizemm = Cache.GetVoxelSizemm();
+	for (uint32 i = 0; i < Cache.GetNumAudioStreams(); i++)
+	{
+		const VoxelFrameCache::FAudioStream& Stream = Cache.GetAudioStream(i);
+		Info.AudioStreams.Add(FString(std::string(Stream.FileName, strnlen(Stream.FileName, sizeof(Stream.FileName))).c_str()));
+	}
+	return true;
+}
+
+bool FVoxelRecordingCatalog::LoadIndex(TArray<FVoxelRecordingInfo>& Out) const
+{
+	FString Text;
+	TSharedPtr<FJsonObject> Root;
+	const TArray<TSharedPtr<FJsonValue>>* Entries = nullptr;
+	if (!FFileHelper::LoadFileToString(Text, *IndexPath) || !FJsonSerializer::Deserialize(TJsonReaderFactory<>::Create(Text), Root) ||
+		!Root.IsValid() || Root->GetIntegerField(TEXT("Version")) != IndexVersion || !Root->TryGetArrayField(TEXT("Recordings"), Entries))
+	{
+		return false;
+	}
+
+	for (const TSharedPtr<FJsonValue>& Value : *Entries)
+	{
+		const TSharedPtr<FJsonObject>* Entry = nullptr;
+		if (!Value->TryGetObject(Entry))
+		{
+			continue;
+		}
+		FVoxelRecordingInfo Info;
+		Info.FileName = (*Entry)->GetStringField(TEXT("FileName"));
+		Info.Size = (int64)(*Entry)->GetNumberField(TEXT("Size"));
+		Info.Time = (int64)(*Entry)->GetNumberField(TEXT("Time"));
+		Info.CacheSize = (int64)(*Entry)->GetNumberField(TEXT("CacheSize"));
+		Info.CacheTime = (int64)(*Entry)->GetNumberField(TEXT("CacheTime"));
+		Info.Modified = FDateTime::FromUnixTimestamp(Info.Time);
+		Info.SizeMB = Info.Size / (1024.0f * 1024.0f);
+		Info.bHasMetadata = (*Entry)->GetBoolField(TEXT("HasMetadata"));
+		Info.NumFrames = (*Entry)->GetIntegerField(TEXT("NumFrames"));
+		Info.Duration = (float)(*Entry)->GetNumberField(TEXT("Duration"));
+		Info.MaxVoxels = (*Entry)->GetIntegerField(TEXT("MaxVoxels"));
+		Info.VoxelSizemm = (*Entry)->GetIntegerField(TEXT("VoxelSizemm"));
+		(*Entry)->TryGetStringArrayField(TEXT("AudioStreams"), Info.AudioStreams);
+		Out.Add(MoveTemp(Info));
+	}
+	return true;
+}
+
+void FVoxelRecordingCatalog::SaveIndex(const TArray<FVoxelRecordingInfo>& InRecordings) const
+{
+	TArray<TSharedPtr<FJsonValue>> Entries;
+	for (const FVoxelRecordingInfo& Info : InRecordings)
+	{
+		TSharedPtr<FJsonObject> Entry = MakeShareable(new FJsonObject);
+		Entry->SetStringField(TEXT("FileName"), Info.FileName);
+		Entry->SetNumberField(TEXT("Size"), (double)Info.Size);
+		Entry->SetNumberField(TEXT("Time"), (double)Info.Time);
+		Entry->SetNumberField(TEXT("CacheSize"), (double)Info.CacheSize);
+		Entry->SetNumberField(TEXT("CacheTime"), (double)Info.CacheTime);
+		Entry->SetBoolField(TEXT("HasMetadata"), Info.bHasMetadata);
+		Entry->SetNumberField(TEXT("NumFrames"), Info.NumFrames);
+		Entry->SetNumberField(TEXT("Duration"), Info.Duration);
+		Entry->SetNumberField(TEXT("MaxVoxels"), Info.MaxVoxels);
+		Entry->SetNumberField(TEXT("VoxelSizemm"), Info.VoxelSizemm);
+		TArray<TSharedPtr<FJsonValue>> AudioStreams;
+		for (const FString& AudioStream : Info.AudioStreams)
+		{
+			AudioStreams.Add(MakeShareable(new FJsonValueString(AudioStream)));
+		}
+		Entry->SetArrayField(TEXT("AudioStreams"), AudioStreams);
+		Entries.Add(MakeShareable(new FJsonValueObject(Entry)));
+	}
+	TSharedPtr<FJsonObject> Root = MakeShareable(new FJsonObject);
+	Root->SetNumberField(TEXT("Version"), IndexVersion);
+	Root->SetArrayField(TEXT("Recordings"), Entries);
+
+	// Written beside it and moved over, so a run that stops halfway doesn't leave half an index
+	FString Text;
+	const FString TempPath = IndexPath + TEXT(".tmp");
+	if (!FJsonSerializer::Serialize(Root.ToSharedRef(), TJsonWriterFactory<>::Create(&Text)) ||
+		!FFileHelper::SaveStringToFile(Text, *TempPath) || !IFileManager::Get().Move(*IndexPath, *TempPath, true))
+	{
+		UE_LOG(VoxLog, Warning, TEXT("Failed writing recording index %s"), *IndexPath);
+		IFileManager::Get().Delete(*TempPath);
+	}
+}
+
+bool FVoxelRecordingCatalog::Publish(TArray<FVoxelRecordingInfo>&& InRecordings)
+{
+	// Metadata only changes along with the sizes and times it was read at
+	auto Same = [](const FVoxelRecordingInfo& A, const FVoxelRecordingInfo& B)
+	{
+		return A.FileName == B.FileName && A.Size == B.Size && A.Time == B.Time && A.CacheSize == B.CacheSize && A.CacheTime == B.CacheTime &&
+			A.bHasMetadata == B.bHasMetadata;
+	};
+
+	std::lock_guard<std::mutex> Lock(Mutex);
+	bool bSame = Recordings.Num() == InRecordings.Num();
+	for (int32 i = 0; bSame && i < Recordings.Num(); i++)
+	{
+		bSame = Same(Recordings[i], InRecordings[i]);
+	}
+	if (bSame)
+	{
+		return false;
+	}
+	Recordings = MoveTemp(InRecordings);
+	Version++;
+	return true;
+}
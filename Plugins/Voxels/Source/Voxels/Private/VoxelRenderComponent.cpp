@@ -1,7 +1,22 @@
 #include "VoxelRenderComponent.h"
 #include "Voxels.h"
 #include "VoxelRenderSubComponent.h"
+#include "VoxelPacking.h"
 #include "Engine.h"
+#include "Kismet/GameplayStatics.h"
+#include "SceneManagement.h"
+#include "RenderingThread.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+
+DECLARE_STATS_GROUP(TEXT("Voxels"), STATGROUP_Voxels, STATCAT_Advanced);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Queue (ms)"), STAT_VoxelQueueMs, STATGROUP_Voxels);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Copy (ms)"), STAT_VoxelCopyMs, STATGROUP_Voxels);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Wait (ms)"), STAT_VoxelWaitMs, STATGROUP_Voxels);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Submit (ms)"), STAT_VoxelSubmitMs, STATGROUP_Voxels);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Upload (ms)"), STAT_VoxelUploadMs, STATGROUP_Voxels);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Local arrival to upload (ms)"), STAT_VoxelTotalMs, STATGROUP_Voxels);
+
+CSV_DEFINE_CATEGORY(Voxels, true);
 
 
 UVoxelRenderComponent::UVoxelRenderComponent(const FObjectInitializer& ObjectInitializer)
@@ -9,16 +24,243 @@ UVoxelRenderComponent::UVoxelRenderComponent(const FObjectInitializer& ObjectIni
 {
 	PrimaryComponentTick.bCanEverTick = true;
 
-	for(int i = 0; i < TOTAL_VOXELS / SUB_VOXEL_COUNT; i++)
+	// Sub-renderers are created as they're needed, see GrowRenderers
+
+	//SetIsReplicated(true);
+}
+
+void UVoxelRenderComponent::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (!FMath::IsPowerOfTwo(VoxelTextureSize) || VoxelTextureSize > (int32)FVoxelStagingBuffer::HashBlockTexels)
+	{
+		UE_LOG(VoxLog, Warning, TEXT("VoxelTextureSize %d isn't a power of two up to %u, using %d"), VoxelTextureSize, FVoxelStagingBuffer::HashBlockTexels, DEFAULT_VOXEL_TEXTURE_SIZE);
+		VoxelTextureSize = DEFAULT_VOXEL_TEXTURE_SIZE;
+		VoxelMesh = nullptr;
+	}
+	if (!FMath::IsPowerOfTwo(AtlasWidth) || AtlasWidth > (int32)FVoxelStagingBuffer::HashBlockTexels)
+	{
+		UE_LOG(VoxLog, Warning, TEXT("AtlasWidth %d isn't a power of two up to %u, using %d"), AtlasWidth, FVoxelStagingBuffer::HashBlockTexels, DEFAULT_VOXEL_ATLAS_WIDTH);
+		AtlasWidth = DEFAULT_VOXEL_ATLAS_WIDTH;
+	}
+}
+
+void UVoxelRenderComponent::GrowRenderers(int32 NumSlices)
+{
+	while (VoxelRenderers.Num() < NumSlices)
 	{
-		UVoxelRenderSubComponent* VRSC = ObjectInitializer.CreateDefaultSubobject<UVoxelRenderSubComponent>(this, FName(*(FString::Printf(TEXT("VoxelSubRender%d"), i))));
-		VRSC->SetupAttachment(GetAttachmentRoot());
+		UVoxelRenderSubComponent* VRSC = NewObject<UVoxelRenderSubComponent>(this);
+		VRSC->Init(VoxelTextureSize, VoxelMesh);
+		VRSC->SetupAttachment(this);
+		VRSC->SetScale(Scale);
+		VRSC->SetLocation(Location);
+		VRSC->SetRotation(Rotation);
+		VRSC->RegisterComponent();
 		VoxelRenderers.Add(VRSC);
 	}
+}
 
-	//SetIsReplicated(true);
+void UVoxelRenderComponent::ShrinkRenderers(int32 NumSlices)
+{
+	while (VoxelRenderers.Num() > NumSlices)
+	{
+		VoxelRenderers.Pop()->DestroyComponent();
+	}
+}
+
+void UVoxelRenderComponent::UpdateAtlas(const FVoxelStagingBufferRef& Staging, int32 VoxelCount, int32 Capacity)
+{
+	if (AtlasRenderer == nullptr)
+	{
+		AtlasRenderer = NewObject<UVoxelAtlasSubComponent>(this);
+		AtlasRenderer->Init(AtlasWidth, Capacity, AtlasMaterial);
+		AtlasRenderer->SetupAttachment(this);
+		AtlasRenderer->SetScale(Scale);
+		AtlasRenderer->SetLocation(Location);
+		AtlasRenderer->SetRotation(Rotation);
+		AtlasRenderer->RegisterComponent();
+	}
+	AtlasRenderer->SetData(Staging, VoxelCount);
 }
 
+void UVoxelRenderComponent::UpdateInstanced(const FVoxelStagingBufferRef& Staging, int32 VoxelCount)
+{
+	if (InstancedRenderer == nullptr)
+	{
+		InstancedRenderer = NewObject<UVoxelInstancedSubComponent>(this);
+		InstancedRenderer->Init(InstanceMesh, InstanceMaterial, ShrinkDelaySeconds);
+		InstancedRenderer->SetupAttachment(this);
+		InstancedRenderer->SetScale(Scale);
+		InstancedRenderer->SetLocation(Location);
+		InstancedRenderer->SetRotation(Rotation);
+		InstancedRenderer->RegisterComponent();
+	}
+	InstancedRenderer->SetData(Staging, VoxelCount);
+}
+
+void UVoxelRenderComponent::UpdateSubRenderers(const FVoxelStagingBufferRef& Staging, int32 VoxelCount)
+{
+	const int32 SliceVoxels = VoxelTextureSize * VoxelTextureSize;
+	const int32 NumSlices = FMath::DivideAndRoundUp(VoxelCount, SliceVoxels);
+	GrowRenderers(NumSlices);
+
+	FConvexVolume ViewFrustum;
+	FVector ViewOrigin;
+	const bool bCull = CullSlices && GetCullingView(ViewFrustum, ViewOrigin);
+	SlicesCulled = 0;
+
+	for(int32 Slice = 0; Slice < VoxelRenderers.Num(); Slice++)
+	{
+		UVoxelRenderSubComponent* VRSC = VoxelRenderers[Slice];
+		int32 RenderedVoxels = Slice * SliceVoxels;
+		int32 SliceCount = FMath::Min(VoxelCount - RenderedVoxels, SliceVoxels);
+		// With delta frames whole slices can be holes, they're hidden like the ones past the end rather than drawn
+		if (Slice < NumSlices && !VoxelPacking::IsSliceEmpty(Staging->BlockVoxelCounts.GetData(), Staging->BlockVoxelCounts.Num(), FVoxelStagingBuffer::HashBlockTexels, RenderedVoxels, SliceCount))
+		{
+			// Tight bounds let the engine cull the slice's draw as well, sources without block bounds leave them huge
+			VRSC->SetVoxelBounds(Staging->GetBounds(RenderedVoxels, SliceCount));
+			if (bCull)
+			{
+				const FBox Box = VRSC->Bounds.GetBox();
+				const bool bTooFar = CullDistance > 0.0f && Box.ComputeSquaredDistanceToPoint(ViewOrigin) > FMath::Square(CullDistance);
+				if (bTooFar || !ViewFrustum.IntersectBox(Box.GetCenter(), Box.GetExtent()))
+				{
+					// The textures keep whatever they last had, SetData catches up on the blocks changed since
+					VRSC->SetVisibility(false);
+					SlicesCulled++;
+					continue;
+				}
+			}
+			// SetData uploads straight from the source's staging buffer, no copy is taken, and only if the slice changed
+			uint64 SliceHash = VoxelPacking::HashSlice(Staging->BlockHashes.GetData(), Staging->BlockHashes.Num(), FVoxelStagingBuffer::HashBlockTexels, RenderedVoxels, SliceCount);
+			VRSC->SetData(Staging, RenderedVoxels, SliceCount, SliceHash);
+			VRSC->SetVisibility(true);
+		}
+		else
+		{
+			VRSC->ZeroData();
+			VRSC->SetVisibility(false);
+		}
+	}
+
+	// Only give up surplus sub-renderers once they've gone unused for a while, so they don't churn
+	if (NumSlices < VoxelRenderers.Num())
+	{
+		float Now = GetWorld()->GetTimeSeconds();
+		if (ShrinkPendingSince < 0.0f)
+		{
+			ShrinkPendingSince = Now;
+			RecentSlices = NumSlices;
+		}
+		RecentSlices = FMath::Max(RecentSlices, NumSlices);
+		if (Now - ShrinkPendingSince > ShrinkDelaySeconds)
+		{
+			ShrinkRenderers(RecentSlices);
+			ShrinkPendingSince = -1.0f;
+		}
+	}
+	else
+	{
+		ShrinkPendingSince = -1.0f;
+	}
+}
+
+void UVoxelRenderComponent::SubmitFrameTiming(const FVoxelStagingBufferRef& Staging, double AcquiredTime)
+{
+	FPendingTiming Pending;
+	Pending.ReceivedTime = Staging->ReceivedTime;
+	Pending.SubmittedTime = FPlatformTime::Seconds();
+	Pending.Timing.FrameSequence = Staging->FrameSequence;
+	Pending.Timing.QueueMs = (Staging->CopyStartTime - Staging->ReceivedTime) * 1000.0;
+	Pending.Timing.CopyMs = (Staging->CopyEndTime - Staging->CopyStartTime) * 1000.0;
+	Pending.Timing.WaitMs = (AcquiredTime - Staging->CopyEndTime) * 1000.0;
+	Pending.Timing.SubmitMs = (Pending.SubmittedTime - AcquiredTime) * 1000.0;
+
+	// The render thread is normally a frame behind, don't let this grow if it stalls
+	if (PendingTimings.Num() >= 8)
+	{
+		PendingTimings.RemoveAt(0);
+	}
+	PendingTimings.Add(Pending);
+
+	// Render commands run in order, so this runs once the uploads SetData queued are done
+	TSharedRef<FUploadFence, ESPMode::ThreadSafe> Fence = UploadFence;
+	uint32 Sequence = Staging->FrameSequence;
+	ENQUEUE_RENDER_COMMAND(VoxelUploadFence)(
+		[Fence, Sequence](FRHICommandListImmediate& RHICmdList)
+	{
+		Fence->Time.store(FPlatformTime::Seconds(), std::memory_order_relaxed);
+		Fence->Sequence.store(Sequence, std::memory_order_release);
+	});
+}
+
+void UVoxelRenderComponent::CompleteFrameTiming()
+{
+	const uint32 UploadedSequence = UploadFence->Sequence.load(std::memory_order_acquire);
+	const double UploadedTime = UploadFence->Time.load(std::memory_order_relaxed);
+	int32 NumCompleted = 0;
+	for (FPendingTiming& Pending : PendingTimings)
+	{
+		if (Pending.Timing.FrameSequence > (int32)UploadedSequence)
+		{
+			break;
+		}
+		// Earlier frames finished no later than the one the fence was written for
+		FVoxelFrameTiming& Timing = Pending.Timing;
+		Timing.UploadMs = FMath::Max(UploadedTime - Pending.SubmittedTime, 0.0) * 1000.0;
+		Timing.TotalMs = FMath::Max(UploadedTime - Pending.ReceivedTime, 0.0) * 1000.0;
+		LastFrameTiming = Timing;
+		NumCompleted++;
+	}
+	if (NumCompleted == 0)
+	{
+		return;
+	}
+	PendingTimings.RemoveAt(0, NumCompleted, false);
+
+	SET_FLOAT_STAT(STAT_VoxelQueueMs, LastFrameTiming.QueueMs);
+	SET_FLOAT_STAT(STAT_VoxelCopyMs, LastFrameTiming.CopyMs);
+	SET_FLOAT_STAT(STAT_VoxelWaitMs, LastFrameTiming.WaitMs);
+	SET_FLOAT_STAT(STAT_VoxelSubmitMs, LastFrameTiming.SubmitMs);
+	SET_FLOAT_STAT(STAT_VoxelUploadMs, LastFrameTiming.UploadMs);
+	SET_FLOAT_STAT(STAT_VoxelTotalMs, LastFrameTiming.TotalMs);
+	CSV_CUSTOM_STAT(Voxels, QueueMs, LastFrameTiming.QueueMs, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(Voxels, CopyMs, LastFrameTiming.CopyMs, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(Voxels, WaitMs, LastFrameTiming.WaitMs, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(Voxels, SubmitMs, LastFrameTiming.SubmitMs, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(Voxels, UploadMs, LastFrameTiming.UploadMs, ECsvCustomStatOp::Set);
+	CSV_CUSTOM_STAT(Voxels, TotalMs, LastFrameTiming.TotalMs, ECsvCustomStatOp::Set);
+}
+
+bool UVoxelRenderComponent::GetCullingView(FConvexVolume& OutFrustum, FVector& OutOrigin) const
+{
+	APlayerCameraManager* CameraManager = UGameplayStatics::GetPlayerCameraManager(this, 0);
+	if (CameraManager == nullptr)
+	{
+		return false;
+	}
+	FMinimalViewInfo View = CameraManager->GetCameraCachePOV();
+	View.FOV = FMath::Min(View.FOV + CullFOVPadding, 170.0f);
+	FMatrix ViewMatrix, ProjectionMatrix, ViewProjectionMatrix;
+	UGameplayStatics::GetViewProjectionMatrix(View, ViewMatrix, ProjectionMatrix, ViewProjectionMatrix);
+	GetViewFrustumBounds(OutFrustum, ViewProjectionMatrix, false);
+	OutOrigin = View.Location;
+	return true;
+}
+
+void UVoxelRenderComponent::UpdateViewerPosition()
+{
+	APlayerCameraManager* CameraManager = UGameplayStatics::GetPlayerCameraManager(this, 0);
+	if (CameraManager == nullptr || Scale <= 0.0f)
+	{
+		return;
+	}
+	// Same transform the sub-renderers give voxels: scaled to cm, rotated and moved, relative to this component
+	const FTransform VoxelToComponent(FRotator(Rotation.Y, Rotation.Z, Rotation.X), Location, FVector(Scale));
+	const FTransform VoxelToWorld = VoxelToComponent * GetComponentTransform();
+	VoxelSource->SetViewerPosition(VoxelToWorld.InverseTransformPosition(CameraManager->GetCameraLocation()));
+}
 
 void UVoxelRenderComponent::TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction)
 {
@@ -28,27 +270,44 @@ void UVoxelRenderComponent::TickComponent(float DeltaTime, ELevelTick TickType,
 
 	if(VoxelSource != nullptr)
 	{
-		int VoxelCount;
-		uint8 Voxelmm;
-		uint8* CoarsePositionData = nullptr;
-		uint8* PositionData = nullptr;
-		uint8* ColourData = nullptr;
 		//double startRead = FPlatformTime::Seconds();
-		VoxelSource->GetFramePointers(VoxelCount, CoarsePositionData, PositionData, ColourData, Voxelmm);
-		SetScale(((float)Voxelmm) / 10.0);// convert mm to cm
+		CompleteFrameTiming();
+		UpdateViewerPosition();
+		VoxelSource->SetDrawsMergedVoxels(RenderMode != EVoxelRenderMode::SubRenderers);
+		FVoxelStagingBufferRef Staging = VoxelSource->GetFrame();
+		const double AcquiredTime = FPlatformTime::Seconds();
+		// Nothing to do until the source publishes a new frame, the textures still hold the last one. Culled slices
+		// of it are uploaded as they come into view though.
+		if (!Staging.IsValid())
+		{
+			return;
+		}
+		if (Staging->FrameSequence == LastFrameSequence)
+		{
+			if (CullSlices && RenderMode == EVoxelRenderMode::SubRenderers)
+			{
+				UpdateSubRenderers(Staging, LastVoxelCount);
+			}
+			return;
+		}
+		LastFrameSequence = Staging->FrameSequence;
+		int32 VoxelCount = (int32)Staging->NumVoxels;
+		SetScale(((float)Staging->VoxelSizemm) / 10.0);// convert mm to cm
 		//double endRead = FPlatformTime::Seconds();
 		//GEngine->AddOnScreenDebugMessage(-1, 5.0f, FColor::Red, FString::Printf(TEXT("GetNextFrame time: %.4f ms"), (endRead - startRead) * 1000.0));
 
-		// Throw away any data beyond the number of pregenerated voxels
-		if(VoxelCount > TOTAL_VOXELS)
+		// Throw away any data beyond the number of voxels we're allowed to draw
+		int32 Capacity = MaxVoxels > 0 ? MaxVoxels : VoxelSource->GetMaxVoxels();
+		if(VoxelCount > Capacity)
 		{
-			GEngine->AddOnScreenDebugMessage(VoxelWarningKey, 5.0f, FColor::Red, FString::Printf(TEXT("Too man voxels! %d / %d"), VoxelCount, TOTAL_VOXELS));
-			VoxelCount = TOTAL_VOXELS;
+			GEngine->AddOnScreenDebugMessage(VoxelWarningKey, 5.0f, FColor::Red, FString::Printf(TEXT("Too man voxels! %d / %d"), VoxelCount, Capacity));
+			VoxelCount = Capacity;
 		}
+		LastVoxelCount = VoxelCount;
 
 		/*if(saveFrame)
 		{
-			uint8* cPointer = ColourData;
+			uint8* cPointer = Staging->GetColourData();
 			for(int i = 0; i < VoxelCount; i++)
 			{
 				OutColours.Add(FColor(cPointer[2], cPointer[1], cPointer[0]));
@@ -56,30 +315,19 @@ void UVoxelRenderComponent::TickComponent(float DeltaTime, ELevelTick TickType,
 			}
 		}*/
 
-		int offset = 0;
-		int RenderedVoxels = 0;
-		bool bZero = false;
-		for(auto& VRSC : VoxelRenderers)
+		if (RenderMode == EVoxelRenderMode::Atlas)
 		{
-			if (bZero)
-			{
-				VRSC->ZeroData();
-			}
-			else {
-				if (RenderedVoxels + SUB_VOXEL_COUNT > VoxelCount) {
-					bZero = true; // Zero out further sub-renderers
-					// Zero out the remainder of this one
-					int SRVoxels = VoxelCount - RenderedVoxels;
-					int EndOffset = offset + SRVoxels * VOXEL_TEXTURE_BPP;
-					memset(CoarsePositionData + EndOffset, 0, (SUB_VOXEL_COUNT - SRVoxels) * VOXEL_TEXTURE_BPP);
-					memset(PositionData + EndOffset, 0, (SUB_VOXEL_COUNT - SRVoxels) * VOXEL_TEXTURE_BPP);
-				}
-				// Set Data takes copies of required slices for render thread
-				VRSC->SetData(CoarsePositionData + offset, PositionData + offset, ColourData + offset);
-				offset += SUB_VOXEL_COUNT * VOXEL_TEXTURE_BPP;
-				RenderedVoxels += SUB_VOXEL_COUNT;
-			}
+			UpdateAtlas(Staging, VoxelCount, Capacity);
 		}
+		else if (RenderMode == EVoxelRenderMode::Instanced)
+		{
+			UpdateInstanced(Staging, VoxelCount);
+		}
+		else
+		{
+			UpdateSubRenderers(Staging, VoxelCount);
+		}
+		SubmitFrameTiming(Staging, AcquiredTime);
 
 		// For debugging, save texture map to PNG
 		/*if(saveFrame)
@@ -88,11 +336,11 @@ void UVoxelRenderComponent::TickComponent(float DeltaTime, ELevelTick TickType,
 			TArray<FColor> OutPositions;
 			for(int i = 0; i < OutColours.Num(); i++)
 			{
-				uint8* p = PositionData + i * VOXEL_TEXTURE_BPP;
+				uint8* p = Staging->GetPositionData() + i * VOXEL_TEXTURE_BPP;
 				OutPositions.Add(FColor(p[0], p[1], p[2]));
 			}
 			// Pad with 0s
-			int diff = TOTAL_VOXELS - OutColours.Num();
+			int diff = Capacity - OutColours.Num();
 			for(int i = 0; i < diff; i++)
 			{
 				OutColours.Add(FColor(0, 0, 0));
@@ -101,7 +349,7 @@ void UVoxelRenderComponent::TickComponent(float DeltaTime, ELevelTick TickType,
 			TArray<uint8> CompressedPNG;
 			FImageUtils::CompressImageArray(
 				512,
-				TOTAL_VOXELS / 512,
+				Capacity / 512,
 				OutColours,
 				CompressedPNG
 			);
@@ -109,7 +357,7 @@ void UVoxelRenderComponent::TickComponent(float DeltaTime, ELevelTick TickType,
 			CompressedPNG.Reset();
 			FImageUtils::CompressImageArray(
 				512,
-				TOTAL_VOXELS / 512,
+				Capacity / 512,
 				OutPositions,
 				CompressedPNG
 			);
@@ -121,6 +369,15 @@ void UVoxelRenderComponent::TickComponent(float DeltaTime, ELevelTick TickType,
 
 void UVoxelRenderComponent::SetScale(float Scale)
 {
+	this->Scale = Scale;
+	if (AtlasRenderer != nullptr)
+	{
+		AtlasRenderer->SetScale(Scale);
+	}
+	if (InstancedRenderer != nullptr)
+	{
+		InstancedRenderer->SetScale(Scale);
+	}
 	for(auto& VRSC : VoxelRenderers)
 	{
 		VRSC->SetScale(Scale);
@@ -129,6 +386,15 @@ void UVoxelRenderComponent::SetScale(float Scale)
 
 void UVoxelRenderComponent::SetLocation(FVector Location)
 {
+	this->Location = Location;
+	if (AtlasRenderer != nullptr)
+	{
+		AtlasRenderer->SetLocation(Location);
+	}
+	if (InstancedRenderer != nullptr)
+	{
+		InstancedRenderer->SetLocation(Location);
+	}
 	for (auto& VRSC : VoxelRenderers)
 	{
 		VRSC->SetLocation(Location);
@@ -137,6 +403,15 @@ void UVoxelRenderComponent::SetLocation(FVector Location)
 
 void UVoxelRenderComponent::SetRotation(FVector Rotation)
 {
+	this->Rotation = Rotation;
+	if (AtlasRenderer != nullptr)
+	{
+		AtlasRenderer->SetRotation(Rotation);
+	}
+	if (InstancedRenderer != nullptr)
+	{
+		InstancedRenderer->SetRotation(Rotation);
+	}
 	for (auto& VRSC : VoxelRenderers)
 	{
 		VRSC->SetRotation(Rotation);
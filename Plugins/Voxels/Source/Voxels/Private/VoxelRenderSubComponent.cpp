@@ -1,6 +1,8 @@
 #include "VoxelRenderSubComponent.h"
 #include "Voxels.h"
 #include "Engine.h"
+#include "RenderingThread.h"
+#include "RHI.h"
 
 // Fix conflict between Windows.h macros and Unreal function name
 #undef UpdateResource
@@ -32,22 +34,22 @@ UVoxelRenderSubComponent::UVoxelRenderSubComponent()
 		UE_LOG(LogTemp, Error, TEXT("Couldn't load /Voxels/VertexMoveMaterial"));
 	}
 
-	UpdateTextureRegion = new FUpdateTextureRegion2D(0, 0, 0, 0, SUB_VOXEL_COUNT_SQR, SUB_VOXEL_COUNT_SQR);
-
-	EmptyData = new uint8[SUB_VOXEL_COUNT * VOXEL_TEXTURE_BPP]();
-
 	//SetIsReplicated(true);
 }
 
-void UVoxelRenderSubComponent::OnComponentDestroyed(bool bDestroyingHierarchy)
+void UVoxelRenderSubComponent::Init(int32 TextureSize, UStaticMesh* Mesh)
 {
-	if(UpdateTextureRegion != nullptr)
+	this->TextureSize = TextureSize;
+	UploadedRows = TextureSize;
+	if (Mesh != nullptr)
 	{
-		delete UpdateTextureRegion;
-		UpdateTextureRegion = nullptr;
+		SetStaticMesh(Mesh);
 	}
+}
 
-	delete[] EmptyData;
+void UVoxelRenderSubComponent::OnComponentDestroyed(bool bDestroyingHierarchy)
+{
+	EmptyData.SafeRelease();
 
 	Super::OnComponentDestroyed(bDestroyingHierarchy);
 }
@@ -56,19 +58,23 @@ void UVoxelRenderSubComponent::BeginPlay()
 {
 	Super::BeginPlay();
 
-	SetBoundsScale(10000.0f); // TODO: Automatically match this to voxel mat properties
+	// Until SetVoxelBounds is called the voxels could be anywhere VertexMoveMaterial can put them
+	SetBoundsScale(10000.0f);
 
 	if(StaticMaterial)
 	{
-		CoarsePositionTexture = UTexture2D::CreateTransient(SUB_VOXEL_COUNT_SQR, SUB_VOXEL_COUNT_SQR);
+		CoarsePositionTexture = UTexture2D::CreateTransient(TextureSize, TextureSize);
 		CoarsePositionTexture->UpdateResource();
 
-		PositionTexture = UTexture2D::CreateTransient(SUB_VOXEL_COUNT_SQR, SUB_VOXEL_COUNT_SQR);
+		PositionTexture = UTexture2D::CreateTransient(TextureSize, TextureSize);
 		PositionTexture->UpdateResource();
 
-		ColourTexture = UTexture2D::CreateTransient(SUB_VOXEL_COUNT_SQR, SUB_VOXEL_COUNT_SQR);
+		ColourTexture = UTexture2D::CreateTransient(TextureSize, TextureSize);
 		ColourTexture->UpdateResource();
 
+		// Staging buffers are zeroed when they're allocated
+		EmptyData = FVoxelStagingPool::Create(TextureSize * TextureSize * VOXEL_TEXTURE_BPP)->Acquire();
+
 		Material = CreateDynamicMaterialInstance(0, StaticMaterial);
 		Material->SetTextureParameterValue(FName("CoarsePositionTexture"), CoarsePositionTexture);
 		Material->SetTextureParameterValue(FName("PositionTexture"), PositionTexture);
@@ -99,30 +105,53 @@ void UVoxelRenderSubComponent::BeginPlay()
 	}
 }
 
-void UVoxelRenderSubComponent::SetData(uint8* CoarsePositionData, uint8* PositionData, uint8* ColourData)
+void UVoxelRenderSubComponent::SetData(const FVoxelStagingBufferRef& Staging, uint32 TexelOffset, uint32 NumVoxels, uint64 SliceHash)
 {
 	if(CoarsePositionTexture && PositionTexture && ColourTexture)
 	{
-		// Take heap allocated copy of input data to hand to render thread, which will be responsible for cleanup in lambda
-		// TODO: Restructure so that caller moves memory responsibility to here, avoiding extra allocation, remove delete in callback once done
-		size_t DataSize = SUB_VOXEL_COUNT * VOXEL_TEXTURE_BPP;
-		uint8* PositionDataRT = new uint8[DataSize];
-		memcpy(PositionDataRT, PositionData, DataSize);
-		uint8* ColourDataRT = new uint8[DataSize];
-		memcpy(ColourDataRT, ColourData, DataSize);
-		uint8* CoarseDataRT = new uint8[DataSize];
-		memcpy(CoarseDataRT, CoarsePositionData, DataSize);
-
-		// Region is safely reused across calls, it isn't modified and doesn't need to be deleted
-		CoarsePositionTexture->UpdateTextureRegions(0, 1, UpdateTextureRegion, SUB_VOXEL_COUNT_SQR * VOXEL_TEXTURE_BPP, VOXEL_TEXTURE_BPP, CoarseDataRT, [](uint8 *Data, const FUpdateTextureRegion2D *Region) {
-			delete[] Data;
-		});
-		PositionTexture->UpdateTextureRegions(0, 1, UpdateTextureRegion, SUB_VOXEL_COUNT_SQR * VOXEL_TEXTURE_BPP, VOXEL_TEXTURE_BPP, PositionDataRT, [](uint8 *Data, const FUpdateTextureRegion2D *Region) {
-			delete[] Data;
-		});
-		ColourTexture->UpdateTextureRegions(0, 1, UpdateTextureRegion, SUB_VOXEL_COUNT_SQR * VOXEL_TEXTURE_BPP, VOXEL_TEXTURE_BPP, ColourDataRT, [](uint8 *Data, const FUpdateTextureRegion2D *Region) {
-			delete[] Data;
-		});
+		if (bHasData && SliceHash == UploadedHash)
+		{
+			return;
+		}
+
+		// Only the rows of blocks whose hash changed are uploaded, as one region per run of changed blocks.
+		// Texture sizes are powers of two no bigger than a block, so block edges always fall on row edges.
+		const uint32 BlockTexels = FVoxelStagingBuffer::HashBlockTexels;
+		const uint32 NumRows = FMath::DivideAndRoundUp<uint32>(NumVoxels, TextureSize);
+		const uint32 DataEnd = TexelOffset + NumRows * TextureSize;
+		const int32 FirstBlock = TexelOffset / BlockTexels;
+		const int32 EndBlock = FMath::Min<int32>(FMath::DivideAndRoundUp(DataEnd, BlockTexels), Staging->BlockHashes.Num());
+		UploadedBlockHashes.SetNumZeroed(EndBlock - FirstBlock);
+
+		TArray<FUpdateTextureRegion2D, TInlineAllocator<8>> Regions;
+		int32 RunStart = -1;
+		for (int32 Block = FirstBlock; Block <= EndBlock; Block++)
+		{
+			bool bDirty = Block < EndBlock && (!bHasData || UploadedBlockHashes[Block - FirstBlock] != Staging->BlockHashes[Block]);
+			if (bDirty && RunStart < 0)
+			{
+				RunStart = Block;
+			}
+			else if (!bDirty && RunStart >= 0)
+			{
+				uint32 FirstRow = (FMath::Max(RunStart * BlockTexels, TexelOffset) - TexelOffset) / TextureSize;
+				uint32 EndRow = (FMath::Min(Block * BlockTexels, DataEnd) - TexelOffset) / TextureSize;
+				Regions.Add(FUpdateTextureRegion2D(0, FirstRow, 0, 0, TextureSize, EndRow - FirstRow));
+				RunStart = -1;
+			}
+			if (Block < EndBlock)
+			{
+				UploadedBlockHashes[Block - FirstBlock] = Staging->BlockHashes[Block];
+			}
+		}
+
+		// Rows that held voxels last time but don't now are cleared
+		const FUpdateTextureRegion2D EmptyRegion(0, NumRows, 0, 0, TextureSize, FMath::Max<int32>(UploadedRows - NumRows, 0));
+		UploadTextures(Staging, TexelOffset, Regions, EmptyRegion);
+		bHasData = true;
+		UploadedHash = SliceHash;
+		UploadedRows = NumRows;
+		bZeroed = false;
 	}
 	else
 	{
@@ -132,11 +161,92 @@ void UVoxelRenderSubComponent::SetData(uint8* CoarsePositionData, uint8* Positio
 
 void UVoxelRenderSubComponent::ZeroData()
 {
-	if (CoarsePositionTexture && PositionTexture)
+	if (CoarsePositionTexture && PositionTexture && EmptyData.IsValid() && !bZeroed)
+	{
+		UploadTextures(nullptr, 0, TArrayView<const FUpdateTextureRegion2D>(), FUpdateTextureRegion2D(0, 0, 0, 0, TextureSize, UploadedRows));
+		bZeroed = true;
+		bHasData = false;
+		UploadedRows = 0;
+	}
+}
+
+void UVoxelRenderSubComponent::UploadTextures(const FVoxelStagingBufferRef& Staging, uint32 TexelOffset, TArrayView<const FUpdateTextureRegion2D> DataRegions, const FUpdateTextureRegion2D& EmptyRegion)
+{
+	FTextureResource* CoarsePositionResource = CoarsePositionTexture->Resource;
+	FTextureResource* PositionResource = PositionTexture->Resource;
+	FTextureResource* ColourResource = ColourTexture->Resource;
+	if (CoarsePositionResource == nullptr || PositionResource == nullptr || ColourResource == nullptr)
+	{
+		return;
+	}
+	if (DataRegions.Num() == 0 && EmptyRegion.Height == 0)
+	{
+		return;
+	}
+
+	// Upload straight out of the staging buffers, rather than going through UpdateTextureRegions which would need
+	// a heap copy per texture. The captured references keep the buffers out of their pools until the upload is done.
+	// Colours of unused rows are left alone, nothing is drawn for them once their positions are cleared.
+	const uint32 Pitch = TextureSize * VOXEL_TEXTURE_BPP;
+	TArray<FUpdateTextureRegion2D, TInlineAllocator<8>> Regions(DataRegions);
+	FVoxelStagingBufferRef Empty = EmptyRegion.Height > 0 ? EmptyData : nullptr;
+	ENQUEUE_RENDER_COMMAND(UploadVoxelTextures)(
+		[CoarsePositionResource, PositionResource, ColourResource, Regions, EmptyRegion, Pitch, TexelOffset, Staging, Empty](FRHICommandListImmediate& RHICmdList)
+	{
+		for (const FUpdateTextureRegion2D& Region : Regions)
+		{
+			if (!Staging.IsValid() || Region.Height == 0)
+			{
+				continue;
+			}
+			const uint32 ByteOffset = TexelOffset * VOXEL_TEXTURE_BPP + Region.DestY * Pitch;
+			RHIUpdateTexture2D(CoarsePositionResource->TextureRHI->GetTexture2D(), 0, Region, Pitch, Staging->GetCoarsePositionData() + ByteOffset);
+			RHIUpdateTexture2D(PositionResource->TextureRHI->GetTexture2D(), 0, Region, Pitch, Staging->GetPositionData() + ByteOffset);
+			RHIUpdateTexture2D(ColourResource->TextureRHI->GetTexture2D(), 0, Region, Pitch, Staging->GetColourData() + ByteOffset);
+		}
+		if (Empty.IsValid())
+		{
+			RHIUpdateTexture2D(CoarsePositionResource->TextureRHI->GetTexture2D(), 0, EmptyRegion, Pitch, Empty->GetCoarsePositionData());
+			RHIUpdateTexture2D(PositionResource->TextureRHI->GetTexture2D(), 0, EmptyRegion, Pitch, Empty->GetPositionData());
+		}
+	});
+}
+
+void UVoxelRenderSubComponent::SetVoxelBounds(const FVoxelBounds& VoxelBounds)
+{
+	if (FMemory::Memcmp(&VoxelBounds, &this->VoxelBounds, sizeof(FVoxelBounds)) != 0)
+	{
+		const bool bWasEmpty = this->VoxelBounds.IsEmpty();
+		this->VoxelBounds = VoxelBounds;
+		if (!bWasEmpty || !VoxelBounds.IsEmpty())
+		{
+			UpdateBounds();
+			MarkRenderTransformDirty();
+		}
+	}
+}
+
+void UVoxelRenderSubComponent::UpdateVoxelBounds()
+{
+	if (!VoxelBounds.IsEmpty())
+	{
+		UpdateBounds();
+		MarkRenderTransformDirty();
+	}
+}
+
+FBoxSphereBounds UVoxelRenderSubComponent::CalcBounds(const FTransform& LocalToWorld) const
+{
+	if (VoxelBounds.IsEmpty())
 	{
-		CoarsePositionTexture->UpdateTextureRegions(0, 1, UpdateTextureRegion, SUB_VOXEL_COUNT_SQR * VOXEL_TEXTURE_BPP, VOXEL_TEXTURE_BPP, EmptyData, [](uint8 *Data, const FUpdateTextureRegion2D *Region) {});
-		PositionTexture->UpdateTextureRegions(0, 1, UpdateTextureRegion, SUB_VOXEL_COUNT_SQR * VOXEL_TEXTURE_BPP, VOXEL_TEXTURE_BPP, EmptyData, [](uint8 *Data, const FUpdateTextureRegion2D *Region) {});
+		return Super::CalcBounds(LocalToWorld);
 	}
+	// VertexMoveMaterial scales, rotates and then moves voxels. A voxel either side covers the cubes drawn around them.
+	const FBox VoxelBox(
+		FVector(VoxelBounds.Min[0], VoxelBounds.Min[1], VoxelBounds.Min[2]) - FVector(1.0f),
+		FVector(VoxelBounds.Max[0], VoxelBounds.Max[1], VoxelBounds.Max[2]) + FVector(1.0f));
+	const FTransform VoxelToLocal(FRotator(Rotation.Y, Rotation.Z, Rotation.X), Location, FVector(Scale));
+	return FBoxSphereBounds(VoxelBox.TransformBy(VoxelToLocal * LocalToWorld));
 }
 
 void UVoxelRenderSubComponent::SetScale(float Scale)
@@ -151,6 +261,7 @@ void UVoxelRenderSubComponent::SetScale(float Scale)
 		{
 			bQueueScale = true;
 		}
+		UpdateVoxelBounds();
 	}
 }
 
@@ -165,6 +276,7 @@ void UVoxelRenderSubComponent::SetLocation(FVector Location)
 	{
 		bQueueLocation = true;
 	}
+	UpdateVoxelBounds();
 }
 
 void UVoxelRenderSubComponent::SetRotation(FVector Rotation)
@@ -178,4 +290,5 @@ void UVoxelRenderSubComponent::SetRotation(FVector Rotation)
 	{
 		bQueueRotation = true;
 	}
+	UpdateVoxelBounds();
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include "VoxelSlotAllocator.h"
+
+void FVoxelSlotAllocator::Reset(uint32_t MaxSlots, uint32_t BlockSlots)
+{
+	this->MaxSlots = MaxSlots;
+	this->BlockSlots = BlockSlots;
+	FreeBits.assign((MaxSlots + 63) / 64, 0);
+	FirstHoleWord = (uint32_t)FreeBits.size();
+	BlockCounts.assign((MaxSlots + BlockSlots - 1) / BlockSlots, 0);
+	NumSlots = 0;
+	NumAllocated = 0;
+}
+
+uint32_t FVoxelSlotAllocator::FindHole()
+{
+	while (FreeBits[FirstHoleWord] == 0)
+	{
+		FirstHoleWord++;
+	}
+	uint64_t Word = FreeBits[FirstHoleWord];
+	uint32_t Bit = 0;
+	while ((Word & 1) == 0)
+	{
+		Word >>= 1;
+		Bit++;
+	}
+	return FirstHoleWord * 64 + Bit;
+}
+
+int32_t FVoxelSlotAllocator::Allocate()
+{
+	uint32_t Slot;
+	if (NumAllocated < NumSlots)
+	{
+		Slot = FindHole();
+		FreeBits[Slot / 64] &= ~(1ull << (Slot % 64));
+	}
+	else if (NumSlots < MaxSlots)
+	{
+		Slot = NumSlots++;
+	}
+	else
+	{
+		return -1;
+	}
+	NumAllocated++;
+	BlockCounts[Slot / BlockSlots]++;
+	return (int32_t)Slot;
+}
+
+void FVoxelSlotAllocator::Free(uint32_t Slot)
+{
+	if (!IsAllocated(Slot))
+	{
+		return;
+	}
+	NumAllocated--;
+	BlockCounts[Slot / BlockSlots]--;
+	FreeBits[Slot / 64] |= 1ull << (Slot % 64);
+	if (Slot / 64 < FirstHoleWord)
+	{
+		FirstHoleWord = Slot / 64;
+	}
+
+	// Free slots at the top of the range aren't holes, drop them so the range only covers what's in use
+	while (NumSlots > 0 && (FreeBits[(NumSlots - 1) / 64] & (1ull << ((NumSlots - 1) % 64))) != 0)
+	{
+		NumSlots--;
+		FreeBits[NumSlots / 64] &= ~(1ull << (NumSlots % 64));
+	}
+	if (NumAllocated == NumSlots)
+	{
+		FirstHoleWord = (uint32_t)FreeBits.size();
+	}
+}
+
+uint32_t FVoxelSlotAllocator::Compact(uint32_t MaxMoves, std::vector<FMove>& Moves)
+{
+	uint32_t NumMoves = 0;
+	while (NumMoves < MaxMoves && NumAllocated < NumSlots)
+	{
+		// The top slot is always allocated, trailing free ones are dropped as they're freed
+		const uint32_t From = NumSlots - 1;
+		const uint32_t To = (uint32_t)Allocate();
+		Free(From);
+		Moves.push_back({ From, To });
+		NumMoves++;
+	}
+	return NumMoves;
+}
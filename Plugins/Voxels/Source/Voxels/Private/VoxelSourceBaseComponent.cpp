@@ -3,6 +3,7 @@
 #include "VoxelSourceBaseComponent.h"
 #include "Engine.h"
 #include "VoxelRenderSubComponent.h"
+#include "VoxelPacking.h"
 #include"Runtime/Engine/Classes/Kismet/KismetSystemLibrary.h"
 #include <chrono>
 #include <functional>
@@ -36,20 +37,24 @@ const VIMR::Bone VIMR::skeleton[] = {
   Bone{ VIMR::JointType_KneeRight, VIMR::JointType_AnkleRight }
 };
 
-void UVoxelSourceBaseComponent::CopyVoxelData(VIMR::VoxelGrid* voxels) {
-	if (inProgress) {
-		FString failLogMessage = FString("Received more voxels before copying last frame finished. ID: ") + ClientConfigID;
-		UE_LOG(VoxLog, Log, TEXT("%s"), *failLogMessage);
-		return;
-	}
-
-	inProgress = true;
-	VoxelCount[buffIdx] = 0;
-	VoxelSizemm[buffIdx] = (uint8)voxels->VoxSize_mm();
-	VoxelSize_mm = voxels->VoxSize_mm();
+void UVoxelSourceBaseComponent::GatherFrame(VIMR::VoxelGrid* voxels, FVoxelGather& Gather) {
 	//FIXME: A way to check if the octree contains nodes which have aux labels
 
+	// Colours are gathered along with the positions, so voxels can be merged and reordered before anything is
+	// written to a frame buffer. LevelOfDetail lets the frame run past MaxVoxels, DecimateFrame brings it back down.
+	// Frames wanted whole run past both, LimitFrame brings them back to the gather limit.
+	const bool bWhole = WantsWholeFrames();
+	const uint32 MostVoxels = bWhole ? MaxWholeFrameVoxels : GetGatherLimit();
+	Gather.Reserve(FMath::Min(Capacity, MostVoxels));
+	Gather.bLabels = bWhole || KeepVoxelLabels;
+	// The gather may have been grown past MostVoxels while LevelOfDetail was on, it never shrinks
+	uint32 GatherLimit = FMath::Min(Gather.GetCapacity(), MostVoxels);
+	uint8* ColourOut = (uint8*)Gather.Colours.GetData();
+
+	// Local, as frames that are dropped are still gathered when they're wanted whole, on whichever thread drops them
+	VIMR::Voxel* node = nullptr;
 	int pOffset = 0;
+	uint32 Count = 0;
 	while (voxels->GetNextVoxel(&node)) {
 		/*
 		if (node->GetFlag(VIMR::Voxel::Flags::Hidden) != 0){
@@ -69,47 +74,416 @@ void UVoxelSourceBaseComponent::CopyVoxelData(VIMR::VoxelGrid* voxels) {
 
 		if(ColourVoxelSource){
 			int s=node->GetSrc();
-			memcpy(&ColourData[buffIdx][pOffset], &src_rgb[3 * (s % BODY_COUNT)], 3);
+			memcpy(&ColourData[pOffset], &src_rgb[3 * (s % BODY_COUNT)], 3);
 		}else if(ColorBodyVoxels && aux < 100){
-			memcpy(&ColourData[buffIdx][pOffset], &body_rgb[3 * (aux % 20)], 3);
+			memcpy(&ColourData[pOffset], &body_rgb[3 * (aux % 20)], 3);
 		}else{
-			node->read_data((char*)&ColourData[buffIdx][pOffset]);
+			node->read_data((char*)&ColourData[pOffset]);
 		}*/
-		node->read_data((char*)&ColourData[buffIdx][pOffset]);
-		int16_t pY = node->pos.Y;
-		int16_t pX = node->pos.X;
-		int16_t pZ = node->pos.Z;
-		CoarsePositionData[buffIdx][pOffset + 0] = (pZ >> 8) + 128;
-		CoarsePositionData[buffIdx][pOffset + 1] = (pY >> 8) + 128;
-		CoarsePositionData[buffIdx][pOffset + 2] = (pX >> 8) + 128;
-
-		PositionData[buffIdx][pOffset + 0] = pZ & 0xFF;
-		PositionData[buffIdx][pOffset + 1] = pY & 0xFF;
-		PositionData[buffIdx][pOffset + 2] = pX & 0xFF;
+		node->read_data((char*)&ColourOut[pOffset]);
+		// Positions are only gathered here, they're split into coarse/fine texels in one vectorised pass by PackFrame
+		int16* Gathered = Gather.Positions.GetData() + Count * VoxelPacking::GatherStride;
+		Gathered[0] = node->pos.Z;
+		Gathered[1] = node->pos.Y;
+		Gathered[2] = node->pos.X;
+		Gathered[3] = 0;
+		if (Gather.bLabels) {
+			Gather.Flags[Count] = (uint8)((node->GetFlag(VIMR::Voxel::Flags::Hidden) != 0 ? VoxelFlag_Hidden : 0) | (node->GetFlag(VIMR::Voxel::Flags::Special) != 0 ? VoxelFlag_Special : 0));
+			Gather.AuxLabels[Count] = (uint16)node->GetAux();
+		}
 
 		pOffset += VOXEL_TEXTURE_BPP;
-		VoxelCount[buffIdx]++;
+		Count++;
 
-		if (VoxelCount[buffIdx] >= MaxVoxels) {
-			FString failLogMessage = FString("Too Many Voxels! ID: ") + ClientConfigID;
-			UE_LOG(VoxLog, Log, TEXT("%s"), *failLogMessage);
-			break;
+		if (Count >= GatherLimit) {
+			if (GatherLimit >= MostVoxels) {
+				FString failLogMessage = FString("Too Many Voxels! ID: ") + ClientConfigID;
+				UE_LOG(VoxLog, Log, TEXT("%s"), *failLogMessage);
+				break;
+			}
+			GatherLimit = FMath::Min(GatherLimit * 2, MostVoxels);
+			Gather.Reserve(GatherLimit);
+			ColourOut = (uint8*)Gather.Colours.GetData();
 		}
 	}
+	Gather.Count = Count;
+	Gather.VoxelSizemm = (uint8)voxels->VoxSize_mm();
+}
 
-	//UE_LOG(VoxLog, Log, TEXT("VoxCount=%i"), VoxelCount[buffIdx]);
+void UVoxelSourceBaseComponent::LimitFrame(FVoxelGather& Gather) {
+	const uint32 MostVoxels = GetGatherLimit();
+	if (Gather.Count > MostVoxels) {
+		FString failLogMessage = FString("Too Many Voxels! ID: ") + ClientConfigID;
+		UE_LOG(VoxLog, Log, TEXT("%s"), *failLogMessage);
+		Gather.Count = MostVoxels;
+	}
+	Gather.bLabels = Gather.bLabels && KeepVoxelLabels;
+}
+
+void UVoxelSourceBaseComponent::GatherDroppedFrame(TFunctionRef<void(FVoxelGather&)> Gather) {
+	if (WantsWholeFrames()) {
+		FScopeLock Lock(&DroppedGatherLock);
+		Gather(DroppedGather);
+		OnFrameGathered(DroppedGather);
+	}
+}
+
+uint32 UVoxelSourceBaseComponent::GetGatherLimit() const {
+	return IsLevelOfDetailApplied() ? (uint32)MaxVoxels * LodGatherFactor : (uint32)MaxVoxels;
+}
+
+void UVoxelSourceBaseComponent::DecimateFrame(FVoxelGather& Gather) {
+	const uint32 GatheredCount = Gather.Count;
+	if (IsLevelOfDetailApplied()) {
+		// Merge voxels far from the viewer until the frame fits, moving everything kept for each voxel down after it
+		const float Viewer[3] = { ViewerPosition[0].load(std::memory_order_relaxed), ViewerPosition[1].load(std::memory_order_relaxed), ViewerPosition[2].load(std::memory_order_relaxed) };
+		if (Gather.Decimator.Decimate(Gather.Positions.GetData(), Gather.Count, Viewer, (uint32)MaxVoxels, MaxDetailLevel, Gather.DecimatorKept)) {
+			int16* Positions = Gather.Positions.GetData();
+			uint32* Colours = Gather.Colours.GetData();
+			Gather.Count = (uint32)Gather.DecimatorKept.size();
+			for (uint32 i = 0; i < Gather.Count; i++) {
+				const uint32 From = Gather.DecimatorKept[i];
+				FMemory::Memcpy(Positions + i * VoxelPacking::GatherStride, Positions + From * VoxelPacking::GatherStride, VoxelPacking::GatherStride * sizeof(int16));
+				Colours[i] = Colours[From];
+				if (Gather.bLabels) {
+					Gather.Flags[i] = Gather.Flags[From];
+					Gather.AuxLabels[i] = Gather.AuxLabels[From];
+				}
+			}
+		}
+	}
+	if (Gather.Count > (uint32)MaxVoxels) {
+		// Decimation couldn't bring it down far enough, or stopped applying after this frame was gathered
+		UE_LOG(VoxLog, Log, TEXT("Too Many Voxels! Dropping %u. ID: %s"), Gather.Count - (uint32)MaxVoxels, *ClientConfigID);
+		Gather.Count = (uint32)MaxVoxels;
+	}
+	DecimatedCount.store(GatheredCount - Gather.Count, std::memory_order_relaxed);
+}
+
+void UVoxelSourceBaseComponent::PackFrame(FVoxelGather& Gather, FVoxelStagingBuffer* Frame) {
+	const uint32 BlockTexels = FVoxelStagingBuffer::HashBlockTexels;
+	const uint32 Count = Gather.Count;
+	const int16* GatheredData = Gather.Positions.GetData();
+	const uint32* Order = nullptr;
+	if (MortonOrder && Count > 0) {
+		// Positions and colours are moved to where the sort puts them as each block is packed, labels follow below
+		VoxelPacking::MortonSort(Gather.Positions.GetData(), Count, PackingThreads, Gather.SortOrder, Gather.SortItems, Gather.SortHistograms);
+		Gather.SortedPositions.SetNumUninitialized(Count * VoxelPacking::GatherStride, false);
+		Order = Gather.SortOrder.data();
+		GatheredData = Gather.SortedPositions.GetData();
+	}
+	const uint64* UnsortedPositions = (const uint64*)Gather.Positions.GetData();
+	uint64* SortedPositions = (uint64*)Gather.SortedPositions.GetData();
+	const uint32* Colours = Gather.Colours.GetData();
+	uint8* CoarsePositionData = Frame->GetCoarsePositionData();
+	uint8* PositionData = Frame->GetPositionData();
+	uint8* ColourData = Frame->GetColourData();
+
+	// Blocks are independent, so they're packed concurrently. Each one has its colours copied in, is packed, has any
+	// unused tail zeroed so leftover cubes in the sub-renderer that draws it don't show stale voxels, and is hashed so
+	// the render component can skip re-uploading slices that haven't changed.
+	Frame->NumVoxels = Count;
+	Frame->BlockHashes.SetNumUninitialized(FMath::DivideAndRoundUp(Count, BlockTexels), false);
+	Frame->BlockVoxelCounts.SetNumUninitialized(Frame->BlockHashes.Num(), false);
+	Frame->BlockBounds.SetNumUninitialized(Frame->BlockHashes.Num(), false);
+	uint64* BlockHashes = Frame->BlockHashes.GetData();
+	uint16* BlockVoxelCounts = Frame->BlockVoxelCounts.GetData();
+	FVoxelBounds* BlockBounds = Frame->BlockBounds.GetData();
+
+	VoxelPacking::ParallelFor(Frame->BlockHashes.Num(), VoxelPacking::GetNumWorkers(Count, PackingThreads), [=](int32 Block) {
+		const uint32 First = Block * BlockTexels;
+		const size_t BlockOffset = First * VOXEL_TEXTURE_BPP;
+		const uint32 BlockCount = FMath::Min<uint32>(Count - First, BlockTexels);
+		uint32* ColoursTo = (uint32*)(ColourData + BlockOffset);
+		if (Order) {
+			for (uint32 i = 0; i < BlockCount; i++) {
+				SortedPositions[First + i] = UnsortedPositions[Order[First + i]];
+				ColoursTo[i] = Colours[Order[First + i]];
+			}
+		}
+		else {
+			FMemory::Memcpy(ColoursTo, Colours + First, BlockCount * VOXEL_TEXTURE_BPP);
+		}
+		BlockVoxelCounts[Block] = (uint16)BlockCount;
+		BlockHashes[Block] = VoxelPacking::PackBlock(GatheredData + First * VoxelPacking::GatherStride, BlockCount, BlockTexels,
+			CoarsePositionData + BlockOffset, PositionData + BlockOffset, ColourData + BlockOffset);
+		BlockBounds[Block] = FVoxelBounds();
+		VoxelPacking::GatheredBounds(GatheredData + First * VoxelPacking::GatherStride, BlockCount, BlockBounds[Block].Min, BlockBounds[Block].Max);
+	});
+
+	if (Gather.bLabels) {
+		Frame->Flags.SetNumUninitialized(Count, false);
+		Frame->AuxLabels.SetNumUninitialized(Count, false);
+		if (Order) {
+			for (uint32 i = 0; i < Count; i++) {
+				Frame->Flags[i] = Gather.Flags[Order[i]];
+				Frame->AuxLabels[i] = Gather.AuxLabels[Order[i]];
+			}
+		}
+		else {
+			FMemory::Memcpy(Frame->Flags.GetData(), Gather.Flags.GetData(), Count * sizeof(uint8));
+			FMemory::Memcpy(Frame->AuxLabels.GetData(), Gather.AuxLabels.GetData(), Count * sizeof(uint16));
+		}
+	}
+	else {
+		Frame->Flags.Reset();
+		Frame->AuxLabels.Reset();
+	}
+}
+
+void UVoxelSourceBaseComponent::CopyDeltaFrame(const FVoxelGather& Gather, int32 buffIdx) {
+	const uint32 BlockTexels = FVoxelStagingBuffer::HashBlockTexels;
+	const uint32 Sequence = LastFrameSequence + 1;
+	if (!bDeltaActive) {
+		// Starting over: the image holds nothing yet and every frame buffer needs a full copy of it
+		if (!DeltaImage.IsValid() || DeltaImage->GetPlaneSize() < (size_t)MaxVoxels * VOXEL_TEXTURE_BPP) {
+			DeltaImage = FVoxelStagingPool::GetShared(MaxVoxels * VOXEL_TEXTURE_BPP)->Acquire();
+		}
+		FMemory::Memzero(DeltaImage->GetCoarsePositionData(), DeltaImage->GetPlaneSize() * 3);
+		DeltaImage->BlockHashes.Reset();
+		DeltaEncoder.Reset(MaxVoxels, BlockTexels);
+		DeltaBlockSequences.Reset();
+		DeltaEpoch = Sequence;
+		bDeltaActive = true;
+	}
+
+	DeltaEncoder.SetCompaction(CompactionThreshold, (uint32)FMath::Max(MaxCompactionMoves, 0));
+	DeltaEncoder.BeginFrame();
+	if (DeltaEncoder.AddVoxels(Gather.Positions.GetData(), Gather.Colours.GetData(), Gather.Count) < Gather.Count) {
+		FString failLogMessage = FString("Too Many Voxels! ID: ") + ClientConfigID;
+		UE_LOG(VoxLog, Log, TEXT("%s"), *failLogMessage);
+	}
+	uint8* ImageCoarse = DeltaImage->GetCoarsePositionData();
+	uint8* ImagePosition = DeltaImage->GetPositionData();
+	uint8* ImageColour = DeltaImage->GetColourData();
+	DeltaEncoder.EndFrame(ImageCoarse, ImagePosition, ImageColour, DirtyBlocks);
+	const FVoxelDeltaEncoder::FStats& Stats = DeltaEncoder.GetStats();
+	ChangedVoxelCount.store(Stats.Added + Stats.Removed + Stats.Recoloured, std::memory_order_relaxed);
+	SlotHoleCount.store(DeltaEncoder.GetSlots().GetNumHoles(), std::memory_order_relaxed);
+
+	const uint32 Count = DeltaEncoder.GetNumSlots();
+	while (Count > Capacity && Capacity < (uint32)MaxVoxels) {
+		GrowCapacity(buffIdx);
+	}
+	FrameBuffers[buffIdx]->NumVoxels = Count;
+
+	// Rehash and re-bound the blocks that changed, and note when they did
+	const int32 NumBlocks = (int32)DirtyBlocks.size();
+	const int32 OldNumBlocks = DeltaBlockSequences.Num();
+	DeltaImage->BlockHashes.SetNumZeroed(NumBlocks, false);
+	DeltaImage->BlockBounds.SetNum(NumBlocks, false);
+	DeltaBlockSequences.SetNumZeroed(NumBlocks, false);
+	for (int32 Block = OldNumBlocks; Block < NumBlocks; Block++) {
+		DirtyBlocks[Block] = 1;
+	}
+	uint64* ImageHashes = DeltaImage->BlockHashes.GetData();
+	FVoxelBounds* ImageBounds = DeltaImage->BlockBounds.GetData();
+	uint32* BlockSequences = DeltaBlockSequences.GetData();
+	const uint8* Dirty = DirtyBlocks.data();
+
+	// Bring the frame buffer up to date: blocks changed since the frame it last held, or everything if it's new
+	FVoxelStagingBuffer* Frame = FrameBuffers[buffIdx];
+	const uint32 HeldSequence = Frame->FrameSequence >= DeltaEpoch && Frame->FrameSequence < Sequence ? Frame->FrameSequence : 0;
+	uint8* CoarsePositionData = Frame->GetCoarsePositionData();
+	uint8* PositionData = Frame->GetPositionData();
+	uint8* ColourData = Frame->GetColourData();
+	VoxelPacking::ParallelFor(NumBlocks, PackingThreads, [=](int32 Block) {
+		const size_t BlockOffset = (size_t)Block * BlockTexels * VOXEL_TEXTURE_BPP;
+		const size_t BlockBytes = BlockTexels * VOXEL_TEXTURE_BPP;
+		if (Dirty[Block]) {
+			ImageHashes[Block] = VoxelPacking::HashBlock(ImageCoarse + BlockOffset, ImagePosition + BlockOffset, ImageColour + BlockOffset, BlockTexels);
+			ImageBounds[Block] = FVoxelBounds();
+			VoxelPacking::TexelBounds(ImageCoarse + BlockOffset, ImagePosition + BlockOffset, BlockTexels, ImageBounds[Block].Min, ImageBounds[Block].Max);
+			BlockSequences[Block] = Sequence;
+		}
+		if (HeldSequence == 0 || BlockSequences[Block] > HeldSequence) {
+			FMemory::Memcpy(CoarsePositionData + BlockOffset, ImageCoarse + BlockOffset, BlockBytes);
+			FMemory::Memcpy(PositionData + BlockOffset, ImagePosition + BlockOffset, BlockBytes);
+			FMemory::Memcpy(ColourData + BlockOffset, ImageColour + BlockOffset, BlockBytes);
+		}
+	});
+	Frame->BlockHashes = DeltaImage->BlockHashes;
+	Frame->BlockBounds = DeltaImage->BlockBounds;
+	Frame->Flags.Reset();
+	Frame->AuxLabels.Reset();
+	Frame->BlockVoxelCounts.SetNumUninitialized(NumBlocks, false);
+	FMemory::Memcpy(Frame->BlockVoxelCounts.GetData(), DeltaEncoder.GetSlots().GetBlockCounts().data(), NumBlocks * sizeof(uint16));
+}
+
+void UVoxelSourceBaseComponent::CopyVoxelData(VIMR::VoxelGrid* voxels) {
+	CopyFrame([this, voxels](FVoxelGather& Gather) { GatherFrame(voxels, Gather); });
+}
+
+void UVoxelSourceBaseComponent::CopyReceivedVoxelData(VIMR::VoxelGrid* voxels, double ReceivedTime) {
+	CopyFrame([this, voxels](FVoxelGather& Gather) { GatherFrame(voxels, Gather); }, ReceivedTime);
+}
+
+void UVoxelSourceBaseComponent::CopyFrame(TFunctionRef<void(FVoxelGather&)> Gather, double ReceivedTime) {
+	if (inProgress.exchange(true, std::memory_order_acquire)) {
+		DroppedCount.fetch_add(1, std::memory_order_relaxed);
+		FString failLogMessage = FString("Received more voxels before copying last frame finished. ID: ") + ClientConfigID;
+		UE_LOG(VoxLog, Log, TEXT("%s"), *failLogMessage);
+		GatherDroppedFrame(Gather);
+		return;
+	}
+
+	const double CopyStartTime = FPlatformTime::Seconds();
+
+	if (DecodePool.IsValid() && !DeltaFrames) {
+		// Only copy the voxels out here, a decode worker packs and publishes them. If the queue is full the
+		// backpressure policy either drops a frame, hands back the oldest one's slot or waits for room.
+		bDeltaActive = false;
+		const int32 Slot = DecodePool->BeginFrame();
+		if (Slot >= 0) {
+			FVoxelGather& SlotGather = *DecodeSlots[Slot];
+			SlotGather.ReceivedTime = ReceivedTime;
+			SlotGather.CopyStartTime = CopyStartTime;
+			Gather(SlotGather);
+			OnFrameGathered(SlotGather);
+			LimitFrame(SlotGather);
+			DecodePool->SubmitFrame(Slot);
+		}
+		else {
+			GatherDroppedFrame(Gather);
+		}
+		inProgress.store(false, std::memory_order_release);
+		return;
+	}
+
+	// Decode workers may still be publishing frames from before DeltaFrames was turned on
+	FScopeLock Lock(&PublishLock);
+	const int32 buffIdx = Handoff.GetWriteIndex();
+	if (FrameBuffers[buffIdx]->GetRefCount() > 1 || FrameBuffers[buffIdx]->GetPlaneSize() < Capacity * VOXEL_TEXTURE_BPP) {
+		// Render thread hasn't finished uploading from this one yet, or it's from before the last time we grew
+		FrameBuffers[buffIdx] = StagingPool->Acquire();
+	}
+
+	Gather(FrameGather);
+	OnFrameGathered(FrameGather);
+	LimitFrame(FrameGather);
+	if (DeltaFrames) {
+		CopyDeltaFrame(FrameGather, buffIdx);
+	}
+	else {
+		bDeltaActive = false;
+		DecimateFrame(FrameGather);
+		// DecimateFrame leaves at most MaxVoxels, so this stops once the buffers are as big as they get
+		while (FrameGather.Count > Capacity && Capacity < (uint32)MaxVoxels) {
+			GrowCapacity(buffIdx);
+		}
+		PackFrame(FrameGather, FrameBuffers[buffIdx]);
+	}
+
+	//UE_LOG(VoxLog, Log, TEXT("VoxCount=%i"), Frame->NumVoxels);
 	/*for (int i = 0; i < 20; i++)
 	{
 		Bone_pos[i] = 0.5* (JointPositions[VIMR::skeleton[i].End] + JointPositions[VIMR::skeleton[i].Start]); // out of bounds range check 
 		Bone_dir[i] = JointPositions[VIMR::skeleton[i].End] - JointPositions[VIMR::skeleton[i].Start];
 	}*/
 
-	while (inDisplay)
-		;
+	PublishFrame(buffIdx, FrameGather.VoxelSizemm, ReceivedTime, CopyStartTime);
+	inProgress.store(false, std::memory_order_release);
+}
 
-	buffIdx = (buffIdx + 1) % BufferSize;
-	dispIdx = (dispIdx + 1) % BufferSize;
-	inProgress = false;
+void UVoxelSourceBaseComponent::PublishFrame(int32 buffIdx, uint8 VoxelSizemm, double ReceivedTime, double CopyStartTime) {
+	FVoxelStagingBuffer* Frame = FrameBuffers[buffIdx];
+	Frame->FrameSequence = ++LastFrameSequence;
+	Frame->VoxelSizemm = VoxelSizemm;
+	PublishedVoxelSizemm.store(VoxelSizemm, std::memory_order_relaxed);
+	Frame->Bounds = FVoxelBounds();
+	for (const FVoxelBounds& Block : Frame->BlockBounds) {
+		Frame->Bounds.Add(Block);
+	}
+	Frame->ReceivedTime = ReceivedTime > 0.0 && ReceivedTime <= CopyStartTime ? ReceivedTime : CopyStartTime;
+	Frame->CopyStartTime = CopyStartTime;
+	Frame->CopyEndTime = FPlatformTime::Seconds();
+
+	if (bJitterBuffering) {
+		FVoxelFramePacer::FSettings Settings;
+		Settings.TargetLatency = JitterTargetLatencyMs / 1000.0;
+		Settings.MaxLatency = JitterMaxLatencyMs / 1000.0;
+		Settings.bAdaptive = JitterAdaptive;
+		Settings.JitterMultiplier = JitterMultiplier;
+		const double ReleaseTime = Pacer.Schedule(Frame->ReceivedTime, Settings);
+		ObservedJitter.store((float)Pacer.GetJitter(), std::memory_order_relaxed);
+		PlayoutDelay.store((float)Pacer.GetDelay(), std::memory_order_relaxed);
+		LateCount.store((uint32)Pacer.GetNumLate(), std::memory_order_relaxed);
+
+		FScopeLock Lock(&JitterLock);
+		JitterFrames.Add({ FrameBuffers[buffIdx], ReleaseTime });
+		if (JitterFrames.Num() > FMath::Max(JitterMaxFrames, 1)) {
+			JitterFrames.RemoveAt(0, 1, false);
+			SkippedCount.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	// Publish the finished buffer and take back whichever one was parked. If the parked frame was never
+	// picked up by the game thread it has just been overwritten by this newer one.
+	else if (Handoff.Publish()) {
+		OverwrittenCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	PublishedCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void UVoxelSourceBaseComponent::DecodeFrame(int32 Slot) {
+	// Packed into a buffer of its own, which takes the write buffer's place when it's this frame's turn to publish
+	FVoxelGather& Gather = *DecodeSlots[Slot];
+	DecimateFrame(Gather);
+	Gather.Frame = FVoxelStagingPool::GetShared(FMath::Max(Gather.Count, InitialCapacity) * VOXEL_TEXTURE_BPP)->Acquire();
+	PackFrame(Gather, Gather.Frame);
+}
+
+void UVoxelSourceBaseComponent::PublishDecoded(int32 Slot) {
+	FVoxelGather& Gather = *DecodeSlots[Slot];
+	FScopeLock Lock(&PublishLock);
+	const int32 buffIdx = Handoff.GetWriteIndex();
+	FrameBuffers[buffIdx] = Gather.Frame;
+	Gather.Frame.SafeRelease();
+	PublishFrame(buffIdx, Gather.VoxelSizemm, Gather.ReceivedTime, Gather.CopyStartTime);
+}
+
+void UVoxelSourceBaseComponent::GrowCapacity(int32 buffIdx)
+{
+	uint32 NewCapacity = FMath::Min<uint32>(Capacity * 2, (uint32)MaxVoxels);
+	UE_LOG(VoxLog, Log, TEXT("Growing frame buffers from %u to %u voxels. ID: %s"), Capacity, NewCapacity, *ClientConfigID);
+
+	// Buffers from the old pool still in use are swapped out as they come back round
+	StagingPool = FVoxelStagingPool::GetShared(NewCapacity * VOXEL_TEXTURE_BPP);
+	FrameBuffers[buffIdx] = StagingPool->Acquire();
+	Capacity = NewCapacity;
+}
+
+void UVoxelSourceBaseComponent::FVoxelGather::Reserve(uint32 NumVoxels)
+{
+	if (GetCapacity() < NumVoxels) {
+		Positions.SetNumZeroed(NumVoxels * VoxelPacking::GatherStride);
+		Colours.SetNumZeroed(NumVoxels);
+		Flags.SetNumZeroed(NumVoxels);
+		AuxLabels.SetNumZeroed(NumVoxels);
+	}
+}
+
+void UVoxelSourceBaseComponent::FVoxelGather::SwapVoxels(FVoxelGather& Other)
+{
+	Swap(Positions, Other.Positions);
+	Swap(Colours, Other.Colours);
+	Swap(Flags, Other.Flags);
+	Swap(AuxLabels, Other.AuxLabels);
+	Swap(Count, Other.Count);
+	Swap(bLabels, Other.bLabels);
+	Swap(VoxelSizemm, Other.VoxelSizemm);
+}
+
+void UVoxelSourceBaseComponent::SetViewerPosition(const FVector& VoxelPosition)
+{
+	ViewerPosition[0].store(VoxelPosition.X, std::memory_order_relaxed);
+	ViewerPosition[1].store(VoxelPosition.Y, std::memory_order_relaxed);
+	ViewerPosition[2].store(VoxelPosition.Z, std::memory_order_relaxed);
+}
+
+void UVoxelSourceBaseComponent::SetDrawsMergedVoxels(bool bDraws)
+{
+	bMergedVoxelsReported = true;
+	bMergedVoxelsDrawnThisTick &= bDraws;
 }
 
 // Sets default values for this component's properties
@@ -118,21 +492,29 @@ UVoxelSourceBaseComponent::UVoxelSourceBaseComponent()
 	// Set this component to be initialized when the game starts, and to be ticked every frame.  You can turn these features
 	// off to improve performance if you don't need them.
 	PrimaryComponentTick.bCanEverTick = true;
+
+	inProgress = false;
+	ChangedVoxelCount = 0;
+	SlotHoleCount = 0;
+	PublishedVoxelSizemm = 0;
+	DecimatedCount = 0;
+	for (std::atomic<float>& Axis : ViewerPosition) {
+		Axis = 0.0f;
+	}
+	MergedVoxelsDrawn = false;
+	PublishedCount = 0;
+	DroppedCount = 0;
+	OverwrittenCount = 0;
+	ObservedJitter = 0.0f;
+	PlayoutDelay = 0.0f;
+	LateCount = 0;
+	SkippedCount = 0;
 }
 
 // Called when the game starts
 void UVoxelSourceBaseComponent::BeginPlay()
 {
 	Super::BeginPlay();
-	for (int i = 0; i < BufferSize; i++) {
-		CoarsePositionData[i] = new uint8[MaxVoxels * VOXEL_TEXTURE_BPP]();
-		PositionData[i] = new uint8[MaxVoxels * VOXEL_TEXTURE_BPP]();
-		ColourData[i] = new uint8[MaxVoxels * VOXEL_TEXTURE_BPP]();
-		VoxelCount[i] = 0;
-		VoxelSizemm[i] = 0;
-	}
-	buffIdx = 1;
-	dispIdx = 0;
 	while (SpecialVoxelPos.Num() < 65) {
 		SpecialVoxelPos.Add(FVector(0, 0, 0));
 		SpecialVoxelRotation.Add(FRotator(0, 0, 0));
@@ -166,41 +548,138 @@ void UVoxelSourceBaseComponent::BeginPlay()
 	if (VIMRconfig->GetString("SharedDataPath", &shared_data_path, ln)) {
 		UE_LOG(VoxLog, Log, TEXT("Shared Data at: %s"), ANSI_TO_TCHAR(shared_data_path));
 	}
+
+	char* max_voxels;
+	if (MaxVoxels <= 0) {
+		if (VIMRconfig->GetComponentConfigVal(TCHAR_TO_ANSI(*ClientConfigID), "MaxVoxels", &max_voxels, ln) || VIMRconfig->GetString("MaxVoxels", &max_voxels, ln)) {
+			MaxVoxels = FCString::Atoi(ANSI_TO_TCHAR(max_voxels));
+		}
+		if (MaxVoxels <= 0) {
+			MaxVoxels = DEFAULT_MAX_VOXELS;
+		}
+	}
+	// Keep whole hash blocks so packing never has to deal with a partial one at the end of the buffer
+	MaxVoxels = Align(MaxVoxels, FVoxelStagingBuffer::HashBlockTexels);
+	Capacity = FMath::Min<uint32>(MaxVoxels, InitialCapacity);
+	UE_LOG(VoxLog, Log, TEXT("Max voxels: %d. ID: %s"), MaxVoxels, *ClientConfigID);
+
+	// Shared with every other source, so buffers left over from earlier sources, recordings and levels are reused
+	StagingPool = FVoxelStagingPool::GetShared(Capacity * VOXEL_TEXTURE_BPP);
+	for (int i = 0; i < BufferSize; i++) {
+		FrameBuffers[i] = StagingPool->Acquire();
+	}
+	FrameGather.Reserve(Capacity);
+	LastFrameSequence = 0;
+	Handoff.Reset();
+	inProgress = false;
+	bJitterBuffering = JitterBuffer;
+	Pacer.Reset();
+
+	if (DecodeWorkers > 0) {
+		DecodePool = MakeUnique<FVoxelDecodePool>(DecodeWorkers, DecodeQueueDepth, (FVoxelDecodePool::EBackpressure)DecodeBackpressure,
+			[this](int32 Slot) { DecodeFrame(Slot); }, [this](int32 Slot) { PublishDecoded(Slot); });
+		for (int32 Slot = 0; Slot < DecodePool->GetNumSlots(); Slot++) {
+			DecodeSlots.Add(MakeUnique<FVoxelGather>());
+		}
+		UE_LOG(VoxLog, Log, TEXT("Decoding on %d workers. ID: %s"), DecodeWorkers, *ClientConfigID);
+	}
 }
 
 void UVoxelSourceBaseComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
 	Super::EndPlay(EndPlayReason);
+	// Workers publish the frames they're in the middle of before they stop, so this goes before the buffers
+	DecodePool.Reset();
+	DecodeSlots.Empty();
+	JitterFrames.Empty();
+	JitterCurrent.SafeRelease();
 	for (int i = 0; i < BufferSize; i++) {
-		delete CoarsePositionData[i];
-		delete PositionData[i];
-		delete ColourData[i];
-		VoxelCount[i] = 0;
-		VoxelSizemm[i] = 0;
+		FrameBuffers[i].SafeRelease();
 	}
 	SpecialVoxelPos.Empty();
 	SpecialVoxelRotation.Empty();
 	JointPositions.Empty();
 	Bone_dir.Empty();
 	Bone_pos.Empty();
+	StagingPool.Reset();
+	FrameGather = FVoxelGather();
+	DroppedGather = FVoxelGather();
+	DeltaImage.SafeRelease();
+	DeltaBlockSequences.Empty();
+	bDeltaActive = false;
 	inProgress = false;
 }
 
 
-void UVoxelSourceBaseComponent::GetFramePointers(int & VoxelCount, uint8 *& CoarsePositionData, uint8 *& PositionData, uint8 *& ColourData, uint8 & Voxelmm)
+FVoxelStagingBufferRef UVoxelSourceBaseComponent::GetFrame()
 {
-	inDisplay = true;
-	Voxelmm = this->VoxelSizemm[dispIdx];
-	VoxelCount = this->VoxelCount[dispIdx];
-	CoarsePositionData = this->CoarsePositionData[dispIdx];
-	PositionData = this->PositionData[dispIdx];
-	ColourData = this->ColourData[dispIdx];
-	inDisplay = false;
+	if (bJitterBuffering) {
+		// Show the newest frame due by the middle of the render frame about to be drawn, skipping any older ones due
+		// by then too, so frames land on the tick nearest their turn
+		const double DueBy = FPlatformTime::Seconds() + FApp::GetDeltaTime() * 0.5;
+		FScopeLock Lock(&JitterLock);
+		int32 Due = 0;
+		while (Due < JitterFrames.Num() && JitterFrames[Due].ReleaseTime <= DueBy) {
+			Due++;
+		}
+		if (Due > 0) {
+			JitterCurrent = JitterFrames[Due - 1].Frame;
+			JitterFrames.RemoveAt(0, Due, false);
+			SkippedCount.fetch_add(Due - 1, std::memory_order_relaxed);
+		}
+		return JitterCurrent;
+	}
+
+	// Swap in the newest completed frame if there is one, otherwise keep showing the current one. Renderers sharing
+	// this source get the same frame until a newer one is published, and the producer never writes to a buffer
+	// that's still referenced, see CopyVoxelData.
+	Handoff.Acquire();
+	const FVoxelStagingBufferRef& Frame = FrameBuffers[Handoff.GetReadIndex()];
+	return Frame.IsValid() && Frame->FrameSequence != 0 ? Frame : nullptr;
 }
 
 // Called every frame
 void UVoxelSourceBaseComponent::TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction)
 {
 	Super::TickComponent(DeltaTime, TickType, ThisTickFunction);
+
+	FramesPublished = (int32)PublishedCount.load(std::memory_order_relaxed);
+	FramesDropped = (int32)DroppedCount.load(std::memory_order_relaxed);
+	FramesOverwritten = (int32)OverwrittenCount.load(std::memory_order_relaxed);
+	VoxelsChanged = (int32)ChangedVoxelCount.load(std::memory_order_relaxed);
+	VoxelSlotHoles = (int32)SlotHoleCount.load(std::memory_order_relaxed);
+	VoxelsDecimated = (int32)DecimatedCount.load(std::memory_order_relaxed);
+	if (const uint32 Sizemm = PublishedVoxelSizemm.load(std::memory_order_relaxed)) {
+		VoxelSize_mm = (float)Sizemm;
+	}
+
+	// Renderers that can't draw merged voxels would draw them as single ones, leaving holes, so they're left alone
+	// until the next tick every renderer can. Sources nothing renders keep the last answer.
+	if (bMergedVoxelsReported) {
+		MergedVoxelsDrawn.store(bMergedVoxelsDrawnThisTick, std::memory_order_relaxed);
+		if (LevelOfDetail && !bMergedVoxelsDrawnThisTick && !bWarnedLevelOfDetail) {
+			UE_LOG(VoxLog, Warning, TEXT("LevelOfDetail is ignored, a renderer reading this source can't draw merged voxels. ID: %s"), *ClientConfigID);
+			bWarnedLevelOfDetail = true;
+		}
+	}
+	bMergedVoxelsReported = false;
+	bMergedVoxelsDrawnThisTick = true;
+	if (bJitterBuffering) {
+		{
+			FScopeLock Lock(&JitterLock);
+			JitterBufferDepth = JitterFrames.Num();
+		}
+		JitterMs = ObservedJitter.load(std::memory_order_relaxed) * 1000.0f;
+		JitterDelayMs = PlayoutDelay.load(std::memory_order_relaxed) * 1000.0f;
+		FramesLate = (int32)LateCount.load(std::memory_order_relaxed);
+		FramesSkipped = (int32)SkippedCount.load(std::memory_order_relaxed);
+	}
+	if (DecodePool.IsValid()) {
+		const FVoxelDecodePool::FStats DecodeStats = DecodePool->GetStats();
+		DecodeQueueLength = (int32)DecodeStats.Queued;
+		FramesDecodeDropped = (int32)(DecodeStats.DroppedOldest + DecodeStats.DroppedNewest);
+		DecodeWaits = (int32)DecodeStats.Blocked;
+		DecodeSlotWaits = (int32)DecodeStats.SlotWaits;
+	}
 }
 
@@ -0,0 +1,257 @@
+#include "VoxelStagingBuffer.h"
+#include "HAL/UnrealMemory.h"
+#include "HAL/PlatformTime.h"
+#include "Misc/ScopeLock.h"
+#if PLATFORM_WINDOWS
+#include "Windows/WindowsHWrapper.h"
+#elif PLATFORM_LINUX
+#include <stdlib.h>
+#include <sys/mman.h>
+#endif
+
+// Huge page backed memory straight from the OS, null if the platform has none or won't give it. Sets Allocated to what
+// has to be given back.
+static uint8* AllocateHugePages(size_t Bytes, size_t& Allocated)
+{
+#if PLATFORM_WINDOWS
+	// Large pages need the lock pages in memory privilege and whole pages, so only worth it when rounding up wastes
+	// little. Without them, plain pages still keep the buffer off the heap.
+	const size_t LargePage = GetLargePageMinimum();
+	if (LargePage > 0 && Align(Bytes, LargePage) - Bytes <= Bytes / 8)
+	{
+		if (void* Ptr = VirtualAlloc(nullptr, Align(Bytes, LargePage), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+		{
+			Allocated = Align(Bytes, LargePage);
+			return (uint8*)Ptr;
+		}
+	}
+	Allocated = Bytes;
+	return (uint8*)VirtualAlloc(nullptr, Bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif PLATFORM_LINUX
+	// Transparent huge pages cover the whole 2MB pages of the buffer, the tail gets normal ones
+	void* Ptr = nullptr;
+	if (posix_memalign(&Ptr, FVoxelStagingBuffer::HugePageSize, Bytes) != 0)
+	{
+		return nullptr;
+	}
+	madvise(Ptr, Bytes, MADV_HUGEPAGE);
+	Allocated = Bytes;
+	return (uint8*)Ptr;
+#else
+	return nullptr;
+#endif
+}
+
+static void FreeHugePages(uint8* Ptr, size_t Allocated)
+{
+#if PLATFORM_WINDOWS
+	VirtualFree(Ptr, 0, MEM_RELEASE);
+#elif PLATFORM_LINUX
+	free(Ptr);
+#endif
+}
+
+FVoxelStagingBuffer::FVoxelStagingBuffer(size_t PlaneSize)
+	: PlaneSize(Align(PlaneSize, Alignment))
+{
+	const size_t Bytes = 3 * this->PlaneSize;
+	Data = Bytes >= HugePageSize ? AllocateHugePages(Bytes, OSAllocSize) : nullptr;
+	if (Data == nullptr)
+	{
+		OSAllocSize = 0;
+		Data = (uint8*)FMemory::Malloc(Bytes, Alignment);
+	}
+	FMemory::Memzero(Data, Bytes);
+}
+
+FVoxelStagingBuffer::~FVoxelStagingBuffer()
+{
+	if (OSAllocSize > 0)
+	{
+		FreeHugePages(Data, OSAllocSize);
+	}
+	else
+	{
+		FMemory::Free(Data);
+	}
+}
+
+uint32 FVoxelStagingBuffer::AddRef() const
+{
+	return (uint32)NumRefs.Increment();
+}
+
+uint32 FVoxelStagingBuffer::Release() const
+{
+	int32 Refs = NumRefs.Decrement();
+	check(Refs >= 0);
+	if (Refs == 0)
+	{
+		// Move the pool reference out first, recycling may hand the buffer to another thread straight away
+		TSharedPtr<FVoxelStagingPool, ESPMode::ThreadSafe> Owner = MoveTemp(const_cast<FVoxelStagingBuffer*>(this)->Pool);
+		if (Owner.IsValid())
+		{
+			Owner->Recycle(const_cast<FVoxelStagingBuffer*>(this));
+		}
+		else
+		{
+			delete this;
+		}
+	}
+	return (uint32)Refs;
+}
+
+uint32 FVoxelStagingBuffer::GetRefCount() const
+{
+	return (uint32)NumRefs.GetValue();
+}
+
+FVoxelBounds FVoxelStagingBuffer::GetBounds(uint32 First, uint32 NumVoxels) const
+{
+	FVoxelBounds Result;
+	const int32 FirstBlock = First / HashBlockTexels;
+	const int32 EndBlock = FMath::DivideAndRoundUp(First + NumVoxels, HashBlockTexels);
+	if (NumVoxels == 0 || EndBlock > BlockBounds.Num())
+	{
+		return Result;
+	}
+	for (int32 Block = FirstBlock; Block < EndBlock; Block++)
+	{
+		Result.Add(BlockBounds[Block]);
+	}
+	return Result;
+}
+
+void FVoxelStagingBuffer::ResetFrame()
+{
+	FrameSequence = 0;
+	NumVoxels = 0;
+	VoxelSizemm = 0;
+	Bounds = FVoxelBounds();
+	ReceivedTime = CopyStartTime = CopyEndTime = 0.0;
+	// Keep the allocations, the next frame will need about as much
+	BlockHashes.Reset();
+	BlockVoxelCounts.Reset();
+	BlockBounds.Reset();
+	Flags.Reset();
+	AuxLabels.Reset();
+}
+
+// Shared pools by plane size, kept until module shutdown so buffers outlive the sources using them
+static FCriticalSection SharedPoolsLock;
+static TMap<size_t, TSharedRef<FVoxelStagingPool, ESPMode::ThreadSafe>> SharedPools;
+
+size_t FVoxelStagingPool::GetSizeClass(size_t PlaneSize)
+{
+	// Frames of 196,608 voxels have 768KB planes, which would otherwise take a 1MB class
+	const size_t FineClassesFrom = 256 * 1024;
+	if (PlaneSize > FineClassesFrom)
+	{
+		const size_t Step = FMath::RoundUpToPowerOfTwo64(PlaneSize) / 8;
+		return Align(PlaneSize, Step);
+	}
+	return FMath::Max<size_t>(FMath::RoundUpToPowerOfTwo64(PlaneSize), FVoxelStagingBuffer::Alignment);
+}
+
+TSharedRef<FVoxelStagingPool, ESPMode::ThreadSafe> FVoxelStagingPool::GetShared(size_t PlaneSize)
+{
+	const size_t SizeClass = GetSizeClass(PlaneSize);
+	FScopeLock Lock(&SharedPoolsLock);
+	if (TSharedRef<FVoxelStagingPool, ESPMode::ThreadSafe>* Pool = SharedPools.Find(SizeClass))
+	{
+		return *Pool;
+	}
+	TSharedRef<FVoxelStagingPool, ESPMode::ThreadSafe> Pool = Create(SizeClass);
+	Pool->MaxIdle = MaxSharedIdle;
+	return SharedPools.Add(SizeClass, Pool);
+}
+
+void FVoxelStagingPool::TrimShared(double IdleSeconds)
+{
+	const double Now = FPlatformTime::Seconds();
+	FScopeLock Lock(&SharedPoolsLock);
+	for (auto It = SharedPools.CreateIterator(); It; ++It)
+	{
+		FVoxelStagingPool& Pool = It.Value().Get();
+		if (Now - Pool.LastAcquireTime.load(std::memory_order_relaxed) < IdleSeconds)
+		{
+			continue;
+		}
+		// Buffers in flight and sources hold the pool too, so a pool only the map holds has nothing out
+		if (It.Value().IsUnique())
+		{
+			It.RemoveCurrent();
+		}
+		else
+		{
+			Pool.TrimIdle();
+		}
+	}
+}
+
+void FVoxelStagingPool::ReleaseShared()
+{
+	FScopeLock Lock(&SharedPoolsLock);
+	SharedPools.Empty();
+}
+
+TSharedRef<FVoxelStagingPool, ESPMode::ThreadSafe> FVoxelStagingPool::Create(size_t PlaneSize)
+{
+	return MakeShareable(new FVoxelStagingPool(PlaneSize));
+}
+
+FVoxelStagingPool::~FVoxelStagingPool()
+{
+	// Buffers still in flight hold a reference to the pool, so everything left here is idle
+	TArray<FVoxelStagingBuffer*> Idle;
+	FreeList.PopAll(Idle);
+	for (FVoxelStagingBuffer* Buffer : Idle)
+	{
+		delete Buffer;
+	}
+}
+
+FVoxelStagingBufferRef FVoxelStagingPool::Acquire()
+{
+	LastAcquireTime.store(FPlatformTime::Seconds(), std::memory_order_relaxed);
+	FVoxelStagingBuffer* Buffer = FreeList.Pop();
+	if (Buffer == nullptr)
+	{
+		Buffer = new FVoxelStagingBuffer(PlaneSize);
+		NumAllocated.Increment();
+	}
+	else
+	{
+		NumIdle.Decrement();
+		Buffer->ResetFrame();
+	}
+	Buffer->Pool = AsShared();
+	return FVoxelStagingBufferRef(Buffer);
+}
+
+void FVoxelStagingPool::Recycle(FVoxelStagingBuffer* Buffer)
+{
+	// Take the idle place before pushing and give it back if there wasn't one, so buffers released on several threads
+	// at once can't all see room for one more. Acquire and TrimIdle pop before they decrement, so the count is never
+	// lower than what's in the list.
+	if (NumIdle.Increment() > MaxIdle && MaxIdle > 0)
+	{
+		NumIdle.Decrement();
+		delete Buffer;
+		NumAllocated.Decrement();
+		return;
+	}
+	FreeList.Push(Buffer);
+}
+
+void FVoxelStagingPool::TrimIdle()
+{
+	TArray<FVoxelStagingBuffer*> Idle;
+	FreeList.PopAll(Idle);
+	for (FVoxelStagingBuffer* Buffer : Idle)
+	{
+		NumIdle.Decrement();
+		NumAllocated.Decrement();
+		delete Buffer;
+	}
+}
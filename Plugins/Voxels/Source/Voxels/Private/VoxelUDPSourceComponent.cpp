@@ -25,7 +25,11 @@ void UVoxelUDPSourceComponent::BeginPlay()
 	Super::BeginPlay();
 	SetComponentTickEnabled(false);
 
-	consumer = new VIMR::Async::RingbufferConsumer<VIMR::Octree, 8>(std::bind(&UVoxelSourceBaseComponent::CopyVoxelData, this, std::placeholders::_1));
+	// With DecodeWorkers set, CopyVoxelData only copies the voxels out of the ring slot and leaves packing to the
+	// workers, so slow frames don't hold up the ring
+	consumer = new VIMR::Async::RingbufferConsumer<FVoxelReceivedOctree, 8>([this](FVoxelReceivedOctree* Octree) {
+		CopyReceivedVoxelData(Octree, Octree->ReceivedTime);
+	});
 
 	sendPoses = false;
 	char* cliAddr, *cliPort, *posePort, *poseAddr;
@@ -38,7 +42,12 @@ void UVoxelUDPSourceComponent::BeginPlay()
 		UE_LOG(VoxLog, Log, TEXT("Failed to get config key %s:Port"), *ClientConfigID);
 	}
 	else {
-		deserializer = new VIMR::Deserializer(std::bind(&VIMR::Async::RingbufferConsumer<VIMR::Octree, 8>::Consume, consumer));
+		// Same as binding Consume directly, but stamps each slot with when its frame arrives for the frame timings
+		deserializer = new VIMR::Deserializer([this](auto&&...) -> decltype(auto) {
+			FVoxelReceivedOctree* Slot = consumer->Consume();
+			Slot->ReceivedTime = FPlatformTime::Seconds();
+			return Slot;
+		});
 		UE_LOG(VoxLog, Log, TEXT("Adding receiver %s  %s:%s"), *ClientConfigID, ANSI_TO_TCHAR(cliAddr), ANSI_TO_TCHAR(cliPort));
 		if (!deserializer->AddReceiver(TCHAR_TO_ANSI(*ClientConfigID), cliAddr, cliPort)) {
 			UE_LOG(VoxLog, Error, TEXT("Adding receiver %s  %s:%s"), *ClientConfigID, ANSI_TO_TCHAR(cliAddr), ANSI_TO_TCHAR(cliPort));
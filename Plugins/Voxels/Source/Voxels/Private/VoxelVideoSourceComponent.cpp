@@ -5,6 +5,7 @@
 #include "VoxelVideoSourceComponent.h"
 #include "Engine.h"
 #include <chrono>
+#include <cstring>
 #include <string>
 #include "VoxelRenderSubComponent.h"
 #include <exception>
@@ -12,12 +13,65 @@
 
 #include "Paths.h"
 #include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Async/Async.h"
+#include "VoxelPacking.h"
+#include "VoxelCacheCodec.h"
 
 using namespace std::placeholders;
 using std::string;
 
 DEFINE_LOG_CATEGORY(VoxVidLog);
 
+// Any thread. Maps the cache at CachePath and opens it, if it's complete and, unless it's a standalone container, made
+// from the recording of VideoSize bytes last modified at VideoTime.
+static bool MapFrameCache(const FString& CachePath, bool bStandalone, uint64 VideoSize, int64 VideoTime,
+	TUniquePtr<IMappedFileHandle>& CacheMapping, TUniquePtr<IMappedFileRegion>& CacheRegion, FVoxelFrameCacheReader& FrameCache)
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	if (!PlatformFile.FileExists(*CachePath))
+	{
+		return false;
+	}
+	CacheMapping.Reset(PlatformFile.OpenMapped(*CachePath));
+	if (CacheMapping.IsValid())
+	{
+		CacheRegion.Reset(CacheMapping->MapRegion(0, CacheMapping->GetFileSize()));
+	}
+	// A standalone container is the recording, a cache has to have been made from this version of it
+	if (!CacheRegion.IsValid() || !FrameCache.Open(CacheRegion->GetMappedPtr(), (size_t)CacheRegion->GetMappedSize(), &GetVoxelCacheCodec()) ||
+		(!bStandalone && !FrameCache.IsFrom(VideoSize, VideoTime)))
+	{
+		UE_LOG(VoxVidLog, Log, TEXT("Frame cache %s is out of date or incomplete, it will be written again"), *CachePath);
+		FrameCache.Close();
+		CacheRegion.Reset();
+		CacheMapping.Reset();
+		return false;
+	}
+	return true;
+}
+
+void FVoxelVideoSink::Attach(UVoxelSourceBaseComponent* InTarget)
+{
+	FScopeLock ScopeLock(&Lock);
+	Target = InTarget;
+}
+
+void FVoxelVideoSink::Detach()
+{
+	FScopeLock ScopeLock(&Lock);
+	Target = nullptr;
+}
+
+void FVoxelVideoSink::CopyVoxelData(VIMR::VoxelGrid* Voxels)
+{
+	FScopeLock ScopeLock(&Lock);
+	if (Target != nullptr)
+	{
+		Target->CopyVoxelData(Voxels);
+	}
+}
+
 // Sets default values for this component's properties
 UVoxelVideoSourceComponent::UVoxelVideoSourceComponent()
 {
@@ -53,14 +107,54 @@ void UVoxelVideoSourceComponent::BeginPlay()
 void UVoxelVideoSourceComponent::TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction)
 {
 	Super::TickComponent(DeltaTime, TickType, ThisTickFunction);
-	if (VoxelVideoReader != nullptr) 
+	if (bSwapPending && IsPreloadReady())
+	{
+		// Everything that waits on the disk was done by the preload, what's left is closing the old recording and
+		// making the audio sources
+		bSwapPending = false;
+		TSharedPtr<FVoxelVideoLoad, ESPMode::ThreadSafe> Load = PreloadTask.Get();
+		PreloadTask = TFuture<TSharedPtr<FVoxelVideoLoad, ESPMode::ThreadSafe>>();
+		Preload.Reset();
+		SwapInVoxelVideo(*Load, bSwapLoop);
+		if (bSwapPlay)
+		{
+			_play();
+		}
+	}
+	if (VoxelVideoReader != nullptr && !CachePlayer.IsValid() && VoxelVideoReader->State() == VIMR::VoxVidPlayer::PlayState::Finished)
 	{
-		if (VoxelVideoReader->State() == VIMR::VoxVidPlayer::PlayState::Finished) 
+		// Played through while writing the cache, switch to it so the recording can be sought in and looped
+		if (FinishCacheRecording() && OpenFrameCache())
 		{
-			OnPlaybackFinished.Broadcast();
-			Finished = true;
+			UE_LOG(VoxVidLog, Log, TEXT("Cached %d frames of %s"), GetNumFrames(), *FileName);
+			CachePlayer->SetLoop(bLoopVideo);
+			if (bLoopVideo)
+			{
+				CachePlayer->Play();
+				SeekAudio(true);
+			}
+			else
+			{
+				bCachedAtEnd = true;
+			}
 		}
 	}
+	if (CachePlayer.IsValid())
+	{
+		ReadAheadDepth = CachePlayer->GetReadAheadDepth();
+		ReadAheadUnderruns = (int32)CachePlayer->GetNumUnderruns();
+		CachedFramesSkipped = (int32)CachePlayer->GetNumSkipped();
+	}
+	if (OnRecordingsChanged.IsBound() && FVoxelRecordingCatalog::Get().GetVersion() != RecordingsVersion)
+	{
+		RecordingsVersion = FVoxelRecordingCatalog::Get().GetVersion();
+		OnRecordingsChanged.Broadcast();
+	}
+	if (IsPlaybackFinished())
+	{
+		OnPlaybackFinished.Broadcast();
+		Finished = true;
+	}
 
 	if (!cmdStack.empty()){
 		cmdStack.top()();
@@ -70,13 +164,29 @@ void UVoxelVideoSourceComponent::TickComponent(float DeltaTime, ELevelTick TickT
 
 void UVoxelVideoSourceComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
+	// Stop the player threads before the base class releases the frame buffers they write into
+	DiscardPreload();
+	CloseVoxelVideoReader();
+	CloseFrameCache();
+	AbortCacheRecording();
 	Super::EndPlay(EndPlayReason);
-	VoxelVideoReader->Close();
 }
 
 void UVoxelVideoSourceComponent::_pause()
 {
-	VoxelVideoReader->Pause();
+	if (CachePlayer.IsValid())
+	{
+		CachePlayer->Pause();
+	}
+	else if (VoxelVideoReader != nullptr)
+	{
+		VoxelVideoReader->Pause();
+		FScopeLock Lock(&CacheWriteLock);
+		if (CachePauseStart == 0.0)
+		{
+			CachePauseStart = FPlatformTime::Seconds();
+		}
+	}
 	for (auto i : AudioStreams) {
 		i.second->Pause();
 	}
@@ -84,15 +194,36 @@ void UVoxelVideoSourceComponent::_pause()
 
 void UVoxelVideoSourceComponent::_play()
 {
-	VoxelVideoReader->Play();
-	for (auto i : AudioStreams) {
-		i.second->Start();
-	}
+	_playOnlyVideo();
+	_playOnlySound();
 }
 
 void UVoxelVideoSourceComponent::_playOnlyVideo()
 {
+	if (CachePlayer.IsValid())
+	{
+		// Playing again after the end starts over, so the sound has to as well
+		if (CachePlayer->IsFinished() || bCachedAtEnd)
+		{
+			CachePlayer->SeekToFrame(0);
+			SeekAudio(false);
+		}
+		bCachedAtEnd = false;
+		CachePlayer->Play();
+		return;
+	}
+	if (VoxelVideoReader == nullptr)
+	{
+		return;
+	}
 	VoxelVideoReader->Play();
+	// Time spent paused doesn't count towards the cached frames' times
+	FScopeLock Lock(&CacheWriteLock);
+	if (CachePauseStart > 0.0 && CacheRecordStart > 0.0)
+	{
+		CacheRecordStart += FPlatformTime::Seconds() - CachePauseStart;
+	}
+	CachePauseStart = 0.0;
 }
 
 void UVoxelVideoSourceComponent::_playOnlySound()
@@ -110,80 +241,465 @@ void UVoxelVideoSourceComponent::_stop()
 
 void UVoxelVideoSourceComponent::_restart()
 {
-	VoxelVideoReader->Restart();
+	if (CachePlayer.IsValid())
+	{
+		bCachedAtEnd = false;
+		CachePlayer->SeekToFrame(0);
+	}
+	else if (VoxelVideoReader != nullptr)
+	{
+		VoxelVideoReader->Restart();
+		// Starts the cache over too, it only counts if it goes from the first frame to the last
+		if (CacheFrames)
+		{
+			BeginCacheRecording();
+		}
+	}
 	for (auto i : AudioStreams) {
 		i.second->Stop();
 		i.second->Start();
 	}
 }
 
-void UVoxelVideoSourceComponent::LoadVoxelVideo(FString file, bool loop)
+void UVoxelVideoSourceComponent::_seekToFrame(int32 Frame)
+{
+	if (!CachePlayer.IsValid())
+	{
+		UE_LOG(VoxVidLog, Warning, TEXT("Can't seek in %s until it's been played through once and cached"), *FileName);
+		return;
+	}
+	bCachedAtEnd = false;
+	CachePlayer->SeekToFrame((uint32)FMath::Max(Frame, 0));
+	SeekAudio(CachePlayer->IsPlaying());
+}
+
+void UVoxelVideoSourceComponent::_seekToTime(float Seconds)
 {
-	if (VoxelVideoReader != nullptr)
+	if (!CachePlayer.IsValid())
 	{
-		VoxelVideoReader->Close();
-		
-		for (auto i : AudioStreams) {
-			i.second->Stop();
-			i.second->clear();
+		UE_LOG(VoxVidLog, Warning, TEXT("Can't seek in %s until it's been played through once and cached"), *FileName);
+		return;
+	}
+	bCachedAtEnd = false;
+	CachePlayer->SeekToTime(Seconds);
+	SeekAudio(CachePlayer->IsPlaying());
+}
+
+void UVoxelVideoSourceComponent::SeekAudio(bool bPlay)
+{
+	const float Time = CachePlayer.IsValid() ? (float)CachePlayer->GetTime() : 0.0f;
+	for (auto i : AudioStreams) {
+		i.second->Seek(Time);
+		if (bPlay) {
+			i.second->Start();
 		}
+	}
+}
 
-		AudioStreams.clear();
+bool UVoxelVideoSourceComponent::IsPlaybackFinished()
+{
+	if (CachePlayer.IsValid())
+	{
+		return bCachedAtEnd || CachePlayer->IsFinished();
 	}
+	return VoxelVideoReader != nullptr && VoxelVideoReader->State() == VIMR::VoxVidPlayer::PlayState::Finished;
+}
 
-	FileName = file;
+bool UVoxelVideoSourceComponent::OpenFrameCache()
+{
+	CloseFrameCache();
+	if (!MapFrameCache(CachePath, bStandalone, VideoSize, VideoTime, CacheMapping, CacheRegion, FrameCache))
+	{
+		return false;
+	}
+	StartCachePlayer();
+	return true;
+}
 
-	FString file_path = voxelvideosPath + FileName;
+void UVoxelVideoSourceComponent::StartCachePlayer()
+{
+	ReadAheadSlots.Reset();
+	const int32 ReadAhead = FMath::Max(ReadAheadFrames, 0);
+	for (int32 Slot = 0; ReadAhead > 0 && Slot <= ReadAhead; Slot++)
+	{
+		ReadAheadSlots.Add(MakeUnique<FVoxelGather>());
+	}
+	ReadAheadScratch.Reset();
+	ReadAheadScratch.SetNum(ReadAheadSlots.Num());
+	CachePlayer = MakeUnique<FVoxelCachePlayer>(FrameCache,
+		[this](uint32 Frame, int32 Slot) { CopyCachedFrame(Frame, Slot); }, ReadAhead,
+		[this](uint32 Frame, int32 Slot) { ReadCachedFrame(Frame, Slot); }, FMath::Max(ReadAheadThreads, 1));
+}
 
-	VoxelVideoReader = new VIMR::VoxVidPlayer(std::bind(&UVoxelSourceBaseComponent::CopyVoxelData, this, _1));
-	VoxelVideoReader->Load(TCHAR_TO_ANSI(*file_path));
-	VoxelVideoReader->Loop = loop;
-	UE_LOG(VoxVidLog, Log, TEXT("Loaded file %s"), *file_path);
+void UVoxelVideoSourceComponent::CloseFrameCache()
+{
+	// The player thread reads from the mapping, so it goes first
+	CachePlayer.Reset();
+	ReadAheadSlots.Reset();
+	ReadAheadScratch.Reset();
+	FrameCache.Close();
+	CacheRegion.Reset();
+	CacheMapping.Reset();
+	bCachedAtEnd = false;
+}
 
-	VIMR::AudioStream tmp_astrm;
-	while (VoxelVideoReader->GetNextAudioStream(tmp_astrm))
+void UVoxelVideoSourceComponent::CopyCachedFrame(uint32 Frame, int32 Slot)
+{
+	if (Slot >= 0)
 	{
-		URuntimeAudioSource* newSource = NewObject<URuntimeAudioSource>(this);
-		FString wav_path = voxelvideosPath + FString(tmp_astrm.file_name);
-		FString wav_label = FString(tmp_astrm.voxel_label);
+		FVoxelGather& ReadAhead = *ReadAheadSlots[Slot];
+		CopyFrame([&ReadAhead](FVoxelGather& Gather) { Gather.SwapVoxels(ReadAhead); });
+		return;
+	}
+	VoxelFrameCache::FFrame Cached;
+	if (!FrameCache.GetFrame(Frame, Cached, CacheScratch))
+	{
+		UE_LOG(VoxVidLog, Warning, TEXT("Frame %u of %s doesn't decompress"), Frame, *CachePath);
+		return;
+	}
+	CopyFrame([this, &Cached](FVoxelGather& Gather) { GatherCachedFrame(Cached, Gather); });
+}
 
-		newSource->RegisterComponent();
-		newSource->AttachToComponent(this, FAttachmentTransformRules(EAttachmentRule::KeepRelative, false));
-		newSource->LoadWav(wav_path);
-		AudioStreams[tmp_astrm.voxel_label] = newSource;
+void UVoxelVideoSourceComponent::ReadCachedFrame(uint32 Frame, int32 Slot)
+{
+	if (Frame + 1 < FrameCache.GetNumFrames())
+	{
+		CacheRegion->PreloadHint((int64)FrameCache.GetFrameOffset(Frame + 1), (int64)FrameCache.GetFrameBytes(Frame + 1));
+	}
+	VoxelFrameCache::FFrame Cached;
+	if (!FrameCache.GetFrame(Frame, Cached, ReadAheadScratch[Slot]))
+	{
+		// Shown empty rather than stopping playback
+		UE_LOG(VoxVidLog, Warning, TEXT("Frame %u of %s doesn't decompress"), Frame, *CachePath);
+		ReadAheadSlots[Slot]->Count = 0;
+		return;
+	}
+	GatherCachedFrame(Cached, *ReadAheadSlots[Slot]);
+}
 
-		UE_LOG(VoxLog, Log, TEXT("Loaded wav: %s"), *wav_path);
-		UE_LOG(VoxLog, Log, TEXT("Loaded wav: %s"), *wav_label);
+void UVoxelVideoSourceComponent::GatherCachedFrame(const VoxelFrameCache::FFrame& Cached, FVoxelGather& Gather)
+{
+	// Same limit as gathering from the recording, frames are decimated and sorted again from here on
+	const uint32 MostVoxels = GetGatherLimit();
+	const uint32 Count = FMath::Min(Cached.NumVoxels, MostVoxels);
+	Gather.Reserve(Count);
+	int16* Positions = Gather.Positions.GetData();
+	for (uint32 i = 0; i < Count; i++)
+	{
+		int16* Gathered = Positions + i * VoxelPacking::GatherStride;
+		FMemory::Memcpy(Gathered, Cached.Positions + i * 3, 3 * sizeof(int16));
+		Gathered[3] = 0;
 	}
+	FMemory::Memcpy(Gather.Colours.GetData(), Cached.Colours, Count * sizeof(uint32));
+	// Labels are only there if they were kept when the cache was written
+	Gather.bLabels = KeepVoxelLabels && Cached.Flags != nullptr;
+	if (Gather.bLabels)
+	{
+		FMemory::Memcpy(Gather.Flags.GetData(), Cached.Flags, Count * sizeof(uint8));
+		FMemory::Memcpy(Gather.AuxLabels.GetData(), Cached.AuxLabels, Count * sizeof(uint16));
+	}
+	Gather.Count = Count;
+	Gather.VoxelSizemm = Cached.VoxelSizemm;
 }
 
-TArray<FString> UVoxelVideoSourceComponent::GetAllRecordings()
+void UVoxelVideoSourceComponent::OnFrameGathered(const FVoxelGather& Gather)
 {
-	TArray<FString> files;
-	files.Empty();
+	FScopeLock Lock(&CacheWriteLock);
+	if (!CacheWriteFile.IsValid())
+	{
+		return;
+	}
+	const double Now = FPlatformTime::Seconds();
+	if (CacheRecordStart == 0.0)
+	{
+		CacheRecordStart = Now;
+	}
+	const bool bLabels = Gather.bLabels;
+	if (!CacheWriter.AddFrame(Now - CacheRecordStart, Gather.VoxelSizemm, Gather.Count, Gather.Positions.GetData(), Gather.Colours.GetData(),
+		bLabels ? Gather.Flags.GetData() : nullptr, bLabels ? Gather.AuxLabels.GetData() : nullptr))
+	{
+		UE_LOG(VoxVidLog, Warning, TEXT("Failed writing frame cache %s, giving up on it"), *CachePath);
+		CacheWriteFile.Reset();
+		bCacheRecording.store(false, std::memory_order_relaxed);
+		FPlatformFileManager::Get().GetPlatformFile().DeleteFile(*(CachePath + TEXT(".tmp")));
+	}
+}
+
+void UVoxelVideoSourceComponent::BeginCacheRecording()
+{
+	AbortCacheRecording();
+	FScopeLock Lock(&CacheWriteLock);
+	CacheWriteFile.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenWrite(*(CachePath + TEXT(".tmp"))));
+	if (!CacheWriteFile.IsValid())
+	{
+		UE_LOG(VoxVidLog, Warning, TEXT("Can't write frame cache %s, %s won't be seekable"), *CachePath, *FileName);
+		return;
+	}
+	IFileHandle* File = CacheWriteFile.Get();
+	CacheWriter.Begin(VideoSize, VideoTime, [File](const void* Data, size_t Bytes) { return File->Write((const uint8*)Data, (int64)Bytes); },
+		CompressCache ? &GetVoxelCacheCodec() : nullptr, VideoAudioStreams);
+	bCacheRecording.store(true, std::memory_order_relaxed);
+	CacheRecordStart = 0.0;
+	CachePauseStart = 0.0;
+}
+
+bool UVoxelVideoSourceComponent::FinishCacheRecording()
+{
+	FScopeLock Lock(&CacheWriteLock);
+	if (!CacheWriteFile.IsValid())
+	{
+		return false;
+	}
+	const bool bWritten = CacheWriter.End() && CacheWriteFile->Flush();
+	CacheWriteFile.Reset();
+	bCacheRecording.store(false, std::memory_order_relaxed);
+
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	const FString TempPath = CachePath + TEXT(".tmp");
+	PlatformFile.DeleteFile(*CachePath);
+	if (!bWritten || !PlatformFile.MoveFile(*CachePath, *TempPath))
+	{
+		UE_LOG(VoxVidLog, Warning, TEXT("Failed writing frame cache %s"), *CachePath);
+		PlatformFile.DeleteFile(*TempPath);
+		return false;
+	}
+	// So the recording's length and audio streams are listed without waiting for the next poll
+	FVoxelRecordingCatalog::Get().Rescan();
+	return true;
+}
+
+void UVoxelVideoSourceComponent::AbortCacheRecording()
+{
+	FScopeLock Lock(&CacheWriteLock);
+	bCacheRecording.store(false, std::memory_order_relaxed);
+	if (CacheWriteFile.IsValid())
+	{
+		CacheWriteFile.Reset();
+		FPlatformFileManager::Get().GetPlatformFile().DeleteFile(*(CachePath + TEXT(".tmp")));
+	}
+}
+
+void UVoxelVideoSourceComponent::LoadVoxelVideo(FString file, bool loop)
+{
+	FVoxelVideoLoad Load;
+	ReadVoxelVideo(voxelvideosPath, file, CacheFrames, Load);
+	SwapInVoxelVideo(Load, loop);
+}
 
-	FString recordingPath = FPaths::ProjectContentDir() + "VoxelVideos/";
-	FString voxelvideo_ext = "vx3";
+void UVoxelVideoSourceComponent::PreloadVoxelVideo(FString file)
+{
+	DiscardPreload();
+	// Nothing of the component is touched off the game thread, so the read can outlive it
+	TSharedPtr<FVoxelVideoLoad, ESPMode::ThreadSafe> Load = MakeShared<FVoxelVideoLoad, ESPMode::ThreadSafe>();
+	Preload = Load;
+	PreloadTask = Async(EAsyncExecution::ThreadPool, [Load, Directory = voxelvideosPath, file, bCache = CacheFrames]()
+	{
+		ReadVoxelVideo(Directory, file, bCache, *Load);
+		return Load;
+	});
+}
 
-	if (FPaths::DirectoryExists(*recordingPath))
+void UVoxelVideoSourceComponent::SwapToPreloaded(bool loop, bool play)
+{
+	if (!PreloadTask.IsValid())
 	{
-		IFileManager::Get().FindFiles(files, *recordingPath, *voxelvideo_ext);
+		UE_LOG(VoxVidLog, Warning, TEXT("Nothing has been preloaded to swap to"));
+		return;
+	}
+	bSwapPending = true;
+	bSwapLoop = loop;
+	bSwapPlay = play;
+}
 
-		for (int i = 0; i < files.Num(); i++)
+void UVoxelVideoSourceComponent::DiscardPreload()
+{
+	bSwapPending = false;
+	if (!PreloadTask.IsValid())
+	{
+		return;
+	}
+	Preload->bCancelled.store(true, std::memory_order_relaxed);
+	Preload.Reset();
+	// The reader was never attached, so it can be closed whenever the read stops
+	Async(EAsyncExecution::ThreadPool, [Task = MoveTemp(PreloadTask)]() mutable
+	{
+		TSharedPtr<FVoxelVideoLoad, ESPMode::ThreadSafe> Load = Task.Get();
+		if (Load->Reader != nullptr)
 		{
-			UE_LOG(LogTemp, Log, TEXT("These files Exists: %s"), *files[i]);
+			Load->Reader->Close();
 		}
+	});
+	PreloadTask = TFuture<TSharedPtr<FVoxelVideoLoad, ESPMode::ThreadSafe>>();
+}
+
+void UVoxelVideoSourceComponent::CloseVoxelVideoReader()
+{
+	if (VoxelVideoReader == nullptr)
+	{
+		return;
+	}
+	// Once detached its frames go nowhere, so VIMR can take as long as it likes to stop
+	VoxelVideoSink->Detach();
+	VoxelVideoSink.Reset();
+	Async(EAsyncExecution::ThreadPool, [Reader = VoxelVideoReader]()
+	{
+		Reader->Close();
+	});
+	VoxelVideoReader = nullptr;
+}
+
+void UVoxelVideoSourceComponent::ReadVoxelVideo(const FString& Directory, const FString& File, bool bCache, FVoxelVideoLoad& Load)
+{
+	Load.FileName = File;
+	Load.Path = Directory + File;
+	Load.bStandalone = FPaths::GetExtension(Load.Path).Equals(TEXT("vxz"), ESearchCase::IgnoreCase);
 
-		UE_LOG(LogTemp, Log, TEXT("This Path Exists: %s"), *recordingPath)
+	if (Load.bStandalone)
+	{
+		// A converted recording carries its frames and audio streams, VIMR isn't needed to play it
+		Load.CachePath = Load.Path;
+		if (!MapFrameCache(Load.CachePath, true, 0, 0, Load.CacheMapping, Load.CacheRegion, Load.FrameCache))
+		{
+			UE_LOG(VoxVidLog, Warning, TEXT("Can't play %s, it isn't a complete voxel video container"), *Load.Path);
+			return;
+		}
+		for (uint32 i = 0; i < Load.FrameCache.GetNumAudioStreams(); i++)
+		{
+			Load.AudioStreams.push_back(Load.FrameCache.GetAudioStream(i));
+		}
 	}
 	else
 	{
-		UE_LOG(LogTemp, Log, TEXT("This path doesn't exist"));
+		Load.CachePath = Load.Path + TEXT(".vxcache");
+		Load.VideoSize = (uint64)FMath::Max<int64>(IFileManager::Get().FileSize(*Load.Path), 0);
+		Load.VideoTime = IFileManager::Get().GetTimeStamp(*Load.Path).ToUnixTimestamp();
+
+		// Still loaded when playing from the cache, for its audio streams
+		TSharedPtr<FVoxelVideoSink, ESPMode::ThreadSafe> Sink = MakeShared<FVoxelVideoSink, ESPMode::ThreadSafe>();
+		Load.Sink = Sink;
+		Load.Reader = new VIMR::VoxVidPlayer([Sink](VIMR::VoxelGrid* Voxels) { Sink->CopyVoxelData(Voxels); });
+		Load.Reader->Load(TCHAR_TO_ANSI(*Load.Path));
+		if (Load.bCancelled.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+
+		VIMR::AudioStream tmp_astrm;
+		while (Load.Reader->GetNextAudioStream(tmp_astrm))
+		{
+			// Listed in the cache too, so the recording catalog can show them
+			VoxelFrameCache::FAudioStream Listed;
+			FMemory::Memzero(Listed);
+			strncpy(Listed.FileName, std::string(tmp_astrm.file_name).c_str(), sizeof(Listed.FileName) - 1);
+			strncpy(Listed.VoxelLabel, std::string(tmp_astrm.voxel_label).c_str(), sizeof(Listed.VoxelLabel) - 1);
+			Load.AudioStreams.push_back(Listed);
+		}
+		if (bCache)
+		{
+			MapFrameCache(Load.CachePath, false, Load.VideoSize, Load.VideoTime, Load.CacheMapping, Load.CacheRegion, Load.FrameCache);
+		}
+	}
+
+	// Whole wavs, read here rather than when their sources are made
+	for (const VoxelFrameCache::FAudioStream& Stream : Load.AudioStreams)
+	{
+		if (Load.bCancelled.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+		FVoxelVideoLoad::FAudio Audio;
+		Audio.WavFile = FString(std::string(Stream.FileName, strnlen(Stream.FileName, sizeof(Stream.FileName))).c_str());
+		Audio.VoxelLabel = std::string(Stream.VoxelLabel, strnlen(Stream.VoxelLabel, sizeof(Stream.VoxelLabel)));
+		FFileHelper::LoadFileToArray(Audio.WavData, *(Directory + Audio.WavFile));
+		Load.Audio.Add(MoveTemp(Audio));
+	}
+}
+
+void UVoxelVideoSourceComponent::SwapInVoxelVideo(FVoxelVideoLoad& Load, bool loop)
+{
+	CloseVoxelVideoReader();
+	for (auto i : AudioStreams) {
+		i.second->Stop();
+		i.second->clear();
+	}
+	AudioStreams.clear();
+
+	CloseFrameCache();
+	AbortCacheRecording();
+
+	FileName = Load.FileName;
+	VideoPath = Load.Path;
+	CachePath = Load.CachePath;
+	bStandalone = Load.bStandalone;
+	VideoSize = Load.VideoSize;
+	VideoTime = Load.VideoTime;
+	bLoopVideo = loop;
+	VoxelVideoReader = Load.Reader;
+	VoxelVideoSink = MoveTemp(Load.Sink);
+	Load.Reader = nullptr;
+	if (VoxelVideoSink.IsValid())
+	{
+		VoxelVideoSink->Attach(this);
+	}
+	VideoAudioStreams = std::move(Load.AudioStreams);
+	for (FVoxelVideoLoad::FAudio& Audio : Load.Audio)
+	{
+		AddAudioStream(Audio.WavFile, Audio.VoxelLabel, MoveTemp(Audio.WavData));
+	}
+	Load.Audio.Reset();
+
+	if (Load.FrameCache.IsOpen())
+	{
+		CacheMapping = MoveTemp(Load.CacheMapping);
+		CacheRegion = MoveTemp(Load.CacheRegion);
+		FrameCache = Load.FrameCache;
+		Load.FrameCache.Close();
+		StartCachePlayer();
+		CachePlayer->SetLoop(loop);
+		UE_LOG(VoxVidLog, Log, TEXT("Loaded file %s, playing %d frames from %s"), *VideoPath, GetNumFrames(), *CachePath);
 	}
+	else if (VoxelVideoReader != nullptr)
+	{
+		// The first pass writes the cache, so it can't loop until it's been switched over to the cache
+		if (CacheFrames)
+		{
+			BeginCacheRecording();
+		}
+		VoxelVideoReader->Loop = loop && !CacheFrames;
+		UE_LOG(VoxVidLog, Log, TEXT("Loaded file %s"), *VideoPath);
+	}
+}
+
+void UVoxelVideoSourceComponent::AddAudioStream(const FString& WavFile, const std::string& VoxelLabel, TArray<uint8>&& WavData)
+{
+	URuntimeAudioSource* newSource = NewObject<URuntimeAudioSource>(this);
+	FString wav_path = voxelvideosPath + WavFile;
+	FString wav_label = FString(VoxelLabel.c_str());
+
+	newSource->RegisterComponent();
+	newSource->AttachToComponent(this, FAttachmentTransformRules(EAttachmentRule::KeepRelative, false));
+	newSource->LoadWavData(MoveTemp(WavData));
+	AudioStreams[VoxelLabel] = newSource;
+
+	UE_LOG(VoxLog, Log, TEXT("Loaded wav: %s"), *wav_path);
+	UE_LOG(VoxLog, Log, TEXT("Loaded wav: %s"), *wav_label);
+}
 
+TArray<FString> UVoxelVideoSourceComponent::GetAllRecordings()
+{
+	TArray<FString> files;
+	for (const FVoxelRecordingInfo& recording : FVoxelRecordingCatalog::Get().GetRecordings())
+	{
+		files.Add(recording.FileName);
+	}
 	return files;
 }
 
+TArray<FVoxelRecordingInfo> UVoxelVideoSourceComponent::GetAllRecordingInfo()
+{
+	return FVoxelRecordingCatalog::Get().GetRecordings();
+}
+
 void UVoxelVideoSourceComponent::SetAudioLocation(FVector Location)
 {
 	for (auto as : AudioStreams) 
@@ -1,20 +1,56 @@
 // Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
 
 #include "Voxels.h"
+#include "VoxelPacking.h"
+#include "VoxelStagingBuffer.h"
+#include "VoxelRecordingCatalog.h"
+#include "Async/ParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Containers/Ticker.h"
 
 
 #define LOCTEXT_NAMESPACE "FVoxelsModule"
 
+// Runs the engine independent packing code on the task graph, limited to NumWorkers concurrent tasks
+static void TaskGraphParallelFor(int32 Num, int32 NumWorkers, const VoxelPacking::FIndexFn& Body)
+{
+	if (NumWorkers <= 0)
+	{
+		NumWorkers = FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+	}
+	NumWorkers = FMath::Min(NumWorkers, Num);
+	ParallelFor(NumWorkers, [&](int32 Worker)
+	{
+		for (int32 i = Worker; i < Num; i += NumWorkers)
+		{
+			Body(i);
+		}
+	});
+}
+
 
 void FVoxelsModule::StartupModule()
 {
 	// This code will execute after your module is loaded into memory; the exact timing is specified in the .uplugin file per-module
+	VoxelPacking::SetParallelFor(&TaskGraphParallelFor);
+
+	// Staging buffers for frame sizes nothing has used for a while are given back, after a recording or level with
+	// bigger frames has finished with them
+	TrimPoolsHandle = FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([](float)
+	{
+		FVoxelStagingPool::TrimShared(30.0);
+		return true;
+	}), 5.0f);
 }
 
 void FVoxelsModule::ShutdownModule()
 {
 	// This function may be called during shutdown to clean up your module.  For modules that support dynamic reloading,
 	// we call this function before unloading the module.
+	VoxelPacking::SetParallelFor(nullptr);
+	FTicker::GetCoreTicker().RemoveTicker(TrimPoolsHandle);
+	FVoxelStagingPool::ReleaseShared();
+	FVoxelRecordingCatalog::Shutdown();
 }
 
 #undef LOCTEXT_NAMESPACE
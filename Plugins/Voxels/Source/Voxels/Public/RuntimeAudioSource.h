@@ -9,6 +9,7 @@
 #include "Sound/SoundAttenuation.h"
 #include "Runtime/Engine/Public/AudioDevice.h"
 #include "Engine/Engine.h"
+#include "Async/Future.h"
 #include "RuntimeAudioSource.generated.h"
 
 
@@ -23,6 +24,8 @@ public:
 
 	UFUNCTION(BlueprintCallable, Category = "RTAudio")
 		void LoadWav(FString wavPath);
+	// LoadWav with the file already read, so the read can happen off the game thread
+	void LoadWavData(TArray<uint8>&& wavData);
 
 	void LoadBuffer(char* data, int numdata);
 
@@ -42,6 +45,10 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "RTAudio")
 	bool IsReady();
 
+	// Pauses and queues the wav up from Seconds in, ready for Start. LoadWav's format, 16 bit mono at 44.1kHz.
+	UFUNCTION(BlueprintCallable, Category = "RTAudio")
+	void Seek(float Seconds);
+
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
 		FString RecordingPath;
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
@@ -57,8 +64,13 @@ public:
 protected:
 	// Called when the game starts
 	virtual void BeginPlay() override;
+	virtual void OnComponentDestroyed(bool bDestroyingHierarchy) override;
+
+	// Empties the wave and queues the wav from Offset bytes in on the thread pool, copying a whole recording's samples
+	// being too slow for the game thread. Waits for the last one to finish first.
+	void QueueAudio(int32 Offset);
+	void WaitForQueue();
 
-	
 
 	UPROPERTY()
 	UAudioComponent* AudioComponent;
@@ -68,4 +80,8 @@ protected:
 	USoundAttenuation* SoundAttenuation;
 
 	TArray<uint8> audioData;
+	TFuture<void> QueueTask;
+
+	// Canonical RIFF header in front of the samples
+	static const int32 WavHeaderBytes = 44;
 };
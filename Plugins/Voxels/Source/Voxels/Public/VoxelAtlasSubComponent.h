@@ -0,0 +1,96 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "VoxelStagingBuffer.h"
+#include "VoxelRenderSubComponent.h"
+#include "VoxelAtlasSubComponent.generated.h"
+
+#define DEFAULT_VOXEL_ATLAS_WIDTH 512
+#define VOXEL_ATLAS_TILE_SIZE 128 // AtlasUnitCubes has 128 * 128 cubes
+
+/**
+*	Draws every voxel of a frame from a single set of atlas textures, with one instance of AtlasUnitCubes per
+*	VOXEL_ATLAS_TILE_SIZE squared voxels. Voxel i is at texel (i % AtlasWidth, i / AtlasWidth), so a frame is uploaded
+*	with one region update per texture for each run of changed rows. Each instance's first voxel index is passed in
+*	its custom data, which VertexMoveAtlasMaterial adds to the index of each cube to find its texel.
+*
+*	Both assets are built in code, see CreateAtlasMesh and CreateAtlasMaterial, and saved by -run=VoxelMaterial. The
+*	editor builds them on the fly until then. Merged voxels are drawn at their size, and the component's bounds are
+*	fitted to the frame's voxels so the single draw is culled like any other mesh.
+*/
+UCLASS()
+class VOXELS_API UVoxelAtlasSubComponent : public UInstancedStaticMeshComponent
+{
+	GENERATED_BODY()
+
+public:
+	UVoxelAtlasSubComponent();
+
+	// Must be called before the component is registered. AtlasWidth must be a power of two no wider than a block.
+	// Null AtlasMaterial uses /Voxels/VertexMoveAtlasMaterial.
+	void Init(int32 AtlasWidth, int32 Capacity, UMaterialInterface* AtlasMaterial);
+
+	// Uploads the changed rows of the first NumVoxels texels of Staging, and clears rows no longer in use
+	void SetData(const FVoxelStagingBufferRef& Staging, uint32 NumVoxels);
+
+	void BeginPlay() override;
+
+	void OnComponentDestroyed(bool bDestroyingHierarchy) override;
+
+	FBoxSphereBounds CalcBounds(const FTransform& LocalToWorld) const override;
+
+#if WITH_EDITOR
+	// Builds what /Voxels/AtlasUnitCubes is saved from: VOXEL_ATLAS_TILE_SIZE squared unit cubes laid out in a grid,
+	// cube (x, y) from (x, y, 0) to (x + 1, y + 1, 1). UV 0 is the centre of the cube's cell in the tile, and the
+	// vertex colour which of the cube's corners a vertex is.
+	static UStaticMesh* CreateAtlasMesh(UObject* Outer, FName Name, EObjectFlags Flags);
+
+	// Builds what /Voxels/VertexMoveAtlasMaterial is saved from: unlit, moving each cube of AtlasUnitCubes onto the
+	// voxel at its texel and sizing it to the voxel's level, coloured from ColourTexture. Cubes of empty texels are
+	// collapsed. Shaders are compiled as it's built, so it's editor only.
+	static UMaterial* CreateAtlasMaterial(UObject* Outer, FName Name, EObjectFlags Flags);
+#endif
+
+	// Size of a voxel in cm
+	void SetScale(float Scale);
+
+	void SetLocation(FVector Location);
+
+	// Degrees about the X, Y and Z axes
+	void SetRotation(FVector Rotation);
+
+private:
+	UPROPERTY()
+	UMaterialInterface* StaticMaterial;
+
+	UPROPERTY()
+	UMaterialInstanceDynamic* Material;
+
+	UPROPERTY()
+	UTexture2D* CoarsePositionTexture;
+
+	UPROPERTY()
+	UTexture2D* PositionTexture;
+
+	UPROPERTY()
+	UTexture2D* ColourTexture;
+
+	// Adds or removes instances so there's one per VOXEL_ATLAS_TILE_SIZE squared voxels
+	void SetNumTiles(int32 NumTiles);
+
+	int32 AtlasWidth = DEFAULT_VOXEL_ATLAS_WIDTH;
+	int32 AtlasHeight = 0;
+
+	// Zero filled, big enough to clear the whole atlas
+	FVoxelStagingBufferRef EmptyData;
+
+	// Block hashes of what's in the atlas, and how many rows of it hold voxels
+	TArray<uint64> UploadedBlockHashes;
+	int32 UploadedRows = 0;
+
+	float Scale = 1.0f;
+
+	// Extent of the frame's voxels, empty when the source doesn't know it
+	FVoxelBounds VoxelBounds;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include "VoxelFrameCache.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+*	Plays the frames of a frame cache on a thread of its own, calling OnFrame with each frame's index when its time
+*	comes. Seeking only moves the play head, so it takes the same time wherever it lands. Frames that are due by the
+*	time the one before has been handled are skipped, so playback keeps to the recording's clock.
+*
+*	With read ahead, threads of their own read the frames after the play head into slots the caller owns, so a slow
+*	disk, a network share or decompressing holds them up rather than playback. Each thread takes the next frame in
+*	order, which keeps the reads from the cache close to sequential, and frames are shown in order however they
+*	finish.
+*/
+class FVoxelCachePlayer
+{
+public:
+	// Slot is where the frame was read ahead to, or -1 if it wasn't and has to be read from the cache
+	typedef std::function<void(uint32_t Frame, int32_t Slot)> FFrameFn;
+	// Reads a frame into a slot, on a read ahead thread
+	typedef std::function<void(uint32_t Frame, int32_t Slot)> FReadFn;
+
+	/**
+	*	Starts paused on the first frame. Cache has to stay open for as long as the player exists.
+	*
+	*	@param ReadAhead	Frames to keep read ahead of the play head, 0 for none. Read is given slots up to ReadAhead
+	*						inclusive, as one is held by the frame being shown.
+	*	@param ReadThreads	Threads reading ahead, for frames that take longer to read than to show
+	*/
+	FVoxelCachePlayer(const FVoxelFrameCacheReader& Cache, FFrameFn OnFrame, int32_t ReadAhead = 0, FReadFn Read = nullptr, int32_t ReadThreads = 1);
+
+	// Waits for the frame being handled, if any
+	~FVoxelCachePlayer();
+
+	FVoxelCachePlayer(const FVoxelCachePlayer&) = delete;
+	FVoxelCachePlayer& operator=(const FVoxelCachePlayer&) = delete;
+
+	// Plays on from the play head, from the start once the end has been reached
+	void Play();
+	void Pause();
+
+	// Moves the play head and shows the frame there, even while paused
+	void SeekToFrame(uint32_t Frame);
+	void SeekToTime(double Seconds);
+
+	void SetLoop(bool bInLoop);
+
+	bool IsPlaying();
+	// Played to the end without looping
+	bool IsFinished();
+
+	// Time of the last frame shown
+	double GetTime();
+
+	// Frames that were due before the one before them was done with, and were left out
+	uint64_t GetNumSkipped();
+
+	// Frames read ahead and waiting to be shown
+	int32_t GetReadAheadDepth();
+
+	// Frames that came due while playing before they'd been read ahead
+	uint64_t GetNumUnderruns();
+
+private:
+	typedef std::chrono::steady_clock FClock;
+
+	void Run();
+	void ReadLoop();
+
+	struct FAhead
+	{
+		uint32_t Frame;
+		int32_t Slot;
+		// False while it's being read
+		bool bRead;
+	};
+
+	// With the lock held. The slot Frame was read ahead to, dropping the frames before it, or -1 if it wasn't.
+	// Waits for it if it's being read.
+	int32_t TakeReadAhead(std::unique_lock<std::mutex>& Lock, uint32_t Frame, bool bSeek);
+
+	// With the lock held. Drops a frame read ahead, its slot comes back once it's been read.
+	void DropAhead(const FAhead& Entry);
+
+	// With the lock held. Forgets what was read ahead, for after the play head jumps.
+	void DropReadAhead();
+
+	// With the lock held. Frame to read ahead next, or -1 if there's nothing to read or no room for it.
+	int64_t NextToRead() const;
+
+	// When the frame at the play head is due, starting it now
+	void RestartClock();
+
+	const FVoxelFrameCacheReader& Cache;
+	const FFrameFn OnFrame;
+	const int32_t ReadAhead;
+	const FReadFn Read;
+
+	std::mutex Mutex;
+	std::condition_variable Changed;
+	std::thread Thread;
+	std::vector<std::thread> ReadThreads;
+	std::condition_variable ReadChanged;
+	std::condition_variable ReadDone;
+	// Next frame to show
+	uint32_t PlayHead = 0;
+	uint32_t LastShown = 0;
+	// What the clock read when the recording's time was 0
+	FClock::time_point Origin;
+	bool bPlaying = false;
+	bool bFinished = false;
+	bool bLoop = false;
+	// Set by a seek, so the frame at the play head is shown even while paused
+	bool bShowPlayHead = false;
+	bool bStopping = false;
+	uint64_t NumSkipped = 0;
+
+	// Frames read or being read ahead, in play order
+	std::deque<FAhead> Ahead;
+	std::vector<int32_t> FreeSlots;
+	uint64_t NumUnderruns = 0;
+};
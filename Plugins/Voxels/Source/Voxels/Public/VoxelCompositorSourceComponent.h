@@ -0,0 +1,110 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Components/SceneComponent.h"
+#include "VoxelSourceInterface.h"
+#include "Voxels.h"
+#include "VoxelCompositorSourceComponent.generated.h"
+
+USTRUCT(BlueprintType)
+struct VOXELS_API FVoxelCompositorInput
+{
+	GENERATED_BODY()
+
+	// Source to take frames from. Render it through the compositor only, not with a render component of its own.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	TScriptInterface<IVoxelSourceInterface> Source;
+
+	// Added to every voxel position from this source, in voxels. Inputs can only be moved by whole voxels, rotating
+	// or scaling one would mean voxelising it again.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	FIntVector Offset = FIntVector::ZeroValue;
+
+	// Sources with a higher priority get their voxels first when there are more than the compositor's MaxVoxels
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	int32 Priority = 0;
+
+	// Most voxels taken from this source per frame, 0 for no limit
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	int32 MaxVoxels = 0;
+};
+
+/**
+*	Merges the frames of several voxel sources into one, so a single render component draws them all with one set of
+*	sub-renderers. Frames are merged on the game thread when a renderer asks for one and an input has published since.
+*
+*	Every input takes whole HashBlockTexels blocks of the merged frame, copied as they are when the input has no
+*	offset, so blocks from an input that hasn't changed keep their hashes and aren't uploaded again. Empty blocks
+*	are left out, and budgets are applied a block at a time: once a block doesn't fit, the rest of that input's
+*	frame is dropped.
+*/
+UCLASS(ClassGroup = (Custom), meta = (BlueprintSpawnableComponent))
+class VOXELS_API UVoxelCompositorSourceComponent : public USceneComponent, public IVoxelSourceInterface
+{
+	GENERATED_BODY()
+
+public:
+	UVoxelCompositorSourceComponent();
+
+	FVoxelStagingBufferRef GetFrame() override;
+
+	int GetSourceType() override { return CompositorSource; }
+
+	int32 GetMaxVoxels() override { return MaxVoxels; }
+
+	// Passed on to every input, moved by its offset
+	void SetViewerPosition(const FVector& VoxelPosition) override;
+
+	// Passed on to every input
+	void SetDrawsMergedVoxels(bool bDraws) override;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	TArray<FVoxelCompositorInput> Inputs;
+
+	// Most voxels in a merged frame, rounded up to whole blocks. 0 uses DEFAULT_MAX_VOXELS.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	int32 MaxVoxels = 0;
+
+	// Voxels left out of the last merged frame to stay within the budgets
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Stats")
+	int32 VoxelsOverBudget = 0;
+
+	// Voxels left out of the last merged frame because their input's Offset moved them past the edge of the grid
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Stats")
+	int32 VoxelsOutOfRange = 0;
+
+protected:
+	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+private:
+	// Builds a new merged frame out of InputFrames
+	void Merge();
+
+	// What each input's contribution to the current merged frame was made from, to tell when it needs merging again
+	struct FMergedInput
+	{
+		FVoxelStagingBufferRef Frame;
+		uint32 FrameSequence = 0;
+		FIntVector Offset = FIntVector::ZeroValue;
+		int32 Priority = 0;
+		int32 MaxVoxels = 0;
+	};
+	TArray<FMergedInput> MergedInputs;
+
+	// A block of an input frame and where it goes in the merged one
+	struct FBlockCopy
+	{
+		const FVoxelStagingBuffer* Input;
+		int32 InputBlock;
+		int32 OutputBlock;
+		int16 Offset[3];
+	};
+	TArray<FBlockCopy> BlockCopies;
+
+	TSharedPtr<FVoxelStagingPool, ESPMode::ThreadSafe> StagingPool;
+	FVoxelStagingBufferRef Composite;
+	uint32 LastFrameSequence = 0;
+	bool bWarnedVoxelSize = false;
+	bool bWarnedOutOfRange = false;
+};
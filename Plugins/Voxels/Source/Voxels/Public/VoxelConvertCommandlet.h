@@ -0,0 +1,31 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "VoxelConvertCommandlet.generated.h"
+
+/**
+*	Converts .vx3 recordings to standalone .vxz containers, LZ4 compressed with every frame independently decodable,
+*	which UVoxelVideoSourceComponent plays without VIMR or the .vx3.
+*
+*	UE4Editor-Cmd.exe <project> -run=VoxelConvert -in=<recording.vx3 or folder> [-out=<container.vxz>] [-labels] [-raw]
+*
+*	Paths are relative to Content/VoxelVideos. A folder converts every recording in it. -labels keeps voxel flags and
+*	aux labels, -raw leaves frames uncompressed. A recording with an up to date .vxcache beside it is converted from
+*	that, otherwise it has to be played through, which takes as long as the recording.
+*/
+UCLASS()
+class VOXELS_API UVoxelConvertCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UVoxelConvertCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	bool Convert(const FString& InPath, const FString& OutPath, bool bLabels, bool bCompress);
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <cstdint>
+#include <vector>
+
+/**
+*	Brings a frame with more voxels than fit down to a budget by merging voxels into 2x and 4x cells, far from the
+*	viewer first, rather than dropping whichever voxels happen to come last.
+*
+*	Voxels are grouped into 16x16x16 regions. Each region's voxel count at every level comes from an occupancy bitmap,
+*	so levels can be picked before anything is merged: every region is taken to level 1 starting from the farthest
+*	until the frame fits, then to level 2 the same way, and only if that still isn't enough are the farthest regions
+*	left out. A merged voxel sits at its cell's lowest corner, keeps the colour of the first voxel seen in the cell
+*	and has its level in the otherwise unused fourth lane of its gathered position.
+*
+*	This works on gathered positions rather than on the levels of a VIMR octree for two reasons. Frames don't always
+*	come from an octree: cached video frames, read-ahead slots and compositor inputs are already flat arrays, and
+*	VIMR::VoxelGrid only hands voxels out one at a time anyway. And an octree level applies to every voxel alike,
+*	whereas picking a level per region by distance needs each region's count at every level before anything is
+*	merged. A 16x16x16 bitmap is 512 bytes per region and gives those counts with a popcount per row.
+*
+*	Merged voxels can only be drawn by renderers that size each cube from its level. That's the Atlas and Instanced
+*	modes. VertexMoveMaterial, which the sub-renderers use, is a saved asset that draws every cube the same size,
+*	and merged voxels would show as holes there, so sources skip decimation while any of their renderers are in
+*	that mode (see UVoxelSourceBaseComponent::SetDrawsMergedVoxels).
+*/
+class FVoxelDecimator
+{
+public:
+	// Regions are this many voxels across, and cells at the highest level can't be bigger
+	static const int32_t RegionBits = 4;
+	static const int32_t MaxLevel = 2;
+
+	/**
+	*	Picks a level for every region so Count voxels fit in Budget, and merges them. Returns false without touching
+	*	anything if they already fit.
+	*
+	*	@param Positions	Count gathered positions, see VoxelPacking::GatherStride. Kept ones are snapped to their
+	*						cell and have their level set.
+	*	@param Viewer		X, Y, Z of the viewer in voxels
+	*	@param Levels		Highest level to use, up to MaxLevel
+	*	@param Kept			Indices of the voxels kept, in order. The caller moves them and anything it has per voxel down.
+	*/
+	bool Decimate(int16_t* Positions, uint32_t Count, const float* Viewer, uint32_t Budget, int32_t Levels, std::vector<uint32_t>& Kept);
+
+	// Voxels kept at each level by the last Decimate, and the number of voxels left out entirely
+	uint32_t GetNumAtLevel(int32_t Level) const { return NumAtLevel[Level]; }
+	uint32_t GetNumDropped() const { return NumDropped; }
+
+private:
+	struct FRegion
+	{
+		uint64_t Key;
+		float DistanceSquared;
+		// Voxels at each level, level 0 counting every voxel even if two share a position
+		uint32_t Counts[MaxLevel + 1];
+		// -1 leaves the region out
+		int32_t Level;
+		// One bit per texel at level 0, rows of 16 along X indexed by Z * 16 + Y
+		uint16_t Occupancy[256];
+		// Cells already given a voxel, at the region's level
+		uint64_t Emitted[8];
+	};
+
+	// Index of the region with Key, adding it if it's new
+	uint32_t FindOrAddRegion(uint64_t Key);
+	void GrowTable();
+
+	std::vector<FRegion> Regions;
+	std::vector<uint32_t> RegionOf;
+	std::vector<uint32_t> ByDistance;
+
+	// Open addressing map from region key to index in Regions
+	std::vector<uint64_t> TableKeys;
+	std::vector<uint32_t> TableRegions;
+	uint32_t TableMask = 0;
+
+	uint32_t NumAtLevel[MaxLevel + 1] = {};
+	uint32_t NumDropped = 0;
+};
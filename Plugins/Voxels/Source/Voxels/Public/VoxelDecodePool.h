@@ -0,0 +1,106 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+*	Decodes frames on a pool of worker threads, so whoever hands them over only has to copy them out and can go
+*	straight back to receiving. Frames live in slots owned by the caller: BeginFrame picks one to fill, SubmitFrame
+*	queues it, a worker runs Decode on it, and Publish is then called for every decoded frame one at a time and in
+*	the order they were submitted, however the workers finish.
+*
+*	The queue holds up to QueueDepth frames waiting for a worker. Once it's full, Backpressure decides what gives.
+*/
+class FVoxelDecodePool
+{
+public:
+	enum class EBackpressure
+	{
+		// Reuse the oldest frame still waiting for a worker, so the newest frames get through
+		DropOldest,
+		// Turn the new frame away
+		DropNewest,
+		// Wait for a worker to take a frame off the queue
+		Block,
+	};
+
+	struct FStats
+	{
+		uint64_t Submitted = 0;
+		uint64_t Published = 0;
+		// Queued frames given up for newer ones, with DropOldest
+		uint64_t DroppedOldest = 0;
+		// Frames turned away by a full queue, with DropNewest
+		uint64_t DroppedNewest = 0;
+		// Times BeginFrame had to wait for room in the queue, with Block
+		uint64_t Blocked = 0;
+		// Times BeginFrame had to wait for a free slot, whatever the policy, because workers were holding every slot
+		// with frames finished ahead of a slow one
+		uint64_t SlotWaits = 0;
+		// Frames waiting for a worker right now
+		uint32_t Queued = 0;
+	};
+
+	typedef std::function<void(int32_t Slot)> FSlotFn;
+
+	// Starts NumWorkers threads (at least 1) and hands out GetNumSlots() slots
+	FVoxelDecodePool(int32_t NumWorkers, int32_t QueueDepth, EBackpressure Backpressure, FSlotFn Decode, FSlotFn Publish);
+
+	// Stops the workers, see Stop
+	~FVoxelDecodePool();
+
+	FVoxelDecodePool(const FVoxelDecodePool&) = delete;
+	FVoxelDecodePool& operator=(const FVoxelDecodePool&) = delete;
+
+	// Enough slots for a full queue, one frame being decoded by every worker and one finished early by every worker
+	// while an earlier frame holds up publishing
+	int32_t GetNumSlots() const { return NumSlots; }
+
+	/**
+	*	Slot to copy the next frame into, or -1 if it should be dropped. Only one thread submits frames at a time.
+	*	Applies the backpressure policy if the queue is full.
+	*/
+	int32_t BeginFrame();
+
+	// Queues the frame copied into Slot from BeginFrame
+	void SubmitFrame(int32_t Slot);
+
+	FStats GetStats();
+
+	// Waits for the frames being decoded to be published and the workers to exit. Frames still queued are dropped,
+	// and BeginFrame returns -1 from then on.
+	void Stop();
+
+private:
+	void WorkerLoop();
+
+	const int32_t QueueDepth;
+	const EBackpressure Backpressure;
+	const FSlotFn Decode;
+	const FSlotFn Publish;
+	int32_t NumSlots;
+
+	std::mutex Mutex;
+	std::condition_variable WorkQueued;
+	std::condition_variable RoomMade;
+	std::vector<int32_t> FreeSlots;
+	std::deque<int32_t> Queue;
+	// Decoded frames waiting for an earlier one to be published, by sequence number. Numbers are handed out as
+	// workers take frames off the queue, so frames dropped from it leave no gaps.
+	std::map<uint64_t, int32_t> Decoded;
+	uint64_t NextSequence = 0;
+	uint64_t NextPublish = 0;
+	// Set while a worker is publishing, the others leave their frames in Decoded for it
+	bool bPublishing = false;
+	bool bStopping = false;
+	FStats Stats;
+
+	std::vector<std::thread> Workers;
+};
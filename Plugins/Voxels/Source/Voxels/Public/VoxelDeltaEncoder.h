@@ -0,0 +1,149 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <cstdint>
+#include <vector>
+#include "VoxelSlotAllocator.h"
+
+/**
+*	Keeps every voxel in the same texel slot for as long as it exists, so a frame where most voxels haven't changed
+*	only rewrites the texels of those that have. Voxels are matched to last frame's on their position, through an
+*	open addressing hash of pos.X/Y/Z, and slots freed by removed voxels are handed to new ones. Holes that new voxels
+*	don't fill are closed by moving the highest voxels down into them, a few at a time, see SetCompaction.
+*
+*	The work per frame goes with what changed rather than the voxel count. A voxel that's still there costs a compare
+*	against the slot it had, only blocks with fewer voxels seen than they hold are searched for removed ones, and each
+*	added or removed voxel touches the hash table once.
+*
+*	Texels are laid out the same way CopyVoxelData packs a full frame (see VoxelPacking), with free slots zeroed.
+*/
+class FVoxelDeltaEncoder
+{
+public:
+	struct FStats
+	{
+		uint32_t Added = 0;
+		uint32_t Removed = 0;
+		uint32_t Recoloured = 0;
+		uint32_t Unchanged = 0;
+		// Voxels moved into a lower slot to close a hole
+		uint32_t Moved = 0;
+	};
+
+	// Forgets every voxel, the next frame places all of its voxels from slot 0. Changes are tracked in blocks of
+	// BlockSlots texels.
+	void Reset(uint32_t MaxSlots, uint32_t BlockSlots);
+
+	// Once more than MinHoleFraction of the slots in use are holes, EndFrame moves up to MaxMovesPerFrame voxels
+	// down into them. Every move dirties two blocks, so this bounds how much extra a frame uploads.
+	void SetCompaction(float MinHoleFraction, uint32_t MaxMovesPerFrame);
+
+	void BeginFrame();
+
+	// Notes a voxel of the current frame. Returns false once the frame has as many voxels as there are slots.
+	bool AddVoxel(int16_t X, int16_t Y, int16_t Z, uint32_t Colour)
+	{
+		return AddVoxel(MakeKey(X, Y, Z), Colour);
+	}
+
+	// Notes Count voxels gathered the way VoxelPacking gathers them, four int16 each: Z, Y, X and one that's ignored.
+	// Returns how many were taken, fewer than Count once the frame has as many voxels as there are slots.
+	uint32_t AddVoxels(const int16_t* Gathered, const uint32_t* Colours, uint32_t Count);
+
+	/**
+	*	Frees the slots of voxels that weren't in this frame, places the new ones, compacts if needed and writes the
+	*	texels of every slot that changed. DirtyBlocks is resized to cover GetNumSlots() and has 1 for every block that
+	*	was written to.
+	*/
+	void EndFrame(uint8_t* CoarseOut, uint8_t* FineOut, uint8_t* ColourOut, std::vector<uint8_t>& DirtyBlocks);
+
+	// Slots up to the highest in use, including holes left by removed voxels
+	uint32_t GetNumSlots() const { return Slots.GetNumSlots(); }
+
+	const FVoxelSlotAllocator& GetSlots() const { return Slots; }
+
+	// What the last frame changed
+	const FStats& GetStats() const { return Stats; }
+
+private:
+	// Z, Y and X in the low 48 bits, the same bytes a gathered voxel starts with
+	static uint64_t MakeKey(int16_t X, int16_t Y, int16_t Z)
+	{
+		return (uint64_t)(uint16_t)Z | ((uint64_t)(uint16_t)Y << 16) | ((uint64_t)(uint16_t)X << 32);
+	}
+
+	static const uint64_t KeyMask = 0xFFFFFFFFFFFFull;
+
+	bool AddVoxel(uint64_t Key, uint32_t Colour);
+
+	// Only 48 bits of a key are used, so this can't collide with a voxel
+	static const uint64_t EmptyKey = ~0ull;
+
+	// Slot of a voxel first seen this frame, until EndFrame places it
+	static const int32_t NewSlot = -1;
+
+	// Key and slot side by side, so a probe reads one cache line
+	struct FEntry
+	{
+		uint64_t Key;
+		int32_t Slot;
+	};
+
+	uint32_t HashIndex(uint64_t Key) const
+	{
+		return (uint32_t)((Key * 0x9E3779B97F4A7C15ull) >> 32) & TableMask;
+	}
+
+	// Table index of Key, or of the empty entry it would go in
+	uint32_t Probe(uint64_t Key) const;
+
+	void Erase(uint64_t Key);
+
+	std::vector<FEntry> Table;
+	uint32_t TableMask = 0;
+	uint32_t NumEntries = 0;
+	uint32_t MaxEntries = 0;
+
+	// Per slot: the voxel in it and its colour
+	std::vector<uint64_t> SlotKeys;
+	std::vector<uint32_t> SlotColours;
+
+	bool IsSeen(uint32_t Slot) const { return (SeenBits[Slot / 64] & (1ull << (Slot % 64))) != 0; }
+
+	// One bit per slot, set once its voxel is seen this frame, and how many were seen in each block. Blocks where
+	// that matches the slot allocator's count lost nothing.
+	std::vector<uint64_t> SeenBits;
+	std::vector<uint16_t> SeenCounts;
+
+	// Slot of the voxel that came after each slot's voxel in the last frame, -1 if it was new or the last one
+	std::vector<int32_t> SlotNext;
+	int32_t FirstSlot = -1;
+	int32_t PreviousSlot = -1;
+
+	FVoxelSlotAllocator Slots;
+	std::vector<FVoxelSlotAllocator::FMove> Moves;
+	std::vector<uint32_t> RecolouredSlots;
+
+	// New voxels are entered in the table as they're added, and keep their entry's index until EndFrame places them.
+	// Removed voxels are erased after that, since erasing moves entries.
+	struct FNewVoxel
+	{
+		uint64_t Key;
+		uint32_t Colour;
+		// NoEntry if the table was too full, it's entered once removed voxels are out
+		uint32_t Entry;
+	};
+	static const uint32_t NoEntry = ~0u;
+	std::vector<FNewVoxel> NewVoxels;
+	std::vector<uint64_t> RemovedKeys;
+
+	// Gives a new voxel the lowest free slot and writes its texels
+	void PlaceVoxel(const FNewVoxel& Voxel, uint32_t Entry, uint8_t* CoarseOut, uint8_t* FineOut, uint8_t* ColourOut, std::vector<uint8_t>& DirtyBlocks);
+
+	uint32_t MaxSlots = 0;
+	uint32_t BlockSlots = 1;
+	float MinHoleFraction = 0.25f;
+	uint32_t MaxMovesPerFrame = 4096;
+	uint32_t NumInFrame = 0;
+	FStats Stats;
+};
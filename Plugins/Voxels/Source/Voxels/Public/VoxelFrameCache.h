@@ -0,0 +1,260 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/**
+*	A voxel video's frames in the form CopyVoxelData gathers them, whole and with labels, with an index of where each one starts and when
+*	it's shown, so a recording can be memory mapped and jumped around in. VIMR's .vx3 files can only be played from
+*	the start, so the cache is written beside one as it's played through the first time. The same format, compressed
+*	and with the recording's audio streams listed, is the standalone .vxz container.
+*
+*	Layout, little endian:
+*		FHeader
+*		FAudioStream per audio stream
+*		Every frame: FFrameHeader, then its streams: positions, colours, and with labels flags and aux labels. Each
+*		stream is padded to 8 bytes.
+*		Index: FIndexEntry per frame
+*		FFooter
+*
+*	The index and footer repeat what a listing needs from the frame headers, so OpenMetadata can read a cache's
+*	length and size without touching its frames.
+*
+*	Uncompressed, the streams are Z, Y, X int16 per voxel, uint32 per voxel, uint8 per voxel and uint16 per voxel, so
+*	frames can be used straight from the mapping. Compressed, every stream of every frame is compressed on its own, so
+*	frames can be decoded in any order and on any number of threads. Before that, positions are delta coded from the
+*	voxel before and split into Z, Y and X planes, and colours and aux labels are split into planes of bytes, which
+*	VIMR's grid order makes long runs of small or equal values. A stream compression didn't shrink is stored as it is.
+*/
+namespace VoxelFrameCache
+{
+	static const uint32_t Magic = 0x43465856; // "VXFC"
+	// 3: frames are whole, before version 3 they were cut down to the MaxVoxels of the source that played them
+	// 4: voxel counts in the index and footer
+	static const uint32_t Version = 4;
+
+	enum class ECodec : uint32_t
+	{
+		None = 0,
+		LZ4 = 1,
+		Zlib = 2,
+	};
+
+	enum EStream
+	{
+		Stream_Positions,
+		Stream_Colours,
+		Stream_Flags,
+		Stream_AuxLabels,
+		NumStreams
+	};
+
+	/**
+	*	Block compression for caches, supplied by whoever reads or writes them so this stays engine independent.
+	*/
+	struct FCodec
+	{
+		ECodec Id = ECodec::None;
+		// Most bytes Compress can turn Bytes into
+		std::function<size_t(size_t Bytes)> Bound;
+		// Compressed size, 0 on failure
+		std::function<size_t(const void* In, size_t InBytes, void* Out, size_t OutCapacity)> Compress;
+		// False unless In decompressed to exactly OutBytes
+		std::function<bool(const void* In, size_t InBytes, void* Out, size_t OutBytes)> Decompress;
+	};
+
+	struct FHeader
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		// Size and modification time of the .vx3 the cache was made from, so a changed recording isn't played from a
+		// stale cache. 0 for a standalone container.
+		uint64_t SourceSize;
+		int64_t SourceTime;
+		// ECodec
+		uint32_t Codec;
+		uint32_t NumAudioStreams;
+	};
+
+	// A wav played along with the recording, named as VIMR::AudioStream names it
+	struct FAudioStream
+	{
+		char FileName[192];
+		char VoxelLabel[64];
+	};
+
+	struct FFrameHeader
+	{
+		// Seconds from the first frame
+		double Time;
+		uint32_t NumVoxels;
+		uint8_t VoxelSizemm;
+		uint8_t bLabels;
+		uint16_t Pad;
+		// Bytes stored for each stream, before padding
+		uint32_t StreamBytes[NumStreams];
+	};
+
+	struct FIndexEntry
+	{
+		uint64_t Offset;
+		double Time;
+		// Same as the frame's header
+		uint32_t NumVoxels;
+		uint8_t VoxelSizemm;
+		uint8_t Pad[3];
+	};
+
+	struct FFooter
+	{
+		uint64_t IndexOffset;
+		uint32_t NumFrames;
+		// Most voxels in any frame
+		uint32_t MaxVoxels;
+		uint32_t Pad;
+		uint32_t Magic;
+	};
+
+	// A frame in a mapped cache, pointing into it
+	struct FFrame
+	{
+		double Time = 0.0;
+		uint32_t NumVoxels = 0;
+		uint8_t VoxelSizemm = 0;
+		// Z, Y, X per voxel
+		const int16_t* Positions = nullptr;
+		const uint32_t* Colours = nullptr;
+		// Null if the frame was cached without labels
+		const uint8_t* Flags = nullptr;
+		const uint16_t* AuxLabels = nullptr;
+	};
+
+	// Where a compressed frame is decoded to, reused from frame to frame. One per thread decoding.
+	struct FFrameScratch
+	{
+		std::vector<uint8_t> Stream;
+		std::vector<int16_t> Positions;
+		std::vector<uint32_t> Colours;
+		std::vector<uint8_t> Flags;
+		std::vector<uint16_t> AuxLabels;
+	};
+}
+
+/**
+*	Writes a frame cache front to back through a callback, so it can go to whatever file API the caller uses.
+*/
+class FVoxelFrameCacheWriter
+{
+public:
+	typedef std::function<bool(const void* Data, size_t Bytes)> FWriteFn;
+
+	/**
+	*	Writes the header. Anything written before is forgotten.
+	*
+	*	@param Codec		Compresses every frame, null to leave them uncompressed. Has to outlive the writer.
+	*	@param AudioStreams	Listed for a standalone container to play along with it
+	*/
+	bool Begin(uint64_t SourceSize, int64_t SourceTime, FWriteFn Write, const VoxelFrameCache::FCodec* Codec = nullptr,
+		const std::vector<VoxelFrameCache::FAudioStream>& AudioStreams = std::vector<VoxelFrameCache::FAudioStream>());
+
+	/**
+	*	Appends a frame. Frames have to come in time order.
+	*
+	*	@param Positions	NumVoxels gathered positions, see VoxelPacking::GatherStride. Levels of detail aren't kept.
+	*	@param Flags		Null to leave labels out, otherwise AuxLabels is needed too
+	*/
+	bool AddFrame(double Time, uint8_t VoxelSizemm, uint32_t NumVoxels, const int16_t* Positions, const uint32_t* Colours, const uint8_t* Flags, const uint16_t* AuxLabels);
+
+	// Writes the index and footer. The cache is only valid once this has succeeded.
+	bool End();
+
+	uint32_t GetNumFrames() const { return (uint32_t)Index.size(); }
+
+private:
+	bool Write(const void* Data, size_t Bytes);
+	bool Pad();
+
+	FWriteFn WriteFn;
+	const VoxelFrameCache::FCodec* Codec = nullptr;
+	uint64_t Offset = 0;
+	bool bFailed = false;
+	std::vector<VoxelFrameCache::FIndexEntry> Index;
+	// Each stream laid out for storing, then compressed
+	std::vector<uint8_t> Streams[VoxelFrameCache::NumStreams];
+	std::vector<uint8_t> Compressed[VoxelFrameCache::NumStreams];
+};
+
+/**
+*	Reads frames out of a cache that's already in memory, normally mapped. Doesn't copy anything, so the memory has
+*	to outlive the reader.
+*/
+class FVoxelFrameCacheReader
+{
+public:
+	// False if Data isn't a complete cache of this version, or it's compressed with something other than Codec. Codec
+	// has to outlive the reader. Checks every frame header, so it reads a page or so of every frame.
+	bool Open(const uint8_t* Data, size_t Size, const VoxelFrameCache::FCodec* Codec = nullptr);
+
+	// Opens the cache for its metadata only, reading nothing but the header, audio streams, index and footer. Frames
+	// can't be read from a cache opened like this, GetFrame fails.
+	bool OpenMetadata(const uint8_t* Data, size_t Size);
+
+	void Close();
+
+	bool IsOpen() const { return NumFrames > 0; }
+
+	// Whether the cache was made from a source of SourceSize bytes last modified at SourceTime
+	bool IsFrom(uint64_t SourceSize, int64_t SourceTime) const;
+
+	bool IsCompressed() const { return Codec != nullptr; }
+
+	uint32_t GetNumAudioStreams() const { return NumAudioStreams; }
+	const VoxelFrameCache::FAudioStream& GetAudioStream(uint32_t Stream) const { return AudioStreams[Stream]; }
+
+	uint32_t GetNumFrames() const { return NumFrames; }
+
+	// Time of the last frame
+	double GetDuration() const { return NumFrames > 0 ? Index[NumFrames - 1].Time : 0.0; }
+
+	double GetFrameTime(uint32_t Frame) const { return Index[Frame].Time; }
+
+	// Most voxels in any frame, and the voxel size of the first
+	uint32_t GetMaxVoxels() const { return MaxVoxels; }
+	uint8_t GetVoxelSizemm() const { return VoxelSizemm; }
+
+	// Where a frame lies in the cache, for hinting the reads ahead of it
+	uint64_t GetFrameOffset(uint32_t Frame) const { return Index[Frame].Offset; }
+	uint64_t GetFrameBytes(uint32_t Frame) const
+	{
+		const uint64_t End = Frame + 1 < NumFrames ? Index[Frame + 1].Offset : (uint64_t)((const uint8_t*)Index - Data);
+		return End - Index[Frame].Offset;
+	}
+
+	// Frame must be below GetNumFrames(). An uncompressed frame points into the cache, a compressed one is decoded to
+	// Scratch and points into that. False if it doesn't decompress, or the cache was opened with OpenMetadata.
+	bool GetFrame(uint32_t Frame, VoxelFrameCache::FFrame& Out, VoxelFrameCache::FFrameScratch& Scratch) const;
+
+	// Last frame shown at or before Time, the first one if Time is before it. Frames are close to evenly spaced, so
+	// the guess from the average frame rate is at most a step or two off.
+	uint32_t FindFrame(double Time) const;
+
+private:
+	// Everything Open and OpenMetadata check before the frames, and the members that come from it
+	bool OpenIndex(const uint8_t* Data, size_t Size);
+
+	const uint8_t* Data = nullptr;
+	size_t Size = 0;
+	const VoxelFrameCache::FHeader* Header = nullptr;
+	const VoxelFrameCache::FIndexEntry* Index = nullptr;
+	uint32_t NumFrames = 0;
+	const VoxelFrameCache::FCodec* Codec = nullptr;
+	const VoxelFrameCache::FAudioStream* AudioStreams = nullptr;
+	uint32_t NumAudioStreams = 0;
+	uint32_t MaxVoxels = 0;
+	uint8_t VoxelSizemm = 0;
+	// Opened with OpenMetadata
+	bool bMetadataOnly = false;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+/**
+*	Works out when each frame of a live stream should be shown so they come out at the cadence they were captured,
+*	however unevenly the network delivers them.
+*
+*	The stream doesn't carry capture times, so they're reconstructed: frames are taken to be captured one period
+*	apart, with the period averaged from the arrivals. The least any frame took to arrive over the last couple of
+*	seconds is the network's base delay, and every frame is shown at its capture time plus that delay plus a playout
+*	delay covering the jitter on top. Frames that still arrive after that are late and shown as soon as they're in.
+*/
+class FVoxelFramePacer
+{
+public:
+	struct FSettings
+	{
+		// Least playout delay, in seconds
+		double TargetLatency = 0.05;
+		// Most playout delay, in seconds
+		double MaxLatency = 0.25;
+		// Raise the playout delay to JitterMultiplier times the observed jitter
+		bool bAdaptive = true;
+		double JitterMultiplier = 3.0;
+	};
+
+	// Forgets the stream, the next frame starts it over
+	void Reset();
+
+	// When the frame that arrived at ArrivalTime should be shown, on the same clock. Never earlier than ArrivalTime
+	// or than the frame before.
+	double Schedule(double ArrivalTime, const FSettings& Settings);
+
+	// Seconds between frames, as averaged from their arrivals
+	double GetPeriod() const { return Period; }
+
+	// Mean deviation of the time between arrivals from the period, in seconds
+	double GetJitter() const { return Jitter; }
+
+	// Playout delay used for the last frame, in seconds
+	double GetDelay() const { return Delay; }
+
+	// Frames that arrived after they should have been shown
+	uint64_t GetNumLate() const { return NumLate; }
+
+private:
+	// Arrivals further apart than this many periods are a pause or lost frames, not jitter, and restart the clock
+	static const int32_t GapPeriods = 3;
+	// Seconds of arrivals the base delay is the least of
+	static constexpr double BaseDelayWindow = 2.0;
+
+	bool bStarted = false;
+	double LastArrival = 0.0;
+	double LastCapture = 0.0;
+	double LastRelease = 0.0;
+	double Period = 0.0;
+	double Jitter = 0.0;
+	double Delay = 0.0;
+	uint64_t NumLate = 0;
+	// Gaps in a row
+	int32_t NumGaps = 0;
+
+	// Arrival time and how long after its capture time each frame arrived, for a sliding minimum: every entry arrived
+	// later and took longer than the one before
+	std::deque<std::pair<double, double>> Offsets;
+};
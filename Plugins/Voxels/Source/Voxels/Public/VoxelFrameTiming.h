@@ -0,0 +1,44 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelFrameTiming.generated.h"
+
+/**
+*	How long a voxel frame spent in each stage between arriving and its textures being uploaded, in milliseconds.
+*	Filled in by UVoxelRenderComponent once the render thread has finished uploading the frame.
+*/
+USTRUCT(BlueprintType)
+struct VOXELS_API FVoxelFrameTiming
+{
+	GENERATED_BODY()
+
+	// Sequence number the source gave the frame
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Voxels")
+	int32 FrameSequence = 0;
+
+	// From the deserializer handing the frame to the ring buffer until CopyVoxelData picked it up. 0 for video sources.
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Voxels")
+	float QueueMs = 0.0f;
+
+	// CopyVoxelData gathering, packing and hashing the frame, including any wait for a decode worker
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Voxels")
+	float CopyMs = 0.0f;
+
+	// From the frame being published until the game thread picked it up with GetFrame
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Voxels")
+	float WaitMs = 0.0f;
+
+	// From GetFrame until every renderer's SetData had been called
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Voxels")
+	float SubmitMs = 0.0f;
+
+	// From SetData until the render thread had issued the texture uploads
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Voxels")
+	float UploadMs = 0.0f;
+
+	// From the frame arriving on this machine until its upload, the sum of the above. Both ends are read from this
+	// machine's clock. VIMR streams don't carry when the sender captured or sent a frame, so time on the network and
+	// in the sender isn't included.
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Voxels")
+	float TotalMs = 0.0f;
+};
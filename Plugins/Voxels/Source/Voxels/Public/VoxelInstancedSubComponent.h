@@ -0,0 +1,69 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "VoxelStagingBuffer.h"
+#include "VoxelInstancedSubComponent.generated.h"
+
+/**
+*	Draws a frame with one instance of a cube mesh per live voxel, so vertex work follows the voxel count rather than
+*	the capacity. Positions are decoded from the source's packed textures into instance transforms, and the colour is
+*	passed in custom data 0-2 (linear 0-1 RGB straight from the capture), which InstancedVoxelMaterial reads.
+*	Instances past the frame's voxel count are collapsed, and given up once they've gone unused for a while.
+*
+*	Voxels merged by LevelOfDetail are drawn at their size, which the sub-renderers can't do. Only instances in
+*	blocks that changed are rewritten, see the instances stage of VoxelPipelineBenchmark for what that costs.
+*/
+UCLASS()
+class VOXELS_API UVoxelInstancedSubComponent : public UInstancedStaticMeshComponent
+{
+	GENERATED_BODY()
+
+public:
+	UVoxelInstancedSubComponent();
+
+	// Must be called before the component is registered. Null Mesh or InstanceMaterial use the defaults.
+	void Init(UStaticMesh* Mesh, UMaterialInterface* InstanceMaterial, float ShrinkDelaySeconds);
+
+	// Updates the instances of the blocks that changed since the last frame
+	void SetData(const FVoxelStagingBufferRef& Staging, uint32 NumVoxels);
+
+	void BeginPlay() override;
+
+#if WITH_EDITOR
+	// Builds what /Voxels/InstancedVoxelMaterial is saved from: unlit, coloured by custom data 0-2, usable on
+	// instanced meshes. Shaders are compiled as it's built, so it's editor only.
+	static UMaterial* CreateInstancedVoxelMaterial(UObject* Outer, FName Name, EObjectFlags Flags);
+#endif
+
+	// Size of a voxel in cm
+	void SetScale(float Scale);
+
+	void SetLocation(FVector Location);
+
+	// Degrees about the X, Y and Z axes
+	void SetRotation(FVector Rotation);
+
+private:
+	// Decodes voxels [First, End) into instances, collapsing any past NumVoxels
+	void UpdateInstances(const FVoxelStagingBuffer* Staging, uint32 First, uint32 End, uint32 NumVoxels);
+
+	UPROPERTY()
+	UMaterialInterface* StaticMaterial;
+
+	// Width of the mesh in local units, used to scale it to one voxel
+	float MeshSize = 100.0f;
+
+	float Scale = 1.0f;
+
+	float ShrinkDelaySeconds = 5.0f;
+	float ShrinkPendingSince = -1.0f;
+
+	// Block hashes of the frame the instances were built from, and how many voxels it had
+	TArray<uint64> UploadedBlockHashes;
+	uint32 UploadedVoxels = 0;
+
+	// Reused between frames so updates don't allocate. Decoded instances are 4 floats each.
+	TArray<FTransform> Transforms;
+	TArray<float> InstanceData;
+};
@@ -0,0 +1,26 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "VoxelMaterialCommandlet.generated.h"
+
+/**
+*	Saves the materials and meshes the plugin builds in code to its Content folder, so packaged builds have them.
+*
+*	UE4Editor-Cmd.exe <project> -run=VoxelMaterial
+*
+*	Writes /Voxels/InstancedVoxelMaterial, which the Instanced render mode draws with, and /Voxels/AtlasUnitCubes and
+*	/Voxels/VertexMoveAtlasMaterial for the Atlas render mode. Existing assets are overwritten.
+*/
+UCLASS()
+class VOXELS_API UVoxelMaterialCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UVoxelMaterialCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
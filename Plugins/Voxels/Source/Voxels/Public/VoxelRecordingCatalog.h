@@ -0,0 +1,114 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "VoxelRecordingCatalog.generated.h"
+
+/**
+*	A recording in VoxelVideos/. Everything past its size comes from its frame cache, so a .vx3 that hasn't been
+*	played through yet only has its name, size and time.
+*/
+USTRUCT(BlueprintType)
+struct VOXELS_API FVoxelRecordingInfo
+{
+	GENERATED_BODY()
+
+	// Relative to VoxelVideos/, as LoadVoxelVideo takes it
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		FString FileName;
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		FDateTime Modified;
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		float SizeMB = 0.0f;
+
+	// The rest is only filled in if this is set
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		bool bHasMetadata = false;
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		int32 NumFrames = 0;
+	// Time of the last frame, in seconds
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		float Duration = 0.0f;
+	// Most voxels in a single frame
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		int32 MaxVoxels = 0;
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		int32 VoxelSizemm = 0;
+	// Wav files played along with it
+	UPROPERTY(BlueprintReadOnly, Category = "Recording")
+		TArray<FString> AudioStreams;
+
+	// Size and modification time of the recording and its cache when this was read, 0 for no cache. It's read again
+	// once either changes.
+	int64 Size = 0;
+	int64 Time = 0;
+	int64 CacheSize = 0;
+	int64 CacheTime = 0;
+};
+
+/**
+*	The recordings in a folder, kept up to date on a thread of its own so listing them never waits on the disk.
+*
+*	The metadata is saved to an index file in the folder, so the list is there as soon as the next run starts and a
+*	recording's cache is only read again once it changes. There's no file watcher outside the editor, so the folder
+*	is listed again every few seconds, which is one directory listing however many recordings there are.
+*/
+class VOXELS_API FVoxelRecordingCatalog
+{
+public:
+	// The catalog of the project's VoxelVideos/, started on first use. Game thread only.
+	static FVoxelRecordingCatalog& Get();
+	// Stops it, when the module shuts down
+	static void Shutdown();
+
+	explicit FVoxelRecordingCatalog(const FString& Directory);
+
+	// Waits for a scan in progress to finish
+	~FVoxelRecordingCatalog();
+
+	FVoxelRecordingCatalog(const FVoxelRecordingCatalog&) = delete;
+	FVoxelRecordingCatalog& operator=(const FVoxelRecordingCatalog&) = delete;
+
+	// As of the last scan, sorted by name. Before the first scan is done, as saved in the index.
+	TArray<FVoxelRecordingInfo> GetRecordings();
+	bool FindRecording(const FString& FileName, FVoxelRecordingInfo& Out);
+
+	// Goes up whenever the recordings change, so callers know to get them again
+	uint32 GetVersion() const { return Version; }
+
+	// Scans now rather than at the next poll, for after a recording or its cache has been written
+	void Rescan();
+
+private:
+	void Run();
+
+	// Lists the folder and reads the metadata of anything new or changed. Publishes and saves the result if it
+	// differs from what's published.
+	void Scan();
+
+	// Fills in Info's metadata from Path, a .vxz or a .vx3's cache. False if it isn't a complete cache, or it's for
+	// another version of the recording.
+	static bool ReadMetadata(const FString& Path, bool bStandalone, FVoxelRecordingInfo& Info);
+
+	bool LoadIndex(TArray<FVoxelRecordingInfo>& Out) const;
+	void SaveIndex(const TArray<FVoxelRecordingInfo>& InRecordings) const;
+
+	// Publishes InRecordings if they differ from what's there. True if they did.
+	bool Publish(TArray<FVoxelRecordingInfo>&& InRecordings);
+
+	const FString Directory;
+	const FString IndexPath;
+
+	std::mutex Mutex;
+	std::condition_variable Changed;
+	std::thread Thread;
+	bool bStopping = false;
+	bool bRescan = false;
+	TArray<FVoxelRecordingInfo> Recordings;
+	std::atomic<uint32> Version{ 0 };
+};
@@ -3,9 +3,27 @@
 #include "CoreMinimal.h"
 #include "Components/SceneComponent.h"
 #include "VoxelSourceInterface.h"
+#include "VoxelRenderSubComponent.h"
+#include "VoxelAtlasSubComponent.h"
+#include "VoxelInstancedSubComponent.h"
+#include "VoxelFrameTiming.h"
+#include "ConvexVolume.h"
+#include <atomic>
 #include "VoxelRenderComponent.generated.h"
 
-#define TOTAL_VOXELS 196608
+UENUM(BlueprintType)
+enum class EVoxelRenderMode : uint8
+{
+	// A static mesh and set of textures per VoxelTextureSize squared voxels
+	SubRenderers,
+	// One set of atlas textures and one instanced draw for all voxels, drawing merged voxels at their size. Needs
+	// /Voxels/AtlasUnitCubes and /Voxels/VertexMoveAtlasMaterial, saved by -run=VoxelMaterial and built on the fly in
+	// the editor until then.
+	Atlas,
+	// One cube instance per live voxel, drawing merged voxels at their size. Needs /Voxels/InstancedVoxelMaterial to
+	// show colours, saved by -run=VoxelMaterial and built on the fly in the editor until then.
+	Instanced,
+};
 
 UCLASS( ClassGroup=(Custom), meta=(BlueprintSpawnableComponent) )
 class VOXELS_API UVoxelRenderComponent : public USceneComponent
@@ -28,7 +46,130 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
 	TScriptInterface<IVoxelSourceInterface> VoxelSource;
 
+	// Most voxels drawn per frame, 0 draws as many as the source can hold
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	int32 MaxVoxels = 0;
+
+	// Width and height of each sub-renderer's textures, must be a power of two. VoxelMesh needs this many squared cubes.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = Default)
+	int32 VoxelTextureSize = DEFAULT_VOXEL_TEXTURE_SIZE;
+
+	// Cube mesh drawn by each sub-renderer, null uses UnitCubesOffset
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = Default)
+	UStaticMesh* VoxelMesh = nullptr;
+
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = Default)
+	EVoxelRenderMode RenderMode = EVoxelRenderMode::SubRenderers;
+
+	// Width of the atlas textures in Atlas mode, must be a power of two. The height is picked to fit MaxVoxels.
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = Default)
+	int32 AtlasWidth = DEFAULT_VOXEL_ATLAS_WIDTH;
+
+	// Material used in Atlas mode, null uses /Voxels/VertexMoveAtlasMaterial
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = Default)
+	UMaterialInterface* AtlasMaterial = nullptr;
+
+	// Cube drawn per voxel in Instanced mode, null uses /Engine/BasicShapes/Cube
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = Default)
+	UStaticMesh* InstanceMesh = nullptr;
+
+	// Material used in Instanced mode, null uses /Voxels/InstancedVoxelMaterial
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = Default)
+	UMaterialInterface* InstanceMaterial = nullptr;
+
+	// Sub-renderers no longer needed are kept around this long in case the voxel count goes back up
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Default)
+	float ShrinkDelaySeconds = 5.0f;
+
+	// In SubRenderers mode, don't upload slices whose voxels are outside the player camera's view or farther than
+	// CullDistance from it. They're uploaded once they come back into view, from whichever frame is newest by then.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Culling)
+	bool CullSlices = false;
+
+	// Slices with no voxels this close to the camera are culled, in cm. 0 culls by view only.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Culling)
+	float CullDistance = 0.0f;
+
+	// Degrees added to the camera's field of view when culling, so slices are uploaded just before they come into
+	// view and ones seen by only one eye in VR aren't missed
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Culling)
+	float CullFOVPadding = 20.0f;
+
+	// Slices left out of the last update by CullSlices
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Stats")
+	int32 SlicesCulled = 0;
+
+	// Stage timings of the most recent frame to finish uploading. Also reported as "stat Voxels" and CSV profiler stats.
+	UPROPERTY(VisibleAnywhere, BlueprintReadOnly, Category = "Stats")
+	FVoxelFrameTiming LastFrameTiming;
+
+protected:
+	virtual void BeginPlay() override;
+
 private:
+	// Creates sub-renderers until there are at least NumSlices of them
+	void GrowRenderers(int32 NumSlices);
+
+	// Destroys sub-renderers beyond the first NumSlices
+	void ShrinkRenderers(int32 NumSlices);
+
+	// Draws the frame in Atlas mode, created on the first frame once the source's capacity is known
+	void UpdateAtlas(const FVoxelStagingBufferRef& Staging, int32 VoxelCount, int32 Capacity);
+
+	// Draws the frame in Instanced mode, created on the first frame
+	void UpdateInstanced(const FVoxelStagingBufferRef& Staging, int32 VoxelCount);
+
+	// Draws the frame with a sub-renderer per VoxelTextureSize squared voxels
+	void UpdateSubRenderers(const FVoxelStagingBufferRef& Staging, int32 VoxelCount);
+
+	// Player camera's view for CullSlices, widened by CullFOVPadding. False if there's no player camera.
+	bool GetCullingView(FConvexVolume& OutFrustum, FVector& OutOrigin) const;
+
+	// Tells the source where the player's camera is in its voxels, for sources that decimate far away voxels
+	void UpdateViewerPosition();
+
+	// Notes the frame's timings so far, and queues a render command behind its uploads to time them
+	void SubmitFrameTiming(const FVoxelStagingBufferRef& Staging, double AcquiredTime);
+
+	// Finishes the timings of any submitted frames the render thread has since uploaded
+	void CompleteFrameTiming();
+
+	// Written by the render thread once it gets to the end of a frame's uploads
+	struct FUploadFence
+	{
+		std::atomic<uint32> Sequence{ 0 };
+		std::atomic<double> Time{ 0.0 };
+	};
+	TSharedRef<FUploadFence, ESPMode::ThreadSafe> UploadFence = MakeShared<FUploadFence, ESPMode::ThreadSafe>();
+
+	// Frames submitted but not yet uploaded, oldest first
+	struct FPendingTiming
+	{
+		FVoxelFrameTiming Timing;
+		double ReceivedTime;
+		double SubmittedTime;
+	};
+	TArray<FPendingTiming> PendingTimings;
+
 	UPROPERTY()
 	TArray<class UVoxelRenderSubComponent*> VoxelRenderers;
+
+	UPROPERTY()
+	UVoxelAtlasSubComponent* AtlasRenderer = nullptr;
+
+	UPROPERTY()
+	UVoxelInstancedSubComponent* InstancedRenderer = nullptr;
+
+	// Most slices used since the sub-renderers were last needed, and when that was. Negative while all are in use.
+	int32 RecentSlices = 0;
+	float ShrinkPendingSince = -1.0f;
+
+	// Applied to sub-renderers as they're created
+	float Scale = 1.0f;
+	FVector Location = FVector(0.0f);
+	FVector Rotation = FVector(0.0f);
+
+	// Sequence number of the last source frame handed to the sub-renderers, and how many of its voxels were drawn
+	uint32 LastFrameSequence = 0;
+	int32 LastVoxelCount = 0;
 };
\ No newline at end of file
@@ -2,11 +2,13 @@
 
 #include "CoreMinimal.h"
 #include "Components/StaticMeshComponent.h"
+#include "VoxelStagingBuffer.h"
+#include "Containers/ArrayView.h"
 #include "VoxelRenderSubComponent.generated.h"
 
 
-#define SUB_VOXEL_COUNT 16384 // default 16384 
-#define SUB_VOXEL_COUNT_SQR 128 // default 128
+#define DEFAULT_VOXEL_TEXTURE_SIZE 128 // UnitCubesOffset has 128 * 128 cubes
+#define DEFAULT_MAX_VOXELS 196608
 #define VOXEL_TEXTURE_BPP 4
 
 UCLASS()
@@ -17,8 +19,15 @@ class VOXELS_API UVoxelRenderSubComponent : public UStaticMeshComponent
 public:
 	UVoxelRenderSubComponent();
 
-	void SetData(uint8* CoarsePositionData, uint8* PositionData, uint8* ColourData);
+	// Must be called before the component is registered. Mesh has to have TextureSize * TextureSize cubes, null keeps UnitCubesOffset.
+	void Init(int32 TextureSize, UStaticMesh* Mesh);
 
+	// Uploads the NumVoxels texels of Staging starting at TexelOffset, and clears rows that are no longer used. Only
+	// blocks whose hash changed since the last upload are sent, and nothing if SliceHash matches it. Holds a
+	// reference to Staging until the render thread is done with it.
+	void SetData(const FVoxelStagingBufferRef& Staging, uint32 TexelOffset, uint32 NumVoxels, uint64 SliceHash);
+
+	// Clears the position textures, skipped if they're already clear
 	void ZeroData();
 
 	void BeginPlay() override;
@@ -31,6 +40,12 @@ public:
 
 	void SetRotation(FVector Rotation);
 
+	// Fits the component's bounds to the slice's voxels, so it can be culled. Empty bounds go back to covering
+	// anywhere VertexMoveMaterial could put a voxel.
+	void SetVoxelBounds(const FVoxelBounds& VoxelBounds);
+
+	FBoxSphereBounds CalcBounds(const FTransform& LocalToWorld) const override;
+
 private:
 	UPROPERTY()
 	UMaterialInterface* StaticMaterial;
@@ -47,8 +62,22 @@ private:
 	UPROPERTY()
 	UTexture2D* ColourTexture;
 
-	FUpdateTextureRegion2D *UpdateTextureRegion;
-	uint8* EmptyData;
+	// Uploads each region from the rows of Staging starting at TexelOffset, and clears EmptyRegion of the position
+	// textures from EmptyData
+	void UploadTextures(const FVoxelStagingBufferRef& Staging, uint32 TexelOffset, TArrayView<const FUpdateTextureRegion2D> DataRegions, const FUpdateTextureRegion2D& EmptyRegion);
+
+	int32 TextureSize = DEFAULT_VOXEL_TEXTURE_SIZE;
+
+	// Zero filled slice used to clear unused rows
+	FVoxelStagingBufferRef EmptyData;
+
+	bool bHasData = false;
+	uint64 UploadedHash = 0;
+	// Hashes of the source blocks covering the slice when it was last uploaded, and how many rows it used.
+	// Transient textures start out undefined, so every row is cleared the first time.
+	TArray<uint64> UploadedBlockHashes;
+	int32 UploadedRows = DEFAULT_VOXEL_TEXTURE_SIZE;
+	bool bZeroed = false;
 
 	bool bQueueScale = false;
 	bool bQueueLocation = false;
@@ -58,4 +87,9 @@ private:
 
 	FVector Location = FVector(0.0f);
 	FVector Rotation = FVector(0.0f);
+
+	// Fits the bounds again after the voxels' transform changed
+	void UpdateVoxelBounds();
+
+	FVoxelBounds VoxelBounds;
 };
@@ -0,0 +1,67 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <cstdint>
+#include <vector>
+
+/**
+*	Hands out texel slots for voxels that should stay in the same texel for as long as they exist. New slots are
+*	always the lowest free ones, so holes left by freed slots fill up before the used range grows, and Compact moves
+*	slots from the top of the range down into any holes that remain so the range can shrink.
+*
+*	Slots are also counted per block of BlockSlots, so renderers can tell which blocks have nothing in them.
+*
+*	Used by FVoxelDeltaEncoder to keep voxels in their texels with DeltaFrames on. The block counts become the frame's
+*	BlockVoxelCounts, which let sub-renderers above the range in use go idle, and the holes are the VoxelSlotHoles stat.
+*/
+class FVoxelSlotAllocator
+{
+public:
+	struct FMove
+	{
+		uint32_t From;
+		uint32_t To;
+	};
+
+	// Frees every slot
+	void Reset(uint32_t MaxSlots, uint32_t BlockSlots);
+
+	// Lowest free slot, or -1 if every slot is taken
+	int32_t Allocate();
+
+	void Free(uint32_t Slot);
+
+	bool IsAllocated(uint32_t Slot) const
+	{
+		return Slot < NumSlots && (FreeBits[Slot / 64] & (1ull << (Slot % 64))) == 0;
+	}
+
+	// Moves up to MaxMoves of the highest allocated slots into the lowest free ones, appending each move to Moves.
+	// The caller has to move whatever it keeps per slot to match.
+	uint32_t Compact(uint32_t MaxMoves, std::vector<FMove>& Moves);
+
+	// One past the highest allocated slot
+	uint32_t GetNumSlots() const { return NumSlots; }
+
+	// Free slots below GetNumSlots()
+	uint32_t GetNumHoles() const { return NumSlots - NumAllocated; }
+
+	// Allocated slots in each block, covering every block up to the MaxSlots given to Reset
+	const std::vector<uint16_t>& GetBlockCounts() const { return BlockCounts; }
+
+private:
+	// Lowest free slot below NumSlots, only valid while there are holes
+	uint32_t FindHole();
+
+	// One bit per slot below NumSlots, set while it's free
+	std::vector<uint64_t> FreeBits;
+	// No word of FreeBits before this one has a bit set, past the end while there are no holes
+	uint32_t FirstHoleWord = 0;
+
+	std::vector<uint16_t> BlockCounts;
+	uint32_t BlockSlots = 1;
+
+	uint32_t NumSlots = 0;
+	uint32_t NumAllocated = 0;
+	uint32_t MaxSlots = 0;
+};
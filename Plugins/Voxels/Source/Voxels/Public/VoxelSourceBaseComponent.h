@@ -5,6 +5,11 @@
 #include "CoreMinimal.h"
 #include "Components/ActorComponent.h"
 #include "VoxelSourceInterface.h"
+#include "VoxelTripleBuffer.h"
+#include "VoxelDeltaEncoder.h"
+#include "VoxelDecimator.h"
+#include "VoxelDecodePool.h"
+#include "VoxelFramePacer.h"
 #include "VIMR/VoxGrid.hpp"
 #include "VIMR/Octree.hpp"
 #include "Voxels.h"
@@ -12,6 +17,7 @@
 #include "AllowWindowsPlatformTypes.h"
 #include "VIMR/cfg_unreal.hpp"
 #include "HideWindowsPlatformTypes.h"
+#include <atomic>
 #include <map>
 #include <string>
 #include "VoxelSourceBaseComponent.generated.h"
@@ -19,6 +25,18 @@
 using std::map;
 using std::string;
 
+// What gives when frames arrive faster than the decode workers get through them, same order as FVoxelDecodePool::EBackpressure
+UENUM(BlueprintType)
+enum class EVoxelDecodeBackpressure : uint8
+{
+	// Replace the oldest frame still waiting for a worker, so latency stays low
+	DropOldest,
+	// Drop the frame that just arrived
+	DropNewest,
+	// Hold up the thread handing frames over until there's room, so nothing is lost
+	Block,
+};
+
 UCLASS(ClassGroup = (Custom), meta = (BlueprintSpawnableComponent))
 class VOXELS_API UVoxelSourceBaseComponent : public USceneComponent, public IVoxelSourceInterface
 {
@@ -28,12 +46,21 @@ public:
 	// Sets default values for this component's properties
 	UVoxelSourceBaseComponent();
 
-	void GetFramePointers(int &VoxelCount, uint8*& CoarsePositionData, uint8*& PositionData, uint8*& ColourData, uint8& Voxelmm) override;
+	FVoxelStagingBufferRef GetFrame() override;
 
 	int GetSourceType() { return UDPSource; }
 
+	int32 GetMaxVoxels() override { return MaxVoxels; }
+
+	void SetViewerPosition(const FVector& VoxelPosition) override;
+
+	void SetDrawsMergedVoxels(bool bDraws) override;
+
 	void CopyVoxelData(VIMR::VoxelGrid* voxels);
 
+	// Same, for a grid that came in over the network at ReceivedTime (FPlatformTime::Seconds())
+	void CopyReceivedVoxelData(VIMR::VoxelGrid* voxels, double ReceivedTime);
+
 	virtual void TickComponent(float DeltaTime, ELevelTick TickType, FActorComponentTickFunction* ThisTickFunction) override;
 
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
@@ -63,15 +90,145 @@ public:
 		TArray<FVector> Bone_dir;
 	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
 		TArray<FVector> Bone_pos;
+	// Voxel size of the last frame published, refreshed every tick
 	UPROPERTY(BlueprintReadOnly, VisibleAnywhere)
 		float VoxelSize_mm = 8.0;
+
+	// Most voxels kept from a single frame. 0 reads MaxVoxels from LocalConfig.json, first from this component's
+	// section then from the top level, falling back to DEFAULT_MAX_VOXELS. Frame buffers start smaller and grow up to it.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 MaxVoxels = 0;
+
+	// Most threads used to pack a frame's sub-renderer slices, 0 for one per hardware thread. Each gets at least
+	// VoxelPacking::MinVoxelsPerWorker voxels, so smaller frames are packed on one.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 PackingThreads = 0;
+
+	// Threads that pack frames, so the thread handing them over only copies the voxels out and goes straight back to
+	// receiving. 0 packs each frame on that thread, as it arrives. Frames are still published in the order they came.
+	// Not used with DeltaFrames on, where each frame builds on the one before. Read when play begins.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 DecodeWorkers = 0;
+
+	// Frames that can wait for a decode worker before DecodeBackpressure kicks in
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 DecodeQueueDepth = 2;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		EVoxelDecodeBackpressure DecodeBackpressure = EVoxelDecodeBackpressure::DropOldest;
+
+	// Hold frames back and hand them to the renderers at the cadence they were captured, on the render tick nearest
+	// each one's turn, rather than as soon as they're copied, so network jitter doesn't show up as uneven motion.
+	// Meant for live sources, adds at least JitterTargetLatencyMs of latency. Read when play begins.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Jitter Buffer")
+		bool JitterBuffer = false;
+
+	// Least time frames are held back for on top of the network's base delay, in milliseconds
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Jitter Buffer")
+		float JitterTargetLatencyMs = 50.0f;
+
+	// Hold frames back for JitterMultiplier times the observed jitter when that's longer than JitterTargetLatencyMs
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Jitter Buffer")
+		bool JitterAdaptive = true;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Jitter Buffer")
+		float JitterMultiplier = 3.0f;
+
+	// Longest frames are held back for, however bad the jitter gets, in milliseconds
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Jitter Buffer")
+		float JitterMaxLatencyMs = 250.0f;
+
+	// Most frames held back at once, each one keeps a frame buffer. Once full the oldest is dropped.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Jitter Buffer")
+		int32 JitterMaxFrames = 8;
+
+	// Keep each voxel in the same texel for as long as it exists, so only voxels that were added, removed or
+	// recoloured since the last frame are repacked, and the renderers only upload the blocks they're in.
+	// Worth it for mostly static scenes, but voxels are no longer in grid order and removed ones leave holes.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		bool DeltaFrames = false;
+
+	// Copy each voxel's Hidden and Special flags and aux label into the frame, for anything that needs to tell
+	// body parts apart. Not kept with DeltaFrames on, where texels aren't in the order the grid gives them.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		bool KeepVoxelLabels = false;
+
+	// When a frame has more than MaxVoxels voxels, merge the ones far from the viewer into 2x2x2 and then 4x4x4 cells
+	// until it fits, rather than dropping whichever come last. Merged voxels have their level in the alpha of the fine
+	// position texel, which only the Atlas and Instanced render modes draw at their size, so this is ignored while any
+	// renderer reading the source uses SubRenderers. Not applied with DeltaFrames on.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		bool LevelOfDetail = false;
+
+	// Reorder each frame's voxels along a Morton (Z-order) curve before packing them into texels, so every
+	// sub-renderer slice covers a compact region. Slices get tighter bounds to cull with, and neighbouring cubes read
+	// neighbouring texels. Not applied with DeltaFrames on, where voxels keep their texels.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		bool MortonOrder = false;
+
+	// Highest level voxels are merged to with LevelOfDetail on, 1 for 2x2x2 cells and 2 for 4x4x4
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 MaxDetailLevel = FVoxelDecimator::MaxLevel;
+
+	// With DeltaFrames on, once more than this fraction of the texel slots in use are holes, the highest voxels
+	// are moved down into them so the range in use shrinks and the sub-renderers above it go idle
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		float CompactionThreshold = 0.25f;
+
+	// Most voxels moved per frame while compacting, each move makes two blocks upload again
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 MaxCompactionMoves = 4096;
+
+	// Frame exchange stats, refreshed every tick from the producer thread's counters
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 FramesPublished = 0;
+	// Frames that arrived while the previous one was still being copied
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 FramesDropped = 0;
+	// Completed frames that were replaced by a newer one before the game thread picked them up
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 FramesOverwritten = 0;
+	// Voxels added, removed or recoloured by the last frame, with DeltaFrames on
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 VoxelsChanged = 0;
+	// Free texel slots below the highest one in use, with DeltaFrames on
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 VoxelSlotHoles = 0;
+	// Voxels the last frame had beyond MaxVoxels that were merged away or left out, with LevelOfDetail on
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 VoxelsDecimated = 0;
+	// Frames waiting for a decode worker
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 DecodeQueueLength = 0;
+	// Frames dropped by DecodeBackpressure because the decode queue was full
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 FramesDecodeDropped = 0;
+	// Times a full decode queue held up the thread handing frames over
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 DecodeWaits = 0;
+	// Times the thread handing frames over waited for decode workers to give back a slot, whatever DecodeBackpressure is
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 DecodeSlotWaits = 0;
+	// Frames held back by the jitter buffer
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 JitterBufferDepth = 0;
+	// Mean deviation of the time between frames arriving from their period, and what frames are held back for
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		float JitterMs = 0.0f;
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		float JitterDelayMs = 0.0f;
+	// Frames that arrived after their turn to be shown, and frames the jitter buffer never showed because a newer
+	// one was due by the same tick or it was full
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 FramesLate = 0;
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 FramesSkipped = 0;
 protected:
 	// Called when the game starts
 	virtual void BeginPlay() override;
 	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 
 	VIMR::Config::UnrealConfigWrapper* VIMRconfig = nullptr;
-	VIMR::Voxel *node;
 
 	const int BODY_COUNT = 6;
 
@@ -105,18 +262,167 @@ protected:
 	  128,128,128 //RCalf
 	};
 
-	static const int BufferSize = 2;
-	uint32_t MaxVoxels = TOTAL_VOXELS; //FIXME: Hard-coded stuff here
-	uint8* CoarsePositionData[BufferSize];
-	uint8* PositionData[BufferSize];
-	uint8* ColourData[BufferSize];
-	uint8 VoxelSizemm[BufferSize];
-	uint32_t VoxelCount[BufferSize];
+	// Triple buffered between the producer (network/video thread) and the consumer (game thread), see Handoff
+	static const int BufferSize = 3;
+
+	// Voxels copied out of a grid, waiting to be packed into a frame, and the scratch space for packing them
+	struct FVoxelGather
+	{
+		// Grows every array to hold at least NumVoxels, keeping what's in them. Never shrinks them.
+		void Reserve(uint32 NumVoxels);
+
+		uint32 GetCapacity() const { return (uint32)Colours.Num(); }
+
+		// Trades the gathered voxels with Other's without copying them
+		void SwapVoxels(FVoxelGather& Other);
+
+		// Positions gathered from the voxel grid before being packed into texels, their colours, and labels with
+		// KeepVoxelLabels on
+		TArray<int16> Positions;
+		TArray<uint32> Colours;
+		TArray<uint8> Flags;
+		TArray<uint16> AuxLabels;
+		uint32 Count = 0;
+		bool bLabels = false;
+		uint8 VoxelSizemm = 0;
+		double ReceivedTime = 0.0;
+		double CopyStartTime = 0.0;
+
+		// With LevelOfDetail on
+		FVoxelDecimator Decimator;
+		std::vector<uint32_t> DecimatorKept;
+
+		// With MortonOrder on, the order voxels are packed in and the positions in that order
+		std::vector<uint32_t> SortOrder;
+		std::vector<uint64_t> SortItems;
+		std::vector<uint32_t> SortHistograms;
+		TArray<int16> SortedPositions;
+
+		// Packed by a decode worker, waiting to be published
+		FVoxelStagingBufferRef Frame;
+	};
+
+	// Copies a frame in with Gather, then packs and publishes it here or on a decode worker. ReceivedTime is when it
+	// arrived, 0 for frames that don't come over the network, which count from when the copy starts.
+	void CopyFrame(TFunctionRef<void(FVoxelGather&)> Gather, double ReceivedTime = 0.0);
+
+	// Copies every voxel of the grid into Gather
+	void GatherFrame(VIMR::VoxelGrid* voxels, FVoxelGather& Gather);
+
+	// Called on the producer thread with every frame as soon as it's gathered, before it's decimated or packed
+	virtual void OnFrameGathered(const FVoxelGather& Gather) {}
+
+	// Whether OnFrameGathered needs frames whole: gathered past MaxVoxels, with labels, and even if the pipeline
+	// drops them. LimitFrame cuts them down to what KeepVoxelLabels and MaxVoxels allow once it's had them.
+	virtual bool WantsWholeFrames() const { return false; }
+	void LimitFrame(FVoxelGather& Gather);
+
+	// Gathers a frame the pipeline is dropping for OnFrameGathered, if it wants whole frames
+	void GatherDroppedFrame(TFunctionRef<void(FVoxelGather&)> Gather);
+
+	// Most voxels a frame is gathered with, past MaxVoxels while LevelOfDetail applies
+	uint32 GetGatherLimit() const;
+
+	// LevelOfDetail, as long as every renderer reading the source can draw merged voxels
+	bool IsLevelOfDetailApplied() const { return LevelOfDetail && MergedVoxelsDrawn.load(std::memory_order_relaxed); }
+
+	// Brings the gathered voxels down to MaxVoxels, merging them with LevelOfDetail applied
+	void DecimateFrame(FVoxelGather& Gather);
+
+	// Packs the gathered voxels into Frame, which has to have room for them
+	void PackFrame(FVoxelGather& Gather, FVoxelStagingBuffer* Frame);
+
+	// Applies the frame's changes to DeltaImage, then copies the blocks the write buffer is missing from it
+	void CopyDeltaFrame(const FVoxelGather& Gather, int32 buffIdx);
+
+	// Stamps the write buffer and hands it to the game thread, through the jitter buffer if it's on. Caller holds
+	// PublishLock.
+	void PublishFrame(int32 buffIdx, uint8 VoxelSizemm, double ReceivedTime, double CopyStartTime);
+
+	// Decode pool callbacks, on the decode workers
+	void DecodeFrame(int32 Slot);
+	void PublishDecoded(int32 Slot);
+
+	// Swaps the buffer being written for a larger one. Producer only.
+	void GrowCapacity(int32 buffIdx);
+
+	// Frame buffers start out this big, enough for a single person at the default voxel size
+	static const uint32 InitialCapacity = 65536;
+
+	// With LevelOfDetail on, up to this many times MaxVoxels are gathered before the frame is decimated
+	static const uint32 LodGatherFactor = 8;
+
+	// Most voxels a whole frame is gathered with, far past anything a capture produces
+	static const uint32 MaxWholeFrameVoxels = 1u << 24;
+
+	// Current size of the frame buffers in voxels, grows up to MaxVoxels. Only touched by the producer after BeginPlay.
+	uint32 Capacity = 0;
+	// Each buffer may still be referenced by the render thread after the consumer lets go of it, in which
+	// case the producer swaps in a fresh one from the pool rather than writing over it
+	TSharedPtr<FVoxelStagingPool, ESPMode::ThreadSafe> StagingPool;
+	FVoxelStagingBufferRef FrameBuffers[BufferSize];
+
+	// Used when frames are packed as they arrive
+	FVoxelGather FrameGather;
+
+	// With DecodeWorkers, one gather per pool slot. Frames published by the workers take the place of the write
+	// buffer, and PublishLock keeps them from publishing over each other or over a frame packed as it arrived.
+	TUniquePtr<FVoxelDecodePool> DecodePool;
+	TArray<TUniquePtr<FVoxelGather>> DecodeSlots;
+	FCriticalSection PublishLock;
+
+	// Delta frames state, only touched by the producer. DeltaImage always holds the latest frame and its block hashes
+	// and bounds, and each block's
+	// entry in DeltaBlockSequences is the sequence number of the frame that last changed it. Buffers holding a frame
+	// from before DeltaEpoch are copied in full.
+	FVoxelDeltaEncoder DeltaEncoder;
+	FVoxelStagingBufferRef DeltaImage;
+	TArray<uint32> DeltaBlockSequences;
+	std::vector<uint8_t> DirtyBlocks;
+	uint32 DeltaEpoch = 0;
+	bool bDeltaActive = false;
+
+	FVoxelTripleBuffer Handoff;
+	uint32 LastFrameSequence; // Only touched while holding PublishLock
+
+	// With JitterBuffer on, published frames wait here, oldest first, until GetFrame finds them due. They keep their
+	// buffers referenced, so the producer writes the next frame into a fresh one instead of going round Handoff.
+	struct FJitterFrame
+	{
+		FVoxelStagingBufferRef Frame;
+		double ReleaseTime;
+	};
+	bool bJitterBuffering = false;
+	FVoxelFramePacer Pacer; // Only touched while holding PublishLock
+	TArray<FJitterFrame> JitterFrames;
+	FCriticalSection JitterLock;
+	FVoxelStagingBufferRef JitterCurrent; // Game thread only
+	std::atomic<float> ObservedJitter;
+	std::atomic<float> PlayoutDelay;
+	std::atomic<uint32> LateCount;
+	std::atomic<uint32> SkippedCount;
+
+	std::atomic<bool> inProgress;
 
+	// Frames the pipeline drops are gathered here when they're wanted whole, on whichever producer thread drops them
+	FCriticalSection DroppedGatherLock;
+	FVoxelGather DroppedGather;
 
-	int buffIdx;
-	int dispIdx;
+	std::atomic<uint32> ChangedVoxelCount;
+	std::atomic<uint32> SlotHoleCount;
+	// VoxelSizemm of the last frame published, 0 before the first
+	std::atomic<uint32> PublishedVoxelSizemm;
+	std::atomic<uint32> DecimatedCount;
 
-	bool inProgress = false;
-	bool inDisplay = false;
+	// Set by the game thread through SetViewerPosition, read by the producer
+	std::atomic<float> ViewerPosition[3];
+	// Whether every renderer that called SetDrawsMergedVoxels last tick draws merged voxels. The game thread gathers
+	// the calls over a tick and sets this in TickComponent.
+	std::atomic<bool> MergedVoxelsDrawn;
+	bool bMergedVoxelsReported = false;
+	bool bMergedVoxelsDrawnThisTick = true;
+	bool bWarnedLevelOfDetail = false;
+	std::atomic<uint32> PublishedCount;
+	std::atomic<uint32> DroppedCount;
+	std::atomic<uint32> OverwrittenCount;
 };
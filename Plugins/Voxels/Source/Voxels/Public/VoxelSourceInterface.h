@@ -2,6 +2,7 @@
 
 #include "CoreMinimal.h"
 #include "UObject/NoExportTypes.h"
+#include "VoxelStagingBuffer.h"
 #include "VoxelSourceInterface.generated.h"
 
 UINTERFACE()
@@ -15,8 +16,22 @@ class VOXELS_API IVoxelSourceInterface
 	GENERATED_BODY()
 
 public:
-	virtual void GetFramePointers(int& VoxelCount, uint8*& CoarsePositionData, uint8*& PositionData, uint8*& ColourData, uint8& voxelmm) = 0;
+	// Newest frame the source has published, null before the first one. Frames are shared by everything that asks
+	// for them and never change once published, so callers can hold on to one for as long as they need it.
+	// FrameSequence increases by one for every frame the source publishes, so callers can tell when nothing has changed.
+	virtual FVoxelStagingBufferRef GetFrame() = 0;
 
 	UFUNCTION()
 	virtual int GetSourceType() = 0;
+
+	// Most voxels a single frame from this source can hold
+	virtual int32 GetMaxVoxels() = 0;
+
+	// Where the viewer is, in this source's voxels. Sources that merge voxels far from the viewer to stay within
+	// MaxVoxels use it to decide which ones, the rest ignore it.
+	virtual void SetViewerPosition(const FVector& VoxelPosition) {}
+
+	// Whether the renderer reading this source draws merged voxels at their size, called by every renderer each tick.
+	// Sources only merge voxels while all of them do.
+	virtual void SetDrawsMergedVoxels(bool bDraws) {}
 };
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Templates/RefCounting.h"
+#include "Templates/SharedPointer.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Containers/LockFreeList.h"
+#include <atomic>
+
+class FVoxelStagingPool;
+
+// Extent of a set of voxels in voxel units, in X, Y, Z order. Min is above Max while there are none.
+struct FVoxelBounds
+{
+	int16 Min[3] = { MAX_int16, MAX_int16, MAX_int16 };
+	int16 Max[3] = { MIN_int16, MIN_int16, MIN_int16 };
+
+	bool IsEmpty() const { return Min[0] > Max[0]; }
+
+	void Add(const FVoxelBounds& Other)
+	{
+		for (int32 Axis = 0; Axis < 3; Axis++)
+		{
+			Min[Axis] = FMath::Min(Min[Axis], Other.Min[Axis]);
+			Max[Axis] = FMath::Max(Max[Axis], Other.Max[Axis]);
+		}
+	}
+};
+
+// Bits of FVoxelStagingBuffer::Flags, copied from the VIMR voxel flags of the same name
+enum EVoxelFlags : uint8
+{
+	VoxelFlag_Hidden = 1 << 0,
+	VoxelFlag_Special = 1 << 1,
+};
+
+/**
+*	One frame of voxels, shared between a voxel source, any number of renderers and the render thread.
+*	The coarse position, position and colour planes are stored back to back so a sub-renderer can upload
+*	its slice straight out of the buffer, the rest describes what's in them. Nothing changes a frame once its
+*	source has published it, and the buffer goes back to its pool when the last reference is released, which is
+*	usually on the render thread once the texture upload has been done.
+*/
+class VOXELS_API FVoxelStagingBuffer
+{
+public:
+	uint8* GetCoarsePositionData() const { return Data; }
+	uint8* GetPositionData() const { return Data + PlaneSize; }
+	uint8* GetColourData() const { return Data + 2 * PlaneSize; }
+	size_t GetPlaneSize() const { return PlaneSize; }
+
+	// Frames are hashed in blocks of this many texels. Both position planes are zero padded up to the end of the last
+	// block, so texels past the last voxel are empty. The colour plane isn't, those texels keep whatever was there.
+	// Sub-renderer texture sizes are powers of two no bigger than this, so every row they upload is covered.
+	static const uint32 HashBlockTexels = 4096;
+
+	// Sequence number of the frame currently held, and a content hash of each HashBlockTexels block of it
+	uint32 FrameSequence = 0;
+	TArray<uint64> BlockHashes;
+
+	// Texels in use, including any free ones between voxels, and the size of a voxel
+	uint32 NumVoxels = 0;
+	uint8 VoxelSizemm = 0;
+
+	// Extent of the frame's voxels, and of the voxels in each HashBlockTexels block
+	FVoxelBounds Bounds;
+	TArray<FVoxelBounds> BlockBounds;
+
+	// EVoxelFlags and VIMR aux label of each voxel, in texel order. Empty unless the source was asked to keep them.
+	TArray<uint8> Flags;
+	TArray<uint16> AuxLabels;
+
+	// Voxels in each HashBlockTexels block. Full up to the voxel count for a frame packed in grid order, the
+	// compositor's frames have a partly full block wherever one input's voxels end, and with delta frames a block
+	// can be anything down to empty.
+	TArray<uint16> BlockVoxelCounts;
+
+	// FPlatformTime::Seconds() when the frame arrived on this machine, and when CopyVoxelData started and finished it.
+	// Sources that don't receive over the network use the copy start as the arrival time.
+	double ReceivedTime = 0.0;
+	double CopyStartTime = 0.0;
+	double CopyEndTime = 0.0;
+
+	// Extent of the voxels in the blocks covering NumVoxels texels from First. Empty if any of those blocks has no
+	// bounds, as well as when there are no voxels.
+	FVoxelBounds GetBounds(uint32 First, uint32 NumVoxels) const;
+
+	uint32 AddRef() const;
+	uint32 Release() const;
+	uint32 GetRefCount() const;
+
+	// Planes start on this boundary, and are sized in multiples of it
+	static const uint32 Alignment = 64;
+
+	// Buffers of at least this many bytes are aligned to it and asked to be backed by huge pages, so uploading a
+	// frame doesn't walk hundreds of 4KB pages
+	static const size_t HugePageSize = 2 * 1024 * 1024;
+
+private:
+	friend class FVoxelStagingPool;
+
+	FVoxelStagingBuffer(size_t PlaneSize);
+	~FVoxelStagingBuffer();
+
+	// Forgets the frame held, so whoever acquires the buffer next can't mistake it for one of theirs. The planes
+	// are left as they are.
+	void ResetFrame();
+
+	mutable FThreadSafeCounter NumRefs;
+
+	// Only set while the buffer is handed out, so idle buffers don't keep their pool alive
+	TSharedPtr<FVoxelStagingPool, ESPMode::ThreadSafe> Pool;
+
+	uint8* Data;
+	size_t PlaneSize;
+	// Bytes allocated from the OS for a huge page buffer, 0 if it came from FMemory
+	size_t OSAllocSize = 0;
+};
+
+typedef TRefCountPtr<FVoxelStagingBuffer> FVoxelStagingBufferRef;
+
+/**
+*	Lock-free pool of equally sized staging buffers. Buffers are only allocated while the pool is warming up,
+*	after that every Acquire reuses one that has been released by the render thread.
+*
+*	Voxel sources share one process-wide pool per size class, see GetShared, so buffers are reused across sources,
+*	recordings and level loads instead of being allocated again. Buffers from a shared pool hold whatever frame
+*	they were last used for. Shared pools keep at most MaxSharedIdle buffers idle, and TrimShared frees the idle
+*	buffers of classes nothing has used for a while.
+*/
+class VOXELS_API FVoxelStagingPool : public TSharedFromThis<FVoxelStagingPool, ESPMode::ThreadSafe>
+{
+public:
+	// A pool of its own, with zero filled buffers
+	static TSharedRef<FVoxelStagingPool, ESPMode::ThreadSafe> Create(size_t PlaneSize);
+
+	// The shared pool for the size class holding PlaneSize, see GetSizeClass. Thread safe.
+	static TSharedRef<FVoxelStagingPool, ESPMode::ThreadSafe> GetShared(size_t PlaneSize);
+
+	// Lets go of the shared pools, each one is freed once its last buffer comes back. Called on module shutdown.
+	static void ReleaseShared();
+
+	// Frees the idle buffers of shared pools nothing has acquired from in IdleSeconds, and drops the pools no one
+	// holds. Called every few seconds by the module.
+	static void TrimShared(double IdleSeconds);
+
+	// Most idle buffers a shared pool keeps, any more are freed as they come back
+	static const int32 MaxSharedIdle = 16;
+
+	// Plane size of the class PlaneSize falls in. Powers of two up to 256KB, then four classes per power of two
+	// (1, 1.25, 1.5 and 1.75 times it) so a class is never more than a quarter bigger than what's asked for.
+	static size_t GetSizeClass(size_t PlaneSize);
+
+	~FVoxelStagingPool();
+
+	FVoxelStagingBufferRef Acquire();
+
+	size_t GetPlaneSize() const { return PlaneSize; }
+
+	int32 GetNumAllocated() const { return NumAllocated.GetValue(); }
+
+	// Frees every buffer that's waiting to be acquired
+	void TrimIdle();
+
+private:
+	friend class FVoxelStagingBuffer;
+
+	FVoxelStagingPool(size_t PlaneSize) : PlaneSize(PlaneSize) {}
+
+	void Recycle(FVoxelStagingBuffer* Buffer);
+
+	size_t PlaneSize;
+	FThreadSafeCounter NumAllocated;
+	FThreadSafeCounter NumIdle;
+	// 0 for no limit
+	int32 MaxIdle = 0;
+	// FPlatformTime::Seconds() of the last Acquire
+	std::atomic<double> LastAcquireTime{ 0.0 };
+	TLockFreePointerListUnordered<FVoxelStagingBuffer, PLATFORM_CACHE_LINE_SIZE> FreeList;
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+// Engine independent, so it can also be built into the headless benchmarks in Plugins/Voxels/Benchmark
+#include <atomic>
+#include <cstdint>
+
+/**
+*	Index bookkeeping for a lock free triple buffer. The producer only ever writes GetWriteIndex(), the consumer only
+*	ever reads GetReadIndex(), and the third buffer is parked between them. Neither side waits on the other.
+*/
+class FVoxelTripleBuffer
+{
+public:
+	FVoxelTripleBuffer()
+	{
+		Reset();
+	}
+
+	// Not thread safe, only call while neither side is running
+	void Reset()
+	{
+		ReadIdx = 0;
+		WriteIdx = 1;
+		LatestIdx.store(2, std::memory_order_release);
+	}
+
+	int32_t GetWriteIndex() const { return WriteIdx; }
+
+	int32_t GetReadIndex() const { return ReadIdx; }
+
+	/**
+	*	Producer only. Parks the buffer just written and takes back whichever one was parked.
+	*	@return True if the parked frame was never picked up by the consumer, and has just been overwritten
+	*/
+	bool Publish()
+	{
+		int32_t Previous = LatestIdx.exchange(WriteIdx | FreshFrameFlag, std::memory_order_acq_rel);
+		WriteIdx = Previous & ~FreshFrameFlag;
+		return (Previous & FreshFrameFlag) != 0;
+	}
+
+	/**
+	*	Consumer only. Swaps in the newest published frame if there is one, otherwise keeps the current one.
+	*	@return True if the read buffer changed
+	*/
+	bool Acquire()
+	{
+		if ((LatestIdx.load(std::memory_order_relaxed) & FreshFrameFlag) == 0)
+		{
+			return false;
+		}
+		ReadIdx = LatestIdx.exchange(ReadIdx, std::memory_order_acq_rel) & ~FreshFrameFlag;
+		return true;
+	}
+
+private:
+	// Set in LatestIdx while the parked buffer holds a frame the consumer hasn't picked up yet
+	static const int32_t FreshFrameFlag = 0x4;
+
+	int32_t WriteIdx;
+	int32_t ReadIdx;
+	std::atomic<int32_t> LatestIdx;
+};
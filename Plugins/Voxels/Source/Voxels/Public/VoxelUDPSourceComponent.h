@@ -13,6 +13,14 @@
 #include <string>
 #include "VoxelUDPSourceComponent.generated.h"
 
+// An octree slot of the receive ring, stamped with when the deserializer started filling it so the time travels with
+// the frame however long it waits in the ring. This is the local receive time by FPlatformTime::Seconds(): the
+// stream has no sender timestamp to carry instead.
+struct FVoxelReceivedOctree : public VIMR::Octree
+{
+	double ReceivedTime = 0.0;
+};
+
 UCLASS(ClassGroup = (Custom), meta = (BlueprintSpawnableComponent))
 class VOXELS_API UVoxelUDPSourceComponent : public UVoxelSourceBaseComponent
 {
@@ -35,5 +43,5 @@ protected:
 	bool sendPoses = false;
 	std::map<std::string, VIMR::Network::UDPSenderAsync*> pose_senders;
 	VIMR::Utils::Buffer<char, 128> pose_buf;
-	VIMR::Async::RingbufferConsumer<VIMR::Octree, 8>* consumer = nullptr;
+	VIMR::Async::RingbufferConsumer<FVoxelReceivedOctree, 8>* consumer = nullptr;
 };
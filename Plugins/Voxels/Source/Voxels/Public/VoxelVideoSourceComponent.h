@@ -13,13 +13,76 @@
 #include "VIMR/voxgrid.hpp"
 #include "VIMR/vidplayer.hpp"
 #include "RuntimeAudioSource.h"
+#include "VoxelFrameCache.h"
+#include "VoxelCachePlayer.h"
+#include "VoxelRecordingCatalog.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Async/MappedFileHandle.h"
+#include "Async/Future.h"
+#include <atomic>
 #include <functional>
 #include <stack>
+#include <string>
+#include <vector>
 #include "VoxelVideoSourceComponent.generated.h"
 
 DECLARE_LOG_CATEGORY_EXTERN(VoxVidLog, All, All);
 
 DECLARE_DYNAMIC_MULTICAST_DELEGATE(FOnPlaybackFinished); // Macro for setting up dispatcher event. 
+DECLARE_DYNAMIC_MULTICAST_DELEGATE(FOnRecordingsChanged);
+
+/**
+*	Where a recording's reader sends its frames. They go nowhere until it's attached as the recording is swapped in, so
+*	a preloaded reader can't feed the source while another recording is showing, and it's detached before the reader
+*	is closed so the reader can be closed on any thread.
+*/
+struct FVoxelVideoSink
+{
+	void Attach(UVoxelSourceBaseComponent* InTarget);
+	// Waits for a frame being copied in, after which nothing reaches the source
+	void Detach();
+
+	// VIMR's playback thread
+	void CopyVoxelData(VIMR::VoxelGrid* Voxels);
+
+private:
+	FCriticalSection Lock;
+	UVoxelSourceBaseComponent* Target = nullptr;
+};
+
+/**
+*	Everything opening a recording reads from disk: the recording loaded into VIMR, its frame cache mapped and its
+*	index checked, and its wavs. Read on a background thread by PreloadVoxelVideo, or on the spot by LoadVoxelVideo,
+*	then swapped in on the game thread.
+*/
+struct FVoxelVideoLoad
+{
+	FString FileName;
+	FString Path;
+	FString CachePath;
+	bool bStandalone = false;
+	uint64 VideoSize = 0;
+	int64 VideoTime = 0;
+	// Null for a standalone container, or if the recording couldn't be opened
+	VIMR::VoxVidPlayer* Reader = nullptr;
+	TSharedPtr<FVoxelVideoSink, ESPMode::ThreadSafe> Sink;
+	// Set when a preload is discarded, what hasn't been read yet is skipped
+	std::atomic<bool> bCancelled{ false };
+	// Open if the recording has an up to date frame cache, or is a container
+	TUniquePtr<IMappedFileHandle> CacheMapping;
+	TUniquePtr<IMappedFileRegion> CacheRegion;
+	FVoxelFrameCacheReader FrameCache;
+
+	struct FAudio
+	{
+		FString WavFile;
+		std::string VoxelLabel;
+		TArray<uint8> WavData;
+	};
+	TArray<FAudio> Audio;
+	// The same streams, to be listed in the cache when it's written
+	std::vector<VoxelFrameCache::FAudioStream> AudioStreams;
+};
 
 UCLASS(ClassGroup = (Custom), meta = (BlueprintSpawnableComponent))
 class VOXELS_API UVoxelVideoSourceComponent : public UVoxelSourceBaseComponent
@@ -54,16 +117,54 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "PlaybackControl")
 		void Restart(){cmdStack.push((PlaybackControlFnPtr)std::bind(&UVoxelVideoSourceComponent::_restart, this));}
 
+	// Jump to a frame, or to a time in seconds from the first frame, carrying on playing if it was. Only once the
+	// recording has a frame cache, see CacheFrames.
+	UFUNCTION(BlueprintCallable, Category = "PlaybackControl")
+		void SeekToFrame(int32 Frame) { cmdStack.push((PlaybackControlFnPtr)std::bind(&UVoxelVideoSourceComponent::_seekToFrame, this, Frame)); }
+	UFUNCTION(BlueprintCallable, Category = "PlaybackControl")
+		void SeekToTime(float Seconds) { cmdStack.push((PlaybackControlFnPtr)std::bind(&UVoxelVideoSourceComponent::_seekToTime, this, Seconds)); }
+
+	// True once the loaded recording plays from its frame cache
+	UFUNCTION(BlueprintCallable, Category = "PlaybackControl")
+		bool IsSeekable() const { return CachePlayer.IsValid(); }
+	// Frames in the recording and the time of the last one, 0 until it's seekable
+	UFUNCTION(BlueprintCallable, Category = "PlaybackControl")
+		int32 GetNumFrames() const { return (int32)FrameCache.GetNumFrames(); }
+	UFUNCTION(BlueprintCallable, Category = "PlaybackControl")
+		float GetDuration() const { return (float)FrameCache.GetDuration(); }
+	// Time of the frame showing, 0 until it's seekable
+	UFUNCTION(BlueprintCallable, Category = "PlaybackControl")
+		float GetPlaybackTime() const { return CachePlayer.IsValid() ? (float)CachePlayer->GetTime() : 0.0f; }
+
+	// The recordings in VoxelVideos/, as of the last time it was scanned in the background. Doesn't wait on the disk,
+	// so it can be called every frame. Until the first scan is done, the recordings saved from the last run.
 	UFUNCTION(BlueprintCallable, Category = "FileManagement")
 		TArray<FString> GetAllRecordings();
+	// The same, with each recording's length, voxels and audio streams, for recordings that have a frame cache
+	UFUNCTION(BlueprintCallable, Category = "FileManagement")
+		TArray<FVoxelRecordingInfo> GetAllRecordingInfo();
+	// Loads a .vx3 recording, or a .vxz container converted from one with the VoxelConvert commandlet
 	UFUNCTION(BlueprintCallable, Category = "FileManagement")
 		void LoadVoxelVideo(FString filepath, bool loop);
+	// Opens a recording on a background thread, for SwapToPreloaded to switch to without a hitch: loads it into VIMR,
+	// maps and checks its frame cache, and reads its wavs. Replaces an earlier preload, cancelling it and any swap to
+	// it without waiting for it to stop reading.
+	UFUNCTION(BlueprintCallable, Category = "FileManagement")
+		void PreloadVoxelVideo(FString filepath);
+	// Switches to the preloaded recording on the first tick once it's read, playing it straight away if play is set
+	UFUNCTION(BlueprintCallable, Category = "FileManagement")
+		void SwapToPreloaded(bool loop, bool play);
+	UFUNCTION(BlueprintCallable, Category = "FileManagement")
+		bool IsPreloadReady() const { return PreloadTask.IsValid() && PreloadTask.IsReady(); }
 
 	UFUNCTION(BlueprintCallable)
 		void SetAudioLocation(FVector Location);
 
 	UPROPERTY(BlueprintAssignable, Category = "EventDispatchers")
 		FOnPlaybackFinished OnPlaybackFinished;
+	// Recordings were added, removed or changed in VoxelVideos/, or the first scan of it finished
+	UPROPERTY(BlueprintAssignable, Category = "EventDispatchers")
+		FOnRecordingsChanged OnRecordingsChanged;
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
 		FString VideoFileName = "voxvid0.vx3";
 
@@ -76,6 +177,36 @@ public:
 	UPROPERTY(BlueprintReadWrite,  EditAnywhere)
 		FString FileName;
 
+	// The first time a recording is played through from the start, write its frames to a .vxcache file beside it,
+	// and from then on play it from there: memory mapped, seekable, and without reading the .vx3 again. Costs
+	// about 10 bytes per voxel per frame of disk, less with CompressCache. A looping recording loops from its cache
+	// once it's written.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		bool CacheFrames = true;
+
+	// Write the frame cache compressed with LZ4: a few milliseconds a frame while it's written and a little when each
+	// frame is read back, for a third or less of the disk and bandwidth. Read when the cache is begun.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		bool CompressCache = true;
+
+	// Frames read ahead of the one showing when playing from the frame cache, on a thread of their own so a slow disk
+	// or network share doesn't stall playback. 0 reads each frame as it's shown. Read when a recording is loaded.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 ReadAheadFrames = 8;
+	// Threads reading ahead, each decompressing a frame of its own. Read when a recording is loaded.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+		int32 ReadAheadThreads = 2;
+
+	// Frames read ahead and waiting to be shown
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 ReadAheadDepth = 0;
+	// Frames that came due before they'd been read ahead, since the recording was loaded
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 ReadAheadUnderruns = 0;
+	// Frames skipped to keep to the recording's clock, since the recording was loaded
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Stats")
+		int32 CachedFramesSkipped = 0;
+
 protected:
 
 	FString baseRecordingPath;
@@ -94,6 +225,7 @@ protected:
 
 	// DON'T instantate these things here. UBT can't handle it. Do it in BeginPlay
 	VIMR::VoxVidPlayer *VoxelVideoReader = nullptr;
+	TSharedPtr<FVoxelVideoSink, ESPMode::ThreadSafe> VoxelVideoSink;
 
 	void _pause();
 	void _play();
@@ -101,4 +233,87 @@ protected:
 	void _playOnlySound();
 	void _stop();
 	void _restart();
+	void _seekToFrame(int32 Frame);
+	void _seekToTime(float Seconds);
+
+	// Plays a wav from the recordings folder along with the recording, on the voxels labelled VoxelLabel
+	void AddAudioStream(const FString& WavFile, const std::string& VoxelLabel, TArray<uint8>&& WavData);
+
+	// Any thread: reads everything the recording File in Directory needs from disk into Load, unless it's cancelled
+	static void ReadVoxelVideo(const FString& Directory, const FString& File, bool bCache, FVoxelVideoLoad& Load);
+	// Closes the recording playing and switches to Load's, which is left empty
+	void SwapInVoxelVideo(FVoxelVideoLoad& Load, bool loop);
+	// Cancels the preload in progress, if any. What it opened is closed on the thread pool once it's stopped.
+	void DiscardPreload();
+	// Stops the reader playing sending frames, and closes it on the thread pool
+	void CloseVoxelVideoReader();
+
+	// Moves every audio stream to the time of the frame showing
+	void SeekAudio(bool bPlay);
+
+	bool IsPlaybackFinished();
+
+	// Maps the cache beside the loaded recording and starts a paused player on it. False if there isn't one, or it's
+	// from an older version of the recording.
+	bool OpenFrameCache();
+	// Starts a paused player on the cache that's mapped
+	void StartCachePlayer();
+	void CloseFrameCache();
+
+	// Player thread: copies a cached frame in as if the recording had just played it, from its read ahead slot if it
+	// has one
+	void CopyCachedFrame(uint32 Frame, int32 Slot);
+	// Read ahead thread: gathers a frame into a slot, hinting the frame after to the OS so it's read in meanwhile
+	void ReadCachedFrame(uint32 Frame, int32 Slot);
+	void GatherCachedFrame(const VoxelFrameCache::FFrame& Cached, FVoxelGather& Gather);
+
+	// Writing the cache while the recording plays through the first time. It goes to a temporary file that only
+	// replaces the cache once the last frame is in.
+	void OnFrameGathered(const FVoxelGather& Gather) override;
+	bool WantsWholeFrames() const override { return bCacheRecording.load(std::memory_order_relaxed); }
+	void BeginCacheRecording();
+	bool FinishCacheRecording();
+	void AbortCacheRecording();
+
+	FString VideoPath;
+	FString CachePath;
+	// Size and modification time of the loaded .vx3, which its cache has to match
+	uint64 VideoSize = 0;
+	int64 VideoTime = 0;
+	bool bLoopVideo = false;
+	// Playing a .vxz container converted from a recording, rather than the recording
+	bool bStandalone = false;
+	// The recording's audio streams, listed in its cache too
+	std::vector<VoxelFrameCache::FAudioStream> VideoAudioStreams;
+	// Catalog version OnRecordingsChanged was last broadcast for
+	uint32 RecordingsVersion = 0;
+
+	TFuture<TSharedPtr<FVoxelVideoLoad, ESPMode::ThreadSafe>> PreloadTask;
+	// What PreloadTask is reading into, to cancel it
+	TSharedPtr<FVoxelVideoLoad, ESPMode::ThreadSafe> Preload;
+	// SwapToPreloaded was called, and is waiting for the preload to finish
+	bool bSwapPending = false;
+	bool bSwapLoop = false;
+	bool bSwapPlay = false;
+	// Played through to the end while writing the cache, and switched over to it
+	bool bCachedAtEnd = false;
+
+	TUniquePtr<IMappedFileHandle> CacheMapping;
+	TUniquePtr<IMappedFileRegion> CacheRegion;
+	FVoxelFrameCacheReader FrameCache;
+	TUniquePtr<FVoxelCachePlayer> CachePlayer;
+	TArray<TUniquePtr<FVoxelGather>> ReadAheadSlots;
+	// What compressed frames are decoded to, for each read ahead slot and for frames that weren't read ahead
+	TArray<VoxelFrameCache::FFrameScratch> ReadAheadScratch;
+	VoxelFrameCache::FFrameScratch CacheScratch;
+
+	// Guards everything below, the writer is fed on VIMR's playback thread and started and stopped on the game thread
+	FCriticalSection CacheWriteLock;
+	TUniquePtr<IFileHandle> CacheWriteFile;
+	FVoxelFrameCacheWriter CacheWriter;
+	// FPlatformTime::Seconds() when the first frame arrived, moved on by any pauses. 0 until it arrives.
+	double CacheRecordStart = 0.0;
+	double CachePauseStart = 0.0;
+	// Whether CacheWriteFile is open, for the producer to check without taking the lock
+	std::atomic<bool> bCacheRecording{ false };
 };
\ No newline at end of file
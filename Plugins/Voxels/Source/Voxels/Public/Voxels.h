@@ -13,6 +13,9 @@ public:
 	/** IModuleInterface implementation */
 	virtual void StartupModule() override;
 	virtual void ShutdownModule() override;
+
+private:
+	FDelegateHandle TrimPoolsHandle;
 };
 
 enum DebugMessageKeys
@@ -26,5 +29,6 @@ enum SourceTypes
 {
 	VoxelVideoSource,
 	UDPSource,
-	UDPServerSource
+	UDPServerSource,
+	CompositorSource
 };
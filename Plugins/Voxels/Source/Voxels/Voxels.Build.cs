@@ -51,8 +51,13 @@ public class Voxels : ModuleRules
 			{
 				"CoreUObject",
 				"Engine",
+				"Json",
+				"MeshDescription",
+				"RenderCore",
+				"RHI",
 				"Slate",
 				"SlateCore",
+				"StaticMeshDescription",
 			}
 			);
 